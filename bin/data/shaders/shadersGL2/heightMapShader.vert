@@ -25,21 +25,26 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 #version 120
 
 varying float depthfrag;
+varying vec2 zedCoord;
 
 uniform sampler2DRect tex0; // Sampler for the depth image-space elevation texture automatically set by binding
 
-uniform mat4 kinectProjMatrix; // Transformation from kinect world space to proj image space
-uniform mat4 kinectWorldMatrix; // Transformation from kinect image space to kinect world space
+uniform mat4 zedProjMatrix; // Transformation from Zed world space to proj image space
+uniform mat4 zedWorldMatrix; // Transformation from Zed image space to Zed world space
 uniform vec2 heightColorMapTransformation; // Transformation from elevation to height color map texture coordinate factor and offset
-uniform vec2 depthTransformation; // Normalisation factor and offset applied by openframeworks
+uniform vec2 depthTransformation; // Factor and offset decoding the depth texture sample into mm (identity for 32-bit float)
 uniform vec4 basePlaneEq; // Base plane equation
+uniform vec2 meshOrigin; // Zed coordinate of the first vertex of the grid
+uniform sampler2DRect erosionSampler; // Virtual elevation offset in mm, in ErosionSimulation cells
+uniform int drawErosion;
+uniform vec4 rasterTransformation; // Transformation from Zed coordinate to ElevationRaster cell texture coordinate factor and offset
 
 void main()
 {
-    vec4 position =gl_Vertex;
-    vec2 texcoord = gl_MultiTexCoord0.xy;
-    // copy position so we can work with it.
-    vec4 pos = position;
+    /* Grid vertex position, the texture coordinate is the same: */
+    vec4 pos = vec4(meshOrigin + gl_Vertex.xy, 0, 1);
+    vec2 texcoord = pos.xy;
+    zedCoord = texcoord;
 
     /* Set the vertex' depth image-space z coordinate from the texture: */
     vec4 texel0 = texture2DRect(tex0, texcoord);
@@ -50,16 +55,18 @@ void main()
     pos.w = 1;
     
     /* Transform the vertex from depth image space to world space: */
-    vec4 vertexCc = kinectWorldMatrix * pos;  // Transposed multiplication (Row-major order VS col major order
+    vec4 vertexCc = zedWorldMatrix * pos;  // Transposed multiplication (Row-major order VS col major order
     vec4 vertexCcx = vertexCc * depth;
     vertexCcx.w = 1;
     
     /* Transform elevation to height color map texture coordinate: */
     float elevation = dot(basePlaneEq,vertexCcx);///vertexCc.w;
+    if (drawErosion == 1)
+        elevation += texture2DRect(erosionSampler, pos.xy*rasterTransformation.xy+rasterTransformation.zw).r; // Virtual erosion offset
     depthfrag = elevation*heightColorMapTransformation.x+heightColorMapTransformation.y;
     
     /* Transform vertex to proj coordinates: */
-    vec4 screenPos = kinectProjMatrix * vertexCcx;
+    vec4 screenPos = zedProjMatrix * vertexCcx;
     vec4 projectedPoint = screenPos / screenPos.z;
 
     projectedPoint.z = 0;
@@ -27,18 +27,68 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 out vec4 outputColor;
 
 in float depthfrag;
+in vec2 zedCoord;
 
 uniform sampler2DRect heightColorMapSampler;
 uniform sampler2DRect pixelCornerElevationSampler; // Sampler for the half pixel texture
-uniform float contourLineFactor;
-uniform int drawContourLines;
+uniform sampler2DRect hillshadeSampler; // Normal in rgb and hillshade in a, in Zed image space
+uniform sampler2DRect waterSampler; // Water depth in mm, in WaterSimulation cells
+
+layout(std140) uniform TerrainParameters // Shared by the terrain shaders, updated by TerrainShaderState
+{
+    mat4 zedWorldMatrix; // Transformation from Zed image space to Zed world space
+    mat4 zedProjMatrix; // Transformation from Zed world space to proj image space
+    vec4 basePlaneEq; // Base plane equation
+    vec4 rasterTransformation; // Transformation from Zed coordinate to ElevationRaster cell texture coordinate factor and offset
+    vec2 depthTransformation; // Factor and offset decoding the depth texture sample into mm (identity for 32-bit float)
+    vec2 heightColorMapTransformation; // Transformation from elevation to height color map texture coordinate factor and offset
+    vec2 contourLineFboTransformation; // Transformation from elevation to normalized contourline fbo unit factor and offset
+    vec2 contourLineTransformation; // Transformation from height color map texture coordinate to contour line index factor and offset
+    vec2 meshOrigin; // Zed coordinate of the first vertex of the grid
+    vec2 meshMax; // Last grid vertex relative to meshOrigin
+    vec2 hillshadeTransformation; // Transformation from hillshade to color scale factor and offset
+    vec2 waterDepthTransformation; // Transformation from water depth to water opacity factor and offset
+    float meshStep; // Zed pixels between two grid vertices
+    int meshWidth; // Number of vertices per grid row
+    float contourLineFactor;
+    int drawContourLines;
+    int singlePassContourLines; // Contour lines from the screen-space derivatives of the elevation, without the corner texture
+    int drawHillshade;
+    int drawWater;
+    int drawErosion;
+};
 
 void main()
 {
     vec2 depthPos = vec2(depthfrag, 0.5);//depthvalue*texsize, 0.5);
     vec4 color =  texture(heightColorMapSampler, depthPos);	//colormap converted depth
 
-    if (drawContourLines == 1)
+    if (drawHillshade == 1)
+    {
+        /* Darken the slopes facing away from the sun, a flat surface keeps its color: */
+        float shade = texture(hillshadeSampler, zedCoord).a;
+        color.rgb *= max(shade*hillshadeTransformation.x+hillshadeTransformation.y, 0.0);
+    }
+
+    if (drawWater == 1)
+    {
+        /* Blend the water over the terrain, more opaque as it gets deeper: */
+        float waterDepth = texture(waterSampler, zedCoord*rasterTransformation.xy+rasterTransformation.zw).r;
+        float opacity = clamp(waterDepth*waterDepthTransformation.x+waterDepthTransformation.y, 0.0, 1.0);
+        color.rgb = mix(color.rgb, vec3(0.1, 0.3, 0.8), opacity);
+    }
+
+    if (drawContourLines == 1 && singlePassContourLines == 1)
+    {
+        /* Distance to the closest contour line in pixels, from the contour index change across the pixel: */
+        float contourIndex = depthfrag*contourLineTransformation.x+contourLineTransformation.y;
+        float distance = abs(fract(contourIndex-0.5)-0.5)/max(fwidth(contourIndex), 1.0e-6);
+        
+        /* Anti-aliased one pixel wide topographic contour lines, rendered in black: */
+        float line = 1.0-clamp(distance-0.5, 0.0, 1.0);
+        color = mix(color, vec4(0.0,0.0,0.0,1.0), line);
+    }
+    else if (drawContourLines == 1)
     {
         // Contour line computation
         /* Calculate the contour line interval containing each pixel corner by evaluating the half-pixel offset elevation texture: */
@@ -39,23 +39,43 @@ in vec2 texcoord;
 
 // this is something send to the fragment shader
 out float depthfrag;
+out vec2 zedCoord;
 
+uniform sampler2DRect erosionSampler; // Virtual elevation offset in mm, in ErosionSimulation cells
 uniform sampler2DRect tex0; // Sampler for the depth image-space elevation texture automatically set by binding
 
-uniform mat4 kinectProjMatrix; // Transformation from kinect world space to proj image space
-uniform mat4 kinectWorldMatrix; // Transformation from kinect image space to kinect world space
-uniform vec2 heightColorMapTransformation; // Transformation from elevation to height color map texture coordinate factor and offset
-uniform vec2 depthTransformation; // Normalisation factor and offset applied by openframeworks
-uniform vec4 basePlaneEq; // Base plane equation
+layout(std140) uniform TerrainParameters // Shared by the terrain shaders, updated by TerrainShaderState
+{
+    mat4 zedWorldMatrix; // Transformation from Zed image space to Zed world space
+    mat4 zedProjMatrix; // Transformation from Zed world space to proj image space
+    vec4 basePlaneEq; // Base plane equation
+    vec4 rasterTransformation; // Transformation from Zed coordinate to ElevationRaster cell texture coordinate factor and offset
+    vec2 depthTransformation; // Factor and offset decoding the depth texture sample into mm (identity for 32-bit float)
+    vec2 heightColorMapTransformation; // Transformation from elevation to height color map texture coordinate factor and offset
+    vec2 contourLineFboTransformation; // Transformation from elevation to normalized contourline fbo unit factor and offset
+    vec2 contourLineTransformation; // Transformation from height color map texture coordinate to contour line index factor and offset
+    vec2 meshOrigin; // Zed coordinate of the first vertex of the grid
+    vec2 meshMax; // Last grid vertex relative to meshOrigin
+    vec2 hillshadeTransformation; // Transformation from hillshade to color scale factor and offset
+    vec2 waterDepthTransformation; // Transformation from water depth to water opacity factor and offset
+    float meshStep; // Zed pixels between two grid vertices
+    int meshWidth; // Number of vertices per grid row
+    float contourLineFactor;
+    int drawContourLines;
+    int singlePassContourLines; // Contour lines from the screen-space derivatives of the elevation, without the corner texture
+    int drawHillshade;
+    int drawWater;
+    int drawErosion;
+};
 
 void main()
 {
-    // copy position so we can work with it.
-    vec4 pos = position;
-//    varyingtexcoord = pos.xy;//texcoord;
+    /* Grid vertex position from its index, the texture coordinate is the same: */
+    vec4 pos = vec4(meshOrigin + min(vec2(gl_VertexID % meshWidth, gl_VertexID / meshWidth)*meshStep, meshMax), 0, 1);
+    zedCoord = pos.xy;
 
     /* Set the vertex' depth image-space z coordinate from the texture: */
-    vec4 texel0 = texture(tex0, texcoord);
+    vec4 texel0 = texture(tex0, pos.xy);
     float depth1 = texel0.r;
     float depth = depth1 * depthTransformation.x + depthTransformation.y;
 
@@ -63,16 +83,18 @@ void main()
     pos.w = 1;
     
     /* Transform the vertex from depth image space to world space: */
-    vec4 vertexCc = kinectWorldMatrix * pos;  // Transposed multiplication (Row-major order VS col major order
+    vec4 vertexCc = zedWorldMatrix * pos;  // Transposed multiplication (Row-major order VS col major order
     vec4 vertexCcx = vertexCc * depth;
     vertexCcx.w = 1;
     
     /* Transform elevation to height color map texture coordinate: */
     float elevation = dot(basePlaneEq,vertexCcx);///vertexCc.w;
+    if (drawErosion == 1)
+        elevation += texture(erosionSampler, pos.xy*rasterTransformation.xy+rasterTransformation.zw).r; // Virtual erosion offset
     depthfrag = elevation*heightColorMapTransformation.x+heightColorMapTransformation.y;
     
     /* Transform vertex to proj coordinates: */
-    vec4 screenPos = kinectProjMatrix * vertexCcx;
+    vec4 screenPos = zedProjMatrix * vertexCcx;
     vec4 projectedPoint = screenPos / screenPos.z;
 
     projectedPoint.z = 0;
@@ -0,0 +1,199 @@
+/***********************************************************************
+Benchmark - Headless timing of the processing stages, run with
+Magic-Sand --benchmark instead of opening the windows.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#include "Benchmark.h"
+#include "ZedProjector/ZedGrabber.h"
+#include "ZedProjector/DepthTextureStreamer.h"
+#include "ofxOpenCv.h"
+#include "SandSurfaceRenderer/SoftwareRenderer.h"
+
+int Benchmark::run() {
+	cout << "Magic Sand benchmark, " << std::thread::hardware_concurrency() << " hardware threads" << endl;
+
+	// A hidden window gives the GL context of the texture uploads, the stages needing it are
+	// left out when none can be created
+	ofGLFWWindowSettings settings;
+	settings.setSize(320, 240);
+	settings.visible = false;
+	auto window = std::dynamic_pointer_cast<ofAppGLFWWindow>(ofCreateWindow(settings));
+	bool withGL = window && window->getGLFWWindow() != nullptr;
+
+	depthHandoff(1280, 720, 300, withGL);
+	softwareRender(1280, 720, 30);
+	return 0;
+}
+
+void Benchmark::depthHandoff(int width, int height, int numFrames, bool withTextures) {
+	// Main thread side of the filtered frame handoff, from the received frame to the uploaded
+	// depth texture. The grabber side runs on a thread like ZedGrabber::sendFilteredFrame(), with
+	// three circulating buffers, and waits for a recycled one instead of dropping frames so all
+	// the paths see the same frames: a sand surface with a hand moving across it.
+	const int numPaths = 3;
+	ofThreadChannel<DepthFrame> filtered;
+	ofThreadChannel<ofFloatPixels> recycled;
+	std::thread grabber([&]() {
+		int tileCols = (width + DepthFrame::tileSize - 1) / DepthFrame::tileSize;
+		int tileRows = (height + DepthFrame::tileSize - 1) / DepthFrame::tileSize;
+		float radius = 100;
+		auto handCenter = [&](int i) {
+			return glm::vec2(std::fmod(i * 8.0f, static_cast<float>(width)), height / 2.0f);
+		};
+		for (int i = 0; i < numFrames * numPaths; i++) {
+			DepthFrame frame;
+			if (i < 3)
+				frame.pixels.allocate(width, height, 1);
+			else
+				recycled.receive(frame.pixels);
+			glm::vec2 hand = handCenter(i);
+			for (int y = 0; y < height; y++) {
+				float* row = frame.pixels.getData() + y*width;
+				for (int x = 0; x < width; x++)
+					row[x] = glm::distance(glm::vec2(x, y), hand) < radius ? 700 : 1000 + 20 * std::sin(x*0.05f)*std::cos(y*0.04f);
+			}
+			// The tiles under the hand, now and in the previous frame, changed
+			frame.tileCols = tileCols;
+			frame.tileRows = tileRows;
+			frame.dirtyTiles.assign(tileCols*tileRows, i % numFrames == 0 ? 1 : 0);
+			for (auto center : { handCenter(i - 1), hand }) {
+				int minCol = std::max(static_cast<int>(center.x - radius) / DepthFrame::tileSize, 0);
+				int maxCol = std::min(static_cast<int>(center.x + radius) / DepthFrame::tileSize, tileCols - 1);
+				int minRow = std::max(static_cast<int>(center.y - radius) / DepthFrame::tileSize, 0);
+				int maxRow = std::min(static_cast<int>(center.y + radius) / DepthFrame::tileSize, tileRows - 1);
+				for (int row = minRow; row <= maxRow; row++)
+					for (int col = minCol; col <= maxCol; col++)
+						frame.dirtyTiles[row*tileCols + col] = 1;
+			}
+			frame.frameNumber = i;
+			filtered.send(std::move(frame));
+		}
+	});
+
+	// Copy into the OpenCV image owned by the main thread and upload its texture, as before the
+	// buffers were adopted
+	ofxCvFloatImage filteredDepthImage;
+	filteredDepthImage.setUseTexture(withTextures);
+	filteredDepthImage.allocate(width, height);
+	uint64_t copyTime = 0;
+	for (int i = 0; i < numFrames; i++) {
+		DepthFrame frame;
+		filtered.receive(frame);
+		uint64_t start = ofGetElapsedTimeMicros();
+		filteredDepthImage.setFromPixels(frame.pixels.getData(), width, height);
+		if (withTextures)
+			filteredDepthImage.updateTexture();
+		copyTime += ofGetElapsedTimeMicros() - start;
+		recycled.send(std::move(frame.pixels));
+	}
+
+	// Adopt the received buffer, give the previous one back to the grabber and upload the depth
+	// texture as ZedProjector::receiveDepthFrame(), synchronously and then through the PBO ring
+	uint64_t adoptTime[2] = { 0, 0 };
+	for (int async = 0; async < 2; async++) {
+		DepthTextureStreamer streamer;
+		ofTexture depthTexture;
+		if (withTextures) {
+			streamer.setup(width, height);
+			streamer.setAsync(async == 1);
+			streamer.allocateTexture(depthTexture);
+		}
+		DepthFrame current;
+		for (int i = 0; i < numFrames; i++) {
+			DepthFrame frame;
+			filtered.receive(frame);
+			uint64_t start = ofGetElapsedTimeMicros();
+			std::swap(current, frame);
+			if (frame.pixels.isAllocated())
+				recycled.send(std::move(frame.pixels));
+			if (withTextures)
+				streamer.upload(depthTexture, current);
+			adoptTime[async] += ofGetElapsedTimeMicros() - start;
+		}
+		if (async == 1 && !streamer.isAsync())
+			adoptTime[1] = 0;
+	}
+	grabber.join();
+
+	cout << "Depth frame handoff " << width << "x" << height << (withTextures ? ", to the uploaded texture" : ", without GL, texture uploads left out")
+		<< ": copy " << copyTime / numFrames << " us, adopt " << adoptTime[0] / numFrames << " us";
+	if (!withTextures)
+		cout << " per frame" << endl;
+	else if (adoptTime[1] > 0)
+		cout << ", adopt with PBO streaming " << adoptTime[1] / numFrames << " us per frame" << endl;
+	else
+		cout << " per frame, PBO streaming not available" << endl;
+}
+
+void Benchmark::softwareRender(int width, int height, int numFrames) {
+	// A sand hill 1 m below a Zed seeing it straight down, projected by a projector at the
+	// Zed position with the same intrinsics and resolution
+	float f = width;
+	float cx = width / 2.0f, cy = height / 2.0f;
+	ofFloatPixels depth;
+	depth.allocate(width, height, 1);
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			float dx = (x - cx) / width, dy = (y - cy) / height;
+			depth.getData()[y*width + x] = 1000 - 150 * std::exp(-8 * (dx*dx + dy*dy)) + 20 * std::sin(x*0.05f)*std::cos(y*0.04f);
+		}
+	}
+	// wc = zedWorldMatrix*(x, y, d, 1)*d, screen = zedProjMatrix*wc as in the vertex shaders
+	glm::mat4 zedWorldMatrix(0);
+	zedWorldMatrix[0][0] = 1 / f;
+	zedWorldMatrix[3][0] = -cx / f;
+	zedWorldMatrix[1][1] = 1 / f;
+	zedWorldMatrix[3][1] = -cy / f;
+	zedWorldMatrix[3][2] = 1;
+	zedWorldMatrix[3][3] = 1;
+	glm::mat4 zedProjMatrix(0);
+	zedProjMatrix[0][0] = f;
+	zedProjMatrix[2][0] = cx;
+	zedProjMatrix[1][1] = f;
+	zedProjMatrix[2][1] = cy;
+	zedProjMatrix[2][2] = 1;
+	zedProjMatrix[3][3] = 1;
+
+	// 256 entries colormap over +-200 mm around the base plane, a contour line every 10 mm
+	ofPixels colorMap;
+	colorMap.allocate(256, 1, 3);
+	for (int i = 0; i < 256; i++) {
+		colorMap.getData()[3 * i] = i;
+		colorMap.getData()[3 * i + 1] = 255 - i;
+		colorMap.getData()[3 * i + 2] = 128;
+	}
+	glm::vec2 heightColorMapTransformation(256 / 400.0f, 128);
+
+	ofRectangle roi(0, 0, width, height);
+	for (int step = 1; step <= 4; step *= 2) {
+		for (int pass = 0; pass < 2; pass++) {
+			bool singlePass = pass == 0;
+			SoftwareRenderer renderer;
+			renderer.setup(width, height);
+			renderer.setZedMatrices(zedWorldMatrix, zedProjMatrix);
+			renderer.setBasePlaneEq(glm::vec4(0, 0, -1, 1000));
+			renderer.setHeightColorMap(colorMap, heightColorMapTransformation);
+			renderer.setContourLines(true, singlePass, 40, glm::vec2(400, -200), glm::vec2(400 / 256.0f / 10, 0));
+			renderer.render(depth, roi, step);
+			float renderTime = 0;
+			for (int i = 0; i < numFrames; i++) {
+				renderer.render(depth, roi, step);
+				renderTime += renderer.getRenderTime();
+			}
+			cout << "Software render " << width << "x" << height << ", mesh step " << step << (singlePass ? ", single-pass" : ", two-pass")
+				<< " contour lines: " << renderTime / numFrames << " ms per frame" << endl;
+		}
+	}
+}
@@ -0,0 +1,32 @@
+/***********************************************************************
+Benchmark - Headless timing of the processing stages, run with
+Magic-Sand --benchmark instead of opening the windows.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#pragma once
+
+#include "ofMain.h"
+
+// The stages run on synthetic 1280x720 depth frames, without a Zed, so the numbers can be compared
+// between machines and before/after a change. Texture uploads run in a hidden window and are
+// left out without GL. Each result is printed on its own line.
+class Benchmark {
+public:
+	static int run();
+
+private:
+	static void depthHandoff(int width, int height, int numFrames, bool withTextures);
+	static void softwareRender(int width, int height, int numFrames);
+};
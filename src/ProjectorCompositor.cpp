@@ -0,0 +1,147 @@
+/***********************************************************************
+ProjectorCompositor - ProjectorCompositor blends the projector layers
+into a single image, redrawing only the regions that changed.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#include "ProjectorCompositor.h"
+
+ProjectorCompositor::ProjectorCompositor()
+	:width(0),
+	height(0),
+	fullDirty(true),
+	compositedPixels(0),
+	skippedUpdates(0)
+{
+}
+
+void ProjectorCompositor::setup(int swidth, int sheight) {
+	width = swidth;
+	height = sheight;
+	composite.allocate(width, height, GL_RGBA);
+	composite.begin();
+	ofClear(0, 0, 0, 255);
+	composite.end();
+	fullDirty = true;
+}
+
+int ProjectorCompositor::addLayer(const ofFbo& fbo) {
+	Layer layer;
+	layer.fbo = &fbo;
+	layer.visible = true;
+	layer.version = 0;
+	layers.push_back(layer);
+	fullDirty = true;
+	return layers.size() - 1;
+}
+
+void ProjectorCompositor::setLayerVisible(int layer, bool visible) {
+	if (layers[layer].visible == visible)
+		return;
+	layers[layer].visible = visible;
+	fullDirty = true;
+}
+
+void ProjectorCompositor::updateLayer(int layer, unsigned int version) {
+	if (layers[layer].version == version)
+		return;
+	layers[layer].version = version;
+	if (layers[layer].visible)
+		fullDirty = true;
+}
+
+void ProjectorCompositor::updateLayer(int layer, unsigned int version, const std::vector<ofRectangle>& rects) {
+	if (layers[layer].version == version)
+		return;
+	layers[layer].version = version;
+	if (!layers[layer].visible)
+		return;
+	if (rects.empty())
+		fullDirty = true;
+	for (auto & rect : rects)
+		addDirtyRect(rect);
+}
+
+void ProjectorCompositor::invalidate() {
+	fullDirty = true;
+}
+
+void ProjectorCompositor::addDirtyRect(const ofRectangle& rect) {
+	if (fullDirty)
+		return;
+	// Whole pixels inside the composite
+	float x0 = std::max(std::floor(rect.getLeft()), 0.0f);
+	float y0 = std::max(std::floor(rect.getTop()), 0.0f);
+	float x1 = std::min(std::ceil(rect.getRight()), static_cast<float>(width));
+	float y1 = std::min(std::ceil(rect.getBottom()), static_cast<float>(height));
+	if (x1 <= x0 || y1 <= y0)
+		return;
+	ofRectangle clipped(x0, y0, x1 - x0, y1 - y0);
+
+	// Merge with an overlapping rectangle, the union is redrawn once
+	for (auto & dirty : dirtyRects) {
+		if (dirty.intersects(clipped)) {
+			dirty.growToInclude(clipped);
+			return;
+		}
+	}
+	if (dirtyRects.size() == maxDirtyRects)
+		fullDirty = true;
+	else
+		dirtyRects.push_back(clipped);
+}
+
+void ProjectorCompositor::update() {
+	if (fullDirty) {
+		dirtyRects.assign(1, ofRectangle(0, 0, width, height));
+	}
+	else if (dirtyRects.empty()) {
+		skippedUpdates++;
+		return;
+	}
+
+	composite.begin();
+	for (auto & rect : dirtyRects) {
+		// Replace the region by opaque black, then blend the layers over it
+		ofPushStyle();
+		ofEnableBlendMode(OF_BLENDMODE_DISABLED);
+		ofFill();
+		ofSetColor(0, 0, 0, 255);
+		ofDrawRectangle(rect);
+		ofEnableBlendMode(OF_BLENDMODE_ALPHA);
+		ofSetColor(255);
+		for (auto & layer : layers) {
+			if (layer.visible)
+				layer.fbo->getTexture().drawSubsection(rect.x, rect.y, rect.width, rect.height, rect.x, rect.y, rect.width, rect.height);
+		}
+		ofPopStyle();
+		compositedPixels += static_cast<uint64_t>(rect.width*rect.height);
+	}
+	composite.end();
+
+	dirtyRects.clear();
+	fullDirty = false;
+}
+
+void ProjectorCompositor::draw(float x, float y) {
+	draw(x, y, width, height);
+}
+
+void ProjectorCompositor::draw(float x, float y, float w, float h) {
+	// The composite is opaque, blending the layers a second time is not needed
+	ofPushStyle();
+	ofEnableBlendMode(OF_BLENDMODE_DISABLED);
+	composite.draw(x, y, w, h);
+	ofPopStyle();
+}
@@ -0,0 +1,71 @@
+/***********************************************************************
+ProjectorCompositor - ProjectorCompositor blends the projector layers
+into a single image, redrawing only the regions that changed.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#pragma once
+
+#include "ofMain.h"
+
+// Each layer is an fbo of the projector size with a version given by its producer. When a
+// layer version changes, its producer gives the changed projector rectangles, or none when the
+// whole layer changed. update() clears the union of these rectangles and alpha blends the
+// visible layers, in the order they were added, inside them only.
+// The composite is drawn without blending, so the projector window and the main window preview
+// both draw a single texture instead of blending every layer.
+class ProjectorCompositor {
+public:
+	ProjectorCompositor();
+
+	void setup(int width, int height);
+	int addLayer(const ofFbo& fbo); // Returns the layer index
+
+	void setLayerVisible(int layer, bool visible);
+	void updateLayer(int layer, unsigned int version); // The whole layer changed if version is new
+	void updateLayer(int layer, unsigned int version, const std::vector<ofRectangle>& dirtyRects);
+	void invalidate(); // Next update() recomposites everything
+
+	void update();
+	void draw(float x, float y);
+	void draw(float x, float y, float width, float height);
+
+	// Statistics
+	uint64_t getCompositedPixels() const { // Pixels recomposited since setup
+		return compositedPixels;
+	}
+	uint64_t getSkippedUpdates() const { // update() calls without any change
+		return skippedUpdates;
+	}
+
+private:
+	struct Layer {
+		const ofFbo* fbo;
+		bool visible;
+		unsigned int version;
+	};
+
+	void addDirtyRect(const ofRectangle& rect);
+
+	static const int maxDirtyRects = 64; // Above that the whole composite is redrawn
+
+	int width, height;
+	ofFbo composite;
+	std::vector<Layer> layers;
+	std::vector<ofRectangle> dirtyRects; // Projector pixels to recomposite
+	bool fullDirty;
+
+	uint64_t compositedPixels;
+	uint64_t skippedUpdates;
+};
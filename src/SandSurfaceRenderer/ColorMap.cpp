@@ -66,6 +66,7 @@ bool ColorMap::updateColormap() {
         }
     }
     tex.setFromPixels(entries);
+    version++;
     return true;
 }
 
@@ -75,6 +76,7 @@ bool ColorMap::scaleRange(float factor)
         k.height *= factor;
     min *= factor;
     max *= factor;
+    version++;
     return true;
 }
 
@@ -43,7 +43,8 @@ public:
     };
     
     ColorMap(void)
-    :numEntries(512){
+    :numEntries(512),
+    version(0){
     }
     
     bool setKeys(std::vector<ofColor> colorkeys, std::vector<double> heightkeys); // Set keys
@@ -59,6 +60,10 @@ public:
     HeightMapKey operator[](int scalar) const; // Return a key
     int size() const;
     ofTexture getTexture(); // return color map texture
+    const ofPixels& getPixels() const // RGB entries of the texture
+    {
+        return entries;
+    }
 
     // Utilities
     bool scaleRange(float factor); // Rescale the range
@@ -82,6 +87,10 @@ public:
     {
         return heightMapKeys;
     }
+    unsigned int getVersion(void) const // Incremented each time the colormap changes
+    {
+        return version;
+    }
     
 private:
     // Colorkeys
@@ -92,4 +101,5 @@ private:
     ofPixels entries; // Array of RGBA entries
     ofImage tex;
     double min, max; // The scalar value range
+    unsigned int version; // Number of colormap updates
 };
@@ -0,0 +1,121 @@
+/***********************************************************************
+GridMesh - GridMesh is the static grid of vertices covering the Zed ROI
+that the sandbox shaders displace with the depth texture.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#include "GridMesh.h"
+
+GridMesh::GridMesh()
+	:programmable(false),
+	width(0),
+	height(0),
+	step(1),
+	roiMax(0),
+	origin(0),
+	numIndices(0),
+	vao(0)
+{
+}
+
+GridMesh::~GridMesh() {
+	if (vao != 0)
+		glDeleteVertexArrays(1, &vao);
+}
+
+void GridMesh::setup(const ofRectangle& roi, int sstep) {
+	// We move of a half pixel to center the color pixel (more beautiful)
+	origin = glm::vec2(roi.x, roi.y) - glm::vec2(0.5, 0.5);
+	glm::vec2 newRoiMax = glm::vec2(std::max(static_cast<int>(roi.width) - 1, 0), std::max(static_cast<int>(roi.height) - 1, 0));
+	if (newRoiMax == roiMax && sstep == step && numIndices > 0)
+		return; // Same grid, only the origin moved
+
+	roiMax = newRoiMax;
+	step = sstep;
+	width = (static_cast<int>(roiMax.x) + step - 1) / step + 1;
+	height = (static_cast<int>(roiMax.y) + step - 1) / step + 1;
+	programmable = ofIsGLProgrammableRenderer();
+	uint64_t start = ofGetElapsedTimeMicros();
+	if (programmable)
+		buildProgrammable();
+	else
+		buildFixed();
+	ofLogVerbose("GridMesh") << "setup(): " << width << "x" << height << " grid with step " << step << ", " << numIndices << " indices built in " << (ofGetElapsedTimeMicros() - start) / 1000 << " ms";
+}
+
+void GridMesh::buildProgrammable() {
+	// One strip per row: (x, y), (x, y+1) for every x, then a restart
+	std::vector<GLuint> indices;
+	indices.resize(std::max(height - 1, 0)*(2 * width + 1));
+	GLuint* ptr = indices.data();
+	for (int y = 0; y < height - 1; y++) {
+		GLuint row = y*width;
+		for (int x = 0; x < width; x++) {
+			*ptr++ = row + x;
+			*ptr++ = row + width + x;
+		}
+		*ptr++ = restartIndex;
+	}
+	numIndices = indices.size();
+	indexBuffer.allocate(indices, GL_STATIC_DRAW);
+
+	if (vao == 0)
+		glGenVertexArrays(1, &vao);
+	glBindVertexArray(vao);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer.getId());
+	glBindVertexArray(0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+void GridMesh::buildFixed() {
+	// ROI coordinates of the vertices
+	std::vector<glm::vec2> positions(width*height);
+	for (int y = 0; y < height; y++)
+		for (int x = 0; x < width; x++)
+			positions[y*width + x] = glm::min(glm::vec2(x, y)*float(step), roiMax);
+
+	// One strip per row, joined to the next by repeating its last and first vertices
+	std::vector<ofIndexType> indices;
+	indices.reserve(std::max(height - 1, 0)*(2 * width + 2));
+	for (int y = 0; y < height - 1; y++) {
+		ofIndexType row = y*width;
+		if (y > 0)
+			indices.push_back(row);
+		for (int x = 0; x < width; x++) {
+			indices.push_back(row + x);
+			indices.push_back(row + width + x);
+		}
+		if (y < height - 2)
+			indices.push_back(row + width + width - 1);
+	}
+	numIndices = indices.size();
+	vbo.setVertexData(positions.data(), positions.size(), GL_STATIC_DRAW);
+	vbo.setIndexData(indices.data(), indices.size(), GL_STATIC_DRAW);
+}
+
+void GridMesh::draw() {
+	if (numIndices == 0)
+		return;
+	if (programmable) {
+		glEnable(GL_PRIMITIVE_RESTART);
+		glPrimitiveRestartIndex(restartIndex);
+		glBindVertexArray(vao);
+		glDrawElements(GL_TRIANGLE_STRIP, numIndices, GL_UNSIGNED_INT, nullptr);
+		glBindVertexArray(0);
+		glDisable(GL_PRIMITIVE_RESTART);
+	}
+	else {
+		vbo.drawElements(GL_TRIANGLE_STRIP, numIndices);
+	}
+}
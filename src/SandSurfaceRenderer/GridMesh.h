@@ -0,0 +1,75 @@
+/***********************************************************************
+GridMesh - GridMesh is the static grid of vertices covering the Zed ROI
+that the sandbox shaders displace with the depth texture.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#pragma once
+
+#include "ofMain.h"
+
+// The grid is drawn as one triangle strip per row of cells. Vertices are placed every step
+// Zed pixels, the last row and column are clamped to the ROI border. The buffers only depend
+// on the grid size and step, the ROI origin is a shader uniform, so they are rebuilt only
+// when the ROI size or the step changes.
+// - Programmable renderer: index buffer only, rows separated by a primitive restart index.
+//   The vertex shader computes the vertex position from gl_VertexID, meshOrigin, meshWidth,
+//   meshStep and meshMax.
+// - Fixed pipeline: a vec2 position buffer in ROI coordinates, rows joined by degenerate
+//   triangles. The vertex shader adds meshOrigin.
+// The mesh uniforms are sent by TerrainShaderState::setMesh(), draw() only issues the draw call.
+class GridMesh {
+public:
+	GridMesh();
+	~GridMesh();
+
+	void setup(const ofRectangle& roi, int step = 1);
+	void draw();
+
+	int getWidth() const {
+		return width;
+	}
+	int getHeight() const {
+		return height;
+	}
+	int getStep() const {
+		return step;
+	}
+	glm::vec2 getOrigin() const {
+		return origin;
+	}
+	glm::vec2 getMax() const {
+		return roiMax;
+	}
+
+private:
+	void buildProgrammable();
+	void buildFixed();
+
+	static const GLuint restartIndex = 0xFFFFFFFF;
+
+	bool programmable;
+	int width, height; // Number of vertices per row and per column
+	int step; // Zed pixels between two vertices
+	glm::vec2 roiMax; // Last vertex position relative to the origin
+	glm::vec2 origin; // Zed coordinate of the first vertex
+	GLsizei numIndices;
+
+	// Programmable renderer
+	GLuint vao;
+	ofBufferObject indexBuffer;
+
+	// Fixed pipeline
+	ofVbo vbo;
+};
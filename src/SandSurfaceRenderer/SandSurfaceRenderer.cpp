@@ -30,6 +30,16 @@ using namespace ofxCSG;
 
 SandSurfaceRenderer::SandSurfaceRenderer(std::shared_ptr<ZedProjector> const& k, std::shared_ptr<ofAppBaseWindow> const& p)
 :settingsLoaded(false),
+waterSimulation(nullptr),
+drawWater(false),
+erosionSimulation(nullptr),
+drawErosion(false),
+settingsVersion(0),
+contourLinesDrawn(false),
+sandboxDrawn(false),
+skippedContourLinesPasses(0),
+skippedSandboxPasses(0),
+projWindowVersion(0),
 editColorMap(false){
     zedProjector = k;
     projWindow = p;
@@ -42,6 +52,16 @@ void SandSurfaceRenderer::setup(bool sdisplayGui){
     drawContourLines = true; // Flag if topographic contour lines are enabled
 	contourLineDistance = 10.0; // Elevation distance between adjacent topographic contour lines in millimiters
     
+    // Sandbox mesh
+    meshResolution = 0; // Automatic grid step
+    singlePassContourLines = true; // Contour lines computed in heightMapShader, without the elevation fbo pass
+    
+    // Sandbox hillshade
+    drawHillshade = false;
+    sunAzimuth = 315; // Light from the top left of the Zed image
+    sunElevation = 45;
+    hillshadeStrength = 0.5;
+    
     // Initialize the fbos and images
     projResX = projWindow->getWidth();
     projResY = projWindow->getHeight();
@@ -100,7 +120,12 @@ void SandSurfaceRenderer::setup(bool sdisplayGui){
     // Calculate the contourline fbo scaling and offset coefficients
 	contourLineFboScale = elevationMin-elevationMax;
 	contourLineFboOffset = elevationMax;
-    contourLineFactor = contourLineFboScale/contourLineDistance;
+    updateContourLineParameters();
+    updateHillshadeParameters();
+    zedProjector->setSunDirection(sunAzimuth, sunElevation);
+    zedProjector->setHillshade(drawHillshade);
+    shaderState.setHeightColorMapTransformation(glm::vec2(heightMapScale,heightMapOffset));
+    shaderState.setContourLineFboTransformation(glm::vec2(contourLineFboScale,contourLineFboOffset));
     
     //setup the mesh
     setupMesh();
@@ -129,6 +154,11 @@ void SandSurfaceRenderer::setup(bool sdisplayGui){
         ofLogError("GreatSand") << "setup(): shader not loaded" ;
     }
     
+    // Resolve the shader uniforms and texture units once
+    shaderState.setup();
+    shaderState.addShader(elevationShader);
+    shaderState.addShader(heightMapShader);
+    
     //Prepare fbo
     fboProjWindow.allocate(projResX, projResY, GL_RGBA);
     fboProjWindow.begin();
@@ -155,66 +185,134 @@ void SandSurfaceRenderer::exit(ofEventArgs& e){
 
 void SandSurfaceRenderer::updateConversionMatrices(){
     // Get conversion matrices
-    transposedZedProjMatrix = zedProjector->getTransposedZedProjMatrix();
-    transposedZedWorldMatrix = zedProjector->getTransposedZedWorldMatrix();
+    shaderState.setZedMatrices(zedProjector->getTransposedZedWorldMatrix(), zedProjector->getTransposedZedProjMatrix());
 }
 
 void SandSurfaceRenderer::updateRangesAndBasePlane(){
     basePlaneEq = zedProjector->getBasePlaneEq();
     basePlaneNormal = zedProjector->getBasePlaneNormal();
     basePlaneOffset = zedProjector->getBasePlaneOffset();
+    shaderState.setBasePlaneEq(zedProjector->getBasePlaneEq());
 
-    // Set the FilteredDepthImage native scale - converted to 0..1 when send to the shader
+    // Set the native scale of the Zed depth view, also the quantization range of the 16-bit depth textures
     zedProjector->updateNativeScale(basePlaneOffset.z+elevationMax, basePlaneOffset.z+elevationMin);
     
-    // Calculate the  FilteredDepthImage scaling and offset coefficients
-	FilteredDepthScale = elevationMin-elevationMax;
-	FilteredDepthOffset = basePlaneOffset.z+elevationMax;
-    
     ofLogVerbose("SandSurfaceRenderer") << "setRangesAndBasePlaneEquation(): basePlaneOffset: " << basePlaneOffset ;
     ofLogVerbose("SandSurfaceRenderer") << "setRangesAndBasePlaneEquation(): basePlaneNormal: " << basePlaneNormal ;
 }
 
 void SandSurfaceRenderer::setupMesh(){
-    // Initialise mesh
-    ofRectangle zedROI = zedProjector->getZedROI();
-    glm::vec2 zedRes = zedProjector->getZedRes();
-    meshwidth =zedROI.width;
-    meshheight = zedROI.height;
-    mesh.clear();
-    for(unsigned int y=0;y<meshheight;y++)
-        for(unsigned int x=0;x<meshwidth;x++)
-        {
-            ofGlmPoint pt = ofGlmPoint(x+zedROI.x,y+zedROI.y,0.0f)-ofGlmPoint(0.5,0.5,0); // We move of a half pixel to center the color pixel (more beautiful)
-            mesh.addVertex(pt); // make a new vertex
-            mesh.addTexCoord(pt);
+    // In automatic mode, skip Zed pixels when several of them fall into one projector pixel
+    int step = meshResolution;
+    if (step == 0) {
+        float projPixelsPerZedPixel = zedProjector->getProjectorPixelsPerZedPixel();
+        step = projPixelsPerZedPixel <= 0.25 ? 4 : (projPixelsPerZedPixel <= 0.5 ? 2 : 1);
+        ofLogVerbose("SandSurfaceRenderer") << "setupMesh(): " << projPixelsPerZedPixel << " projector pixels per Zed pixel, automatic grid step: " << step;
+    }
+    // The grid buffers are only rebuilt when the ROI size or the step change
+    mesh.setup(zedProjector->getZedROI(), step);
+    shaderState.setMesh(mesh);
+    settingsVersion++;
+}
+
+SandSurfaceRenderer::PassInputs SandSurfaceRenderer::getPassInputs(){
+    PassInputs inputs;
+    inputs.depth = zedProjector->getDepthVersion();
+    inputs.basePlane = zedProjector->getBasePlaneVersion();
+    inputs.calibration = zedProjector->getCalibrationVersion();
+    inputs.colorMap = heightMap.getVersion();
+    inputs.settings = settingsVersion;
+    inputs.shade = drawHillshade ? zedProjector->getShadeVersion() : 0;
+    inputs.water = drawWater ? waterSimulation->getVersion() : 0;
+    inputs.erosion = drawErosion ? erosionSimulation->getVersion() : 0;
+    return inputs;
+}
+
+void SandSurfaceRenderer::updateDirtyRects(const PassInputs& inputs){
+    projWindowDirtyRects.clear();
+    // Only new depth frames and shaded tiles keep the changes local, to the tiles changed since the last pass
+    const DepthFrame& frame = zedProjector->getDepthFrame();
+    PassInputs depthOnly = sandboxInputs;
+    depthOnly.depth = inputs.depth;
+    depthOnly.shade = inputs.shade;
+    if (!sandboxDrawn || !(depthOnly == inputs) || drawnTileRanges.size() != static_cast<size_t>(frame.tileCols*frame.tileRows))
+        return;
+    auto isTileChanged = [&](int col, int row) {
+        return zedProjector->isDepthTileChangedSince(col, row, sandboxInputs.depth)
+            || (drawHillshade && zedProjector->isShadeTileChangedSince(col, row, sandboxInputs.shade));
+    };
+    // Depths of a tile and of its neighbours, as drawn and as they are now, since the triangles along
+    // the tile edges reach into the neighbours. Pixels without depth are projected far from the sand,
+    // false when some are found
+    auto addTileRange = [&](int col, int row, float& depthMin, float& depthMax) {
+        for (int r = std::max(row-1, 0); r <= std::min(row+1, frame.tileRows-1); r++) {
+            for (int c = std::max(col-1, 0); c <= std::min(col+1, frame.tileCols-1); c++) {
+                const ZedProjector::DepthTileRange& range = zedProjector->getDepthTileRange(c, r);
+                const ZedProjector::DepthTileRange& drawnRange = drawnTileRanges[r*frame.tileCols+c];
+                if (range.holes || drawnRange.holes)
+                    return false;
+                depthMin = std::min(depthMin, std::min(range.depthMin, drawnRange.depthMin));
+                depthMax = std::max(depthMax, std::max(range.depthMax, drawnRange.depthMax));
+            }
         }
-    for(unsigned int y=0;y<meshheight-1;y++)
-        for(unsigned int x=0;x<meshwidth-1;x++)
-        {
-            mesh.addIndex(x+y*meshwidth);         // 0
-            mesh.addIndex((x+1)+y*meshwidth);     // 1
-            mesh.addIndex(x+(y+1)*meshwidth);     // 10
-            
-            mesh.addIndex((x+1)+y*meshwidth);     // 1
-            mesh.addIndex((x+1)+(y+1)*meshwidth); // 11
-            mesh.addIndex(x+(y+1)*meshwidth);     // 10
+        return true;
+    };
+    
+    // Runs of changed tiles, grown by a grid step, projected for their old and new depths, plus a margin for the contour lines
+    int step = mesh.getStep();
+    float margin = 2;
+    for (int row = 0; row < frame.tileRows; row++) {
+        int col = 0;
+        while (col < frame.tileCols) {
+            if (!isTileChanged(col, row)) {
+                col++;
+                continue;
+            }
+            int start = col;
+            while (col < frame.tileCols && isTileChanged(col, row))
+                col++;
+            float depthMin = std::numeric_limits<float>::max();
+            float depthMax = -std::numeric_limits<float>::max();
+            for (int c = start; c < col; c++) {
+                if (!addTileRange(c, row, depthMin, depthMax)) {
+                    projWindowDirtyRects.clear(); // Redraw everything
+                    return;
+                }
+            }
+            if (depthMin > depthMax) // Outside the ROI, nothing is drawn there
+                continue;
+            ofRectangle zedRect(start*DepthFrame::tileSize-step, row*DepthFrame::tileSize-step, (col-start)*DepthFrame::tileSize+2*step, DepthFrame::tileSize+2*step);
+            ofRectangle projRect = zedProjector->zedRectToProjRect(zedRect, depthMin, depthMax);
+            projRect.x -= margin;
+            projRect.y -= margin;
+            projRect.width += 2*margin;
+            projRect.height += 2*margin;
+            projWindowDirtyRects.push_back(projRect);
         }
+    }
+    // Frames without any changed tile still need a non empty list, an empty one means everything changed
+    if (projWindowDirtyRects.empty())
+        projWindowDirtyRects.push_back(ofRectangle());
+}
+
+void SandSurfaceRenderer::storeDrawnTileRanges(){
+    const DepthFrame& frame = zedProjector->getDepthFrame();
+    drawnTileRanges.resize(frame.tileCols*frame.tileRows);
+    for (int row = 0; row < frame.tileRows; row++)
+        for (int col = 0; col < frame.tileCols; col++)
+            drawnTileRanges[row*frame.tileCols+col] = zedProjector->getDepthTileRange(col, row);
 }
 
 void SandSurfaceRenderer::update(){
     // Update Renderer state if needed
-    if (zedProjector->isROIUpdated())
-        setupMesh();
     if (zedProjector->isBasePlaneUpdated())
         updateRangesAndBasePlane();
     if (zedProjector->isCalibrationUpdated())
         updateConversionMatrices();
+    if (zedProjector->isROIUpdated() || (meshResolution == 0 && (zedProjector->isCalibrationUpdated() || zedProjector->isBasePlaneUpdated())))
+        setupMesh();
     
-    // Draw sandbox
-    if (drawContourLines)
-        prepareContourLinesFbo();
-    drawSandbox();
+    render();
     
     // GUI
 	if (displayGui) {
@@ -227,9 +325,40 @@ void SandSurfaceRenderer::update(){
 	}
 }
 
+void SandSurfaceRenderer::render(){
+    // Draw sandbox, skipping the passes whose inputs did not change since they were drawn
+    updateSimulationParameters();
+    PassInputs inputs = getPassInputs();
+    if (drawContourLines && !singlePassContourLines) {
+        // The elevation fbo does not depend on the colormap
+        PassInputs elevationInputs = inputs;
+        elevationInputs.colorMap = 0;
+        if (contourLinesDrawn && elevationInputs == contourLinesInputs) {
+            skippedContourLinesPasses++;
+        } else {
+            prepareContourLinesFbo();
+            contourLinesInputs = elevationInputs;
+            contourLinesDrawn = true;
+        }
+    }
+    if (sandboxDrawn && inputs == sandboxInputs) {
+        skippedSandboxPasses++;
+    } else {
+        updateDirtyRects(inputs);
+        drawSandbox();
+        storeDrawnTileRanges();
+        projWindowVersion++;
+        sandboxInputs = inputs;
+        sandboxDrawn = true;
+    }
+}
+
 void SandSurfaceRenderer::drawMainWindow(float x, float y, float width, float height){
     fboProjWindow.draw(x, y, width, height);
-    
+    drawGui();
+}
+
+void SandSurfaceRenderer::drawGui(){
     if (displayGui) {
         heightMap.getTexture().draw(gui2->getPosition().x, gui2->getPosition().y+gui2->getHeight(), gui2->getWidth(), 30);
 		gui->draw();
@@ -245,23 +374,53 @@ void SandSurfaceRenderer::drawProjectorWindow(){
 	fboProjWindow.draw(0,0);
 }
 
+void SandSurfaceRenderer::updateContourLineParameters(){
+    contourLineFactor = contourLineFboScale/contourLineDistance;
+    // Contour line index from the height color map coordinate: same levels as the elevation fbo pass
+    float contourLineIndexFactor = 1.0/(heightMapScale*contourLineDistance);
+    float contourLineIndexOffset = -(heightMapOffset/heightMapScale+contourLineFboOffset)/contourLineDistance;
+    contourLineTransformation = glm::vec2(contourLineIndexFactor, contourLineIndexOffset);
+    shaderState.setContourLines(drawContourLines, singlePassContourLines, contourLineFactor, contourLineTransformation);
+}
+
+void SandSurfaceRenderer::updateHillshadeParameters(){
+    // Color factor from the hillshade, 1 on a flat surface whose hillshade is sin(sunElevation)
+    float flatShade = std::sin(ofDegToRad(sunElevation));
+    shaderState.setHillshade(drawHillshade, glm::vec2(hillshadeStrength/flatShade, 1-hillshadeStrength));
+    settingsVersion++;
+}
+
+void SandSurfaceRenderer::updateSimulationParameters(){
+    // The simulation versions cover the changes of their textures and of their transformation
+    drawWater = waterSimulation != nullptr && waterSimulation->isEnabled() && waterSimulation->getTexture().isAllocated();
+    drawErosion = erosionSimulation != nullptr && erosionSimulation->isEnabled() && erosionSimulation->getTexture().isAllocated();
+    // Both simulations have one cell per ElevationRaster cell
+    if (drawWater)
+        shaderState.setRasterTransformation(waterSimulation->getTextureTransformation());
+    else if (drawErosion)
+        shaderState.setRasterTransformation(erosionSimulation->getTextureTransformation());
+    // Transparent below 0.5 mm of water, opaque from 10 mm
+    shaderState.setWater(drawWater, glm::vec2(1.0/9.5, -0.5/9.5));
+    shaderState.setErosion(drawErosion);
+}
+
 void SandSurfaceRenderer::drawSandbox() {
     fboProjWindow.begin();
     ofBackground(0);
-    zedProjector->bind();
-    heightMapShader.begin();
-    heightMapShader.setUniformMatrix4f("zedProjMatrix",transposedZedProjMatrix);
-    heightMapShader.setUniformMatrix4f("zedWorldMatrix",transposedZedWorldMatrix);
-    heightMapShader.setUniform2f("heightColorMapTransformation",glm::vec2(heightMapScale,heightMapOffset));
-    heightMapShader.setUniform2f("depthTransformation",glm::vec2(FilteredDepthScale,FilteredDepthOffset));
-    heightMapShader.setUniform4f("basePlaneEq", basePlaneEq);
-    heightMapShader.setUniformTexture("heightColorMapSampler",heightMap.getTexture(), 2);
-    heightMapShader.setUniformTexture("pixelCornerElevationSampler", contourLineFramebufferObject.getTexture(), 3);
-    heightMapShader.setUniform1f("contourLineFactor", contourLineFactor);
-    heightMapShader.setUniform1i("drawContourLines", drawContourLines);
+    shaderState.setDepthTransformation(zedProjector->getDepthTransformation());
+    shaderState.begin(heightMapShader);
+    shaderState.bindTexture(TerrainShaderState::TEXTURE_DEPTH, zedProjector->getTexture());
+    shaderState.bindTexture(TerrainShaderState::TEXTURE_HEIGHT_COLOR_MAP, heightMap.getTexture());
+    if (drawContourLines && !singlePassContourLines)
+        shaderState.bindTexture(TerrainShaderState::TEXTURE_PIXEL_CORNER_ELEVATION, contourLineFramebufferObject.getTexture());
+    if (drawHillshade)
+        shaderState.bindTexture(TerrainShaderState::TEXTURE_HILLSHADE, zedProjector->getShadeTexture());
+    if (drawWater)
+        shaderState.bindTexture(TerrainShaderState::TEXTURE_WATER, waterSimulation->getTexture());
+    if (drawErosion)
+        shaderState.bindTexture(TerrainShaderState::TEXTURE_EROSION, erosionSimulation->getTexture());
     mesh.draw();
-    heightMapShader.end();
-    zedProjector->unbind();
+    shaderState.end(heightMapShader);
     fboProjWindow.end();
 }
 
@@ -269,19 +428,53 @@ void SandSurfaceRenderer::prepareContourLinesFbo()
 {
     contourLineFramebufferObject.begin();
     ofClear(255,255,255, 0);
-    zedProjector->bind();
-	elevationShader.begin();
-    elevationShader.setUniformMatrix4f("zedProjMatrix",transposedZedProjMatrix);
-    elevationShader.setUniformMatrix4f("zedWorldMatrix",transposedZedWorldMatrix);
-    elevationShader.setUniform2f("contourLineFboTransformation",glm::vec2(contourLineFboScale,contourLineFboOffset));
-    elevationShader.setUniform2f("depthTransformation",glm::vec2(FilteredDepthScale,FilteredDepthOffset));
-    elevationShader.setUniform4f("basePlaneEq", basePlaneEq);
+    shaderState.setDepthTransformation(zedProjector->getDepthTransformation());
+    shaderState.begin(elevationShader);
+    shaderState.bindTexture(TerrainShaderState::TEXTURE_DEPTH, zedProjector->getTexture());
+    if (drawErosion)
+        shaderState.bindTexture(TerrainShaderState::TEXTURE_EROSION, erosionSimulation->getTexture());
     mesh.draw();
-    elevationShader.end();
-    zedProjector->unbind();
+    shaderState.end(elevationShader);
     contourLineFramebufferObject.end();
 }
 
+void SandSurfaceRenderer::compareSoftwareRender()
+{
+    // Render the current frame on the CPU and compare it with the last sandbox pass, the hillshade and the erosion are not rendered on the CPU
+    if (drawHillshade)
+        ofLogWarning("SandSurfaceRenderer") << "compareSoftwareRender(): The software renderer ignores the hillshade";
+    if (drawErosion)
+        ofLogWarning("SandSurfaceRenderer") << "compareSoftwareRender(): The software renderer ignores the erosion";
+    // Created on the first comparison, its worker threads are not needed otherwise
+    if (!softwareRenderer) {
+        softwareRenderer.reset(new SoftwareRenderer);
+        softwareRenderer->setup(projResX, projResY);
+    }
+    softwareRenderer->setZedMatrices(zedProjector->getZedWorldMatrix(), zedProjector->getZedProjMatrix());
+    softwareRenderer->setBasePlaneEq(zedProjector->getBasePlaneEq());
+    softwareRenderer->setHeightColorMap(heightMap.getPixels(), glm::vec2(heightMapScale,heightMapOffset));
+    softwareRenderer->setContourLines(drawContourLines, singlePassContourLines, contourLineFactor, glm::vec2(contourLineFboScale,contourLineFboOffset), contourLineTransformation);
+    softwareRenderer->render(zedProjector->getDepthFrame().pixels, zedProjector->getZedROI(), mesh.getStep());
+    
+    ofPixels gpuPixels;
+    fboProjWindow.readToPixels(gpuPixels);
+    gpuPixels.setNumChannels(4);
+    const ofPixels& cpuPixels = softwareRenderer->getPixels();
+    int numDifferent = 0;
+    for (size_t i = 0; i < cpuPixels.size(); i += 4) {
+        for (int c = 0; c < 3; c++) {
+            if (std::abs(cpuPixels[i+c]-gpuPixels[i+c]) > 8) {
+                numDifferent++;
+                break;
+            }
+        }
+    }
+    ofSaveImage(cpuPixels, "softwareRender.png");
+    ofSaveImage(gpuPixels, "gpuRender.png");
+    ofLogVerbose("SandSurfaceRenderer") << "compareSoftwareRender(): Rendered in " << softwareRenderer->getRenderTime() << " ms, "
+        << 100.0*numDifferent/(cpuPixels.size()/4) << "% of the pixels differ from the sandbox pass";
+}
+
 void SandSurfaceRenderer::setupGui(){
     // instantiate the modal windows //
     auto theme = make_shared<ofxModalThemeProjZed>();
@@ -293,8 +486,16 @@ void SandSurfaceRenderer::setupGui(){
     gui2->addToggle("Contour lines", drawContourLines)->setStripeColor(ofColor::blue);
     gui2->addSlider("Lines distance", 1, 30, contourLineDistance)->setName("Contour lines distance");
     gui2->getSlider("Contour lines distance")->setStripeColor(ofColor::blue);
+    gui2->addToggle("Single-pass contour lines", singlePassContourLines)->setStripeColor(ofColor::blue);
+    gui2->addToggle("Hillshade", drawHillshade)->setStripeColor(ofColor::green);
+    gui2->addSlider("Sun azimuth", 0, 360, sunAzimuth)->setStripeColor(ofColor::green);
+    gui2->addSlider("Sun elevation", 5, 90, sunElevation)->setStripeColor(ofColor::green);
+    gui2->addSlider("Hillshade strength", 0, 1, hillshadeStrength)->setStripeColor(ofColor::green);
     gui2->addDropdown("Load Color Map", colorMapFilesList)->setName("Load Color Map");
     gui2->getDropdown("Load Color Map")->setStripeColor(ofColor::yellow);
+    vector<string> meshResolutions = { "Automatic mesh resolution", "Full mesh resolution", "Half mesh resolution", "Quarter mesh resolution" };
+    gui2->addDropdown("Mesh resolution", meshResolutions)->setName("Mesh resolution");
+    gui2->getDropdown("Mesh resolution")->setStripeColor(ofColor::yellow);
     gui2->addHeader(":: Display ::", false);
 
     gui = new ofxDatGui( ofxDatGuiAnchor::NO_ANCHOR );
@@ -302,6 +503,7 @@ void SandSurfaceRenderer::setupGui(){
     gui->addButton("Reset colors to color map file")->setName("Reset colors");
     gui->addButton("Save to color map file")->setName("Save");
     gui->addToggle("Edit color map", editColorMap)->setName("Edit");
+    gui->addButton("Compare with software renderer")->setName("Software render");
 
     gui3 = new ofxDatGui( ofxDatGuiAnchor::NO_ANCHOR );
     gui3->addSlider("Height", -300, 300, 0)->setName("Height");
@@ -329,6 +531,7 @@ void SandSurfaceRenderer::setupGui(){
 	int pos = find(colorMapFilesList.begin(), colorMapFilesList.end(), colorMapFile) - colorMapFilesList.begin();
     if (pos < colorMapFilesList.size())
         gui2->getDropdown("Load Color Map")->select(pos);
+    gui2->getDropdown("Mesh resolution")->select(meshResolution == 4 ? 3 : meshResolution);
     
     // add a scroll view to list colors //
     colorList = new ofxDatGuiScrollView("Colors", 7);
@@ -371,6 +574,8 @@ void SandSurfaceRenderer::populateColorList(){
 void SandSurfaceRenderer::onButtonEvent(ofxDatGuiButtonEvent e){
     if (e.target->is("Save")) {
         saveModal->show();
+    } else if (e.target->is("Software render")) {
+        compareSoftwareRender();
     } else if (e.target->is("Reset colors")) {
         heightMap.loadFile(colorMapPath+colorMapFile);
         populateColorList();
@@ -425,6 +630,16 @@ void SandSurfaceRenderer::onButtonEvent(ofxDatGuiButtonEvent e){
 void SandSurfaceRenderer::onToggleEvent(ofxDatGuiToggleEvent e){
     if (e.target->is("Contour lines")) {
         drawContourLines = e.checked;
+        updateContourLineParameters();
+        settingsVersion++;
+    } else if (e.target->is("Single-pass contour lines")) {
+        singlePassContourLines = e.checked;
+        updateContourLineParameters();
+        settingsVersion++;
+    } else if (e.target->is("Hillshade")) {
+        drawHillshade = e.checked;
+        updateHillshadeParameters();
+        zedProjector->setHillshade(drawHillshade);
     } else if (e.target->is("Edit")) {
         editColorMap = e.checked;
     }
@@ -442,7 +657,18 @@ void SandSurfaceRenderer::onColorPickerEvent(ofxDatGuiColorPickerEvent e){
 void SandSurfaceRenderer::onSliderEvent(ofxDatGuiSliderEvent e){
     if (e.target->is("Contour lines distance")) {
         contourLineDistance = e.value;
-        contourLineFactor = contourLineFboScale/contourLineDistance;        
+        updateContourLineParameters();
+        settingsVersion++;
+    } else if (e.target->is("Sun azimuth")) {
+        sunAzimuth = e.value;
+        zedProjector->setSunDirection(sunAzimuth, sunElevation);
+    } else if (e.target->is("Sun elevation")) {
+        sunElevation = e.value;
+        updateHillshadeParameters();
+        zedProjector->setSunDirection(sunAzimuth, sunElevation);
+    } else if (e.target->is("Hillshade strength")) {
+        hillshadeStrength = e.value;
+        updateHillshadeParameters();
     } else if (e.target->is("Height")) {
         int i = selectedColor;
         int j = heightMap.size()-1-i;
@@ -452,9 +678,14 @@ void SandSurfaceRenderer::onSliderEvent(ofxDatGuiSliderEvent e){
 }
 
 void SandSurfaceRenderer::onDropdownEvent(ofxDatGuiDropdownEvent e){
-    colorMapFile = e.target->getLabel();
-    heightMap.loadFile(colorMapPath+e.target->getLabel());
-    populateColorList();
+    if (e.target->is("Mesh resolution")) {
+        meshResolution = e.child == 0 ? 0 : 1 << (e.child-1); // Automatic, 1, 2 or 4 Zed pixels per grid cell
+        setupMesh();
+    } else {
+        colorMapFile = e.target->getLabel();
+        heightMap.loadFile(colorMapPath+e.target->getLabel());
+        populateColorList();
+    }
 }
 
 void SandSurfaceRenderer::onScrollViewEvent(ofxDatGuiScrollViewEvent e){
@@ -509,6 +740,21 @@ bool SandSurfaceRenderer::loadSettings(){
     colorMapFile = xml.getValue<string>("colorMapFile");
     drawContourLines = xml.getValue<bool>("drawContourLines");
     contourLineDistance = xml.getValue<float>("contourLineDistance");
+    if (xml.exists("meshResolution")) {
+        // Automatic, or a grid step of 1, 2 or 4 Zed pixels, anything else is snapped down to one of them
+        int resolution = xml.getValue<int>("meshResolution");
+        meshResolution = resolution <= 0 ? 0 : (resolution >= 4 ? 4 : (resolution >= 2 ? 2 : 1));
+    }
+    if (xml.exists("singlePassContourLines"))
+        singlePassContourLines = xml.getValue<bool>("singlePassContourLines");
+    if (xml.exists("drawHillshade"))
+        drawHillshade = xml.getValue<bool>("drawHillshade");
+    if (xml.exists("sunAzimuth"))
+        sunAzimuth = xml.getValue<float>("sunAzimuth");
+    if (xml.exists("sunElevation"))
+        sunElevation = xml.getValue<float>("sunElevation");
+    if (xml.exists("hillshadeStrength"))
+        hillshadeStrength = xml.getValue<float>("hillshadeStrength");
     
     return true;
 }
@@ -521,6 +767,12 @@ bool SandSurfaceRenderer::saveSettings(){
     xml.addValue("colorMapFile", colorMapFile);
     xml.addValue("drawContourLines", drawContourLines);
     xml.addValue("contourLineDistance", contourLineDistance);
+    xml.addValue("meshResolution", meshResolution);
+    xml.addValue("singlePassContourLines", singlePassContourLines);
+    xml.addValue("drawHillshade", drawHillshade);
+    xml.addValue("sunAzimuth", sunAzimuth);
+    xml.addValue("sunElevation", sunElevation);
+    xml.addValue("hillshadeStrength", hillshadeStrength);
     xml.setToParent();
     return xml.save(settingsFile);
 }
@@ -31,6 +31,11 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 
 #include "../ZedProjector/ZedProjector.h"
 #include "ColorMap.h"
+#include "GridMesh.h"
+#include "TerrainShaderState.h"
+#include "SoftwareRenderer.h"
+#include "../TerrainAnalysis/WaterSimulation.h"
+#include "../TerrainAnalysis/ErosionSimulation.h"
 #endif /* defined(__GreatSand__SandSurfaceRenderer__) */
 
 class SaveModal : public ofxModalWindow
@@ -70,8 +75,27 @@ public:
     // Main loop function
     void setup(bool sdisplayGui);
     void update();
+    void render(); // Sandbox passes only, also called after a depth frame is received right before drawing the projector
     void drawMainWindow(float x, float y, float width, float height);
     void drawProjectorWindow();
+    void drawGui();
+    
+    // Sandbox layer of the projector compositor
+    const ofFbo& getProjectorWindowFbo() const {
+        return fboProjWindow;
+    }
+    unsigned int getProjectorWindowVersion() const {
+        return projWindowVersion;
+    }
+    const std::vector<ofRectangle>& getProjectorWindowDirtyRects() const { // Changed by the last sandbox pass, empty if all changed
+        return projWindowDirtyRects;
+    }
+    void setWaterSimulation(const WaterSimulation* swaterSimulation) { // Water blended over the sand while it is enabled
+        waterSimulation = swaterSimulation;
+    }
+    void setErosionSimulation(const ErosionSimulation* serosionSimulation) { // Elevation offset added to the sand while it is enabled
+        erosionSimulation = serosionSimulation;
+    }
     
     // Gui and events functions
     void setupGui();
@@ -83,14 +107,41 @@ public:
     void onScrollViewEvent(ofxDatGuiScrollViewEvent e);
     void onSaveModalEvent(ofxModalEvent e);
     void exit(ofEventArgs& e);
+    
+    // Number of passes skipped because their inputs did not change
+    uint64_t getSkippedContourLinesPasses() const {
+        return skippedContourLinesPasses;
+    }
+    uint64_t getSkippedSandboxPasses() const {
+        return skippedSandboxPasses;
+    }
    
 private:
+    // Versions of the inputs of a pass, the pass is skipped when they did not change since it was drawn
+    struct PassInputs {
+        unsigned int depth, basePlane, calibration, colorMap, settings, shade, water, erosion;
+        
+        bool operator == (const PassInputs& pi) const {
+            return depth == pi.depth && basePlane == pi.basePlane && calibration == pi.calibration
+                && colorMap == pi.colorMap && settings == pi.settings && shade == pi.shade && water == pi.water
+                && erosion == pi.erosion;
+        }
+    };
+    
+
     // Private methods
     void setupMesh();
     void updateConversionMatrices();
     void updateRangesAndBasePlane();
+    void updateContourLineParameters();
+    void updateHillshadeParameters();
+    void updateSimulationParameters();
     void drawSandbox();
     void prepareContourLinesFbo();
+    PassInputs getPassInputs();
+    void updateDirtyRects(const PassInputs& inputs);
+    void storeDrawnTileRanges();
+    void compareSoftwareRender();
     void updateColorListColor(int i, int j);
     void populateColorList();
     bool loadSettings();
@@ -104,18 +155,15 @@ private:
     // Projector Resolution
     int projResX, projResY;
     
-    // Conversion matrices
-    ofMatrix4x4                 transposedZedProjMatrix;
-    ofMatrix4x4                 transposedZedWorldMatrix;
-
     // Mesh
-    ofMesh mesh;
-    int meshwidth;          //Mesh size
-    int meshheight;
+    GridMesh mesh;
+    int meshResolution; // Zed pixels between two grid vertices: 1, 2 or 4, 0 for automatic
     
     // Shaders
     ofShader elevationShader;
     ofShader heightMapShader;
+    TerrainShaderState shaderState; // Parameters and textures shared by the shaders
+    std::unique_ptr<SoftwareRenderer> softwareRenderer; // CPU version of the sandbox pass, for comparison, created when first used
     
     // FBos
     ofFbo   fboProjWindow;    
@@ -135,12 +183,35 @@ private:
     
 	float heightMapScale,heightMapOffset; // Scale and offset values to convert from elevation to height color map texture coordinates
     float contourLineFboScale, contourLineFboOffset; // Scale and offset values to convert depth from contourline shader values to real values
-	float FilteredDepthScale,FilteredDepthOffset; // Scale and offset values to convert depth from normalized shader values to real values
     float elevationMin, elevationMax;
     
     // Contourlines
     float contourLineDistance, contourLineFactor;
+    glm::vec2 contourLineTransformation; // Contour line index from the height color map texture coordinate
     bool drawContourLines; // Flag if topographic contour lines are enabled
+    bool singlePassContourLines; // Flag if contour lines are computed from screen-space derivatives instead of the elevation fbo
+    
+    // Hillshade
+    bool drawHillshade; // Flag if the colors are shaded by the ZedProjector shade texture
+    float sunAzimuth, sunElevation; // Degrees
+    float hillshadeStrength; // 0: no shading, 1: slopes facing away from the sun are black
+    
+    // Water
+    const WaterSimulation* waterSimulation;
+    bool drawWater;
+    
+    // Erosion
+    const ErosionSimulation* erosionSimulation;
+    bool drawErosion;
+    
+    // Pass skipping
+    unsigned int settingsVersion; // Incremented on contour lines, hillshade, water and mesh changes
+    PassInputs contourLinesInputs, sandboxInputs; // Inputs of the last drawn passes
+    bool contourLinesDrawn, sandboxDrawn; // The fbos hold a pass drawn from the above inputs
+    uint64_t skippedContourLinesPasses, skippedSandboxPasses;
+    unsigned int projWindowVersion; // Number of sandbox passes
+    std::vector<ofRectangle> projWindowDirtyRects;
+    std::vector<ZedProjector::DepthTileRange> drawnTileRanges; // Depth tile ranges of the last sandbox pass
     
     // GUI Main interface and Modal
     bool displayGui;
@@ -0,0 +1,333 @@
+/***********************************************************************
+SoftwareRenderer - SoftwareRenderer draws the sandbox image of the
+projector on the CPU, with the maths of the terrain shaders.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#include "SoftwareRenderer.h"
+#include "../ZedProjector/Utils.h"
+
+// out[i] = in[i]*scale + offset, NaN stays NaN
+static void scaleRow(const float* in, float* out, int n, float scale, float offset) {
+	int i = 0;
+#ifdef MAGIC_SAND_SSE2
+	__m128 s = _mm_set1_ps(scale);
+	__m128 o = _mm_set1_ps(offset);
+	for (; i + 4 <= n; i += 4)
+		_mm_storeu_ps(out + i, _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(in + i), s), o));
+#endif
+	for (; i < n; ++i)
+		out[i] = in[i] * scale + offset;
+}
+
+// out[i] = start + i*step
+static void fillRamp(float* out, int n, float start, float step) {
+	int i = 0;
+#ifdef MAGIC_SAND_SSE2
+	__m128 value = _mm_setr_ps(start, start + step, start + 2 * step, start + 3 * step);
+	__m128 increment = _mm_set1_ps(4 * step);
+	for (; i + 4 <= n; i += 4) {
+		_mm_storeu_ps(out + i, value);
+		value = _mm_add_ps(value, increment);
+	}
+#endif
+	for (; i < n; ++i)
+		out[i] = start + i*step;
+}
+
+SoftwareRenderer::SoftwareRenderer()
+	:width(0),
+	height(0),
+	resolutionDivider(1),
+	zedWorldMatrix(1),
+	zedProjMatrix(1),
+	basePlaneEq(0, 0, 1, 0),
+	colorMapSize(0),
+	heightColorMapTransformation(1, 0),
+	drawContourLines(false),
+	singlePassContourLines(true),
+	contourLineFactor(1),
+	contourLineFboTransformation(1, 0),
+	contourLineTransformation(1, 0),
+	gridWidth(0),
+	gridHeight(0),
+	renderTime(0)
+{
+}
+
+void SoftwareRenderer::setup(int projWidth, int projHeight, int sresolutionDivider, int numThreads) {
+	resolutionDivider = std::max(sresolutionDivider, 1);
+	width = std::max(projWidth / resolutionDivider, 1);
+	height = std::max(projHeight / resolutionDivider, 1);
+	elevations.assign(width*height, 0);
+	pixels.allocate(width, height, OF_PIXELS_RGBA);
+	bandCells.assign((height + bandHeight - 1) / bandHeight, std::vector<int>());
+	bandScratches.assign(bandCells.size(), BandScratch());
+	for (auto & scratch : bandScratches) {
+		scratch.coords.resize(width);
+		scratch.indices.resize((bandHeight + 2)*width);
+	}
+	if (pool.getNumThreads() == 1 || numThreads != 0)
+		pool.setup(numThreads);
+}
+
+void SoftwareRenderer::setZedMatrices(const glm::mat4& szedWorldMatrix, const glm::mat4& szedProjMatrix) {
+	zedWorldMatrix = szedWorldMatrix;
+	zedProjMatrix = szedProjMatrix;
+}
+
+void SoftwareRenderer::setBasePlaneEq(const glm::vec4& sbasePlaneEq) {
+	basePlaneEq = sbasePlaneEq;
+}
+
+void SoftwareRenderer::setHeightColorMap(const ofPixels& colorMapEntries, const glm::vec2& sheightColorMapTransformation) {
+	colorMapSize = colorMapEntries.getWidth();
+	colorMap.resize(colorMapSize * 3);
+	for (int i = 0; i < colorMapSize; i++) {
+		ofColor color = colorMapEntries.getColor(i, 0);
+		colorMap[3 * i] = color.r;
+		colorMap[3 * i + 1] = color.g;
+		colorMap[3 * i + 2] = color.b;
+	}
+	heightColorMapTransformation = sheightColorMapTransformation;
+}
+
+void SoftwareRenderer::setContourLines(bool sdrawContourLines, bool ssinglePassContourLines, float scontourLineFactor,
+	const glm::vec2& scontourLineFboTransformation, const glm::vec2& scontourLineTransformation) {
+	drawContourLines = sdrawContourLines;
+	singlePassContourLines = ssinglePassContourLines;
+	contourLineFactor = scontourLineFactor;
+	contourLineFboTransformation = scontourLineFboTransformation;
+	contourLineTransformation = scontourLineTransformation;
+}
+
+void SoftwareRenderer::render(const ofFloatPixels& depth, const ofRectangle& roi, int step) {
+	uint64_t start = ofGetElapsedTimeMicros();
+	if (width == 0 || colorMapSize == 0)
+		return;
+
+	// Same grid as GridMesh::setup()
+	step = std::max(step, 1);
+	int roiMaxX = std::max(static_cast<int>(roi.width) - 1, 0);
+	int roiMaxY = std::max(static_cast<int>(roi.height) - 1, 0);
+	gridWidth = (roiMaxX + step - 1) / step + 1;
+	gridHeight = (roiMaxY + step - 1) / step + 1;
+	vertices.resize(gridWidth*gridHeight);
+
+	pool.parallelFor(gridHeight, [&](int row) {
+		transformGridRow(depth, roi, step, row);
+	});
+	binCells();
+	int numBands = bandCells.size();
+	pool.parallelFor(numBands, [this](int band) {
+		rasterizeBand(band);
+	});
+	pool.parallelFor(numBands, [this](int band) {
+		shadeBand(band);
+	});
+	renderTime = (ofGetElapsedTimeMicros() - start) / 1000.0f;
+}
+
+void SoftwareRenderer::transformGridRow(const ofFloatPixels& depth, const ofRectangle& roi, int step, int row) {
+	int depthWidth = depth.getWidth();
+	int depthHeight = depth.getHeight();
+	int roiMaxX = std::max(static_cast<int>(roi.width) - 1, 0);
+	int roiMaxY = std::max(static_cast<int>(roi.height) - 1, 0);
+	int ky = std::min(row*step, roiMaxY);
+	int zy = std::min(static_cast<int>(roi.y) + ky, depthHeight - 1);
+	const float* depthRow = depth.getData() + zy*depthWidth;
+	// Vertex position as in the shaders: half a pixel before the Zed pixel
+	float posY = roi.y - 0.5f + ky;
+	float scale = 1.0f / resolutionDivider;
+	Vertex* vertex = &vertices[row*gridWidth];
+	for (int col = 0; col < gridWidth; col++, vertex++) {
+		int kx = std::min(col*step, roiMaxX);
+		int zx = std::min(static_cast<int>(roi.x) + kx, depthWidth - 1);
+		float d = depthRow[zx];
+		vertex->valid = false;
+		if (d <= 0)
+			continue;
+		glm::vec4 wc = zedWorldMatrix*glm::vec4(roi.x - 0.5f + kx, posY, d, 1)*d;
+		wc.w = 1;
+		glm::vec4 screenPos = zedProjMatrix*wc;
+		if (screenPos.z <= 0)
+			continue;
+		vertex->x = screenPos.x / screenPos.z*scale;
+		vertex->y = screenPos.y / screenPos.z*scale;
+		vertex->elevation = glm::dot(basePlaneEq, wc);
+		vertex->valid = true;
+	}
+}
+
+void SoftwareRenderer::binCells() {
+	for (auto & cells : bandCells)
+		cells.clear();
+	// Rows y with y + 0.5 inside the cell bounds, in the order the strips are drawn
+	int numBands = bandCells.size();
+	for (int row = 0; row < gridHeight - 1; row++) {
+		for (int col = 0; col < gridWidth - 1; col++) {
+			int index = row*gridWidth + col;
+			const Vertex* v[4] = { &vertices[index], &vertices[index + gridWidth], &vertices[index + 1], &vertices[index + gridWidth + 1] };
+			float minX = FLT_MAX, maxX = -FLT_MAX, minY = FLT_MAX, maxY = -FLT_MAX;
+			for (int i = 0; i < 4; i++) {
+				if (!v[i]->valid)
+					continue;
+				minX = std::min(minX, v[i]->x);
+				maxX = std::max(maxX, v[i]->x);
+				minY = std::min(minY, v[i]->y);
+				maxY = std::max(maxY, v[i]->y);
+			}
+			if (maxX < 0 || minX > width || maxY < 0.5f || minY > height - 0.5f)
+				continue; // No valid vertex or outside of the image
+			int firstBand = std::max(static_cast<int>(std::ceil(minY - 0.5f)), 0) / bandHeight;
+			int lastBand = std::min(static_cast<int>(std::floor(maxY - 0.5f)), height - 1) / bandHeight;
+			for (int band = firstBand; band <= std::min(lastBand, numBands - 1); band++)
+				bandCells[band].push_back(index);
+		}
+	}
+}
+
+void SoftwareRenderer::rasterizeBand(int band) {
+	int minY = band*bandHeight;
+	int maxY = std::min(minY + bandHeight, height);
+	std::fill(elevations.begin() + minY*width, elevations.begin() + maxY*width, std::numeric_limits<float>::quiet_NaN());
+	for (int index : bandCells[band]) {
+		// Triangles of the strip: (x, y), (x, y+1), (x+1, y) then (x+1, y), (x, y+1), (x+1, y+1)
+		const Vertex& v00 = vertices[index];
+		const Vertex& v01 = vertices[index + gridWidth];
+		const Vertex& v10 = vertices[index + 1];
+		const Vertex& v11 = vertices[index + gridWidth + 1];
+		if (v00.valid && v01.valid && v10.valid)
+			rasterizeTriangle(v00, v01, v10, minY, maxY);
+		if (v10.valid && v01.valid && v11.valid)
+			rasterizeTriangle(v10, v01, v11, minY, maxY);
+	}
+}
+
+void SoftwareRenderer::rasterizeTriangle(const Vertex& a, const Vertex& b, const Vertex& c, int minY, int maxY) {
+	float area = (b.x - a.x)*(c.y - a.y) - (c.x - a.x)*(b.y - a.y);
+	if (std::abs(area) < 1e-9f)
+		return;
+	// Elevation plane of the triangle
+	float dedx = ((b.elevation - a.elevation)*(c.y - a.y) - (c.elevation - a.elevation)*(b.y - a.y)) / area;
+	float dedy = ((c.elevation - a.elevation)*(b.x - a.x) - (b.elevation - a.elevation)*(c.x - a.x)) / area;
+
+	// Pixels whose center is inside the triangle, left and top edges included
+	float top = std::max(std::min(a.y, std::min(b.y, c.y)) - 0.5f, static_cast<float>(minY));
+	float bottom = std::min(std::max(a.y, std::max(b.y, c.y)) - 0.5f, static_cast<float>(maxY - 1));
+	const Vertex* edges[3][2] = { { &a, &b }, { &b, &c }, { &c, &a } };
+	for (int y = static_cast<int>(std::ceil(top)); y <= bottom; y++) {
+		float yc = y + 0.5f;
+		float xs[2];
+		int n = 0;
+		for (int i = 0; i < 3 && n < 2; i++) {
+			const Vertex& p = *edges[i][0];
+			const Vertex& q = *edges[i][1];
+			if ((p.y <= yc) != (q.y <= yc))
+				xs[n++] = p.x + (yc - p.y)*(q.x - p.x) / (q.y - p.y);
+		}
+		if (n < 2)
+			continue;
+		float left = ofClamp(std::min(xs[0], xs[1]) - 0.5f, 0, width);
+		float right = ofClamp(std::max(xs[0], xs[1]) - 0.5f, 0, width);
+		int x0 = static_cast<int>(std::ceil(left));
+		int x1 = static_cast<int>(std::ceil(right));
+		if (x0 >= x1)
+			continue;
+		float start = a.elevation + dedx*(x0 + 0.5f - a.x) + dedy*(yc - a.y);
+		fillRamp(&elevations[y*width + x0], x1 - x0, start, dedx);
+	}
+}
+
+void SoftwareRenderer::shadeBand(int band) {
+	int minY = band*bandHeight;
+	int maxY = std::min(minY + bandHeight, height);
+	// Colormap coordinates of a row, contour indices of the band and of the rows around it
+	std::vector<float>& coords = bandScratches[band].coords;
+	std::vector<float>& indices = bandScratches[band].indices;
+	for (int y = minY - 1; y <= maxY; y++) {
+		int sy = ofClamp(y, 0, height - 1);
+		float* row = &indices[(y - minY + 1)*width];
+		const float* elevation = &elevations[sy*width];
+		if (singlePassContourLines) {
+			// Contour index from the height color map texture coordinate
+			scaleRow(elevation, row, width, heightColorMapTransformation.x, heightColorMapTransformation.y);
+			scaleRow(row, row, width, contourLineTransformation.x, contourLineTransformation.y);
+		}
+		else {
+			// Contour index of the elevation fbo: normalized, stored in 8 bits, empty pixels cleared to 1
+			scaleRow(elevation, row, width, 1.0f / contourLineFboTransformation.x, -contourLineFboTransformation.y / contourLineFboTransformation.x);
+			for (int x = 0; x < width; x++) {
+				float value = row[x] == row[x] ? std::round(ofClamp(row[x], 0, 1)*255.0f) / 255.0f : 1.0f;
+				row[x] = std::floor(value*contourLineFactor);
+			}
+		}
+	}
+
+	for (int y = minY; y < maxY; y++) {
+		const float* elevation = &elevations[y*width];
+		scaleRow(elevation, coords.data(), width, heightColorMapTransformation.x, heightColorMapTransformation.y);
+		const float* index = &indices[(y - minY + 1)*width];
+		const float* previousIndex = index - width;
+		const float* nextIndex = index + width;
+		unsigned char* out = pixels.getData() + y*width * 4;
+		for (int x = 0; x < width; x++, out += 4) {
+			float coord = coords[x];
+			if (coord != coord) { // Background of the fbo
+				out[0] = out[1] = out[2] = 0;
+				out[3] = 255;
+				continue;
+			}
+			// Linear filtering of the colormap texture, clamped to its edges
+			float t = ofClamp(coord - 0.5f, 0, colorMapSize - 1);
+			int i0 = static_cast<int>(t);
+			int i1 = std::min(i0 + 1, colorMapSize - 1);
+			float f = t - i0;
+			float r = colorMap[3 * i0] * (1 - f) + colorMap[3 * i1] * f;
+			float g = colorMap[3 * i0 + 1] * (1 - f) + colorMap[3 * i1 + 1] * f;
+			float b = colorMap[3 * i0 + 2] * (1 - f) + colorMap[3 * i1 + 2] * f;
+
+			if (drawContourLines && singlePassContourLines) {
+				// fwidth() from the neighbours of the same surface
+				int xn = std::min(x + 1, width - 1);
+				int xp = std::max(x - 1, 0);
+				float dx = index[xn] == index[xn] ? index[xn] - index[x] : (index[xp] == index[xp] ? index[x] - index[xp] : 0);
+				float dy = nextIndex[x] == nextIndex[x] ? nextIndex[x] - index[x] : (previousIndex[x] == previousIndex[x] ? index[x] - previousIndex[x] : 0);
+				float contourIndex = index[x] - 0.5f;
+				float distance = std::abs(contourIndex - std::floor(contourIndex) - 0.5f) / std::max(std::abs(dx) + std::abs(dy), 1.0e-6f);
+				float line = 1 - ofClamp(distance - 0.5f, 0, 1);
+				r *= 1 - line;
+				g *= 1 - line;
+				b *= 1 - line;
+			}
+			else if (drawContourLines) {
+				// Pixel edges crossing a contour line, from the four pixel corners
+				int xn = std::min(x + 1, width - 1);
+				float corner0 = index[x], corner1 = index[xn], corner2 = nextIndex[x], corner3 = nextIndex[xn];
+				int edgeMask = 0;
+				int numEdges = 0;
+				if (corner0 != corner1) { edgeMask += 1; ++numEdges; }
+				if (corner2 != corner3) { edgeMask += 2; ++numEdges; }
+				if (corner0 != corner2) { edgeMask += 4; ++numEdges; }
+				if (corner1 != corner3) { edgeMask += 8; ++numEdges; }
+				if (numEdges > 2 || edgeMask == 3 || edgeMask == 12 || (numEdges == 2 && (x + y) % 2 == 0))
+					r = g = b = 0;
+			}
+			out[0] = static_cast<unsigned char>(r + 0.5f);
+			out[1] = static_cast<unsigned char>(g + 0.5f);
+			out[2] = static_cast<unsigned char>(b + 0.5f);
+			out[3] = 255;
+		}
+	}
+}
@@ -0,0 +1,105 @@
+/***********************************************************************
+SoftwareRenderer - SoftwareRenderer draws the sandbox image of the
+projector on the CPU, with the maths of the terrain shaders.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#pragma once
+
+#include "ofMain.h"
+#include "../WorkerPool.h"
+
+// Same output as the heightMapShader pass into the projector fbo, without any OpenGL call, so
+// the image can be produced, compared and benchmarked on machines without a GPU:
+// - The grid vertices are transformed as in the vertex shaders: depth -> world through
+//   zedWorldMatrix, elevation from basePlaneEq, projection through zedProjMatrix.
+// - The two triangles of each grid cell are rasterized in mesh order, a later triangle
+//   overwriting an earlier one as in the fbo, interpolating the elevation.
+// - The colormap is sampled with linear filtering, the contour lines come from the screen-space
+//   derivatives of the contour index (single-pass) or from the pixel corner edge mask of the
+//   elevation fbo, including its 8-bit quantization.
+// The image is split into bands of rows rasterized and shaded by the worker pool, the spans and
+// the per-row conversions are vectorized. The resolution divider renders a smaller image for
+// interactive use: the contour lines are then one pixel of the smaller image.
+// Grid vertices without depth are skipped, the shaders project them to the Zed origin.
+class SoftwareRenderer {
+public:
+	SoftwareRenderer();
+
+	void setup(int projWidth, int projHeight, int resolutionDivider = 1, int numThreads = 0);
+
+	// Parameters, with the same meaning as in TerrainShaderState except that the matrices are
+	// the ZedProjector matrices, not transposed
+	void setZedMatrices(const glm::mat4& zedWorldMatrix, const glm::mat4& zedProjMatrix);
+	void setBasePlaneEq(const glm::vec4& basePlaneEq);
+	void setHeightColorMap(const ofPixels& colorMapEntries, const glm::vec2& heightColorMapTransformation);
+	void setContourLines(bool drawContourLines, bool singlePassContourLines, float contourLineFactor,
+		const glm::vec2& contourLineFboTransformation, const glm::vec2& contourLineTransformation);
+
+	// depth is the full Zed frame in mm, roi and step describe the grid as in GridMesh
+	void render(const ofFloatPixels& depth, const ofRectangle& roi, int step);
+
+	const ofPixels& getPixels() const { // RGBA, projector size divided by the resolution divider
+		return pixels;
+	}
+	int getResolutionDivider() const {
+		return resolutionDivider;
+	}
+	float getRenderTime() const { // ms of the last render()
+		return renderTime;
+	}
+
+private:
+	struct Vertex {
+		float x, y; // Output image coordinate
+		float elevation; // dot(basePlaneEq, world coordinate), as in the shaders
+		bool valid;
+	};
+	// Shading buffers of a band, allocated by setup()
+	struct BandScratch {
+		std::vector<float> coords; // Colormap coordinates of a row
+		std::vector<float> indices; // Contour indices of the band rows and of the rows around it
+	};
+
+	void transformGridRow(const ofFloatPixels& depth, const ofRectangle& roi, int step, int row);
+	void binCells();
+	void rasterizeBand(int band);
+	void rasterizeTriangle(const Vertex& a, const Vertex& b, const Vertex& c, int minY, int maxY);
+	void shadeBand(int band);
+
+	static const int bandHeight = 16;
+
+	int width, height; // Output image size
+	int resolutionDivider;
+	WorkerPool pool;
+
+	// Parameters
+	glm::mat4 zedWorldMatrix, zedProjMatrix;
+	glm::vec4 basePlaneEq;
+	std::vector<float> colorMap; // RGB entries as floats
+	int colorMapSize;
+	glm::vec2 heightColorMapTransformation;
+	bool drawContourLines, singlePassContourLines;
+	float contourLineFactor;
+	glm::vec2 contourLineFboTransformation, contourLineTransformation;
+
+	// Render buffers
+	int gridWidth, gridHeight;
+	std::vector<Vertex> vertices;
+	std::vector<std::vector<int> > bandCells; // Grid cells overlapping each band, in mesh order
+	std::vector<float> elevations; // Per output pixel, NaN where no triangle was drawn
+	std::vector<BandScratch> bandScratches;
+	ofPixels pixels;
+	float renderTime;
+};
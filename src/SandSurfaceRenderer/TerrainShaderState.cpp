@@ -0,0 +1,234 @@
+/***********************************************************************
+TerrainShaderState - TerrainShaderState keeps the parameters, uniform
+locations and texture units of the terrain shaders.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#include "TerrainShaderState.h"
+#include <glm/gtc/type_ptr.hpp>
+
+static_assert(sizeof(TerrainParameters) == 256, "TerrainParameters does not match the std140 layout of the shaders");
+
+const char* TerrainShaderState::parameterNames[NUM_PARAMS] = {
+	"zedWorldMatrix",
+	"zedProjMatrix",
+	"basePlaneEq",
+	"rasterTransformation",
+	"depthTransformation",
+	"heightColorMapTransformation",
+	"contourLineFboTransformation",
+	"contourLineTransformation",
+	"meshOrigin",
+	"meshMax",
+	"hillshadeTransformation",
+	"waterDepthTransformation",
+	"meshStep",
+	"meshWidth",
+	"contourLineFactor",
+	"drawContourLines",
+	"singlePassContourLines",
+	"drawHillshade",
+	"drawWater",
+	"drawErosion"
+};
+
+const char* TerrainShaderState::samplerNames[NUM_TEXTURE_SLOTS] = {
+	"tex0",
+	"heightColorMapSampler",
+	"pixelCornerElevationSampler",
+	"hillshadeSampler",
+	"waterSampler",
+	"erosionSampler"
+};
+
+const int TerrainShaderState::textureUnits[NUM_TEXTURE_SLOTS] = { 0, 2, 3, 4, 5, 6 };
+
+TerrainShaderState::TerrainShaderState()
+	:programmable(false),
+	parameters(),
+	version(1),
+	bufferVersion(0)
+{
+	for (int i = 0; i < NUM_TEXTURE_SLOTS; i++)
+		boundTextures[i] = nullptr;
+}
+
+void TerrainShaderState::setup() {
+	programmable = ofIsGLProgrammableRenderer();
+	programs.clear();
+	if (programmable) {
+		buffer.allocate(sizeof(TerrainParameters), GL_DYNAMIC_DRAW);
+		bufferVersion = 0;
+	}
+}
+
+void TerrainShaderState::addShader(ofShader& shader) {
+	GLuint id = shader.getProgram();
+	Program* program = findProgram(id);
+	if (program == nullptr) {
+		programs.push_back(Program());
+		program = &programs.back();
+		program->id = id;
+	}
+	program->version = 0;
+
+	shader.begin();
+	if (programmable) {
+		GLuint blockIndex = glGetUniformBlockIndex(id, "TerrainParameters");
+		if (blockIndex != GL_INVALID_INDEX)
+			glUniformBlockBinding(id, blockIndex, bindingPoint);
+		else
+			ofLogWarning("TerrainShaderState") << "addShader(): TerrainParameters block not found in program " << id;
+	}
+	else {
+		for (int i = 0; i < NUM_PARAMS; i++)
+			program->locations[i] = glGetUniformLocation(id, parameterNames[i]);
+	}
+	// Samplers keep their unit, only the textures are bound for each pass
+	for (int i = 0; i < NUM_TEXTURE_SLOTS; i++) {
+		GLint location = glGetUniformLocation(id, samplerNames[i]);
+		if (location != -1)
+			glUniform1i(location, textureUnits[i]);
+	}
+	shader.end();
+}
+
+void TerrainShaderState::setZedMatrices(const glm::mat4& transposedZedWorldMatrix, const glm::mat4& transposedZedProjMatrix) {
+	set(parameters.zedWorldMatrix, transposedZedWorldMatrix);
+	set(parameters.zedProjMatrix, transposedZedProjMatrix);
+}
+
+void TerrainShaderState::setBasePlaneEq(const glm::vec4& basePlaneEq) {
+	set(parameters.basePlaneEq, basePlaneEq);
+}
+
+void TerrainShaderState::setDepthTransformation(const glm::vec2& depthTransformation) {
+	set(parameters.depthTransformation, depthTransformation);
+}
+
+void TerrainShaderState::setHeightColorMapTransformation(const glm::vec2& heightColorMapTransformation) {
+	set(parameters.heightColorMapTransformation, heightColorMapTransformation);
+}
+
+void TerrainShaderState::setContourLineFboTransformation(const glm::vec2& contourLineFboTransformation) {
+	set(parameters.contourLineFboTransformation, contourLineFboTransformation);
+}
+
+void TerrainShaderState::setContourLines(bool drawContourLines, bool singlePassContourLines, float contourLineFactor, const glm::vec2& contourLineTransformation) {
+	set(parameters.drawContourLines, drawContourLines ? 1 : 0);
+	set(parameters.singlePassContourLines, singlePassContourLines ? 1 : 0);
+	set(parameters.contourLineFactor, contourLineFactor);
+	set(parameters.contourLineTransformation, contourLineTransformation);
+}
+
+void TerrainShaderState::setMesh(const GridMesh& mesh) {
+	set(parameters.meshOrigin, mesh.getOrigin());
+	set(parameters.meshMax, mesh.getMax());
+	set(parameters.meshStep, static_cast<float>(mesh.getStep()));
+	set(parameters.meshWidth, mesh.getWidth());
+}
+
+void TerrainShaderState::setHillshade(bool drawHillshade, const glm::vec2& hillshadeTransformation) {
+	set(parameters.drawHillshade, drawHillshade ? 1 : 0);
+	set(parameters.hillshadeTransformation, hillshadeTransformation);
+}
+
+void TerrainShaderState::setRasterTransformation(const glm::vec4& rasterTransformation) {
+	set(parameters.rasterTransformation, rasterTransformation);
+}
+
+void TerrainShaderState::setWater(bool drawWater, const glm::vec2& waterDepthTransformation) {
+	set(parameters.drawWater, drawWater ? 1 : 0);
+	set(parameters.waterDepthTransformation, waterDepthTransformation);
+}
+
+void TerrainShaderState::setErosion(bool drawErosion) {
+	set(parameters.drawErosion, drawErosion ? 1 : 0);
+}
+
+void TerrainShaderState::begin(ofShader& shader) {
+	shader.begin();
+	if (programmable) {
+		if (bufferVersion != version) {
+			buffer.updateData(0, sizeof(TerrainParameters), &parameters);
+			bufferVersion = version;
+		}
+		buffer.bindBase(GL_UNIFORM_BUFFER, bindingPoint);
+	}
+	else {
+		Program* program = findProgram(shader.getProgram());
+		if (program == nullptr) {
+			ofLogError("TerrainShaderState") << "begin(): shader " << shader.getProgram() << " was not added";
+			return;
+		}
+		if (program->version != version) {
+			sendUniforms(*program);
+			program->version = version;
+		}
+	}
+}
+
+void TerrainShaderState::end(ofShader& shader) {
+	unbindTextures();
+	shader.end();
+}
+
+void TerrainShaderState::bindTexture(TextureSlot slot, const ofTexture& texture) {
+	// Through ofTexture so the renderer keeps track of the texture target and matrix of the unit
+	if (boundTextures[slot] != nullptr)
+		boundTextures[slot]->unbind(textureUnits[slot]);
+	texture.bind(textureUnits[slot]);
+	boundTextures[slot] = &texture;
+}
+
+void TerrainShaderState::unbindTextures() {
+	for (int i = 0; i < NUM_TEXTURE_SLOTS; i++) {
+		if (boundTextures[i] == nullptr)
+			continue;
+		boundTextures[i]->unbind(textureUnits[i]);
+		boundTextures[i] = nullptr;
+	}
+}
+
+TerrainShaderState::Program* TerrainShaderState::findProgram(GLuint id) {
+	for (auto & program : programs)
+		if (program.id == id)
+			return &program;
+	return nullptr;
+}
+
+void TerrainShaderState::sendUniforms(const Program& program) {
+	// Uniforms the shader does not use have a -1 location and are ignored by GL
+	const GLint* locations = program.locations;
+	glUniformMatrix4fv(locations[PARAM_ZED_WORLD_MATRIX], 1, GL_FALSE, glm::value_ptr(parameters.zedWorldMatrix));
+	glUniformMatrix4fv(locations[PARAM_ZED_PROJ_MATRIX], 1, GL_FALSE, glm::value_ptr(parameters.zedProjMatrix));
+	glUniform4fv(locations[PARAM_BASE_PLANE_EQ], 1, glm::value_ptr(parameters.basePlaneEq));
+	glUniform4fv(locations[PARAM_RASTER_TRANSFORMATION], 1, glm::value_ptr(parameters.rasterTransformation));
+	glUniform2fv(locations[PARAM_DEPTH_TRANSFORMATION], 1, glm::value_ptr(parameters.depthTransformation));
+	glUniform2fv(locations[PARAM_HEIGHT_COLOR_MAP_TRANSFORMATION], 1, glm::value_ptr(parameters.heightColorMapTransformation));
+	glUniform2fv(locations[PARAM_CONTOUR_LINE_FBO_TRANSFORMATION], 1, glm::value_ptr(parameters.contourLineFboTransformation));
+	glUniform2fv(locations[PARAM_CONTOUR_LINE_TRANSFORMATION], 1, glm::value_ptr(parameters.contourLineTransformation));
+	glUniform2fv(locations[PARAM_MESH_ORIGIN], 1, glm::value_ptr(parameters.meshOrigin));
+	glUniform2fv(locations[PARAM_MESH_MAX], 1, glm::value_ptr(parameters.meshMax));
+	glUniform2fv(locations[PARAM_HILLSHADE_TRANSFORMATION], 1, glm::value_ptr(parameters.hillshadeTransformation));
+	glUniform2fv(locations[PARAM_WATER_DEPTH_TRANSFORMATION], 1, glm::value_ptr(parameters.waterDepthTransformation));
+	glUniform1f(locations[PARAM_MESH_STEP], parameters.meshStep);
+	glUniform1i(locations[PARAM_MESH_WIDTH], parameters.meshWidth);
+	glUniform1f(locations[PARAM_CONTOUR_LINE_FACTOR], parameters.contourLineFactor);
+	glUniform1i(locations[PARAM_DRAW_CONTOUR_LINES], parameters.drawContourLines);
+	glUniform1i(locations[PARAM_SINGLE_PASS_CONTOUR_LINES], parameters.singlePassContourLines);
+	glUniform1i(locations[PARAM_DRAW_HILLSHADE], parameters.drawHillshade);
+	glUniform1i(locations[PARAM_DRAW_WATER], parameters.drawWater);
+	glUniform1i(locations[PARAM_DRAW_EROSION], parameters.drawErosion);
+}
@@ -0,0 +1,146 @@
+/***********************************************************************
+TerrainShaderState - TerrainShaderState keeps the parameters, uniform
+locations and texture units of the terrain shaders.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#pragma once
+
+#include "ofMain.h"
+#include "GridMesh.h"
+
+// Mirror of the TerrainParameters uniform block of the GL3 terrain shaders, in std140 layout
+struct TerrainParameters {
+	glm::mat4 zedWorldMatrix; // Transposed, see ZedProjector::getTransposedZedWorldMatrix()
+	glm::mat4 zedProjMatrix;
+	glm::vec4 basePlaneEq;
+	glm::vec4 rasterTransformation; // Zed coordinate to ElevationRaster cell texture coordinate, xy factor and zw offset
+	glm::vec2 depthTransformation;
+	glm::vec2 heightColorMapTransformation;
+	glm::vec2 contourLineFboTransformation;
+	glm::vec2 contourLineTransformation;
+	glm::vec2 meshOrigin;
+	glm::vec2 meshMax;
+	glm::vec2 hillshadeTransformation;
+	glm::vec2 waterDepthTransformation;
+	float meshStep;
+	int meshWidth;
+	float contourLineFactor;
+	int drawContourLines;
+	int singlePassContourLines;
+	int drawHillshade;
+	int drawWater;
+	int drawErosion; // Last member, the block size is a multiple of 16 bytes
+};
+
+// The parameters shared by the terrain shaders are kept on the CPU and only sent to the GPU
+// when they changed since the last time a shader used them:
+// - Programmable renderer: one uniform buffer bound to the TerrainParameters block of every
+//   shader, updated once per change.
+// - Fixed pipeline: uniforms set through locations resolved once in addShader(), per shader
+//   since the uniform values are stored in each program.
+// The texture samplers get a fixed unit in addShader(), textures are then bound to their unit
+// without any uniform call, and unbound by end().
+class TerrainShaderState {
+public:
+	enum TextureSlot {
+		TEXTURE_DEPTH = 0, // tex0
+		TEXTURE_HEIGHT_COLOR_MAP = 1, // heightColorMapSampler
+		TEXTURE_PIXEL_CORNER_ELEVATION = 2, // pixelCornerElevationSampler
+		TEXTURE_HILLSHADE = 3, // hillshadeSampler
+		TEXTURE_WATER = 4, // waterSampler
+		TEXTURE_EROSION = 5, // erosionSampler
+		NUM_TEXTURE_SLOTS = 6
+	};
+
+	TerrainShaderState();
+
+	void setup();
+	void addShader(ofShader& shader); // To be called after each (re)load of the shader
+
+	// Parameters
+	void setZedMatrices(const glm::mat4& transposedZedWorldMatrix, const glm::mat4& transposedZedProjMatrix);
+	void setBasePlaneEq(const glm::vec4& basePlaneEq);
+	void setDepthTransformation(const glm::vec2& depthTransformation);
+	void setHeightColorMapTransformation(const glm::vec2& heightColorMapTransformation);
+	void setContourLineFboTransformation(const glm::vec2& contourLineFboTransformation);
+	void setContourLines(bool drawContourLines, bool singlePassContourLines, float contourLineFactor, const glm::vec2& contourLineTransformation);
+	void setMesh(const GridMesh& mesh);
+	void setHillshade(bool drawHillshade, const glm::vec2& hillshadeTransformation);
+	void setRasterTransformation(const glm::vec4& rasterTransformation); // Shared by the water and erosion textures
+	void setWater(bool drawWater, const glm::vec2& waterDepthTransformation);
+	void setErosion(bool drawErosion);
+
+	// Pass functions
+	void begin(ofShader& shader); // Begins the shader and sends the changed parameters
+	void end(ofShader& shader);
+	void bindTexture(TextureSlot slot, const ofTexture& texture);
+	void unbindTextures();
+
+	unsigned int getVersion() const { // Number of parameter changes
+		return version;
+	}
+
+private:
+	enum Parameter {
+		PARAM_ZED_WORLD_MATRIX,
+		PARAM_ZED_PROJ_MATRIX,
+		PARAM_BASE_PLANE_EQ,
+		PARAM_RASTER_TRANSFORMATION,
+		PARAM_DEPTH_TRANSFORMATION,
+		PARAM_HEIGHT_COLOR_MAP_TRANSFORMATION,
+		PARAM_CONTOUR_LINE_FBO_TRANSFORMATION,
+		PARAM_CONTOUR_LINE_TRANSFORMATION,
+		PARAM_MESH_ORIGIN,
+		PARAM_MESH_MAX,
+		PARAM_HILLSHADE_TRANSFORMATION,
+		PARAM_WATER_DEPTH_TRANSFORMATION,
+		PARAM_MESH_STEP,
+		PARAM_MESH_WIDTH,
+		PARAM_CONTOUR_LINE_FACTOR,
+		PARAM_DRAW_CONTOUR_LINES,
+		PARAM_SINGLE_PASS_CONTOUR_LINES,
+		PARAM_DRAW_HILLSHADE,
+		PARAM_DRAW_WATER,
+		PARAM_DRAW_EROSION,
+		NUM_PARAMS
+	};
+	struct Program {
+		GLuint id;
+		GLint locations[NUM_PARAMS]; // Fixed pipeline uniforms, -1 when not used by the shader
+		unsigned int version; // Parameters version last sent to the program
+	};
+
+	template<typename T> void set(T& parameter, const T& value) {
+		if (parameter != value) {
+			parameter = value;
+			version++;
+		}
+	}
+	Program* findProgram(GLuint id);
+	void sendUniforms(const Program& program);
+
+	static const GLuint bindingPoint = 0; // Uniform buffer binding point of the TerrainParameters block
+	static const char* parameterNames[NUM_PARAMS];
+	static const char* samplerNames[NUM_TEXTURE_SLOTS];
+	static const int textureUnits[NUM_TEXTURE_SLOTS];
+
+	bool programmable;
+	TerrainParameters parameters;
+	unsigned int version;
+	unsigned int bufferVersion; // Parameters version in the uniform buffer
+	ofBufferObject buffer;
+	std::vector<Program> programs;
+	const ofTexture* boundTextures[NUM_TEXTURE_SLOTS]; // nullptr when the slot is not bound
+};
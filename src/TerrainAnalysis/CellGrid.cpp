@@ -0,0 +1,58 @@
+/***********************************************************************
+CellGrid - Padded grid of the raster cells and cell texture shared by
+the water and erosion simulations.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#include "CellGrid.h"
+
+CellGrid::CellGrid()
+	:cols(0),
+	rows(0),
+	stride(0),
+	wallHeight(0),
+	terrainVersion(0),
+	textureTransformation(0)
+{
+}
+
+void CellGrid::setup(const ElevationRaster& raster, float swallHeight) {
+	cols = raster.getCols();
+	rows = raster.getRows();
+	stride = (cols + 2 + 3) / 4 * 4;
+	wallHeight = swallHeight;
+	terrain.assign(getSize(), wallHeight);
+	mask.assign(getSize(), 0.0f);
+	terrainVersion = 0;
+
+	// Texel centers are at the cell centers
+	glm::vec2 origin = raster.cellToZedCoord(-0.5f, -0.5f);
+	float scale = 1.0f / raster.getCellSize();
+	textureTransformation = glm::vec4(scale, scale, -origin.x*scale, -origin.y*scale);
+	if (GLEW_VERSION_3_0 || GLEW_ARB_texture_rg)
+		texture.allocate(cols, rows, GL_R32F);
+	else
+		texture.allocate(cols, rows, GL_LUMINANCE32F_ARB); // Sampled the same way through .r
+	texture.setTextureMinMagFilter(GL_LINEAR, GL_LINEAR);
+}
+
+void CellGrid::uploadTexture(const float* values) {
+	const ofTextureData& texData = texture.getTextureData();
+	GLenum format = texData.glInternalFormat == GL_R32F ? GL_RED : GL_LUMINANCE;
+	glBindTexture(texData.textureTarget, texData.textureID);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, stride);
+	glTexSubImage2D(texData.textureTarget, 0, 0, 0, cols, rows, format, GL_FLOAT, values + stride + 1);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glBindTexture(texData.textureTarget, 0);
+}
@@ -0,0 +1,112 @@
+/***********************************************************************
+CellGrid - Padded grid of the raster cells and cell texture shared by
+the water and erosion simulations.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#pragma once
+
+#include "ofMain.h"
+#include "ElevationRaster.h"
+
+// The cells of the ElevationRaster with a border of wall cells, so the kernels never test the
+// neighbours, in rows padded to stride floats for unaligned 4-cell groups. Invalid cells are
+// walls too: their terrain is the wall height, above any water surface, and their mask is 0.
+// The grid keeps the terrain copied from the changed raster tiles, and the single channel
+// float texture a simulation uploads its padded rows to, one texel per cell. R32F needs GL 3.0
+// or ARB_texture_rg, GL 2 drivers without it get a LUMINANCE32F texture.
+class CellGrid {
+public:
+	CellGrid();
+
+	void setup(const ElevationRaster& raster, float swallHeight); // All walls, until the terrain is updated
+	bool isResized(const ElevationRaster& raster) const { // The raster changed size or moved since the setup
+		return raster.getCols() != cols || raster.getRows() != rows || raster.isResized(terrainVersion);
+	}
+
+	// Copies the raster tiles changed since the last copy, false if none changed.
+	// changed(i, valid, elevation) is called for each copied cell before it is overwritten,
+	// the terrain and mask still hold its previous values.
+	template<class Changed> bool updateTerrain(const ElevationRaster& raster, Changed changed);
+
+	void uploadTexture(const float* values); // Grid of stride floats per row, read without its border and padding
+
+	int getCols() const {
+		return cols;
+	}
+	int getRows() const {
+		return rows;
+	}
+	int getStride() const { // Floats per row, including the 2 border cells and the padding
+		return stride;
+	}
+	size_t getSize() const {
+		return static_cast<size_t>(stride)*(rows + 2);
+	}
+	int getNumBands() const { // Full-width bands of ElevationRaster::tileCells rows
+		return (rows + ElevationRaster::tileCells - 1) / ElevationRaster::tileCells;
+	}
+	size_t index(int col, int row) const {
+		return static_cast<size_t>(row + 1)*stride + col + 1;
+	}
+	const float* getTerrain() const { // mm
+		return terrain.data();
+	}
+	const float* getMask() const { // 1 for the cells holding water, 0 for the walls
+		return mask.data();
+	}
+	const ofTexture& getTexture() const {
+		return texture;
+	}
+	glm::vec4 getTextureTransformation() const { // Texture coordinate from Zed coordinate: zedCoord * xy + zw
+		return textureTransformation;
+	}
+
+private:
+	int cols, rows;
+	int stride;
+	float wallHeight;
+	std::vector<float> terrain;
+	std::vector<float> mask;
+	unsigned int terrainVersion; // ElevationRaster version of the terrain
+
+	ofTexture texture;
+	glm::vec4 textureTransformation;
+};
+
+template<class Changed> bool CellGrid::updateTerrain(const ElevationRaster& raster, Changed changed) {
+	if (raster.getVersion() == terrainVersion)
+		return false;
+	const int tileCells = ElevationRaster::tileCells;
+	for (int tileRow = 0; tileRow < raster.getTileRows(); tileRow++) {
+		for (int tileCol = 0; tileCol < raster.getTileCols(); tileCol++) {
+			if (!raster.isTileChangedSince(tileCol, tileRow, terrainVersion))
+				continue;
+			int row1 = std::min((tileRow + 1)*tileCells, rows);
+			int col1 = std::min((tileCol + 1)*tileCells, cols);
+			for (int row = tileRow*tileCells; row < row1; row++) {
+				for (int col = tileCol*tileCells; col < col1; col++) {
+					size_t i = index(col, row);
+					bool valid = raster.isValid(col, row);
+					float elevation = valid ? raster.getElevation(col, row) : wallHeight;
+					changed(i, valid, elevation);
+					terrain[i] = elevation;
+					mask[i] = valid ? 1.0f : 0.0f;
+				}
+			}
+		}
+	}
+	terrainVersion = raster.getVersion();
+	return true;
+}
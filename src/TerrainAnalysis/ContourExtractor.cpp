@@ -0,0 +1,351 @@
+/***********************************************************************
+ContourExtractor - Vector contour lines of the elevation raster, computed
+with marching squares.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#include "ContourExtractor.h"
+#include <unordered_map>
+#include <unordered_set>
+
+namespace {
+	// Contour crossing one raster edge, identified by its level and edge
+	struct Segment {
+		uint64_t keys[2];
+		glm::vec2 points[2]; // Cell coordinates
+	};
+
+	uint64_t edgeKey(int level, int edge) {
+		return (static_cast<uint64_t>(static_cast<uint32_t>(level)) << 32) | static_cast<uint32_t>(edge);
+	}
+
+	// Links the ends (2*i and 2*i+1 of element i) that share a key, -1 for the unmatched ones
+	template<typename KeyOf> void linkEnds(int numEnds, KeyOf keyOf, std::vector<int>& links) {
+		std::unordered_map<uint64_t, int> firstEnds;
+		firstEnds.reserve(numEnds);
+		links.assign(numEnds, -1);
+		for (int end = 0; end < numEnds; end++) {
+			auto inserted = firstEnds.insert(std::make_pair(keyOf(end), end));
+			if (!inserted.second) {
+				links[end] = inserted.first->second;
+				links[inserted.first->second] = end;
+			}
+		}
+	}
+}
+
+ContourExtractor::ContourExtractor()
+	:interval(10),
+	intervalChanged(true),
+	rasterVersion(0),
+	version(0)
+{
+}
+
+void ContourExtractor::setInterval(float sinterval) {
+	if (sinterval > 0 && sinterval != interval) {
+		interval = sinterval;
+		intervalChanged = true;
+	}
+}
+
+bool ContourExtractor::update(const ElevationRaster& raster, WorkerPool& pool) {
+	int tileCols = raster.getTileCols();
+	int tileRows = raster.getTileRows();
+	bool full = intervalChanged || raster.isResized(rasterVersion) || tileChains.size() != tileCols*tileRows;
+	if (!full && raster.getVersion() == rasterVersion)
+		return false;
+
+	// The squares of a tile also read the first row and column of cells of the next tiles
+	tileChains.resize(tileCols*tileRows);
+	dirtyTiles.clear();
+	for (int tileRow = 0; tileRow < tileRows; tileRow++) {
+		for (int tileCol = 0; tileCol < tileCols; tileCol++) {
+			bool changed = full;
+			for (int row = tileRow; !changed && row <= std::min(tileRow + 1, tileRows - 1); row++)
+				for (int col = tileCol; !changed && col <= std::min(tileCol + 1, tileCols - 1); col++)
+					changed = raster.isTileChangedSince(col, row, rasterVersion);
+			if (changed)
+				dirtyTiles.push_back(tileRow*tileCols + tileCol);
+		}
+	}
+	rasterVersion = raster.getVersion();
+	intervalChanged = false;
+	if (dirtyTiles.empty())
+		return false;
+
+	pool.parallelFor(static_cast<int>(dirtyTiles.size()), [this, &raster](int i) {
+		extractTile(raster, dirtyTiles[i]);
+	});
+	mergeChains(raster, full);
+	version++;
+	return true;
+}
+
+void ContourExtractor::extractTile(const ElevationRaster& raster, int tile) {
+	int cols = raster.getCols();
+	int tileCol = tile % raster.getTileCols();
+	int tileRow = tile / raster.getTileCols();
+	int minCol = tileCol*ElevationRaster::tileCells;
+	int maxCol = std::min(minCol + ElevationRaster::tileCells, cols - 1);
+	int minRow = tileRow*ElevationRaster::tileCells;
+	int maxRow = std::min(minRow + ElevationRaster::tileCells, raster.getRows() - 1);
+	const float* elevations = raster.getData();
+
+	// Marching squares, corners 0 to 3 clockwise from the top left one, edge i from corner i
+	std::vector<Segment> segments;
+	for (int row = minRow; row < maxRow; row++) {
+		for (int col = minCol; col < maxCol; col++) {
+			const float* cell = elevations + row*cols + col;
+			float v[4] = { cell[0], cell[1], cell[cols + 1], cell[cols] };
+			if (v[0] != v[0] || v[1] != v[1] || v[2] != v[2] || v[3] != v[3])
+				continue;
+			float low = std::min(std::min(v[0], v[1]), std::min(v[2], v[3]));
+			float high = std::max(std::max(v[0], v[1]), std::max(v[2], v[3]));
+			int edges[4] = { 2 * (row*cols + col), 2 * (row*cols + col + 1) + 1, 2 * ((row + 1)*cols + col), 2 * (row*cols + col) + 1 };
+			// A corner is above a level when its elevation is greater or equal
+			for (int level = static_cast<int>(std::floor(low / interval)) + 1; level <= static_cast<int>(std::floor(high / interval)); level++) {
+				float elevation = level*interval;
+				bool above[4] = { v[0] >= elevation, v[1] >= elevation, v[2] >= elevation, v[3] >= elevation };
+				int crossed[4];
+				glm::vec2 points[4];
+				int numCrossed = 0;
+				for (int i = 0; i < 4; i++) {
+					int j = (i + 1) % 4;
+					if (above[i] == above[j])
+						continue;
+					// Interpolate from the top or left corner of the edge, so both squares of an edge agree
+					static const int edgeStarts[4] = { 0, 1, 3, 0 };
+					static const int edgeEnds[4] = { 1, 2, 2, 3 };
+					static const glm::vec2 corners[4] = { glm::vec2(0, 0), glm::vec2(1, 0), glm::vec2(1, 1), glm::vec2(0, 1) };
+					int a = edgeStarts[i];
+					int b = edgeEnds[i];
+					float t = (elevation - v[a]) / (v[b] - v[a]);
+					points[numCrossed] = glm::vec2(col, row) + corners[a] + (corners[b] - corners[a])*t;
+					crossed[numCrossed++] = i;
+				}
+				auto addSegment = [&](int first, int second) {
+					Segment segment;
+					segment.keys[0] = edgeKey(level, edges[crossed[first]]);
+					segment.keys[1] = edgeKey(level, edges[crossed[second]]);
+					segment.points[0] = points[first];
+					segment.points[1] = points[second];
+					segments.push_back(segment);
+				};
+				if (numCrossed == 2) {
+					addSegment(0, 1);
+				}
+				else if (numCrossed == 4) {
+					// Saddle: when the center is on the side of corners 0 and 2, corners 1 and 3 are cut off
+					bool centerAbove = (v[0] + v[1] + v[2] + v[3]) / 4 >= elevation;
+					if (centerAbove == above[0]) {
+						addSegment(0, 1);
+						addSegment(2, 3);
+					}
+					else {
+						addSegment(3, 0);
+						addSegment(1, 2);
+					}
+				}
+			}
+		}
+	}
+
+	// Stitch the segments sharing an edge into chains, open ones first
+	std::vector<int> links;
+	linkEnds(segments.size() * 2, [&segments](int end) { return segments[end / 2].keys[end % 2]; }, links);
+	std::vector<bool> visited(segments.size(), false);
+	std::vector<Chain>& chains = tileChains[tile];
+	chains.clear();
+	for (int pass = 0; pass < 2; pass++) {
+		for (size_t i = 0; i < segments.size(); i++) {
+			if (visited[i])
+				continue;
+			// Open chains start from an unmatched end, closed ones anywhere
+			int startEnd = 2 * i;
+			if (pass == 0) {
+				if (links[2 * i] != -1 && links[2 * i + 1] != -1)
+					continue;
+				startEnd = links[2 * i] == -1 ? 2 * i : 2 * i + 1;
+			}
+			Chain chain;
+			chain.level = static_cast<int>(segments[i].keys[0] >> 32);
+			chain.closed = pass == 1;
+			chain.startKey = segments[i].keys[startEnd % 2];
+			chain.points.push_back(segments[i].points[startEnd % 2]);
+			int end = startEnd;
+			while (true) {
+				int segment = end / 2;
+				visited[segment] = true;
+				int exitEnd = end ^ 1;
+				chain.points.push_back(segments[segment].points[exitEnd % 2]);
+				chain.endKey = segments[segment].keys[exitEnd % 2];
+				end = links[exitEnd];
+				if (end == -1 || visited[end / 2])
+					break;
+			}
+			if (chain.closed)
+				chain.points.pop_back(); // Back to the first point
+			chains.push_back(std::move(chain));
+		}
+	}
+}
+
+void ContourExtractor::mergeChains(const ElevationRaster& raster, bool full) {
+	int numTiles = tileChains.size();
+	tileDirty.assign(numTiles, full ? 1 : 0);
+	for (int tile : dirtyTiles)
+		tileDirty[tile] = 1;
+	if (full) {
+		polylines.clear();
+		stitches.clear();
+	}
+
+	// Open ends of the new chains, a kept open polyline ending on one of them continues there now
+	std::unordered_set<uint64_t> dirtyKeys;
+	for (int tile : dirtyTiles) {
+		for (auto & chain : tileChains[tile]) {
+			if (!chain.closed) {
+				dirtyKeys.insert(chain.startKey);
+				dirtyKeys.insert(chain.endKey);
+			}
+		}
+	}
+
+	// Drop the polylines going through a changed tile or continuing into one, their chains of the
+	// unchanged tiles are stitched again with the new chains
+	std::vector<ChainRef> openChains;
+	size_t numKept = 0;
+	for (size_t i = 0; i < polylines.size(); i++) {
+		const Stitch& stitch = stitches[i];
+		bool changed = !polylines[i].closed && (dirtyKeys.count(stitch.startKey) != 0 || dirtyKeys.count(stitch.endKey) != 0);
+		for (size_t c = 0; !changed && c < stitch.chains.size(); c++)
+			changed = tileDirty[stitch.chains[c].tile] != 0;
+		if (changed) {
+			for (auto & ref : stitch.chains)
+				if (!tileDirty[ref.tile])
+					openChains.push_back(ref);
+			continue;
+		}
+		if (numKept != i) {
+			polylines[numKept] = std::move(polylines[i]);
+			stitches[numKept] = std::move(stitches[i]);
+		}
+		numKept++;
+	}
+	polylines.resize(numKept);
+	stitches.resize(numKept);
+
+	// Closed chains of the changed tiles are complete, open ones continue in the neighbouring tiles
+	for (int tile : dirtyTiles) {
+		for (size_t c = 0; c < tileChains[tile].size(); c++) {
+			const Chain& chain = tileChains[tile][c];
+			ChainRef ref = { tile, static_cast<int>(c) };
+			if (!chain.closed) {
+				openChains.push_back(ref);
+				continue;
+			}
+			Polyline polyline;
+			polyline.elevation = chain.level*interval;
+			polyline.closed = true;
+			for (auto & point : chain.points)
+				polyline.points.push_back(raster.cellToZedCoord(point.x, point.y));
+			polylines.push_back(std::move(polyline));
+			Stitch stitch;
+			stitch.chains.push_back(ref);
+			stitch.startKey = stitch.endKey = 0;
+			stitches.push_back(std::move(stitch));
+		}
+	}
+
+	auto chainOf = [this](const ChainRef& ref) -> const Chain& {
+		return tileChains[ref.tile][ref.chain];
+	};
+	std::vector<int> links;
+	linkEnds(openChains.size() * 2, [&](int end) { return end % 2 == 0 ? chainOf(openChains[end / 2]).startKey : chainOf(openChains[end / 2]).endKey; }, links);
+	std::vector<bool> visited(openChains.size(), false);
+	for (int pass = 0; pass < 2; pass++) {
+		for (size_t i = 0; i < openChains.size(); i++) {
+			if (visited[i])
+				continue;
+			int startEnd = 2 * i;
+			if (pass == 0) {
+				if (links[2 * i] != -1 && links[2 * i + 1] != -1)
+					continue;
+				startEnd = links[2 * i] == -1 ? 2 * i : 2 * i + 1;
+			}
+			Polyline polyline;
+			polyline.elevation = chainOf(openChains[i]).level*interval;
+			polyline.closed = pass == 1;
+			Stitch stitch;
+			stitch.startKey = startEnd % 2 == 0 ? chainOf(openChains[i]).startKey : chainOf(openChains[i]).endKey;
+			int end = startEnd;
+			while (true) {
+				const Chain& chain = chainOf(openChains[end / 2]);
+				visited[end / 2] = true;
+				stitch.chains.push_back(openChains[end / 2]);
+				// Entering through the start key walks the chain forward, through the end key backward
+				bool forward = end % 2 == 0;
+				size_t numPoints = chain.points.size();
+				for (size_t p = polyline.points.empty() ? 0 : 1; p < numPoints; p++) {
+					const glm::vec2& point = chain.points[forward ? p : numPoints - 1 - p];
+					polyline.points.push_back(raster.cellToZedCoord(point.x, point.y));
+				}
+				stitch.endKey = forward ? chain.endKey : chain.startKey;
+				end = links[end ^ 1];
+				if (end == -1 || visited[end / 2])
+					break;
+			}
+			if (polyline.closed)
+				polyline.points.pop_back(); // Back to the first point
+			polylines.push_back(std::move(polyline));
+			stitches.push_back(std::move(stitch));
+		}
+	}
+}
+
+void ContourExtractor::project(ZedProjector& zedProjector) {
+	for (auto & polyline : polylines) {
+		polyline.projPoints.resize(polyline.points.size());
+		for (size_t i = 0; i < polyline.points.size(); i++)
+			polyline.projPoints[i] = zedProjector.zedCoordAndElevationToProjCoord(polyline.points[i].x, polyline.points[i].y, polyline.elevation);
+	}
+}
+
+std::vector<const ContourExtractor::Polyline*> ContourExtractor::getPolylines(float elevation) const {
+	float levelElevation = std::round(elevation / interval)*interval;
+	std::vector<const Polyline*> result;
+	for (auto & polyline : polylines)
+		if (polyline.elevation == levelElevation)
+			result.push_back(&polyline);
+	return result;
+}
+
+bool ContourExtractor::saveSvg(const std::string& path, float width, float height, bool projectorCoordinates) const {
+	ofFile file(path, ofFile::WriteOnly);
+	if (!file.is_open())
+		return false;
+	file << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
+	file << "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"" << width << "\" height=\"" << height << "\" viewBox=\"0 0 " << width << " " << height << "\">\n";
+	file << "<g fill=\"none\" stroke=\"black\" stroke-width=\"1\">\n";
+	for (auto & polyline : polylines) {
+		const std::vector<glm::vec2>& points = projectorCoordinates ? polyline.projPoints : polyline.points;
+		file << (polyline.closed ? "<polygon" : "<polyline") << " data-elevation=\"" << polyline.elevation << "\" points=\"";
+		for (auto & point : points)
+			file << point.x << "," << point.y << " ";
+		file << "\"/>\n";
+	}
+	file << "</g>\n</svg>\n";
+	return true;
+}
@@ -0,0 +1,91 @@
+/***********************************************************************
+ContourExtractor - Vector contour lines of the elevation raster, computed
+with marching squares.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#pragma once
+
+#include "ofMain.h"
+#include "ElevationRaster.h"
+
+// Contour levels are the multiples of the interval, so elevation 0 (the base plane, the sea
+// level of the colormaps) is always a level.
+// The squares between four cell centers are processed per raster tile: each tile keeps the
+// chains stitched from its own segments, and is only reprocessed when its cells, or the cells
+// of its right and bottom neighbours, changed. The open chains are then merged into polylines
+// through the raster edges they end on, which are shared by the neighbouring tiles. Only the
+// polylines going through a changed tile, or ending on one of its new chains, are stitched again.
+// Saddle squares are resolved with the mean of their corners. Squares with an invalid corner
+// produce nothing, the polylines end there.
+class ContourExtractor {
+public:
+	struct Polyline {
+		float elevation;
+		bool closed; // The last point connects to the first one, it is not repeated
+		std::vector<glm::vec2> points; // Zed pixel coordinates
+		std::vector<glm::vec2> projPoints; // Projector coordinates, see project()
+	};
+
+	ContourExtractor();
+
+	void setInterval(float sinterval);
+	float getInterval() const {
+		return interval;
+	}
+
+	bool update(const ElevationRaster& raster, WorkerPool& pool); // False if the polylines did not change
+	void project(ZedProjector& zedProjector); // Computes the projector coordinates of the polylines
+
+	const std::vector<Polyline>& getPolylines() const {
+		return polylines;
+	}
+	std::vector<const Polyline*> getPolylines(float elevation) const; // Polylines of the level closest to elevation
+	unsigned int getVersion() const { // Incremented when the polylines change
+		return version;
+	}
+
+	// SVG file of the polylines in Zed or projector coordinates, width x height in these coordinates
+	bool saveSvg(const std::string& path, float width, float height, bool projectorCoordinates) const;
+
+private:
+	struct Chain {
+		int level;
+		bool closed;
+		uint64_t startKey, endKey; // Raster edges of the end points
+		std::vector<glm::vec2> points; // Cell coordinates
+	};
+	struct ChainRef {
+		int tile;
+		int chain; // Index in tileChains[tile]
+	};
+	// Chains of a polyline, in order
+	struct Stitch {
+		std::vector<ChainRef> chains;
+		uint64_t startKey, endKey; // Raster edges of the end points of an open polyline
+	};
+
+	void extractTile(const ElevationRaster& raster, int tile);
+	void mergeChains(const ElevationRaster& raster, bool full);
+
+	float interval; // mm between two levels
+	bool intervalChanged;
+	unsigned int rasterVersion; // Raster version of the last update
+	std::vector<std::vector<Chain> > tileChains;
+	std::vector<int> dirtyTiles;
+	std::vector<unsigned char> tileDirty;
+	std::vector<Polyline> polylines;
+	std::vector<Stitch> stitches; // Per polyline
+	unsigned int version;
+};
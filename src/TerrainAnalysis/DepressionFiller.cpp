@@ -0,0 +1,383 @@
+/***********************************************************************
+DepressionFiller - Lakes of the sand surface: the water level at which
+every basin would fill, by priority-flood depression filling.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#include "DepressionFiller.h"
+
+const float DepressionFiller::levelStep = 0.5f;
+const float DepressionFiller::baseElevation = -512;
+const int DepressionFiller::labelsPerTile;
+const int DepressionFiller::outside;
+
+// Neighbours: E, SE, S, SW, W, NW, N, NE
+static const int neighbourX[8] = { 1, 1, 0, -1, -1, -1, 0, 1 };
+static const int neighbourY[8] = { 0, 1, 1, 1, 0, -1, -1, -1 };
+static const int unreached = std::numeric_limits<int>::max();
+
+DepressionFiller::DepressionFiller()
+	:minDepth(2),
+	cellLength(5),
+	cols(0),
+	rows(0),
+	tileCols(0),
+	tileRows(0),
+	rasterVersion(0),
+	parametersChanged(false),
+	version(0)
+{
+}
+
+void DepressionFiller::setMinDepth(float sminDepth) {
+	if (sminDepth != minDepth) {
+		minDepth = sminDepth;
+		parametersChanged = true;
+	}
+}
+
+void DepressionFiller::setCellLength(float scellLength) {
+	if (scellLength != cellLength) {
+		cellLength = scellLength;
+		parametersChanged = true; // Lake volumes
+	}
+}
+
+bool DepressionFiller::update(const ElevationRaster& raster, WorkerPool& pool) {
+	if (raster.getVersion() == 0)
+		return false;
+	bool full = raster.isResized(rasterVersion) || tiles.size() != raster.getTileCols()*raster.getTileRows();
+	if (!full && raster.getVersion() == rasterVersion && !parametersChanged)
+		return false;
+	if (full)
+		resize(raster);
+
+	dirtyTiles.clear();
+	for (int tile = 0; tile < tileCols*tileRows; tile++) {
+		tiles[tile].flooded = full || raster.isTileChangedSince(tile % tileCols, tile / tileCols, rasterVersion);
+		if (tiles[tile].flooded)
+			dirtyTiles.push_back(tile);
+	}
+	rasterVersion = raster.getVersion();
+	bool changed = parametersChanged;
+	parametersChanged = false;
+
+	if (!dirtyTiles.empty()) {
+		const float* elevations = raster.getData();
+		pool.parallelFor(static_cast<int>(dirtyTiles.size()), [this, elevations](int i) {
+			floodTile(elevations, dirtyTiles[i]);
+		});
+		addBorderEdges();
+		floodLabels();
+
+		// The water of the other tiles only changes with the levels of their labels
+		dirtyTiles.clear();
+		for (int tile = 0; tile < tileCols*tileRows; tile++) {
+			bool dirty = tiles[tile].flooded;
+			for (int label = tile*labelsPerTile; !dirty && label < (tile + 1)*labelsPerTile; label++)
+				dirty = labelLevels[label] != previousLabelLevels[label];
+			if (dirty)
+				dirtyTiles.push_back(tile);
+		}
+		pool.parallelFor(static_cast<int>(dirtyTiles.size()), [this](int i) {
+			if (finishTile(dirtyTiles[i]))
+				tiles[dirtyTiles[i]].flooded = true; // The terrain or the water changed
+		});
+		for (int tile : dirtyTiles)
+			changed |= tiles[tile].flooded;
+	}
+	if (!changed)
+		return false;
+
+	findLakes(raster);
+	version++;
+	return true;
+}
+
+void DepressionFiller::resize(const ElevationRaster& raster) {
+	cols = raster.getCols();
+	rows = raster.getRows();
+	tileCols = raster.getTileCols();
+	tileRows = raster.getTileRows();
+	for (int i = 0; i < 8; i++)
+		offsets[i] = neighbourY[i] * cols + neighbourX[i];
+	levels.assign(cols*rows, -1);
+	tileLevels.assign(cols*rows, -1);
+	labels.assign(cols*rows, outside);
+	nextCells.assign(cols*rows, -1);
+	waterLevels.assign(cols*rows, -1);
+	lakeIds.assign(cols*rows, 0);
+	tiles.assign(tileCols*tileRows, Tile());
+	labelLevels.assign(tileCols*tileRows*labelsPerTile, unreached);
+	previousLabelLevels.assign(tileCols*tileRows*labelsPerTile, unreached);
+	lakes.clear();
+}
+
+int DepressionFiller::quantize(float elevation) const {
+	if (!(elevation == elevation))
+		return -1;
+	return static_cast<int>(ofClamp(std::floor((elevation - baseElevation) / levelStep), 0, numLevels - 1));
+}
+
+void DepressionFiller::addEdge(std::vector<Edge>& edges, int a, int b, int level) {
+	Edge edge;
+	edge.a = std::min(a, b);
+	edge.b = std::max(a, b);
+	edge.level = level;
+	edges.push_back(edge);
+}
+
+void DepressionFiller::floodTile(const float* elevations, int tile) {
+	Tile& t = tiles[tile];
+	int col0 = (tile % tileCols)*ElevationRaster::tileCells;
+	int row0 = (tile / tileCols)*ElevationRaster::tileCells;
+	int col1 = std::min(col0 + ElevationRaster::tileCells, cols);
+	int row1 = std::min(row0 + ElevationRaster::tileCells, rows);
+	int minLevel = numLevels;
+	int maxLevel = -1;
+	for (int row = row0; row < row1; row++) {
+		for (int col = col0; col < col1; col++) {
+			int i = row*cols + col;
+			levels[i] = quantize(elevations[i]);
+			labels[i] = levels[i] < 0 ? outside : -1;
+			tileLevels[i] = -1;
+			if (levels[i] >= 0) {
+				minLevel = std::min(minLevel, levels[i]);
+				maxLevel = std::max(maxLevel, levels[i]);
+			}
+		}
+	}
+	t.edges.clear();
+	if (maxLevel < 0)
+		return;
+
+	t.heads.assign(maxLevel - minLevel + 1, -1);
+	auto push = [&](int cell, int level) {
+		nextCells[cell] = t.heads[level - minLevel];
+		t.heads[level - minLevel] = cell;
+	};
+	// Labels the cells reached from cell and records the labels met, each meeting once
+	auto visit = [&](int cell, int col, int row, int level) {
+		for (int d = 0; d < 8; d++) {
+			int x = col + neighbourX[d];
+			int y = row + neighbourY[d];
+			if (x < col0 || y < row0 || x >= col1 || y >= row1)
+				continue;
+			int neighbour = cell + offsets[d];
+			if (labels[neighbour] == -1) {
+				labels[neighbour] = labels[cell];
+				tileLevels[neighbour] = std::max(levels[neighbour], level);
+				push(neighbour, tileLevels[neighbour]);
+			}
+			else if (labels[cell] < labels[neighbour]) {
+				addEdge(t.edges, labels[cell], labels[neighbour], std::max(tileLevels[cell], tileLevels[neighbour]));
+			}
+		}
+	};
+
+	// Seeds: each valid perimeter cell, leading out of the raster on the raster edges
+	int label = tile*labelsPerTile + 1;
+	for (int row = row0; row < row1; row++) {
+		for (int col = col0; col < col1; col++) {
+			if (row != row0 && row != row1 - 1 && col != col0 && col != col1 - 1)
+				continue;
+			int i = row*cols + col;
+			if (levels[i] < 0)
+				continue;
+			labels[i] = label++;
+			tileLevels[i] = levels[i];
+			push(i, levels[i]);
+			if (row == 0 || col == 0 || row == rows - 1 || col == cols - 1)
+				addEdge(t.edges, outside, labels[i], levels[i]);
+		}
+	}
+	// The invalid cells lead out of the raster too
+	for (int row = row0; row < row1; row++) {
+		for (int col = col0; col < col1; col++) {
+			int i = row*cols + col;
+			if (levels[i] < 0)
+				visit(i, col, row, -1);
+		}
+	}
+	for (int level = minLevel; level <= maxLevel; level++) {
+		int& head = t.heads[level - minLevel];
+		while (head != -1) {
+			int cell = head;
+			head = nextCells[cell];
+			visit(cell, cell % cols, cell / cols, level);
+		}
+	}
+
+	// Lowest meeting of each pair of labels
+	std::sort(t.edges.begin(), t.edges.end(), [](const Edge& a, const Edge& b) {
+		return a.a != b.a ? a.a < b.a : a.b != b.b ? a.b < b.b : a.level < b.level;
+	});
+	t.edges.erase(std::unique(t.edges.begin(), t.edges.end(), [](const Edge& a, const Edge& b) {
+		return a.a == b.a && a.b == b.b;
+	}), t.edges.end());
+}
+
+void DepressionFiller::addBorderEdges() {
+	edges.clear();
+	for (auto & tile : tiles)
+		edges.insert(edges.end(), tile.edges.begin(), tile.edges.end());
+
+	// Pairs of neighbours in different tiles, from the cell with the other one E, SE, S or SW
+	const int tileCells = ElevationRaster::tileCells;
+	for (int row = 0; row < rows; row++) {
+		for (int col = 0; col < cols; col++) {
+			if (col % tileCells != 0 && col % tileCells != tileCells - 1 && row % tileCells != tileCells - 1)
+				continue;
+			int i = row*cols + col;
+			for (int d = 0; d < 4; d++) {
+				int x = col + neighbourX[d];
+				int y = row + neighbourY[d];
+				if (x < 0 || x >= cols || y >= rows)
+					continue;
+				if (x / tileCells == col / tileCells && y / tileCells == row / tileCells)
+					continue;
+				int neighbour = i + offsets[d];
+				if (labels[i] != labels[neighbour])
+					addEdge(edges, labels[i], labels[neighbour], std::max(tileLevels[i], tileLevels[neighbour]));
+			}
+		}
+	}
+}
+
+void DepressionFiller::floodLabels() {
+	// Edges of each label
+	int numLabels = tileCols*tileRows*labelsPerTile;
+	edgeStarts.assign(numLabels + 1, 0);
+	for (auto & edge : edges) {
+		edgeStarts[edge.a + 1]++;
+		edgeStarts[edge.b + 1]++;
+	}
+	for (int label = 0; label < numLabels; label++)
+		edgeStarts[label + 1] += edgeStarts[label];
+	adjacency.resize(2 * edges.size());
+	for (int e = 0; e < static_cast<int>(edges.size()); e++) {
+		adjacency[edgeStarts[edges[e].a]++] = e;
+		adjacency[edgeStarts[edges[e].b]++] = e;
+	}
+	for (int label = numLabels; label > 0; label--)
+		edgeStarts[label] = edgeStarts[label - 1];
+	edgeStarts[0] = 0;
+
+	// Lowest level at which each label spills out of the raster, level l in bucket l + 1
+	previousLabelLevels.swap(labelLevels);
+	labelLevels.assign(numLabels, unreached);
+	queueHeads.assign(numLevels + 1, -1);
+	queueNodes.clear();
+	queueNext.clear();
+	auto push = [this](int label, int level) {
+		labelLevels[label] = level;
+		queueNodes.push_back(label);
+		queueNext.push_back(queueHeads[level + 1]);
+		queueHeads[level + 1] = static_cast<int>(queueNodes.size()) - 1;
+	};
+	push(outside, -1);
+	for (int bucket = 0; bucket <= numLevels; bucket++) {
+		while (queueHeads[bucket] != -1) {
+			int entry = queueHeads[bucket];
+			queueHeads[bucket] = queueNext[entry];
+			int label = queueNodes[entry];
+			int level = bucket - 1;
+			if (labelLevels[label] != level)
+				continue; // Reached lower since
+			for (int k = edgeStarts[label]; k < edgeStarts[label + 1]; k++) {
+				const Edge& edge = edges[adjacency[k]];
+				int other = edge.a == label ? edge.b : edge.a;
+				int otherLevel = std::max(level, edge.level);
+				if (otherLevel < labelLevels[other])
+					push(other, otherLevel);
+			}
+		}
+	}
+}
+
+bool DepressionFiller::finishTile(int tile) {
+	int col0 = (tile % tileCols)*ElevationRaster::tileCells;
+	int row0 = (tile / tileCols)*ElevationRaster::tileCells;
+	int col1 = std::min(col0 + ElevationRaster::tileCells, cols);
+	int row1 = std::min(row0 + ElevationRaster::tileCells, rows);
+	bool changed = false;
+	for (int row = row0; row < row1; row++) {
+		for (int col = col0; col < col1; col++) {
+			int i = row*cols + col;
+			int water = -1;
+			if (levels[i] >= 0) {
+				int labelLevel = labelLevels[labels[i]];
+				water = labelLevel == unreached ? tileLevels[i] : std::max(tileLevels[i], labelLevel);
+			}
+			if (water != waterLevels[i]) {
+				waterLevels[i] = water;
+				changed = true;
+			}
+		}
+	}
+	return changed;
+}
+
+void DepressionFiller::findLakes(const ElevationRaster& raster) {
+	// Connected flooded cells, the neighbours of a flooded cell are below or at its water level
+	const float* elevations = raster.getData();
+	const float cellArea = cellLength*cellLength;
+	lakes.clear();
+	std::fill(lakeIds.begin(), lakeIds.end(), 0);
+	for (int start = 0; start < cols*rows; start++) {
+		if (lakeIds[start] != 0 || waterLevels[start] <= levels[start])
+			continue;
+		Lake lake;
+		lake.id = static_cast<int>(lakes.size()) + 1;
+		lake.level = baseElevation + waterLevels[start] * levelStep;
+		lake.maxDepth = 0;
+		lake.volume = 0;
+		glm::vec2 cellSum(0);
+		stack.clear();
+		stack.push_back(start);
+		lakeIds[start] = lake.id;
+		for (size_t k = 0; k < stack.size(); k++) {
+			int cell = stack[k];
+			int col = cell % cols;
+			int row = cell / cols;
+			float depth = lake.level - elevations[cell];
+			lake.maxDepth = std::max(lake.maxDepth, depth);
+			lake.volume += depth*cellArea;
+			cellSum += glm::vec2(col, row);
+			for (int d = 0; d < 8; d++) {
+				int x = col + neighbourX[d];
+				int y = row + neighbourY[d];
+				if (x < 0 || y < 0 || x >= cols || y >= rows)
+					continue;
+				int neighbour = cell + offsets[d];
+				if (lakeIds[neighbour] == 0 && waterLevels[neighbour] > levels[neighbour]) {
+					lakeIds[neighbour] = lake.id;
+					stack.push_back(neighbour);
+				}
+			}
+		}
+		lake.numCells = static_cast<int>(stack.size());
+		if (lake.maxDepth < minDepth) {
+			for (int cell : stack)
+				lakeIds[cell] = -1;
+			continue;
+		}
+		lake.center = raster.cellToZedCoord(cellSum.x / lake.numCells, cellSum.y / lake.numCells);
+		lakes.push_back(lake);
+	}
+	// Cells of the ignored lakes
+	for (auto & id : lakeIds)
+		if (id < 0)
+			id = 0;
+}
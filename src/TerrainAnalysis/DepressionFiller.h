@@ -0,0 +1,118 @@
+/***********************************************************************
+DepressionFiller - Lakes of the sand surface: the water level at which
+every basin would fill, by priority-flood depression filling.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#pragma once
+
+#include "ofMain.h"
+#include "ElevationRaster.h"
+
+// Water drains out of the raster through its edges and its invalid cells. The elevations are
+// quantized to levelStep, so the priority queues are arrays of buckets, one per level.
+// Each raster tile is flooded on its own from its perimeter cells, each perimeter cell labelling
+// the cells it reaches, which only depends on the cells of the tile: a tile is only flooded
+// again when it changed. The labels meeting inside a tile or across a tile border make a graph,
+// flooded from the outside of the raster to get the level of each label, and the water level of
+// a cell is the higher of its level in the tile and the level of its label.
+// The lakes are the connected cells below their water level, deeper than the minimum depth.
+class DepressionFiller {
+public:
+	struct Lake {
+		int id;
+		float level; // Water surface elevation, mm
+		float maxDepth; // mm
+		float volume; // mm3
+		int numCells;
+		glm::vec2 center; // Zed coordinate of the mean cell
+	};
+
+	static const float levelStep; // mm between two quantized levels
+	static const float baseElevation; // Elevation of level 0
+	static const int numLevels = 4096;
+
+	DepressionFiller();
+
+	void setMinDepth(float sminDepth); // mm, shallower lakes are ignored
+	void setCellLength(float scellLength); // mm, the sand footprint of a raster cell
+
+	bool update(const ElevationRaster& raster, WorkerPool& pool); // False if the lakes did not change
+
+	unsigned int getVersion() const { // Incremented when the lakes change
+		return version;
+	}
+	int getLakeId(int col, int row) const { // 0 out of the lakes
+		return lakeIds[row*cols + col];
+	}
+	const std::vector<Lake>& getLakes() const { // Lake id - 1 is its index
+		return lakes;
+	}
+	float getWaterLevel(int col, int row) const { // Elevation of the water surface, NaN out of the lakes
+		int id = lakeIds[row*cols + col];
+		return id > 0 ? lakes[id - 1].level : std::numeric_limits<float>::quiet_NaN();
+	}
+
+private:
+	// Meeting of two labels at the water level of the higher cell
+	struct Edge {
+		int a, b;
+		int level;
+	};
+	struct Tile {
+		std::vector<int> heads; // Bucket queue, first cell of each level from the lowest level of the tile
+		std::vector<Edge> edges;
+		bool flooded; // Flooded by the current update
+	};
+
+	static const int labelsPerTile = 4 * ElevationRaster::tileCells; // Perimeter cells, 0 for the outside
+	static const int outside = 0;
+
+	void resize(const ElevationRaster& raster);
+	int quantize(float elevation) const;
+	void floodTile(const float* elevations, int tile);
+	void addBorderEdges();
+	void floodLabels();
+	bool finishTile(int tile); // True if a water level changed
+	void findLakes(const ElevationRaster& raster);
+	static void addEdge(std::vector<Edge>& edges, int a, int b, int level);
+
+	float minDepth;
+	float cellLength;
+	int cols, rows;
+	int tileCols, tileRows;
+	int offsets[8]; // Cell index offsets of the 8 neighbours
+	unsigned int rasterVersion; // Raster version of the last update
+	bool parametersChanged; // Min depth or cell length, the lakes are measured again
+
+	// Cells
+	std::vector<int> levels; // Quantized elevations, -1 when invalid
+	std::vector<int> tileLevels; // Water levels in the tile
+	std::vector<int> labels;
+	std::vector<int> nextCells; // Next cell of the same bucket
+	std::vector<int> waterLevels; // Final water levels
+	std::vector<int> lakeIds;
+
+	// Tiles and labels
+	std::vector<Tile> tiles;
+	std::vector<int> dirtyTiles;
+	std::vector<Edge> edges; // All the edges, within and across tiles
+	std::vector<int> edgeStarts, adjacency; // Edges of each label, both ways
+	std::vector<int> labelLevels, previousLabelLevels;
+	std::vector<int> queueHeads, queueNodes, queueNext; // Bucket queue of the label flooding
+
+	std::vector<Lake> lakes;
+	std::vector<int> stack;
+	unsigned int version;
+};
@@ -0,0 +1,374 @@
+/***********************************************************************
+DrainageNetwork - D8 flow directions, flow accumulation and river network
+of the sand surface, computed incrementally on a worker thread.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#include "DrainageNetwork.h"
+
+const unsigned char DrainageNetwork::noDirection;
+
+// Directions: E, SE, S, SW, W, NW, N, NE
+static const int directionX[8] = { 1, 1, 0, -1, -1, -1, 0, 1 };
+static const int directionY[8] = { 0, 1, 1, 1, 0, -1, -1, -1 };
+static const float directionWeight[8] = { 1, 0.70710678f, 1, 0.70710678f, 1, 0.70710678f, 1, 0.70710678f }; // 1 / distance
+
+DrainageNetwork::DrainageNetwork()
+	:cols(0),
+	rows(0),
+	stamp(0),
+	enabled(false),
+	busy(false),
+	dropResult(false),
+	riversChanged(false),
+	riverThreshold(200),
+	sentVersion(0),
+	version(0)
+{
+}
+
+DrainageNetwork::~DrainageNetwork() {
+	stop();
+}
+
+void DrainageNetwork::setup() {
+	startThread();
+}
+
+void DrainageNetwork::stop() {
+	if (!isThreadRunning())
+		return;
+	jobs.close();
+	waitForThread(true);
+}
+
+void DrainageNetwork::setEnabled(bool senabled) {
+	enabled = senabled;
+	if (!enabled) {
+		// Drop the results already sent, and the one of the running job when it comes. The worker
+		// state is kept, the next job recomputes everything anyway.
+		DrainageResult result;
+		while (results.tryReceive(result)) {
+			busy = false;
+			recycledResults.send(std::move(result));
+		}
+		dropResult = busy;
+		sentVersion = 0;
+		current.rivers.clear();
+		current.cols = current.rows = 0;
+		version++;
+	}
+}
+
+void DrainageNetwork::setRiverThreshold(float sriverThreshold) {
+	riverThreshold = sriverThreshold;
+	riversChanged = true;
+}
+
+bool DrainageNetwork::update(const ElevationRaster& raster) {
+	bool adopted = false;
+	DrainageResult result;
+	while (results.tryReceive(result)) {
+		busy = false;
+		if (enabled && !dropResult) {
+			std::swap(current, result);
+			mergeRivers(result.rivers, current);
+			version++;
+			adopted = true;
+		}
+		dropResult = false;
+		recycledResults.send(std::move(result));
+	}
+	if (!enabled || busy || raster.getVersion() == 0)
+		return adopted;
+	if (raster.getVersion() == sentVersion && !riversChanged)
+		return adopted;
+
+	DrainageJob job;
+	recycledJobs.tryReceive(job);
+	job.rasterVersion = raster.getVersion();
+	job.cols = raster.getCols();
+	job.rows = raster.getRows();
+	job.origin = raster.cellToZedCoord(-0.5f, -0.5f);
+	job.cellSize = raster.getCellSize();
+	job.full = sentVersion == 0 || raster.isResized(sentVersion) || riversChanged;
+	job.riverThreshold = riverThreshold;
+	job.elevations.assign(raster.getData(), raster.getData() + job.cols*job.rows);
+	job.changedTiles.clear();
+	for (int tileRow = 0; tileRow < raster.getTileRows(); tileRow++)
+		for (int tileCol = 0; tileCol < raster.getTileCols(); tileCol++)
+			if (raster.isTileChangedSince(tileCol, tileRow, sentVersion))
+				job.changedTiles.push_back(tileRow*raster.getTileCols() + tileCol);
+	jobs.send(std::move(job));
+	sentVersion = raster.getVersion();
+	riversChanged = false;
+	busy = true;
+	return adopted;
+}
+
+int DrainageNetwork::getDownstream(int col, int row) const {
+	unsigned char direction = current.directions[row*current.cols + col];
+	if (direction == noDirection)
+		return -1;
+	return (row + directionY[direction])*current.cols + col + directionX[direction];
+}
+
+bool DrainageNetwork::isRiverAt(const glm::vec2& zedCoord) const {
+	if (!enabled || current.cols == 0)
+		return false;
+	glm::vec2 cell = (zedCoord - current.origin) / current.cellSize;
+	int col = static_cast<int>(std::floor(cell.x));
+	int row = static_cast<int>(std::floor(cell.y));
+	if (col < 0 || row < 0 || col >= current.cols || row >= current.rows)
+		return false;
+	return isRiver(col, row);
+}
+
+void DrainageNetwork::threadedFunction() {
+	DrainageJob job;
+	while (jobs.receive(job)) {
+		DrainageResult result;
+		recycledResults.tryReceive(result);
+		process(job, result);
+		recycledJobs.send(std::move(job));
+		results.send(std::move(result));
+	}
+}
+
+void DrainageNetwork::resize(int scols, int srows) {
+	cols = scols;
+	rows = srows;
+	for (int i = 0; i < 8; i++)
+		offsets[i] = directionY[i] * cols + directionX[i];
+	elevations.assign(cols*rows, 0.0f);
+	directions.assign(cols*rows, noDirection);
+	accumulation.assign(cols*rows, 0.0f);
+	labels.assign(cols*rows, -1);
+	sinkStamps.assign(cols*rows, 0);
+	visitStamps.assign(cols*rows, 0);
+	inDegrees.assign(cols*rows, 0);
+	stamp = 0;
+}
+
+unsigned char DrainageNetwork::computeDirection(int col, int row) const {
+	int i = row*cols + col;
+	float elevation = elevations[i];
+	if (!(elevation == elevation))
+		return noDirection;
+	unsigned char direction = noDirection;
+	float steepest = 0;
+	for (int d = 0; d < 8; d++) {
+		int x = col + directionX[d];
+		int y = row + directionY[d];
+		if (x < 0 || y < 0 || x >= cols || y >= rows)
+			continue;
+		// Invalid neighbours fail the comparison
+		float slope = (elevation - elevations[i + offsets[d]])*directionWeight[d];
+		if (slope > steepest) {
+			steepest = slope;
+			direction = d;
+		}
+	}
+	return direction;
+}
+
+void DrainageNetwork::markSink(int cell) {
+	if (sinkStamps[cell] == stamp)
+		return;
+	sinkStamps[cell] = stamp;
+	markedSinks.push_back(cell);
+}
+
+void DrainageNetwork::process(const DrainageJob& job, DrainageResult& result) {
+	bool full = job.full || job.cols != cols || job.rows != rows;
+	if (job.cols != cols || job.rows != rows)
+		resize(job.cols, job.rows);
+	std::copy(job.elevations.begin(), job.elevations.end(), elevations.begin());
+	stamp++;
+	affectedCells.clear();
+	markedSinks.clear();
+
+	if (full) {
+		for (int row = 0; row < rows; row++)
+			for (int col = 0; col < cols; col++)
+				directions[row*cols + col] = computeDirection(col, row);
+		for (int i = 0; i < cols*rows; i++)
+			affectedCells.push_back(i);
+	}
+	else {
+		// Directions of the changed tiles and of the cells around them, whose lowest neighbour may have changed
+		changedCells.clear();
+		const int tileCells = ElevationRaster::tileCells;
+		int tileCols = (cols + tileCells - 1) / tileCells;
+		for (int tile : job.changedTiles) {
+			int col0 = std::max((tile % tileCols)*tileCells - 1, 0);
+			int row0 = std::max((tile / tileCols)*tileCells - 1, 0);
+			int col1 = std::min((tile % tileCols + 1)*tileCells + 1, cols);
+			int row1 = std::min((tile / tileCols + 1)*tileCells + 1, rows);
+			for (int row = row0; row < row1; row++) {
+				for (int col = col0; col < col1; col++) {
+					int i = row*cols + col;
+					unsigned char direction = computeDirection(col, row);
+					bool valid = elevations[i] == elevations[i];
+					bool wasValid = labels[i] >= 0;
+					if (direction == directions[i] && valid == wasValid)
+						continue;
+					// The catchment the cell drained to loses it
+					if (wasValid)
+						markSink(labels[i]);
+					directions[i] = direction;
+					changedCells.push_back(i);
+				}
+			}
+		}
+		// The dilated tiles overlap
+		std::sort(changedCells.begin(), changedCells.end());
+		changedCells.erase(std::unique(changedCells.begin(), changedCells.end()), changedCells.end());
+
+		// The catchments the changed cells drain to now gain them, paths already followed are not followed again
+		for (int cell : changedCells) {
+			if (!(elevations[cell] == elevations[cell]))
+				continue;
+			int i = cell;
+			while (visitStamps[i] != stamp) {
+				visitStamps[i] = stamp;
+				if (directions[i] == noDirection) {
+					markSink(i);
+					break;
+				}
+				i += offsets[directions[i]];
+			}
+		}
+
+		// Cells of the marked catchments, upstream from the marked cells which are still sinks.
+		// The other marked cells now drain to one of these sinks.
+		for (int sink : markedSinks) {
+			if (directions[sink] != noDirection || !(elevations[sink] == elevations[sink]))
+				continue;
+			size_t first = affectedCells.size();
+			affectedCells.push_back(sink);
+			for (size_t k = first; k < affectedCells.size(); k++) {
+				int i = affectedCells[k];
+				int col = i % cols;
+				int row = i / cols;
+				for (int d = 0; d < 8; d++) {
+					int x = col + directionX[d];
+					int y = row + directionY[d];
+					if (x < 0 || y < 0 || x >= cols || y >= rows)
+						continue;
+					// The neighbour drains here when its direction is the opposite one
+					int neighbour = i + offsets[d];
+					if (directions[neighbour] == (d + 4) % 8)
+						affectedCells.push_back(neighbour);
+				}
+			}
+		}
+		// The cells which became invalid lose their accumulation
+		for (int cell : changedCells)
+			if (!(elevations[cell] == elevations[cell]))
+				affectedCells.push_back(cell);
+		std::sort(markedSinks.begin(), markedSinks.end());
+	}
+
+	accumulate();
+	buildRivers(job.riverThreshold, result.rivers);
+	result.allRivers = full;
+	result.changedSinks.assign(markedSinks.begin(), markedSinks.end());
+
+	result.rasterVersion = job.rasterVersion;
+	result.cols = cols;
+	result.rows = rows;
+	result.origin = job.origin;
+	result.cellSize = job.cellSize;
+	result.riverThreshold = job.riverThreshold;
+	result.directions.assign(directions.begin(), directions.end());
+	result.accumulation.assign(accumulation.begin(), accumulation.end());
+	result.numRecomputedCells = affectedCells.size();
+}
+
+void DrainageNetwork::accumulate() {
+	// The affected cells are closed upstream: whatever drains into one of them is affected too
+	for (int i : affectedCells)
+		inDegrees[i] = 0;
+	for (int i : affectedCells)
+		if (directions[i] != noDirection)
+			inDegrees[i + offsets[directions[i]]]++;
+
+	// Kahn order: each cell comes after all the cells draining into it
+	order.clear();
+	for (int i : affectedCells) {
+		bool valid = elevations[i] == elevations[i];
+		accumulation[i] = valid ? 1.0f : 0.0f;
+		if (valid && inDegrees[i] == 0)
+			order.push_back(i);
+	}
+	for (size_t k = 0; k < order.size(); k++) {
+		int i = order[k];
+		if (directions[i] == noDirection)
+			continue;
+		int downstream = i + offsets[directions[i]];
+		accumulation[downstream] += accumulation[i];
+		if (--inDegrees[downstream] == 0)
+			order.push_back(downstream);
+	}
+
+	// Sink labels from the sinks up
+	for (int i : affectedCells)
+		labels[i] = -1;
+	for (size_t k = order.size(); k-- > 0;) {
+		int i = order[k];
+		labels[i] = directions[i] == noDirection ? i : labels[i + offsets[directions[i]]];
+	}
+}
+
+void DrainageNetwork::buildRivers(float threshold, std::vector<River>& rivers) {
+	// Rivers of the recomputed catchments, which hold whatever drains into their cells. Number of
+	// river cells draining into each river cell, the chains break where it is not 1.
+	rivers.clear();
+	std::vector<int>& riverInDegrees = inDegrees;
+	for (int i : affectedCells)
+		riverInDegrees[i] = 0;
+	for (int i : affectedCells)
+		if (accumulation[i] >= threshold && directions[i] != noDirection)
+			riverInDegrees[i + offsets[directions[i]]]++;
+	for (int start : affectedCells) {
+		if (accumulation[start] < threshold || riverInDegrees[start] == 1)
+			continue;
+		rivers.push_back(River());
+		River& river = rivers.back();
+		river.sink = labels[start];
+		int i = start;
+		while (true) {
+			river.points.push_back(glm::vec3(i % cols, i / cols, elevations[i]));
+			if (directions[i] == noDirection)
+				break;
+			i += offsets[directions[i]];
+			if (riverInDegrees[i] != 1) { // Junction, the start of another chain
+				river.points.push_back(glm::vec3(i % cols, i / cols, elevations[i]));
+				break;
+			}
+		}
+		river.flow = accumulation[i];
+	}
+}
+
+void DrainageNetwork::mergeRivers(std::vector<River>& previous, DrainageResult& result) {
+	// Keep the previous rivers of the catchments the job did not recompute
+	if (result.allRivers)
+		return;
+	for (auto & river : previous)
+		if (!std::binary_search(result.changedSinks.begin(), result.changedSinks.end(), river.sink))
+			result.rivers.push_back(std::move(river));
+	previous.clear();
+}
@@ -0,0 +1,150 @@
+/***********************************************************************
+DrainageNetwork - D8 flow directions, flow accumulation and river network
+of the sand surface, computed incrementally on a worker thread.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#pragma once
+
+#include "ofMain.h"
+#include "ElevationRaster.h"
+
+// Elevations of the raster sent to the worker thread, with the tiles changed since the previous job
+struct DrainageJob {
+	unsigned int rasterVersion;
+	int cols, rows;
+	glm::vec2 origin; // Zed coordinate of the first cell corner
+	float cellSize;
+	bool full; // Every tile changed, or the river threshold
+	float riverThreshold;
+	std::vector<float> elevations;
+	std::vector<int> changedTiles;
+	DrainageJob() : rasterVersion(0), cols(0), rows(0), cellSize(1), full(true), riverThreshold(0) {}
+};
+
+// Chain of river cells between two junctions, points are (col, row, elevation)
+struct River {
+	std::vector<glm::vec3> points;
+	float flow; // Accumulation of the last cell
+	int sink; // Cell the river drains to
+};
+
+// Published state of the network, recycled like the depth frames
+struct DrainageResult {
+	unsigned int rasterVersion;
+	int cols, rows;
+	glm::vec2 origin;
+	float cellSize;
+	float riverThreshold;
+	std::vector<unsigned char> directions; // DrainageNetwork::noDirection for the sinks and invalid cells
+	std::vector<float> accumulation; // Cells draining through each cell, itself included, 0 when invalid
+	std::vector<River> rivers; // Of the changed catchments only, unless allRivers
+	std::vector<int> changedSinks; // Sorted, their previous rivers are replaced
+	bool allRivers;
+	int numRecomputedCells; // Accumulation recomputed by the job
+	DrainageResult() : rasterVersion(0), cols(0), rows(0), cellSize(1), riverThreshold(0), allRivers(true), numRecomputedCells(0) {}
+};
+
+// Each valid cell drains to its steepest downhill neighbour among 8 (D8), the cells without
+// a lower neighbour are sinks. A job recomputes the directions of the changed tiles and of the
+// cells around them, then only the catchments of the sinks reached by a changed direction,
+// before and after the change: the cells of these catchments are found upstream from their
+// sinks, and get their accumulation again in the topological order of the directions (Kahn),
+// and their sink label from their downstream cell.
+// The rivers are the chains of cells draining more than the river threshold. A job only builds
+// those of the recomputed catchments, and the main thread replaces the rivers of these sinks.
+// The main thread sends one job at a time and adopts the results in update().
+class DrainageNetwork : public ofThread {
+public:
+	static const unsigned char noDirection = 255;
+
+	DrainageNetwork();
+	~DrainageNetwork();
+
+	void setup(); // Starts the worker thread
+	void setEnabled(bool senabled); // Disabling drops the results
+	bool isEnabled() const {
+		return enabled;
+	}
+	void setRiverThreshold(float sriverThreshold); // Cells
+	bool update(const ElevationRaster& raster); // True if new results were adopted
+
+	// Results of the last adopted job
+	unsigned int getVersion() const { // Incremented on each adopted job
+		return version;
+	}
+	int getCols() const {
+		return current.cols;
+	}
+	int getRows() const {
+		return current.rows;
+	}
+	float getAccumulation(int col, int row) const {
+		return current.accumulation[row*current.cols + col];
+	}
+	int getDownstream(int col, int row) const; // Cell index, -1 for the sinks
+	bool isRiver(int col, int row) const {
+		return current.accumulation[row*current.cols + col] >= current.riverThreshold;
+	}
+	bool isRiverAt(const glm::vec2& zedCoord) const; // False while disabled
+	const std::vector<River>& getRivers() const {
+		return current.rivers;
+	}
+	glm::vec2 cellToZedCoord(float col, float row) const {
+		return current.origin + (glm::vec2(col, row) + 0.5f)*current.cellSize;
+	}
+	int getNumRecomputedCells() const {
+		return current.numRecomputedCells;
+	}
+
+private:
+	void threadedFunction();
+	void stop();
+
+	// Worker thread
+	void process(const DrainageJob& job, DrainageResult& result);
+	void resize(int scols, int srows);
+	unsigned char computeDirection(int col, int row) const;
+	void markSink(int cell);
+	void accumulate();
+	void buildRivers(float threshold, std::vector<River>& rivers);
+	static void mergeRivers(std::vector<River>& previous, DrainageResult& result); // Main thread
+
+	// Worker state
+	int cols, rows;
+	int offsets[8]; // Cell index offsets of the 8 directions
+	std::vector<float> elevations;
+	std::vector<unsigned char> directions;
+	std::vector<float> accumulation;
+	std::vector<int> labels; // Sink of each cell, -1 when invalid
+	std::vector<unsigned int> sinkStamps, visitStamps; // Equal to stamp when marked by the current job
+	unsigned int stamp;
+	std::vector<int> changedCells, affectedCells, order;
+	std::vector<int> markedSinks;
+	std::vector<int> inDegrees;
+
+	// Main thread
+	ofThreadChannel<DrainageJob> jobs;
+	ofThreadChannel<DrainageJob> recycledJobs;
+	ofThreadChannel<DrainageResult> results;
+	ofThreadChannel<DrainageResult> recycledResults;
+	bool enabled;
+	bool busy; // A job was sent and its result is not adopted yet
+	bool dropResult; // The result of the running job was computed before disabling
+	bool riversChanged; // The threshold changed since the last job
+	float riverThreshold;
+	unsigned int sentVersion; // Raster version of the last job
+	DrainageResult current;
+	unsigned int version;
+};
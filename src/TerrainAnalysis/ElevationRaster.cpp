@@ -0,0 +1,130 @@
+/***********************************************************************
+ElevationRaster - Reduced resolution elevation grid of the sand surface
+shared by the terrain analysis modules.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#include "ElevationRaster.h"
+
+ElevationRaster::ElevationRaster()
+	:cols(0),
+	rows(0),
+	cellSize(4),
+	tileCols(0),
+	tileRows(0),
+	version(0),
+	setupVersion(0),
+	ex(0), ey(0), ez(0), ew(0), planeOffset(0),
+	updated(false),
+	depthVersion(0),
+	basePlaneVersion(0),
+	calibrationVersion(0)
+{
+}
+
+void ElevationRaster::setup(const ofRectangle& zedROI, int scellSize) {
+	roi = zedROI;
+	cellSize = std::max(scellSize, 1);
+	origin = glm::vec2(roi.x, roi.y);
+	cols = std::max(static_cast<int>(roi.width) / cellSize, 1);
+	rows = std::max(static_cast<int>(roi.height) / cellSize, 1);
+	tileCols = (cols + tileCells - 1) / tileCells;
+	tileRows = (rows + tileCells - 1) / tileCells;
+	elevations.assign(cols*rows, std::numeric_limits<float>::quiet_NaN());
+	tileVersions.assign(tileCols*tileRows, 0);
+	setupVersion = version + 1;
+	updated = false; // The next update recomputes every tile
+}
+
+bool ElevationRaster::update(ZedProjector& zedProjector, WorkerPool& pool) {
+	if (zedProjector.getZedROI() != roi || cols == 0)
+		setup(zedProjector.getZedROI(), cellSize);
+
+	bool full = !updated || zedProjector.getBasePlaneVersion() != basePlaneVersion || zedProjector.getCalibrationVersion() != calibrationVersion;
+	if (!full && zedProjector.getDepthVersion() == depthVersion)
+		return false;
+
+	if (full) {
+		glm::mat4 zedWorldMatrix = zedProjector.getZedWorldMatrix();
+		glm::vec4 basePlaneEq = zedProjector.getBasePlaneEq();
+		glm::vec3 normal(basePlaneEq);
+		ex = glm::dot(normal, glm::vec3(zedWorldMatrix[0]));
+		ey = glm::dot(normal, glm::vec3(zedWorldMatrix[1]));
+		ez = glm::dot(normal, glm::vec3(zedWorldMatrix[2]));
+		ew = glm::dot(normal, glm::vec3(zedWorldMatrix[3]));
+		planeOffset = basePlaneEq.w;
+	}
+
+	// Raster tiles overlapping a depth tile changed since the last update
+	changedTiles.clear();
+	const DepthFrame& frame = zedProjector.getDepthFrame();
+	int tilePixels = tileCells*cellSize;
+	for (int tileRow = 0; tileRow < tileRows; tileRow++) {
+		for (int tileCol = 0; tileCol < tileCols; tileCol++) {
+			bool changed = full;
+			int x0 = static_cast<int>(origin.x) + tileCol*tilePixels;
+			int y0 = static_cast<int>(origin.y) + tileRow*tilePixels;
+			int lastRow = std::min((y0 + tilePixels - 1) / DepthFrame::tileSize, frame.tileRows - 1);
+			int lastCol = std::min((x0 + tilePixels - 1) / DepthFrame::tileSize, frame.tileCols - 1);
+			for (int row = y0 / DepthFrame::tileSize; !changed && row <= lastRow; row++)
+				for (int col = x0 / DepthFrame::tileSize; !changed && col <= lastCol; col++)
+					changed = zedProjector.isDepthTileChangedSince(col, row, depthVersion);
+			if (changed)
+				changedTiles.push_back(tileRow*tileCols + tileCol);
+		}
+	}
+	depthVersion = zedProjector.getDepthVersion();
+	basePlaneVersion = zedProjector.getBasePlaneVersion();
+	calibrationVersion = zedProjector.getCalibrationVersion();
+	updated = true;
+	if (changedTiles.empty())
+		return false;
+
+	const ofFloatPixels& depth = frame.pixels;
+	version++;
+	pool.parallelFor(static_cast<int>(changedTiles.size()), [this, &depth](int i) {
+		updateTile(depth.getData(), depth.getWidth(), changedTiles[i]);
+	});
+	for (int tile : changedTiles)
+		tileVersions[tile] = version;
+	return true;
+}
+
+void ElevationRaster::updateTile(const float* depth, int depthWidth, int tile) {
+	int tileCol = tile % tileCols;
+	int tileRow = tile / tileCols;
+	int maxX = std::min(static_cast<int>(roi.getRight()), depthWidth);
+	for (int row = tileRow*tileCells; row < std::min((tileRow + 1)*tileCells, rows); row++) {
+		int y0 = static_cast<int>(origin.y) + row*cellSize;
+		for (int col = tileCol*tileCells; col < std::min((tileCol + 1)*tileCells, cols); col++) {
+			int x0 = static_cast<int>(origin.x) + col*cellSize;
+			int x1 = std::min(x0 + cellSize, maxX);
+			// Mean elevation of the valid pixels of the cell, pixel centers are at (x + 0.5, y + 0.5)
+			float sum = 0;
+			int count = 0;
+			for (int y = y0; y < y0 + cellSize; y++) {
+				const float* depthRow = depth + y*depthWidth;
+				float yTerm = ey*(y + 0.5f) + ew;
+				for (int x = x0; x < x1; x++) {
+					float d = depthRow[x];
+					if (d > 0) {
+						sum -= d*(ex*(x + 0.5f) + yTerm + ez*d) + planeOffset;
+						count++;
+					}
+				}
+			}
+			elevations[row*cols + col] = count > 0 ? sum / count : std::numeric_limits<float>::quiet_NaN();
+		}
+	}
+}
@@ -0,0 +1,102 @@
+/***********************************************************************
+ElevationRaster - Reduced resolution elevation grid of the sand surface
+shared by the terrain analysis modules.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#pragma once
+
+#include "ofMain.h"
+#include "../ZedProjector/ZedProjector.h"
+#include "../WorkerPool.h"
+
+// Each cell covers cellSize x cellSize Zed pixels of the ROI and holds the mean elevation (mm
+// above the base plane, as ZedProjector::elevationAtZedCoord) of its valid pixels, NaN when
+// none is valid. The cells are grouped in tiles of tileCells x tileCells cells: update() only
+// recomputes the tiles overlapping the depth tiles changed since the previous update, and
+// stamps them with the new raster version so each analysis can find what changed since it
+// last ran, whatever its own rate.
+class ElevationRaster {
+public:
+	static const int tileCells = 16;
+
+	ElevationRaster();
+
+	void setup(const ofRectangle& zedROI, int cellSize);
+	bool update(ZedProjector& zedProjector, WorkerPool& pool); // False if no cell changed
+
+	int getCols() const {
+		return cols;
+	}
+	int getRows() const {
+		return rows;
+	}
+	int getCellSize() const { // In Zed pixels
+		return cellSize;
+	}
+	const float* getData() const {
+		return elevations.data();
+	}
+	float getElevation(int col, int row) const {
+		return elevations[row*cols + col];
+	}
+	bool isValid(int col, int row) const {
+		float elevation = elevations[row*cols + col];
+		return elevation == elevation;
+	}
+	glm::vec2 cellToZedCoord(float col, float row) const { // Cell centers are at integer coordinates
+		return origin + (glm::vec2(col, row) + 0.5f)*static_cast<float>(cellSize);
+	}
+	glm::vec2 zedCoordToCell(const glm::vec2& zedCoord) const {
+		return (zedCoord - origin) / static_cast<float>(cellSize) - 0.5f;
+	}
+
+	// Tiles
+	int getTileCols() const {
+		return tileCols;
+	}
+	int getTileRows() const {
+		return tileRows;
+	}
+	unsigned int getVersion() const { // Incremented by each update() changing cells
+		return version;
+	}
+	bool isTileChangedSince(int tileCol, int tileRow, unsigned int sinceVersion) const {
+		return tileVersions[tileRow*tileCols + tileCol] > sinceVersion;
+	}
+	bool isResized(unsigned int sinceVersion) const { // Size or position changed after that version
+		return setupVersion > sinceVersion;
+	}
+
+private:
+	void updateTile(const float* depth, int depthWidth, int tile);
+
+	ofRectangle roi;
+	glm::vec2 origin; // Zed coordinate of the first cell corner
+	int cols, rows;
+	int cellSize;
+	int tileCols, tileRows;
+	std::vector<float> elevations;
+	std::vector<unsigned int> tileVersions;
+	unsigned int version;
+	unsigned int setupVersion; // Version of the first update after setup()
+
+	// Elevation coefficients of the base plane in Zed pixel space, see TerrainSampler
+	float ex, ey, ez, ew, planeOffset;
+
+	// ZedProjector versions of the last update
+	bool updated;
+	unsigned int depthVersion, basePlaneVersion, calibrationVersion;
+	std::vector<int> changedTiles;
+};
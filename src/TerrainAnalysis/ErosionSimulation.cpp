@@ -0,0 +1,249 @@
+/***********************************************************************
+ErosionSimulation - Hydraulic erosion of a virtual sediment layer on top
+of the sand surface, simulated on the CPU.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#include "ErosionSimulation.h"
+#include "../ZedProjector/Utils.h"
+
+const float ErosionSimulation::stepTime = 0.01f;
+
+static const float gravity = 9810; // mm/s2
+static const float fluxDamping = 0.99f; // Fraction of the flux kept from one step to the next
+static const float dryDepth = 0.01f; // mm, the water of shallower cells deposits all its sediment
+
+ErosionSimulation::ErosionSimulation()
+	:enabled(false),
+	stepsPerUpdate(10),
+	cellLength(5),
+	rainRate(2),
+	evaporationRate(0.5f),
+	capacityFactor(0.05f),
+	exchangeRate(0.3f),
+	maxOffset(100),
+	resetThreshold(3),
+	wallHeight(1.0e6f),
+	current(0),
+	version(0),
+	stepTimeTotal(0),
+	numSteps(0)
+{
+}
+
+void ErosionSimulation::setup(const ElevationRaster& raster) {
+	cellGrid.setup(raster, wallHeight);
+	size_t size = cellGrid.getSize();
+	offset.assign(size, 0.0f);
+	for (int i = 0; i < 2; i++) {
+		water[i].assign(size, 0.0f);
+		sediment[i].assign(size, 0.0f);
+	}
+	concentration.assign(size, 0.0f);
+	current = 0;
+	fluxLeft.assign(size, 0.0f);
+	fluxRight.assign(size, 0.0f);
+	fluxTop.assign(size, 0.0f);
+	fluxBottom.assign(size, 0.0f);
+	uploadTexture();
+}
+
+void ErosionSimulation::setEnabled(bool senabled) {
+	enabled = senabled;
+	if (!enabled)
+		reset();
+}
+
+void ErosionSimulation::reset() {
+	std::fill(offset.begin(), offset.end(), 0.0f);
+	for (int i = 0; i < 2; i++) {
+		std::fill(water[i].begin(), water[i].end(), 0.0f);
+		std::fill(sediment[i].begin(), sediment[i].end(), 0.0f);
+	}
+	std::fill(concentration.begin(), concentration.end(), 0.0f);
+	std::fill(fluxLeft.begin(), fluxLeft.end(), 0.0f);
+	std::fill(fluxRight.begin(), fluxRight.end(), 0.0f);
+	std::fill(fluxTop.begin(), fluxTop.end(), 0.0f);
+	std::fill(fluxBottom.begin(), fluxBottom.end(), 0.0f);
+	if (cellGrid.getTexture().isAllocated())
+		uploadTexture();
+}
+
+bool ErosionSimulation::update(const ElevationRaster& raster, WorkerPool& pool) {
+	if (!enabled || raster.getVersion() == 0 || stepsPerUpdate <= 0)
+		return false;
+	if (cellGrid.isResized(raster))
+		setup(raster);
+	// The virtual changes of the cells which moved more than the threshold are dropped, the
+	// others keep them over their new elevation
+	const float* terrain = cellGrid.getTerrain();
+	const float* mask = cellGrid.getMask();
+	cellGrid.updateTerrain(raster, [this, terrain, mask](size_t i, bool valid, float elevation) {
+		bool moved = valid != (mask[i] != 0) || std::abs(elevation - terrain[i]) > resetThreshold;
+		if (!moved)
+			return;
+		offset[i] = 0;
+		water[current][i] = 0;
+		sediment[current][i] = 0;
+		fluxLeft[i] = fluxRight[i] = fluxTop[i] = fluxBottom[i] = 0;
+	});
+
+	uint64_t start = ofGetElapsedTimeMicros();
+	for (int i = 0; i < stepsPerUpdate; i++)
+		step(pool);
+	uploadTexture();
+	stepTimeTotal += ofGetElapsedTimeMicros() - start;
+	numSteps += stepsPerUpdate;
+	if (numSteps >= logInterval) {
+		ofLogVerbose("ErosionSimulation") << "update(): " << stepTimeTotal / numSteps << " us per step of " << cellGrid.getCols() << "x" << cellGrid.getRows() << " cells";
+		stepTimeTotal = 0;
+		numSteps = 0;
+	}
+	return true;
+}
+
+void ErosionSimulation::step(WorkerPool& pool) {
+	int numBands = cellGrid.getNumBands();
+	pool.parallelFor(numBands, [this](int band) {
+		updateFlux(band);
+	});
+	pool.parallelFor(numBands, [this](int band) {
+		updateSediment(band);
+	});
+	current = 1 - current;
+}
+
+void ErosionSimulation::updateFlux(int band) {
+	const float dt = stepTime;
+	const float k = dt*gravity*cellLength; // Pipe section area / length
+	const int cols = cellGrid.getCols();
+	const int stride = cellGrid.getStride();
+	PipeFlux::Grid grid = { cellGrid.getTerrain(), offset.data(), water[current].data(), fluxLeft.data(), fluxRight.data(), fluxTop.data(), fluxBottom.data(), cols, stride };
+	const float* d = water[current].data();
+	const float* s = sediment[current].data();
+	float* c = concentration.data();
+	int row1 = std::min((band + 1)*ElevationRaster::tileCells, cellGrid.getRows());
+	for (int row = band*ElevationRaster::tileCells; row < row1; row++) {
+		PipeFlux::updateRow(grid, row, k, fluxDamping, cellLength*cellLength / dt);
+
+		// Sediment concentration of the water, read by the neighbours in the second pass
+		int x = 1;
+		const int rowStart = (row + 1)*stride;
+#ifdef MAGIC_SAND_SSE2
+		const __m128 dry = _mm_set1_ps(dryDepth);
+		for (; x + 4 <= cols + 1; x += 4) {
+			int i = rowStart + x;
+			_mm_storeu_ps(c + i, _mm_div_ps(_mm_loadu_ps(s + i), _mm_max_ps(_mm_loadu_ps(d + i), dry)));
+		}
+#endif
+		for (; x <= cols; x++) {
+			int i = rowStart + x;
+			c[i] = s[i] / std::max(d[i], dryDepth);
+		}
+	}
+}
+
+void ErosionSimulation::updateSediment(int band) {
+	const float dt = stepTime;
+	const float volumeToDepth = dt / (cellLength*cellLength);
+	const float rain = rainRate*dt;
+	const float kept = 1 - evaporationRate*dt;
+	const float capacityScale = 0.5f*capacityFactor / (cellLength*cellLength); // The net flows are twice the mean flows
+	const float exchange = exchangeRate*dt;
+	const float* d = water[current].data();
+	const float* s = sediment[current].data();
+	const float* c = concentration.data();
+	float* nextWater = water[1 - current].data();
+	float* nextSediment = sediment[1 - current].data();
+	float* o = offset.data();
+	const float* fl = fluxLeft.data();
+	const float* fr = fluxRight.data();
+	const float* ft = fluxTop.data();
+	const float* fb = fluxBottom.data();
+	const float* mask = cellGrid.getMask();
+	const int cols = cellGrid.getCols();
+	const int stride = cellGrid.getStride();
+	int row1 = std::min((band + 1)*ElevationRaster::tileCells, cellGrid.getRows());
+	for (int row = band*ElevationRaster::tileCells; row < row1; row++) {
+		int x = 1;
+		const int rowStart = (row + 1)*stride;
+#ifdef MAGIC_SAND_SSE2
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 scale = _mm_set1_ps(volumeToDepth);
+		const __m128 rainv = _mm_set1_ps(rain);
+		const __m128 keptv = _mm_set1_ps(kept);
+		const __m128 capacityv = _mm_set1_ps(capacityScale);
+		const __m128 exchangev = _mm_set1_ps(exchange);
+		const __m128 dry = _mm_set1_ps(dryDepth);
+		const __m128 maxOffsetv = _mm_set1_ps(maxOffset);
+		for (; x + 4 <= cols + 1; x += 4) {
+			int i = rowStart + x;
+			// Water and sediment coming from the neighbours minus what leaves, the sediment at the concentration of its cell
+			__m128 inR = _mm_loadu_ps(fr + i - 1);
+			__m128 inL = _mm_loadu_ps(fl + i + 1);
+			__m128 inB = _mm_loadu_ps(fb + i - stride);
+			__m128 inT = _mm_loadu_ps(ft + i + stride);
+			__m128 outL = _mm_loadu_ps(fl + i);
+			__m128 outR = _mm_loadu_ps(fr + i);
+			__m128 outT = _mm_loadu_ps(ft + i);
+			__m128 outB = _mm_loadu_ps(fb + i);
+			__m128 in = _mm_add_ps(_mm_add_ps(inR, inL), _mm_add_ps(inB, inT));
+			__m128 out = _mm_add_ps(_mm_add_ps(outL, outR), _mm_add_ps(outT, outB));
+			__m128 m = _mm_loadu_ps(mask + i);
+			__m128 depth = _mm_add_ps(_mm_add_ps(_mm_loadu_ps(d + i), _mm_mul_ps(_mm_sub_ps(in, out), scale)), rainv);
+			depth = _mm_mul_ps(_mm_mul_ps(_mm_max_ps(depth, zero), keptv), m);
+			__m128 sedimentIn = _mm_add_ps(
+				_mm_add_ps(_mm_mul_ps(inR, _mm_loadu_ps(c + i - 1)), _mm_mul_ps(inL, _mm_loadu_ps(c + i + 1))),
+				_mm_add_ps(_mm_mul_ps(inB, _mm_loadu_ps(c + i - stride)), _mm_mul_ps(inT, _mm_loadu_ps(c + i + stride))));
+			__m128 carried = _mm_add_ps(_mm_loadu_ps(s + i), _mm_mul_ps(_mm_sub_ps(sedimentIn, _mm_mul_ps(out, _mm_loadu_ps(c + i))), scale));
+			carried = _mm_max_ps(carried, zero);
+
+			// Erosion when positive, deposition when negative, everything is deposited by dry cells
+			__m128 flowX = _mm_sub_ps(_mm_add_ps(inR, outR), _mm_add_ps(outL, inL));
+			__m128 flowY = _mm_sub_ps(_mm_add_ps(inB, outB), _mm_add_ps(outT, inT));
+			__m128 capacity = _mm_mul_ps(_mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(flowX, flowX), _mm_mul_ps(flowY, flowY))), capacityv);
+			__m128 exchanged = _mm_mul_ps(_mm_sub_ps(capacity, carried), exchangev);
+			__m128 isDry = _mm_cmplt_ps(depth, dry);
+			exchanged = _mm_or_ps(_mm_and_ps(isDry, _mm_sub_ps(zero, carried)), _mm_andnot_ps(isDry, exchanged));
+			__m128 o0 = _mm_loadu_ps(o + i);
+			exchanged = _mm_min_ps(_mm_max_ps(exchanged, _mm_sub_ps(o0, maxOffsetv)), _mm_add_ps(o0, maxOffsetv));
+			exchanged = _mm_mul_ps(exchanged, m);
+			_mm_storeu_ps(o + i, _mm_sub_ps(o0, exchanged));
+			_mm_storeu_ps(nextSediment + i, _mm_add_ps(carried, exchanged));
+			_mm_storeu_ps(nextWater + i, depth);
+		}
+#endif
+		for (; x <= cols; x++) {
+			int i = rowStart + x;
+			float in = fr[i - 1] + fl[i + 1] + fb[i - stride] + ft[i + stride];
+			float out = fl[i] + fr[i] + ft[i] + fb[i];
+			float depth = std::max(d[i] + (in - out)*volumeToDepth + rain, 0.0f)*kept*mask[i];
+			float sedimentIn = fr[i - 1] * c[i - 1] + fl[i + 1] * c[i + 1] + fb[i - stride] * c[i - stride] + ft[i + stride] * c[i + stride];
+			float carried = std::max(s[i] + (sedimentIn - out*c[i])*volumeToDepth, 0.0f);
+			float flowX = fr[i - 1] + fr[i] - fl[i] - fl[i + 1];
+			float flowY = fb[i - stride] + fb[i] - ft[i] - ft[i + stride];
+			float capacity = std::sqrt(flowX*flowX + flowY*flowY)*capacityScale;
+			float exchanged = depth < dryDepth ? -carried : (capacity - carried)*exchange;
+			exchanged = std::min(std::max(exchanged, o[i] - maxOffset), o[i] + maxOffset)*mask[i];
+			o[i] -= exchanged;
+			nextSediment[i] = carried + exchanged;
+			nextWater[i] = depth;
+		}
+	}
+}
+
+void ErosionSimulation::uploadTexture() {
+	cellGrid.uploadTexture(offset.data());
+	version++;
+}
@@ -0,0 +1,108 @@
+/***********************************************************************
+ErosionSimulation - Hydraulic erosion of a virtual sediment layer on top
+of the sand surface, simulated on the CPU.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#pragma once
+
+#include "ofMain.h"
+#include "ElevationRaster.h"
+#include "CellGrid.h"
+#include "PipeFlux.h"
+
+// Steady rain runs over the measured surface plus a virtual offset, with the virtual pipe model
+// of the WaterSimulation on its own water. The water carries suspended sediment: each cell moves
+// the sediment of its water towards the capacity of its flow, digging the offset when it carries
+// less and depositing when it carries more, and the sediment leaves the cell in the same
+// fraction as its water. The capacity grows with the net flow through the cell, so the water
+// sloshing in a lake does not dig it.
+// A step runs two passes over full-width bands of ElevationRaster::tileCells rows, 4 cells per
+// SSE2 instruction: the fluxes (PipeFlux) and the sediment concentration of each cell, then the
+// water, the sediment and the offset. Many steps run per frame, without any allocation.
+// The offset of a cell is reset when the raster moves more than resetThreshold under it, so the
+// virtual layer follows the real sand. The smaller changes, sensor noise mostly, keep it. The
+// trade-off is that a hand over the sandbox also wipes the layer under its path.
+class ErosionSimulation {
+public:
+	ErosionSimulation();
+
+	void setup(const ElevationRaster& raster); // Flat and dry grid of the raster size
+	void setEnabled(bool senabled); // Disabling resets the offset
+	bool isEnabled() const {
+		return enabled;
+	}
+	void setStepsPerUpdate(int sstepsPerUpdate) {
+		stepsPerUpdate = sstepsPerUpdate;
+	}
+	void setCellLength(float scellLength) { // mm, the sand footprint of a raster cell
+		cellLength = scellLength;
+	}
+
+	bool update(const ElevationRaster& raster, WorkerPool& pool); // Runs the steps of one frame, false if none ran
+	void reset(); // Back to the measured surface
+
+	int getCols() const {
+		return cellGrid.getCols();
+	}
+	int getRows() const {
+		return cellGrid.getRows();
+	}
+	float getOffset(int col, int row) const { // mm added to the measured elevation
+		return offset[cellGrid.index(col, row)];
+	}
+	unsigned int getVersion() const { // Incremented on each change of the offset texture
+		return version;
+	}
+	const ofTexture& getTexture() const { // Offset in mm, one texel per raster cell
+		return cellGrid.getTexture();
+	}
+	glm::vec4 getTextureTransformation() const { // Texture coordinate from Zed coordinate: zedCoord * xy + zw
+		return cellGrid.getTextureTransformation();
+	}
+
+	static const float stepTime; // Simulated seconds per step
+	static const int logInterval = 1000;
+
+private:
+	void step(WorkerPool& pool);
+	void updateFlux(int band);
+	void updateSediment(int band);
+	void uploadTexture();
+
+	bool enabled;
+	int stepsPerUpdate;
+	float cellLength;
+	float rainRate; // mm per second
+	float evaporationRate; // Fraction of the water per second
+	float capacityFactor; // Sediment carried per net flow through the cell, mm per mm/s
+	float exchangeRate; // Fraction of the capacity difference eroded or deposited per second
+	float maxOffset; // mm, in both directions
+	float resetThreshold; // mm, raster change resetting the offset of a cell
+	float wallHeight; // Terrain of the wall cells, above any water surface
+
+	CellGrid cellGrid; // Measured terrain and offset texture
+	std::vector<float> offset; // Virtual elevation change in mm
+	std::vector<float> water[2]; // Depth in mm, current is read while the other is written
+	std::vector<float> sediment[2]; // Suspended sediment in mm of sand
+	std::vector<float> concentration; // Sediment per water depth
+	int current;
+	std::vector<float> fluxLeft, fluxRight, fluxTop, fluxBottom; // Outflows in mm3/s
+
+	unsigned int version;
+
+	// Time spent in the steps, logged every logInterval steps
+	uint64_t stepTimeTotal;
+	int numSteps;
+};
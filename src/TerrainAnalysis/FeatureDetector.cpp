@@ -0,0 +1,373 @@
+/***********************************************************************
+FeatureDetector - Peaks, basins and saddles of the sand surface, with
+their topographic prominence.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#include "FeatureDetector.h"
+#include "../ZedProjector/Utils.h"
+#include <cstring>
+
+namespace {
+	// Ordered as the elevation, then as the cell order between equal elevations
+	uint64_t floodKey(float elevation, int order) {
+		uint32_t bits;
+		std::memcpy(&bits, &elevation, sizeof(bits));
+		bits = (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+		return (static_cast<uint64_t>(bits) << 32) | static_cast<uint32_t>(order);
+	}
+}
+
+FeatureDetector::FeatureDetector()
+	:minProminence(10),
+	suppressionRadius(8),
+	selectionChanged(true),
+	cols(0),
+	rows(0),
+	tileCols(0),
+	tileRows(0),
+	rasterVersion(0),
+	highestCell(-1),
+	lowestCell(-1),
+	highestElevation(0),
+	lowestElevation(0),
+	version(0)
+{
+}
+
+void FeatureDetector::setMinProminence(float sminProminence) {
+	if (sminProminence != minProminence) {
+		minProminence = sminProminence;
+		selectionChanged = true;
+	}
+}
+
+void FeatureDetector::setSuppressionRadius(float ssuppressionRadius) {
+	if (ssuppressionRadius != suppressionRadius) {
+		suppressionRadius = ssuppressionRadius;
+		selectionChanged = true;
+	}
+}
+
+bool FeatureDetector::update(const ElevationRaster& raster, WorkerPool& pool) {
+	if (raster.getVersion() == 0)
+		return false;
+	bool full = raster.isResized(rasterVersion) || raster.getCols() != cols || raster.getRows() != rows;
+	if (!full && raster.getVersion() == rasterVersion) {
+		if (!selectionChanged)
+			return false;
+		selectionChanged = false;
+		return select(raster);
+	}
+	if (full) {
+		cols = raster.getCols();
+		rows = raster.getRows();
+		tileCols = raster.getTileCols();
+		tileRows = raster.getTileRows();
+		tileExtrema.assign(tileCols*tileRows, std::vector<Extremum>());
+		tileRanges.assign(tileCols*tileRows, TileRange());
+	}
+	if (full || static_cast<int>(scratches.size()) != pool.getNumThreads()) {
+		scratches.resize(pool.getNumThreads());
+		for (auto & scratch : scratches) {
+			scratch.stamps.assign(cols*rows, 0);
+			scratch.stamp = 0;
+		}
+	}
+
+	// Tiles changed since the last update, the candidates of a tile also read the cells around it
+	changedTileSums.assign((tileCols + 1)*(tileRows + 1), 0);
+	for (int tileRow = 0; tileRow < tileRows; tileRow++) {
+		for (int tileCol = 0; tileCol < tileCols; tileCol++) {
+			int changed = full || raster.isTileChangedSince(tileCol, tileRow, rasterVersion) ? 1 : 0;
+			int i = (tileRow + 1)*(tileCols + 1) + tileCol + 1;
+			changedTileSums[i] = changed + changedTileSums[i - 1] + changedTileSums[i - tileCols - 1] - changedTileSums[i - tileCols - 2];
+		}
+	}
+	dirtyTiles.clear();
+	for (int tileRow = 0; tileRow < tileRows; tileRow++) {
+		for (int tileCol = 0; tileCol < tileCols; tileCol++) {
+			if (isChanged(std::max(tileCol - 1, 0), std::max(tileRow - 1, 0), std::min(tileCol + 1, tileCols - 1), std::min(tileRow + 1, tileRows - 1)))
+				dirtyTiles.push_back(tileRow*tileCols + tileCol);
+		}
+	}
+	rasterVersion = raster.getVersion();
+
+	const float* elevations = raster.getData();
+	pool.parallelFor(static_cast<int>(dirtyTiles.size()), [this, elevations](int i) {
+		classifyTile(elevations, dirtyTiles[i]);
+	});
+
+	// Highest and lowest valid cells from those of the tiles
+	highestCell = lowestCell = -1;
+	for (auto & range : tileRanges) {
+		if (range.highestCell >= 0 && (highestCell < 0 || isAbove(range.highestElevation, range.highestCell, highestElevation, highestCell))) {
+			highestCell = range.highestCell;
+			highestElevation = range.highestElevation;
+		}
+		if (range.lowestCell >= 0 && (lowestCell < 0 || isAbove(lowestElevation, lowestCell, range.lowestElevation, range.lowestCell))) {
+			lowestCell = range.lowestCell;
+			lowestElevation = range.lowestElevation;
+		}
+	}
+
+	// The floods run again when a tile they read changed, each thread takes every numThreads-th flood
+	floods.clear();
+	for (auto & extrema : tileExtrema)
+		for (auto & extremum : extrema)
+			if (!extremum.flooded || isChanged(extremum.minTileCol, extremum.minTileRow, extremum.maxTileCol, extremum.maxTileRow))
+				floods.push_back(&extremum);
+	int numThreads = static_cast<int>(scratches.size());
+	pool.parallelFor(numThreads, [this, elevations, numThreads](int thread) {
+		for (size_t i = thread; i < floods.size(); i += numThreads)
+			flood(elevations, *floods[i], scratches[thread]);
+	});
+
+	selectionChanged = false;
+	return select(raster);
+}
+
+void FeatureDetector::classifyTile(const float* elevations, int tile) {
+	int tileCol = tile % tileCols;
+	int tileRow = tile / tileCols;
+
+	// Highest and lowest valid cells of the whole tile
+	TileRange& range = tileRanges[tile];
+	range.highestCell = range.lowestCell = -1;
+	for (int row = tileRow*ElevationRaster::tileCells; row < std::min((tileRow + 1)*ElevationRaster::tileCells, rows); row++) {
+		for (int col = tileCol*ElevationRaster::tileCells; col < std::min((tileCol + 1)*ElevationRaster::tileCells, cols); col++) {
+			int cell = row*cols + col;
+			float elevation = elevations[cell];
+			if (elevation != elevation)
+				continue;
+			if (range.highestCell < 0 || elevation >= range.highestElevation) {
+				range.highestCell = cell;
+				range.highestElevation = elevation;
+			}
+			if (range.lowestCell < 0 || elevation < range.lowestElevation) {
+				range.lowestCell = cell;
+				range.lowestElevation = elevation;
+			}
+		}
+	}
+
+	// The raster edge cells miss neighbours and are never candidates
+	int minCol = std::max(tileCol*ElevationRaster::tileCells, 1);
+	int maxCol = std::min((tileCol + 1)*ElevationRaster::tileCells, cols - 1);
+	int minRow = std::max(tileRow*ElevationRaster::tileCells, 1);
+	int maxRow = std::min((tileRow + 1)*ElevationRaster::tileCells, rows - 1);
+
+	// The candidates still found keep their flood, both lists are in cell order
+	std::vector<Extremum>& previous = tileExtrema[tile];
+	std::vector<Extremum> extrema;
+	size_t next = 0;
+	auto add = [&](int cell, bool peak) {
+		while (next < previous.size() && previous[next].cell < cell)
+			next++;
+		if (next < previous.size() && previous[next].cell == cell && previous[next].peak == peak) {
+			extrema.push_back(previous[next]);
+			return;
+		}
+		Extremum extremum;
+		extremum.cell = cell;
+		extremum.peak = peak;
+		extremum.flooded = false;
+		extrema.push_back(extremum);
+	};
+
+	// Equal neighbours before the cell in scan order are below it, the ones after are above it.
+	// The comparisons with an invalid cell fail, so the candidates have 8 valid neighbours
+	for (int row = minRow; row < maxRow; row++) {
+		int col = minCol;
+#ifdef MAGIC_SAND_SSE2
+		for (; col + 4 <= maxCol; col += 4) {
+			const float* e = elevations + row*cols + col;
+			__m128 c = _mm_loadu_ps(e);
+			__m128 w = _mm_loadu_ps(e - 1);
+			__m128 nw = _mm_loadu_ps(e - cols - 1);
+			__m128 n = _mm_loadu_ps(e - cols);
+			__m128 ne = _mm_loadu_ps(e - cols + 1);
+			__m128 east = _mm_loadu_ps(e + 1);
+			__m128 sw = _mm_loadu_ps(e + cols - 1);
+			__m128 s = _mm_loadu_ps(e + cols);
+			__m128 se = _mm_loadu_ps(e + cols + 1);
+			__m128 peak = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(c, w), _mm_cmpge_ps(c, nw)), _mm_and_ps(_mm_cmpge_ps(c, n), _mm_cmpge_ps(c, ne)));
+			peak = _mm_and_ps(peak, _mm_and_ps(_mm_and_ps(_mm_cmpgt_ps(c, east), _mm_cmpgt_ps(c, sw)), _mm_and_ps(_mm_cmpgt_ps(c, s), _mm_cmpgt_ps(c, se))));
+			__m128 basin = _mm_and_ps(_mm_and_ps(_mm_cmplt_ps(c, w), _mm_cmplt_ps(c, nw)), _mm_and_ps(_mm_cmplt_ps(c, n), _mm_cmplt_ps(c, ne)));
+			basin = _mm_and_ps(basin, _mm_and_ps(_mm_and_ps(_mm_cmple_ps(c, east), _mm_cmple_ps(c, sw)), _mm_and_ps(_mm_cmple_ps(c, s), _mm_cmple_ps(c, se))));
+			int peaks = _mm_movemask_ps(peak);
+			int basins = _mm_movemask_ps(basin);
+			if ((peaks | basins) == 0)
+				continue;
+			for (int k = 0; k < 4; k++) {
+				if (peaks & (1 << k))
+					add(row*cols + col + k, true);
+				else if (basins & (1 << k))
+					add(row*cols + col + k, false);
+			}
+		}
+#endif
+		for (; col < maxCol; col++) {
+			const float* e = elevations + row*cols + col;
+			float c = e[0];
+			if (c >= e[-1] && c >= e[-cols - 1] && c >= e[-cols] && c >= e[-cols + 1]
+				&& c > e[1] && c > e[cols - 1] && c > e[cols] && c > e[cols + 1])
+				add(row*cols + col, true);
+			else if (c < e[-1] && c < e[-cols - 1] && c < e[-cols] && c < e[-cols + 1]
+				&& c <= e[1] && c <= e[cols - 1] && c <= e[cols] && c <= e[cols + 1])
+				add(row*cols + col, false);
+		}
+	}
+	previous.swap(extrema);
+}
+
+void FeatureDetector::flood(const float* elevations, Extremum& extremum, Scratch& scratch) const {
+	// The highest peak and the lowest basin never meet a higher cell, they take the whole raster
+	extremum.flooded = true;
+	extremum.saddle = -1;
+	if (extremum.cell == (extremum.peak ? highestCell : lowestCell)) {
+		extremum.prominence = highestElevation - lowestElevation;
+		extremum.minTileCol = 0;
+		extremum.minTileRow = 0;
+		extremum.maxTileCol = tileCols - 1;
+		extremum.maxTileRow = tileRows - 1;
+		return;
+	}
+
+	// The basins flood the raster with both the elevations and the cell order flipped
+	float sign = extremum.peak ? 1.0f : -1.0f;
+	int numCells = cols*rows;
+	auto key = [&](int cell) {
+		return floodKey(sign*elevations[cell], extremum.peak ? cell : numCells - 1 - cell);
+	};
+	if (++scratch.stamp == 0) {
+		std::fill(scratch.stamps.begin(), scratch.stamps.end(), 0);
+		scratch.stamp = 1;
+	}
+	std::vector<uint64_t>& heap = scratch.heap;
+	heap.clear();
+	uint64_t start = key(extremum.cell);
+	uint64_t lowest = start;
+	heap.push_back(start);
+	scratch.stamps[extremum.cell] = scratch.stamp;
+	int minCol = cols, minRow = rows, maxCol = 0, maxRow = 0;
+	auto cellOf = [&](uint64_t key) {
+		int order = static_cast<int>(key & 0xffffffffu);
+		return extremum.peak ? order : numCells - 1 - order;
+	};
+	while (!heap.empty()) {
+		std::pop_heap(heap.begin(), heap.end());
+		uint64_t top = heap.back();
+		heap.pop_back();
+		if (top > start) {
+			extremum.saddle = cellOf(lowest);
+			break;
+		}
+		lowest = std::min(lowest, top);
+		int cell = cellOf(top);
+		int col = cell % cols;
+		int row = cell / cols;
+		int col0 = std::max(col - 1, 0);
+		int row0 = std::max(row - 1, 0);
+		int col1 = std::min(col + 1, cols - 1);
+		int row1 = std::min(row + 1, rows - 1);
+		minCol = std::min(minCol, col0);
+		minRow = std::min(minRow, row0);
+		maxCol = std::max(maxCol, col1);
+		maxRow = std::max(maxRow, row1);
+		for (int y = row0; y <= row1; y++) {
+			for (int x = col0; x <= col1; x++) {
+				int neighbour = y*cols + x;
+				if (scratch.stamps[neighbour] == scratch.stamp)
+					continue;
+				scratch.stamps[neighbour] = scratch.stamp;
+				if (elevations[neighbour] != elevations[neighbour])
+					continue;
+				heap.push_back(key(neighbour));
+				std::push_heap(heap.begin(), heap.end());
+			}
+		}
+	}
+	extremum.prominence = sign*(elevations[extremum.cell] - elevations[cellOf(lowest)]);
+	extremum.minTileCol = minCol / ElevationRaster::tileCells;
+	extremum.minTileRow = minRow / ElevationRaster::tileCells;
+	extremum.maxTileCol = maxCol / ElevationRaster::tileCells;
+	extremum.maxTileRow = maxRow / ElevationRaster::tileCells;
+}
+
+bool FeatureDetector::isChanged(int minTileCol, int minTileRow, int maxTileCol, int maxTileRow) const {
+	int stride = tileCols + 1;
+	int col0 = minTileCol;
+	int row0 = minTileRow;
+	int col1 = maxTileCol + 1;
+	int row1 = maxTileRow + 1;
+	return changedTileSums[row1*stride + col1] - changedTileSums[row0*stride + col1]
+		- changedTileSums[row1*stride + col0] + changedTileSums[row0*stride + col0] > 0;
+}
+
+bool FeatureDetector::select(const ElevationRaster& raster) {
+	std::vector<const Extremum*> prominent;
+	for (auto & extrema : tileExtrema)
+		for (auto & extremum : extrema)
+			if (extremum.prominence >= minProminence)
+				prominent.push_back(&extremum);
+	std::sort(prominent.begin(), prominent.end(), [](const Extremum* a, const Extremum* b) {
+		return a->peak != b->peak ? a->peak : a->prominence > b->prominence;
+	});
+
+	// The most prominent first, each feature suppresses the less prominent ones of its kind around it
+	std::vector<Feature> selected;
+	float radius2 = suppressionRadius*suppressionRadius;
+	auto suppress = [&](Feature& feature) {
+		for (auto & kept : selected) {
+			float dx = static_cast<float>(kept.col - feature.col);
+			float dy = static_cast<float>(kept.row - feature.row);
+			if (kept.kind == feature.kind && dx*dx + dy*dy <= radius2)
+				return;
+		}
+		feature.zedCoord = raster.cellToZedCoord(feature.col, feature.row);
+		feature.elevation = raster.getElevation(feature.col, feature.row);
+		selected.push_back(feature);
+	};
+	std::vector<Feature> saddles;
+	for (auto extremum : prominent) {
+		Feature feature;
+		feature.kind = extremum->peak ? PEAK : BASIN;
+		feature.col = extremum->cell % cols;
+		feature.row = extremum->cell / cols;
+		feature.prominence = extremum->prominence;
+		size_t numSelected = selected.size();
+		suppress(feature);
+		if (selected.size() == numSelected || extremum->saddle < 0)
+			continue;
+		feature.kind = SADDLE;
+		feature.col = extremum->saddle % cols;
+		feature.row = extremum->saddle / cols;
+		saddles.push_back(feature);
+	}
+	std::stable_sort(saddles.begin(), saddles.end(), [](const Feature& a, const Feature& b) {
+		return a.prominence > b.prominence;
+	});
+	for (auto & saddle : saddles)
+		suppress(saddle);
+
+	auto isSame = [](const Feature& a, const Feature& b) {
+		return a.kind == b.kind && a.col == b.col && a.row == b.row && a.elevation == b.elevation && a.prominence == b.prominence;
+	};
+	if (selected.size() == features.size() && std::equal(selected.begin(), selected.end(), features.begin(), isSame))
+		return false;
+	features.swap(selected);
+	version++;
+	return true;
+}
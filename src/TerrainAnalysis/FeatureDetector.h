@@ -0,0 +1,113 @@
+/***********************************************************************
+FeatureDetector - Peaks, basins and saddles of the sand surface, with
+their topographic prominence.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#pragma once
+
+#include "ofMain.h"
+#include "ElevationRaster.h"
+
+// The candidates are the cells above (peaks) or below (basins) their 8 valid neighbours, equal
+// cells being ordered by their index so a flat top has a single candidate. They are found 4
+// cells per SSE2 instruction, only in the raster tiles changed since the last update and their
+// neighbours.
+// The prominence of a peak is its height above its key saddle: the cells are flooded from the
+// peak, highest first, until a cell higher than the peak is reached, and the key saddle is the
+// lowest cell passed on the way. Basins are flooded the other way. Each flood remembers the
+// tiles it read and is only run again when one of them changed. The raster edges and the
+// invalid cells are walls. The highest peak and the lowest basin have no key saddle, their
+// prominence is the elevation range of the raster.
+// The prominent features are then thinned by non-maximum suppression, the most prominent one
+// removing the features of the same kind around it, and the key saddles of the kept peaks and
+// basins are the saddles.
+class FeatureDetector {
+public:
+	enum Kind {
+		PEAK,
+		BASIN,
+		SADDLE
+	};
+	struct Feature {
+		Kind kind;
+		int col, row; // Raster cell
+		glm::vec2 zedCoord;
+		float elevation; // mm
+		float prominence; // mm, of the peak or basin whose key saddle it is for the saddles
+	};
+
+	FeatureDetector();
+
+	void setMinProminence(float sminProminence); // mm, less prominent features are ignored
+	void setSuppressionRadius(float ssuppressionRadius); // Raster cells
+
+	bool update(const ElevationRaster& raster, WorkerPool& pool); // False if the features did not change
+
+	const std::vector<Feature>& getFeatures() const { // By kind, then by decreasing prominence
+		return features;
+	}
+	unsigned int getVersion() const { // Incremented when the features change
+		return version;
+	}
+
+private:
+	struct Extremum {
+		int cell;
+		bool peak;
+		bool flooded; // The fields below are up to date
+		float prominence;
+		int saddle; // Key saddle cell, -1 when the flood took the whole raster
+		int minTileCol, minTileRow, maxTileCol, maxTileRow; // Tiles read by the flood
+	};
+	// Highest and lowest valid cells of a tile, -1 when it has none
+	struct TileRange {
+		int highestCell, lowestCell;
+		float highestElevation, lowestElevation;
+		TileRange() : highestCell(-1), lowestCell(-1), highestElevation(0), lowestElevation(0) {}
+	};
+	// Per thread flood state
+	struct Scratch {
+		std::vector<uint64_t> heap; // Keys of the frontier cells, see floodKey()
+		std::vector<unsigned int> stamps; // Visited cells
+		unsigned int stamp;
+	};
+
+	void classifyTile(const float* elevations, int tile);
+	void flood(const float* elevations, Extremum& extremum, Scratch& scratch) const;
+	bool isChanged(int minTileCol, int minTileRow, int maxTileCol, int maxTileRow) const; // A tile of the range changed
+	bool select(const ElevationRaster& raster); // False if the features did not change
+	static bool isAbove(float elevation, int cell, float otherElevation, int otherCell) { // Equal elevations are ordered by cell
+		return elevation > otherElevation || (elevation == otherElevation && cell > otherCell);
+	}
+
+	float minProminence;
+	float suppressionRadius;
+	bool selectionChanged;
+	int cols, rows;
+	int tileCols, tileRows;
+	unsigned int rasterVersion; // Raster version of the last update
+	int highestCell, lowestCell; // Valid cells
+	float highestElevation, lowestElevation;
+
+	std::vector<std::vector<Extremum> > tileExtrema;
+	std::vector<TileRange> tileRanges;
+	std::vector<int> dirtyTiles;
+	std::vector<int> changedTileSums; // Summed area table of the tiles changed by the update
+	std::vector<Extremum*> floods;
+	std::vector<Scratch> scratches;
+
+	std::vector<Feature> features;
+	unsigned int version;
+};
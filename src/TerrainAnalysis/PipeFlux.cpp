@@ -0,0 +1,87 @@
+/***********************************************************************
+PipeFlux - Outflow kernel of the virtual pipe model shared by the water
+and erosion simulations.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#include "PipeFlux.h"
+#include "../ZedProjector/Utils.h"
+
+// The offset is a template parameter so the water simulation does not read a null layer
+template<bool withOffset> static void updateRowCells(const PipeFlux::Grid& grid, int row, float k, float damping, float volumeRate) {
+	const float* b = grid.terrain;
+	const float* o = grid.offset;
+	const float* d = grid.water;
+	const int stride = grid.stride;
+	const int rowStart = (row + 1)*stride;
+	int x = 1;
+#ifdef MAGIC_SAND_SSE2
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 tiny = _mm_set1_ps(1.0e-12f);
+	const __m128 dampingv = _mm_set1_ps(damping);
+	const __m128 kv = _mm_set1_ps(k);
+	const __m128 volumeRatev = _mm_set1_ps(volumeRate);
+	auto surface = [&](int i) {
+		__m128 h = _mm_loadu_ps(b + i);
+		if (withOffset)
+			h = _mm_add_ps(h, _mm_loadu_ps(o + i));
+		return _mm_add_ps(h, _mm_loadu_ps(d + i));
+	};
+	auto flux = [&](float* f, int i, __m128 h, __m128 hn) {
+		return _mm_max_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(f + i), dampingv), _mm_mul_ps(kv, _mm_sub_ps(h, hn))), zero);
+	};
+	for (; x + 4 <= grid.cols + 1; x += 4) {
+		int i = rowStart + x;
+		__m128 h = surface(i);
+		__m128 fl = flux(grid.left, i, h, surface(i - 1));
+		__m128 fr = flux(grid.right, i, h, surface(i + 1));
+		__m128 ft = flux(grid.top, i, h, surface(i - stride));
+		__m128 fb = flux(grid.bottom, i, h, surface(i + stride));
+
+		// The outflow can not drain more than the water of the cell during the step
+		__m128 sum = _mm_add_ps(_mm_add_ps(fl, fr), _mm_add_ps(ft, fb));
+		__m128 limit = _mm_mul_ps(_mm_loadu_ps(d + i), volumeRatev);
+		__m128 scale = _mm_min_ps(_mm_div_ps(limit, _mm_max_ps(sum, tiny)), one);
+		_mm_storeu_ps(grid.left + i, _mm_mul_ps(fl, scale));
+		_mm_storeu_ps(grid.right + i, _mm_mul_ps(fr, scale));
+		_mm_storeu_ps(grid.top + i, _mm_mul_ps(ft, scale));
+		_mm_storeu_ps(grid.bottom + i, _mm_mul_ps(fb, scale));
+	}
+#endif
+	auto cellSurface = [&](int i) {
+		return withOffset ? b[i] + o[i] + d[i] : b[i] + d[i];
+	};
+	for (; x <= grid.cols; x++) {
+		int i = rowStart + x;
+		float h = cellSurface(i);
+		float fl = std::max(grid.left[i] * damping + k*(h - cellSurface(i - 1)), 0.0f);
+		float fr = std::max(grid.right[i] * damping + k*(h - cellSurface(i + 1)), 0.0f);
+		float ft = std::max(grid.top[i] * damping + k*(h - cellSurface(i - stride)), 0.0f);
+		float fb = std::max(grid.bottom[i] * damping + k*(h - cellSurface(i + stride)), 0.0f);
+		float sum = fl + fr + ft + fb;
+		float scale = std::min(d[i] * volumeRate / std::max(sum, 1.0e-12f), 1.0f);
+		grid.left[i] = fl*scale;
+		grid.right[i] = fr*scale;
+		grid.top[i] = ft*scale;
+		grid.bottom[i] = fb*scale;
+	}
+}
+
+void PipeFlux::updateRow(const Grid& grid, int row, float k, float damping, float volumeRate) {
+	if (grid.offset)
+		updateRowCells<true>(grid, row, k, damping, volumeRate);
+	else
+		updateRowCells<false>(grid, row, k, damping, volumeRate);
+}
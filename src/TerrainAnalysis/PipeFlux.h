@@ -0,0 +1,44 @@
+/***********************************************************************
+PipeFlux - Outflow kernel of the virtual pipe model shared by the water
+and erosion simulations.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#pragma once
+
+#include "ofMain.h"
+
+// Each cell keeps its outflows through the pipes to its 4 neighbours: the damped previous
+// outflow plus the water surface difference times k, never negative, then scaled down when they
+// would drain more than the water of the cell during the step. The grids have a border of wall
+// cells and padded rows of stride floats, the cells of a row are updated in place, 4 per SSE2
+// instruction.
+class PipeFlux {
+public:
+	struct Grid {
+		const float* terrain; // mm
+		const float* offset; // mm added to the terrain, nullptr for none
+		const float* water; // Depth in mm
+		float* left;
+		float* right;
+		float* top;
+		float* bottom; // Outflows in mm3/s
+		int cols; // Without the border
+		int stride;
+	};
+
+	// row is a raster row, k is the pipe section area / length times dt times gravity and
+	// volumeRate the cell area / dt
+	static void updateRow(const Grid& grid, int row, float k, float damping, float volumeRate);
+};
@@ -0,0 +1,492 @@
+/***********************************************************************
+TerrainAnalyzer - TerrainAnalyzer runs the analyses of the sand surface
+and draws their results in a projector layer.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#include "TerrainAnalyzer.h"
+#include "ofxXmlPoco.h"
+
+TerrainAnalyzer::TerrainAnalyzer(std::shared_ptr<ZedProjector> const& k, std::shared_ptr<ofAppBaseWindow> const& p)
+	:cellLength(5),
+	basePlaneVersion(0),
+	calibrationVersion(0),
+	drawVectorContours(false),
+	contourInterval(10),
+	simulateWater(false),
+	waterSpeed(0.25f),
+	drawRivers(false),
+	riverThreshold(200),
+	drawLakes(false),
+	lakeMinDepth(2),
+	lakeMeshVersion(0),
+	lakeMeshDirty(true),
+	simulateErosion(false),
+	erosionSteps(10),
+	drawFeatures(false),
+	featureProminence(10),
+	overlayVersion(0),
+	overlayDirty(true),
+	displayGui(false),
+	gui(nullptr)
+{
+	zedProjector = k;
+	projWindow = p;
+}
+
+void TerrainAnalyzer::setup(bool sdisplayGui) {
+	ofAddListener(ofEvents().exit, this, &TerrainAnalyzer::exit);
+
+	if (loadSettings())
+		ofLogVerbose("TerrainAnalyzer") << "setup(): terrainAnalyzerSettings.xml loaded";
+	else
+		ofLogVerbose("TerrainAnalyzer") << "setup(): terrainAnalyzerSettings.xml could not be loaded";
+	contours.setInterval(contourInterval);
+	water.setSpeed(waterSpeed);
+	water.setEnabled(simulateWater);
+	drainage.setRiverThreshold(riverThreshold);
+	drainage.setEnabled(drawRivers);
+	depressions.setMinDepth(lakeMinDepth);
+	erosion.setStepsPerUpdate(static_cast<int>(erosionSteps));
+	erosion.setEnabled(simulateErosion);
+	features.setMinProminence(featureProminence);
+
+	pool.setup();
+	drainage.setup();
+	raster.setup(zedProjector->getZedROI(), 4);
+	updateCellLength();
+
+	projResX = projWindow->getWidth();
+	projResY = projWindow->getHeight();
+	fboOverlay.allocate(projResX, projResY, GL_RGBA);
+	fboOverlay.begin();
+	ofClear(0, 0, 0, 0);
+	fboOverlay.end();
+
+	displayGui = sdisplayGui;
+	if (displayGui)
+		setupGui();
+}
+
+void TerrainAnalyzer::exit(ofEventArgs& e) {
+	if (saveSettings())
+		ofLogVerbose("TerrainAnalyzer") << "exit(): Settings saved";
+	else
+		ofLogVerbose("TerrainAnalyzer") << "exit(): Settings could not be saved";
+}
+
+void TerrainAnalyzer::update() {
+	overlayDirtyRects.clear(); // Taken by the compositor after the previous update
+	if (zedProjector->getBasePlaneVersion() != basePlaneVersion || zedProjector->getCalibrationVersion() != calibrationVersion) {
+		updateCellLength();
+		lakeMeshDirty = true;
+		overlayDirty = true;
+	}
+
+	// The depth frames are not sand surfaces while calibrating
+	if (!zedProjector->isCalibrating() && zedProjector->isImageStabilized()) {
+		raster.update(*zedProjector, pool);
+		if (drawVectorContours && updateContours())
+			overlayDirty = true;
+		if (drawLakes)
+			depressions.update(raster, pool);
+		if (drawFeatures && features.update(raster, pool))
+			overlayDirty = true;
+		water.update(raster, pool, ofGetLastFrameTime());
+		erosion.update(raster, pool);
+	}
+	// The results of the worker thread are adopted even while the raster is not updated
+	if (drawRivers && drainage.update(raster))
+		overlayDirty = true;
+	if (drawLakes && (lakeMeshDirty || depressions.getVersion() != lakeMeshVersion))
+		updateLakeMesh();
+
+	if (overlayDirty || !overlayDirtyRects.empty())
+		drawOverlay();
+
+	if (displayGui)
+		gui->update();
+}
+
+void TerrainAnalyzer::updateCellLength() {
+	// cellSize Zed pixels seen at the base plane distance
+	basePlaneVersion = zedProjector->getBasePlaneVersion();
+	calibrationVersion = zedProjector->getCalibrationVersion();
+	float distance = zedProjector->getBasePlaneOffset().z;
+	float focalLength = zedProjector->getZedFocalLength();
+	if (distance <= 0 || focalLength <= 0)
+		return;
+	cellLength = raster.getCellSize()*distance / focalLength;
+	water.setCellLength(cellLength);
+	depressions.setCellLength(cellLength);
+	erosion.setCellLength(cellLength);
+	ofLogVerbose("TerrainAnalyzer") << "updateCellLength(): " << cellLength << " mm per raster cell";
+}
+
+bool TerrainAnalyzer::updateContours() {
+	if (!contours.update(raster, pool))
+		return false;
+	contours.project(*zedProjector);
+	return true;
+}
+
+void TerrainAnalyzer::updateLakeMesh() {
+	// Squares of the lake cells at the sand elevation, more opaque where deeper. The cells
+	// sharing a corner share its vertex, at the mean elevation and water level of the cells.
+	lakeMeshVersion = depressions.getVersion();
+	int cols = raster.getCols();
+	int rows = raster.getRows();
+	int tileCols = raster.getTileCols();
+	int tileRows = raster.getTileRows();
+	const int tileCells = ElevationRaster::tileCells;
+	float nan = std::numeric_limits<float>::quiet_NaN();
+	if (lakeLevels.size() != cols*rows || lakeTileRects.size() != tileCols*tileRows) {
+		lakeLevels.assign(cols*rows, nan);
+		lakeElevations.assign(cols*rows, nan);
+		lakeTileRects.assign(tileCols*tileRows, ofRectangle());
+		lakeMeshDirty = true;
+	}
+	if (lakeMeshDirty)
+		overlayDirty = true; // All the vertices moved
+	lakeMeshDirty = false;
+
+	// Water of each cell. The tiles where it changed are redrawn, with those of the neighbouring
+	// cells, which share its corners.
+	std::vector<bool> changedTiles(tileCols*tileRows, false);
+	cornerSums.assign((cols + 1)*(rows + 1), glm::vec3(0));
+	bool hasLakes = depressions.getVersion() > 0; // Sized like the raster once updated
+	for (int row = 0; row < rows; row++) {
+		for (int col = 0; col < cols; col++) {
+			int i = row*cols + col;
+			float level = hasLakes ? depressions.getWaterLevel(col, row) : nan;
+			float elevation = level == level ? raster.getElevation(col, row) : nan;
+			bool sameLevel = level == lakeLevels[i] || (level != level && lakeLevels[i] != lakeLevels[i]);
+			bool sameElevation = elevation == lakeElevations[i] || (elevation != elevation && lakeElevations[i] != lakeElevations[i]);
+			if (!sameLevel || !sameElevation) {
+				for (int r = std::max(row - 1, 0); r <= std::min(row + 1, rows - 1); r++)
+					for (int c = std::max(col - 1, 0); c <= std::min(col + 1, cols - 1); c++)
+						changedTiles[(r / tileCells)*tileCols + c / tileCells] = true;
+			}
+			lakeLevels[i] = level;
+			lakeElevations[i] = elevation;
+			if (level != level)
+				continue;
+			int corner = row*(cols + 1) + col;
+			for (int c : { corner, corner + 1, corner + cols + 1, corner + cols + 2 })
+				cornerSums[c] += glm::vec3(elevation, level, 1);
+		}
+	}
+
+	lakeMesh.clear();
+	lakeMesh.setMode(OF_PRIMITIVE_TRIANGLES);
+	cornerVertices.assign((cols + 1)*(rows + 1), -1);
+	for (int row = 0; row <= rows; row++) {
+		for (int col = 0; col <= cols; col++) {
+			int corner = row*(cols + 1) + col;
+			const glm::vec3& sum = cornerSums[corner];
+			if (sum.z == 0)
+				continue;
+			float elevation = sum.x / sum.z;
+			float depth = (sum.y - sum.x) / sum.z;
+			glm::vec2 zedCoord = raster.cellToZedCoord(col - 0.5f, row - 0.5f);
+			glm::vec2 projCoord = zedProjector->zedCoordAndElevationToProjCoord(zedCoord.x, zedCoord.y, elevation);
+			cornerVertices[corner] = lakeMesh.getNumVertices();
+			lakeMesh.addVertex(glm::vec3(projCoord, 0));
+			lakeMesh.addColor(ofFloatColor(0.1f, 0.35f, 0.9f, ofClamp(depth / 20, 0.3f, 0.8f)));
+		}
+	}
+	std::vector<ofRectangle> tileRects(tileCols*tileRows);
+	for (int row = 0; row < rows; row++) {
+		for (int col = 0; col < cols; col++) {
+			if (lakeLevels[row*cols + col] != lakeLevels[row*cols + col])
+				continue;
+			int corner = row*(cols + 1) + col;
+			int a = cornerVertices[corner];
+			int b = cornerVertices[corner + 1];
+			int c = cornerVertices[corner + cols + 2];
+			int d = cornerVertices[corner + cols + 1];
+			lakeMesh.addTriangle(a, b, c);
+			lakeMesh.addTriangle(a, c, d);
+			ofRectangle& rect = tileRects[(row / tileCells)*tileCols + col / tileCells];
+			for (int v : { a, b, c, d }) {
+				const glm::vec3& p = lakeMesh.getVertex(v);
+				if (rect.isEmpty())
+					rect.set(p.x, p.y, 0, 0);
+				else
+					rect.growToInclude(p.x, p.y);
+			}
+		}
+	}
+
+	// Where the lakes were and are in the changed tiles
+	for (int tile = 0; tile < tileCols*tileRows; tile++) {
+		if (!changedTiles[tile])
+			continue;
+		if (!lakeTileRects[tile].isEmpty())
+			overlayDirtyRects.push_back(lakeTileRects[tile]);
+		if (!tileRects[tile].isEmpty())
+			overlayDirtyRects.push_back(tileRects[tile]);
+	}
+	lakeTileRects.swap(tileRects);
+}
+
+void TerrainAnalyzer::drawOverlay() {
+	fboOverlay.begin();
+	ofClear(0, 0, 0, 0);
+	if (drawLakes)
+		lakeMesh.draw();
+	if (drawVectorContours) {
+		ofSetColor(ofColor::black);
+		ofSetLineWidth(2);
+		ofPolyline line;
+		for (auto & polyline : contours.getPolylines()) {
+			line.clear();
+			for (auto & point : polyline.projPoints)
+				line.addVertex(point.x, point.y);
+			if (polyline.closed)
+				line.close();
+			line.draw();
+		}
+		ofSetLineWidth(1);
+		ofSetColor(ofColor::white);
+	}
+	if (drawRivers) {
+		// Wider downstream, as the flow grows
+		ofSetColor(30, 90, 220);
+		ofPolyline line;
+		for (auto & river : drainage.getRivers()) {
+			if (river.points.size() < 2)
+				continue;
+			line.clear();
+			for (auto & point : river.points) {
+				glm::vec2 zedCoord = drainage.cellToZedCoord(point.x, point.y);
+				glm::vec2 projCoord = zedProjector->zedCoordAndElevationToProjCoord(zedCoord.x, zedCoord.y, point.z);
+				line.addVertex(projCoord.x, projCoord.y);
+			}
+			ofSetLineWidth(ofClamp(2 * sqrt(river.flow / riverThreshold), 2, 8));
+			line.draw();
+		}
+		ofSetLineWidth(1);
+		ofSetColor(ofColor::white);
+	}
+	if (drawFeatures) {
+		// Peaks and basins labelled with their elevation, saddles as small diamonds
+		for (auto & feature : features.getFeatures()) {
+			glm::vec2 p = zedProjector->zedCoordAndElevationToProjCoord(feature.zedCoord.x, feature.zedCoord.y, feature.elevation);
+			if (feature.kind == FeatureDetector::SADDLE) {
+				ofSetColor(ofColor::orange);
+				ofDrawTriangle(p.x - 5, p.y, p.x, p.y - 5, p.x + 5, p.y);
+				ofDrawTriangle(p.x - 5, p.y, p.x, p.y + 5, p.x + 5, p.y);
+				continue;
+			}
+			if (feature.kind == FeatureDetector::PEAK) {
+				ofSetColor(ofColor::darkRed);
+				ofDrawTriangle(p.x - 7, p.y + 5, p.x, p.y - 7, p.x + 7, p.y + 5);
+			}
+			else {
+				ofSetColor(ofColor::darkBlue);
+				ofDrawCircle(p.x, p.y, 6);
+			}
+			ofDrawBitmapStringHighlight(ofToString(static_cast<int>(std::round(feature.elevation))) + " mm", p.x + 10, p.y + 4);
+		}
+		ofSetColor(ofColor::white);
+	}
+	fboOverlay.end();
+	overlayVersion++;
+	if (overlayDirty)
+		overlayDirtyRects.clear();
+	overlayDirty = false;
+}
+
+void TerrainAnalyzer::exportContours() {
+	// The contours are only kept up to date while they are drawn
+	raster.update(*zedProjector, pool);
+	updateContours();
+	string fileName = "contours.svg";
+	if (contours.saveSvg(fileName, projResX, projResY, true))
+		ofLogNotice("TerrainAnalyzer") << "exportContours(): " << contours.getPolylines().size() << " contour lines saved in " << fileName;
+	else
+		ofLogError("TerrainAnalyzer") << "exportContours(): Could not save " << fileName;
+}
+
+void TerrainAnalyzer::drawGui() {
+	if (displayGui)
+		gui->draw();
+}
+
+void TerrainAnalyzer::setupGui() {
+	gui = new ofxDatGui();
+	gui->addToggle("Vector contours", drawVectorContours)->setStripeColor(ofColor::blue);
+	gui->addSlider("Contour interval", 1, 50, contourInterval)->setStripeColor(ofColor::blue);
+	gui->addButton("Export contours to SVG")->setName("Export contours");
+	gui->addToggle("Water simulation", simulateWater)->setStripeColor(ofColor::cyan);
+	gui->addSlider("Water speed", 0.05, 1, waterSpeed)->setStripeColor(ofColor::cyan);
+	gui->addButton("Rain")->setStripeColor(ofColor::cyan);
+	gui->addButton("Drain water")->setStripeColor(ofColor::cyan);
+	gui->addToggle("Rivers", drawRivers)->setStripeColor(ofColor::darkBlue);
+	gui->addSlider("River threshold", 20, 2000, riverThreshold)->setStripeColor(ofColor::darkBlue);
+	gui->addToggle("Lakes", drawLakes)->setStripeColor(ofColor::royalBlue);
+	gui->addSlider("Lake min depth", 0.5, 20, lakeMinDepth)->setStripeColor(ofColor::royalBlue);
+	gui->addToggle("Erosion", simulateErosion)->setStripeColor(ofColor::brown);
+	gui->addSlider("Erosion steps per frame", 1, 50, erosionSteps)->setStripeColor(ofColor::brown);
+	gui->addButton("Reset erosion")->setStripeColor(ofColor::brown);
+	gui->addToggle("Peaks and basins", drawFeatures)->setStripeColor(ofColor::darkRed);
+	gui->addSlider("Min prominence", 1, 100, featureProminence)->setStripeColor(ofColor::darkRed);
+	gui->addHeader(":: Terrain analysis ::", false);
+
+	gui->onButtonEvent(this, &TerrainAnalyzer::onButtonEvent);
+	gui->onToggleEvent(this, &TerrainAnalyzer::onToggleEvent);
+	gui->onSliderEvent(this, &TerrainAnalyzer::onSliderEvent);
+	gui->setPosition(ofxDatGuiAnchor::BOTTOM_LEFT); // Once the gui is assembled
+	gui->setAutoDraw(false);
+}
+
+void TerrainAnalyzer::onButtonEvent(ofxDatGuiButtonEvent e) {
+	if (e.target->is("Export contours")) {
+		if (zedProjector->isImageStabilized())
+			exportContours();
+	}
+	else if (e.target->is("Rain")) {
+		water.rain(2);
+	}
+	else if (e.target->is("Drain water")) {
+		water.drain();
+	}
+	else if (e.target->is("Reset erosion")) {
+		erosion.reset();
+	}
+}
+
+void TerrainAnalyzer::onToggleEvent(ofxDatGuiToggleEvent e) {
+	if (e.target->is("Vector contours")) {
+		drawVectorContours = e.checked;
+		if (drawVectorContours)
+			updateContours();
+		overlayDirty = true;
+	}
+	else if (e.target->is("Water simulation")) {
+		simulateWater = e.checked;
+		water.setEnabled(simulateWater);
+	}
+	else if (e.target->is("Rivers")) {
+		drawRivers = e.checked;
+		drainage.setEnabled(drawRivers);
+		overlayDirty = true;
+	}
+	else if (e.target->is("Lakes")) {
+		drawLakes = e.checked;
+		if (drawLakes)
+			depressions.update(raster, pool);
+		overlayDirty = true;
+	}
+	else if (e.target->is("Erosion")) {
+		simulateErosion = e.checked;
+		erosion.setEnabled(simulateErosion);
+	}
+	else if (e.target->is("Peaks and basins")) {
+		drawFeatures = e.checked;
+		if (drawFeatures)
+			features.update(raster, pool);
+		overlayDirty = true;
+	}
+}
+
+void TerrainAnalyzer::onSliderEvent(ofxDatGuiSliderEvent e) {
+	if (e.target->is("Contour interval")) {
+		contourInterval = e.value;
+		contours.setInterval(contourInterval);
+		if (drawVectorContours && updateContours())
+			overlayDirty = true;
+	}
+	else if (e.target->is("Water speed")) {
+		waterSpeed = e.value;
+		water.setSpeed(waterSpeed);
+	}
+	else if (e.target->is("River threshold")) {
+		riverThreshold = e.value;
+		drainage.setRiverThreshold(riverThreshold);
+	}
+	else if (e.target->is("Lake min depth")) {
+		lakeMinDepth = e.value;
+		depressions.setMinDepth(lakeMinDepth);
+		if (drawLakes && depressions.update(raster, pool))
+			overlayDirty = true;
+	}
+	else if (e.target->is("Erosion steps per frame")) {
+		erosionSteps = e.value;
+		erosion.setStepsPerUpdate(static_cast<int>(erosionSteps));
+	}
+	else if (e.target->is("Min prominence")) {
+		featureProminence = e.value;
+		features.setMinProminence(featureProminence);
+		if (drawFeatures && features.update(raster, pool))
+			overlayDirty = true;
+	}
+}
+
+bool TerrainAnalyzer::loadSettings() {
+	string settingsFile = "settings/terrainAnalyzerSettings.xml";
+
+	ofxXmlPoco xml;
+	if (!xml.load(settingsFile))
+		return false;
+	xml.setTo("TERRAINANALYZERSETTINGS");
+	if (xml.exists("drawVectorContours"))
+		drawVectorContours = xml.getValue<bool>("drawVectorContours");
+	if (xml.exists("contourInterval"))
+		contourInterval = xml.getValue<float>("contourInterval");
+	if (xml.exists("simulateWater"))
+		simulateWater = xml.getValue<bool>("simulateWater");
+	if (xml.exists("waterSpeed"))
+		waterSpeed = xml.getValue<float>("waterSpeed");
+	if (xml.exists("drawRivers"))
+		drawRivers = xml.getValue<bool>("drawRivers");
+	if (xml.exists("riverThreshold"))
+		riverThreshold = xml.getValue<float>("riverThreshold");
+	if (xml.exists("drawLakes"))
+		drawLakes = xml.getValue<bool>("drawLakes");
+	if (xml.exists("lakeMinDepth"))
+		lakeMinDepth = xml.getValue<float>("lakeMinDepth");
+	if (xml.exists("simulateErosion"))
+		simulateErosion = xml.getValue<bool>("simulateErosion");
+	if (xml.exists("erosionSteps"))
+		erosionSteps = xml.getValue<float>("erosionSteps");
+	if (xml.exists("drawFeatures"))
+		drawFeatures = xml.getValue<bool>("drawFeatures");
+	if (xml.exists("featureProminence"))
+		featureProminence = xml.getValue<float>("featureProminence");
+	return true;
+}
+
+bool TerrainAnalyzer::saveSettings() {
+	string settingsFile = "settings/terrainAnalyzerSettings.xml";
+
+	ofxXmlPoco xml;
+	xml.addChild("TERRAINANALYZERSETTINGS");
+	xml.setTo("TERRAINANALYZERSETTINGS");
+	xml.addValue("drawVectorContours", drawVectorContours);
+	xml.addValue("contourInterval", contourInterval);
+	xml.addValue("simulateWater", simulateWater);
+	xml.addValue("waterSpeed", waterSpeed);
+	xml.addValue("drawRivers", drawRivers);
+	xml.addValue("riverThreshold", riverThreshold);
+	xml.addValue("drawLakes", drawLakes);
+	xml.addValue("lakeMinDepth", lakeMinDepth);
+	xml.addValue("simulateErosion", simulateErosion);
+	xml.addValue("erosionSteps", erosionSteps);
+	xml.addValue("drawFeatures", drawFeatures);
+	xml.addValue("featureProminence", featureProminence);
+	xml.setToParent();
+	return xml.save(settingsFile);
+}
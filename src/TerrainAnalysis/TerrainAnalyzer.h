@@ -0,0 +1,140 @@
+/***********************************************************************
+TerrainAnalyzer - TerrainAnalyzer runs the analyses of the sand surface
+and draws their results in a projector layer.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#pragma once
+
+#include "ofMain.h"
+#include "ofxDatGui.h"
+#include "../ZedProjector/ZedProjector.h"
+#include "../WorkerPool.h"
+#include "ElevationRaster.h"
+#include "ContourExtractor.h"
+#include "WaterSimulation.h"
+#include "DrainageNetwork.h"
+#include "DepressionFiller.h"
+#include "ErosionSimulation.h"
+#include "FeatureDetector.h"
+
+// The elevation raster is updated from the dirty depth tiles of each new depth frame, then each
+// enabled analysis updates its results from the raster tiles that changed. The overlay fbo is
+// only redrawn when a drawn result changed. The lake mesh is only rebuilt when the lakes change,
+// and only the raster tiles where they changed are recomposited.
+class TerrainAnalyzer {
+public:
+	TerrainAnalyzer(std::shared_ptr<ZedProjector> const& k, std::shared_ptr<ofAppBaseWindow> const& p);
+
+	void setup(bool sdisplayGui);
+	void update();
+	void drawGui();
+
+	// Analysis layer of the projector compositor
+	const ofFbo& getOverlayFbo() const {
+		return fboOverlay;
+	}
+	unsigned int getOverlayVersion() const {
+		return overlayVersion;
+	}
+	const std::vector<ofRectangle>& getOverlayDirtyRects() const { // Changed by the last version, empty when all of it changed
+		return overlayDirtyRects;
+	}
+
+	const ElevationRaster& getElevationRaster() const {
+		return raster;
+	}
+	const ContourExtractor& getContourExtractor() const { // Up to date when the vector contours are drawn
+		return contours;
+	}
+	const WaterSimulation& getWaterSimulation() const { // Water texture blended by the SandSurfaceRenderer
+		return water;
+	}
+	const DrainageNetwork& getDrainageNetwork() const { // Rivers taken as water by the vehicles, empty while disabled
+		return drainage;
+	}
+	const DepressionFiller& getDepressionFiller() const { // Up to date when the lakes are drawn
+		return depressions;
+	}
+	const ErosionSimulation& getErosionSimulation() const { // Elevation offset added by the SandSurfaceRenderer
+		return erosion;
+	}
+	const FeatureDetector& getFeatureDetector() const { // Up to date when the peaks and basins are drawn
+		return features;
+	}
+
+	// Gui and events functions
+	void setupGui();
+	void onButtonEvent(ofxDatGuiButtonEvent e);
+	void onToggleEvent(ofxDatGuiToggleEvent e);
+	void onSliderEvent(ofxDatGuiSliderEvent e);
+	void exit(ofEventArgs& e);
+
+private:
+	void updateCellLength();
+	bool updateContours();
+	void updateLakeMesh();
+	void drawOverlay();
+	void exportContours();
+	bool loadSettings();
+	bool saveSettings();
+
+	// shared pointers
+	std::shared_ptr<ZedProjector> zedProjector;
+	std::shared_ptr<ofAppBaseWindow> projWindow;
+
+	// Projector Resolution
+	int projResX, projResY;
+
+	// Analyses
+	WorkerPool pool;
+	ElevationRaster raster;
+	float cellLength; // mm, sand footprint of a raster cell on the base plane
+	unsigned int basePlaneVersion, calibrationVersion; // ZedProjector versions of the cell length
+	ContourExtractor contours;
+	bool drawVectorContours;
+	float contourInterval;
+	WaterSimulation water;
+	bool simulateWater;
+	float waterSpeed;
+	DrainageNetwork drainage;
+	bool drawRivers;
+	float riverThreshold; // Cells
+	DepressionFiller depressions;
+	bool drawLakes;
+	float lakeMinDepth;
+	ofVboMesh lakeMesh; // A vertex per cell corner of the lakes
+	unsigned int lakeMeshVersion; // DepressionFiller version of the mesh
+	bool lakeMeshDirty; // Rebuilt whatever the version, the projection changed
+	std::vector<float> lakeLevels, lakeElevations; // Of the cells of the mesh, NaN out of the lakes
+	std::vector<glm::vec3> cornerSums; // Elevation, water level and number of the lake cells around each cell corner
+	std::vector<int> cornerVertices; // Mesh vertex of each cell corner, -1 out of the lakes
+	std::vector<ofRectangle> lakeTileRects; // Projector extent of the lakes of each raster tile, empty without lakes
+	ErosionSimulation erosion;
+	bool simulateErosion;
+	float erosionSteps; // Steps per frame
+	FeatureDetector features;
+	bool drawFeatures;
+	float featureProminence; // mm
+
+	// Overlay
+	ofFbo fboOverlay;
+	unsigned int overlayVersion;
+	bool overlayDirty; // All of the overlay changed
+	std::vector<ofRectangle> overlayDirtyRects;
+
+	// GUI
+	bool displayGui;
+	ofxDatGui* gui;
+};
@@ -0,0 +1,206 @@
+/***********************************************************************
+WaterSimulation - Shallow water flowing over the sand surface, simulated
+on the CPU with a virtual pipe model.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#include "WaterSimulation.h"
+#include "../ZedProjector/Utils.h"
+
+const float WaterSimulation::stepTime = 1.0f / 60;
+
+static const float gravity = 9810; // mm/s2
+static const float fluxDamping = 0.995f; // Fraction of the flux kept from one step to the next
+static const int maxStepsPerUpdate = 4; // Steps dropped after a stall
+
+WaterSimulation::WaterSimulation()
+	:enabled(false),
+	cellLength(5),
+	speed(0.25f),
+	rainRate(4),
+	evaporationRate(0.05f),
+	wallHeight(1.0e6f),
+	current(0),
+	dt(0),
+	stepRain(0),
+	wet(false),
+	accumulatedTime(0),
+	rainTime(0),
+	version(0),
+	stepTimeTotal(0),
+	numSteps(0)
+{
+}
+
+void WaterSimulation::setup(const ElevationRaster& raster) {
+	cellGrid.setup(raster, wallHeight);
+	size_t size = cellGrid.getSize();
+	water[0].assign(size, 0.0f);
+	water[1].assign(size, 0.0f);
+	current = 0;
+	fluxLeft.assign(size, 0.0f);
+	fluxRight.assign(size, 0.0f);
+	fluxTop.assign(size, 0.0f);
+	fluxBottom.assign(size, 0.0f);
+	bandWet.assign(cellGrid.getNumBands(), 0);
+	wet = false;
+	uploadTexture();
+}
+
+void WaterSimulation::setEnabled(bool senabled) {
+	enabled = senabled;
+	if (!enabled)
+		drain();
+}
+
+void WaterSimulation::rain(float duration) {
+	rainTime = std::max(rainTime, duration);
+}
+
+void WaterSimulation::drain() {
+	rainTime = 0;
+	if (!wet)
+		return;
+	std::fill(water[0].begin(), water[0].end(), 0.0f);
+	std::fill(water[1].begin(), water[1].end(), 0.0f);
+	std::fill(fluxLeft.begin(), fluxLeft.end(), 0.0f);
+	std::fill(fluxRight.begin(), fluxRight.end(), 0.0f);
+	std::fill(fluxTop.begin(), fluxTop.end(), 0.0f);
+	std::fill(fluxBottom.begin(), fluxBottom.end(), 0.0f);
+	std::fill(bandWet.begin(), bandWet.end(), 0);
+	wet = false;
+	if (cellGrid.getTexture().isAllocated())
+		uploadTexture();
+}
+
+bool WaterSimulation::update(const ElevationRaster& raster, WorkerPool& pool, float elapsed) {
+	if (!enabled || raster.getVersion() == 0)
+		return false;
+	if (cellGrid.isResized(raster))
+		setup(raster);
+	// The water of the cells becoming invalid is lost
+	cellGrid.updateTerrain(raster, [this](size_t i, bool valid, float elevation) {
+		if (!valid) {
+			water[current][i] = 0;
+			fluxLeft[i] = fluxRight[i] = fluxTop[i] = fluxBottom[i] = 0;
+		}
+	});
+
+	// Nothing moves in a dry sandbox
+	if (!wet && rainTime <= 0) {
+		accumulatedTime = 0;
+		return false;
+	}
+	accumulatedTime += elapsed;
+	int numDue = static_cast<int>(accumulatedTime / stepTime);
+	if (numDue == 0)
+		return false;
+	accumulatedTime -= numDue*stepTime;
+	numDue = std::min(numDue, maxStepsPerUpdate);
+
+	uint64_t start = ofGetElapsedTimeMicros();
+	for (int i = 0; i < numDue; i++)
+		step(pool);
+	uploadTexture();
+	stepTimeTotal += ofGetElapsedTimeMicros() - start;
+	numSteps += numDue;
+	if (numSteps >= logInterval) {
+		ofLogVerbose("WaterSimulation") << "update(): " << stepTimeTotal / numSteps << " us per step of " << cellGrid.getCols() << "x" << cellGrid.getRows() << " cells";
+		stepTimeTotal = 0;
+		numSteps = 0;
+	}
+	return true;
+}
+
+void WaterSimulation::step(WorkerPool& pool) {
+	dt = stepTime*speed;
+	stepRain = rainTime > 0 ? rainRate*stepTime : 0;
+	rainTime -= stepTime;
+
+	int numBands = bandWet.size();
+	pool.parallelFor(numBands, [this](int band) {
+		updateFlux(band);
+	});
+	pool.parallelFor(numBands, [this](int band) {
+		updateWater(band);
+	});
+	current = 1 - current;
+
+	wet = false;
+	for (auto bandIsWet : bandWet)
+		wet = wet || bandIsWet;
+}
+
+void WaterSimulation::updateFlux(int band) {
+	const float k = dt*gravity*cellLength; // Pipe section area / length
+	PipeFlux::Grid grid = { cellGrid.getTerrain(), nullptr, water[current].data(), fluxLeft.data(), fluxRight.data(), fluxTop.data(), fluxBottom.data(), cellGrid.getCols(), cellGrid.getStride() };
+	int row1 = std::min((band + 1)*ElevationRaster::tileCells, cellGrid.getRows());
+	for (int row = band*ElevationRaster::tileCells; row < row1; row++)
+		PipeFlux::updateRow(grid, row, k, fluxDamping, cellLength*cellLength / dt);
+}
+
+void WaterSimulation::updateWater(int band) {
+	const float volumeToDepth = dt / (cellLength*cellLength);
+	const float added = stepRain - evaporationRate*stepTime;
+	const float* d = water[current].data();
+	float* next = water[1 - current].data();
+	const float* fl = fluxLeft.data();
+	const float* fr = fluxRight.data();
+	const float* ft = fluxTop.data();
+	const float* fb = fluxBottom.data();
+	const float* mask = cellGrid.getMask();
+	const int cols = cellGrid.getCols();
+	const int stride = cellGrid.getStride();
+	float maxDepth = 0;
+	int row1 = std::min((band + 1)*ElevationRaster::tileCells, cellGrid.getRows());
+	for (int row = band*ElevationRaster::tileCells; row < row1; row++) {
+		int x = 1;
+		const int rowStart = (row + 1)*stride;
+#ifdef MAGIC_SAND_SSE2
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 scale = _mm_set1_ps(volumeToDepth);
+		const __m128 addedv = _mm_set1_ps(added);
+		__m128 maxv = zero;
+		for (; x + 4 <= cols + 1; x += 4) {
+			int i = rowStart + x;
+			// Inflows are the outflows of the neighbours towards the cell
+			__m128 in = _mm_add_ps(_mm_add_ps(_mm_loadu_ps(fr + i - 1), _mm_loadu_ps(fl + i + 1)),
+				_mm_add_ps(_mm_loadu_ps(fb + i - stride), _mm_loadu_ps(ft + i + stride)));
+			__m128 out = _mm_add_ps(_mm_add_ps(_mm_loadu_ps(fl + i), _mm_loadu_ps(fr + i)),
+				_mm_add_ps(_mm_loadu_ps(ft + i), _mm_loadu_ps(fb + i)));
+			__m128 depth = _mm_add_ps(_mm_add_ps(_mm_loadu_ps(d + i), _mm_mul_ps(_mm_sub_ps(in, out), scale)), addedv);
+			depth = _mm_mul_ps(_mm_max_ps(depth, zero), _mm_loadu_ps(mask + i));
+			_mm_storeu_ps(next + i, depth);
+			maxv = _mm_max_ps(maxv, depth);
+		}
+		float lanes[4];
+		_mm_storeu_ps(lanes, maxv);
+		maxDepth = std::max(maxDepth, std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3])));
+#endif
+		for (; x <= cols; x++) {
+			int i = rowStart + x;
+			float in = fr[i - 1] + fl[i + 1] + fb[i - stride] + ft[i + stride];
+			float out = fl[i] + fr[i] + ft[i] + fb[i];
+			float depth = std::max(d[i] + (in - out)*volumeToDepth + added, 0.0f)*mask[i];
+			next[i] = depth;
+			maxDepth = std::max(maxDepth, depth);
+		}
+	}
+	bandWet[band] = maxDepth > 0;
+}
+
+void WaterSimulation::uploadTexture() {
+	cellGrid.uploadTexture(water[current].data());
+	version++;
+}
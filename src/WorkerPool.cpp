@@ -0,0 +1,107 @@
+/***********************************************************************
+WorkerPool - A fixed set of threads running the iterations of parallel
+loops.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#include "WorkerPool.h"
+#include <algorithm>
+
+WorkerPool::WorkerPool()
+	:currentTask(nullptr),
+	taskCount(0),
+	nextTask(0),
+	finishedTasks(0),
+	busyWorkers(0),
+	generation(0),
+	stopping(false)
+{
+}
+
+WorkerPool::~WorkerPool() {
+	stop();
+}
+
+void WorkerPool::setup(int numThreads) {
+	stop();
+	if (numThreads <= 0)
+		numThreads = std::max<int>(std::thread::hardware_concurrency(), 1);
+	stopping = false;
+	for (int i = 1; i < numThreads; i++)
+		workers.push_back(std::thread(&WorkerPool::workerLoop, this));
+}
+
+void WorkerPool::stop() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (auto & worker : workers)
+		worker.join();
+	workers.clear();
+}
+
+void WorkerPool::parallelFor(int count, const std::function<void(int)>& task) {
+	if (workers.empty() || count <= 1) {
+		for (int i = 0; i < count; i++)
+			task(i);
+		return;
+	}
+	{
+		// A worker late for the previous loop must leave it before the counters are reset
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [this] { return busyWorkers == 0; });
+		currentTask = &task;
+		taskCount = count;
+		nextTask = 0;
+		finishedTasks = 0;
+		generation++;
+	}
+	wake.notify_all();
+	runTasks(task, count);
+
+	std::unique_lock<std::mutex> lock(mutex);
+	done.wait(lock, [this, count] { return finishedTasks == count && busyWorkers == 0; });
+	currentTask = nullptr;
+}
+
+void WorkerPool::workerLoop() {
+	unsigned int seenGeneration = 0;
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true) {
+		wake.wait(lock, [this, &seenGeneration] { return stopping || generation != seenGeneration; });
+		if (stopping)
+			return;
+		seenGeneration = generation;
+		if (currentTask == nullptr) // Woken after the loop ended
+			continue;
+		const std::function<void(int)>& task = *currentTask;
+		int count = taskCount;
+		busyWorkers++;
+		lock.unlock();
+		runTasks(task, count);
+		lock.lock();
+		busyWorkers--;
+		done.notify_all();
+	}
+}
+
+void WorkerPool::runTasks(const std::function<void(int)>& task, int count) {
+	int i;
+	while ((i = nextTask++) < count) {
+		task(i);
+		finishedTasks++;
+	}
+}
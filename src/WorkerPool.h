@@ -0,0 +1,61 @@
+/***********************************************************************
+WorkerPool - A fixed set of threads running the iterations of parallel
+loops.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// The threads are started once by setup() and sleep between the loops. parallelFor() hands
+// out the iterations one at a time, the calling thread takes part, and returns when all of
+// them are done, so the loop body can use the caller's data without any copy.
+// A pool runs one loop at a time: it is owned by the module using it, not shared between
+// threads.
+class WorkerPool {
+public:
+	WorkerPool();
+	~WorkerPool();
+
+	void setup(int numThreads = 0); // Total threads including the caller, 0 for one per core
+	int getNumThreads() const {
+		return workers.size() + 1;
+	}
+
+	// Calls task(i) for every i in [0, count)
+	void parallelFor(int count, const std::function<void(int)>& task);
+
+private:
+	void stop();
+	void workerLoop();
+	void runTasks(const std::function<void(int)>& task, int count);
+
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable wake; // A loop started or the pool stops
+	std::condition_variable done; // A worker left the current loop
+	const std::function<void(int)>* currentTask; // nullptr between the loops
+	int taskCount;
+	std::atomic<int> nextTask;
+	std::atomic<int> finishedTasks;
+	int busyWorkers; // Workers inside runTasks()
+	unsigned int generation; // Number of loops started
+	bool stopping;
+};
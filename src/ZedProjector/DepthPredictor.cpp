@@ -0,0 +1,208 @@
+/***********************************************************************
+DepthPredictor - Extrapolates the filtered depth frames forward in time
+to compensate the latency between the grab and the projection.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#include "DepthPredictor.h"
+#include "Utils.h"
+
+// Sum and number of the valid (> 0) values of a run of n depth values
+static void sumValid(const float* depth, int n, float& sum, float& count) {
+	int i = 0;
+	sum = 0;
+	count = 0;
+#ifdef MAGIC_SAND_SSE2
+	__m128 zero = _mm_setzero_ps();
+	__m128 one = _mm_set1_ps(1.0f);
+	__m128 sums = zero;
+	__m128 counts = zero;
+	for (; i + 4 <= n; i += 4) {
+		__m128 value = _mm_loadu_ps(depth + i);
+		__m128 valid = _mm_cmpgt_ps(value, zero);
+		sums = _mm_add_ps(sums, _mm_and_ps(valid, value));
+		counts = _mm_add_ps(counts, _mm_and_ps(valid, one));
+	}
+	float s[4], c[4];
+	_mm_storeu_ps(s, sums);
+	_mm_storeu_ps(c, counts);
+	sum = s[0] + s[1] + s[2] + s[3];
+	count = c[0] + c[1] + c[2] + c[3];
+#endif
+	for (; i < n; ++i) {
+		if (depth[i] > 0) {
+			sum += depth[i];
+			count += 1;
+		}
+	}
+}
+
+DepthPredictor::DepthPredictor()
+	:width(0),
+	height(0),
+	tileSize(32),
+	tileCols(0),
+	tileRows(0),
+	horizon(50),
+	maxShift(30),
+	minVelocity(20),
+	smoothing(0.5),
+	lastTime(0),
+	numPredictedTiles(0)
+{
+}
+
+void DepthPredictor::setup(int swidth, int sheight, int stileSize) {
+	width = swidth;
+	height = sheight;
+	tileSize = stileSize;
+	tileCols = (width + tileSize - 1) / tileSize;
+	tileRows = (height + tileSize - 1) / tileSize;
+	sums.assign(tileCols*tileRows, 0);
+	counts.assign(tileCols*tileRows, 0);
+	rowShifts.assign(tileCols, 0);
+	reset();
+}
+
+void DepthPredictor::reset() {
+	lastTime = 0;
+	means.assign(tileCols*tileRows, 0);
+	lastCounts.assign(tileCols*tileRows, 0);
+	velocities.assign(tileCols*tileRows, 0);
+	shifts.assign(tileCols*tileRows, 0);
+	// Keep lastShifts: the tiles shifted in the last frame still have to be sent again
+	if (lastShifts.size() != shifts.size())
+		lastShifts.assign(tileCols*tileRows, 0);
+	numPredictedTiles = 0;
+}
+
+void DepthPredictor::apply(float* depth, uint64_t time, int minX, int maxX, int minY, int maxY, std::vector<unsigned char>& changedTiles) {
+	if (tileCols == 0)
+		return;
+	measureTiles(depth, minX, maxX, minY, maxY);
+	updateVelocities(time);
+
+	// A shift spreads over the neighbouring tiles through the interpolation
+	for (int row = 0; row<tileRows; ++row)
+		for (int col = 0; col<tileCols; ++col)
+			if (shifts[row*tileCols + col] != 0 || lastShifts[row*tileCols + col] != 0)
+				for (int r = std::max(row - 1, 0); r <= std::min(row + 1, tileRows - 1); ++r)
+					for (int c = std::max(col - 1, 0); c <= std::min(col + 1, tileCols - 1); ++c)
+						changedTiles[r*tileCols + c] = 1;
+	lastShifts = shifts;
+	if (numPredictedTiles == 0)
+		return;
+
+	for (int y = minY; y<maxY; ++y) {
+		// Vertical interpolation between the centres of the tile rows around y
+		float t = (y + 0.5f) / tileSize - 0.5f;
+		int r0 = static_cast<int>(std::floor(t));
+		float w = t - r0;
+		int r1 = std::min(r0 + 1, tileRows - 1);
+		r0 = std::max(r0, 0);
+		bool moving = false;
+		for (int col = 0; col<tileCols; ++col) {
+			rowShifts[col] = shifts[r0*tileCols + col] * (1 - w) + shifts[r1*tileCols + col] * w;
+			moving = moving || rowShifts[col] != 0;
+		}
+		if (moving)
+			shiftRow(depth + y*width, minX, maxX);
+	}
+}
+
+void DepthPredictor::measureTiles(const float* depth, int minX, int maxX, int minY, int maxY) {
+	std::fill(sums.begin(), sums.end(), 0.0f);
+	std::fill(counts.begin(), counts.end(), 0.0f);
+	for (int y = minY; y<maxY; ++y) {
+		const float* row = depth + y*width;
+		int tileRow = y / tileSize;
+		for (int col = minX / tileSize; col*tileSize < maxX; ++col) {
+			int x0 = std::max(minX, col*tileSize);
+			int x1 = std::min(maxX, (col + 1)*tileSize);
+			float sum, count;
+			sumValid(row + x0, x1 - x0, sum, count);
+			sums[tileRow*tileCols + col] += sum;
+			counts[tileRow*tileCols + col] += count;
+		}
+	}
+}
+
+void DepthPredictor::updateVelocities(uint64_t time) {
+	// Restart the estimation after a gap in the frames
+	bool restart = lastTime == 0 || time <= lastTime || time - lastTime > 1000000;
+	float dt = restart ? 0 : (time - lastTime) / 1000000.0f; // s
+	lastTime = time;
+
+	float minCount = tileSize*tileSize / 8.0f;
+	numPredictedTiles = 0;
+	for (size_t i = 0; i<sums.size(); ++i) {
+		float count = counts[i];
+		float mean = count > 0 ? sums[i] / count : 0;
+		float& velocity = velocities[i];
+		bool stable = count >= minCount && lastCounts[i] >= minCount && std::abs(count - lastCounts[i]) <= 0.05f*count;
+		if (restart || !stable) {
+			velocity = 0;
+		}
+		else {
+			float measured = (mean - means[i]) / dt;
+			if (std::abs(measured) < minVelocity || measured*velocity < 0)
+				velocity = 0; // Stopped or reversed, extrapolating would overshoot
+			else
+				velocity += smoothing*(measured - velocity);
+		}
+		means[i] = mean;
+		lastCounts[i] = count;
+
+		float shift = 0;
+		if (std::abs(velocity) >= minVelocity) {
+			shift = ofClamp(velocity*horizon / 1000.0f, -maxShift, maxShift);
+			numPredictedTiles++;
+		}
+		shifts[i] = shift;
+	}
+}
+
+void DepthPredictor::shiftRow(float* row, int minX, int maxX) {
+	// Linear interpolation between consecutive tile centres, constant before the first and after the last
+	int half = tileSize / 2;
+	for (int k = -1; k<tileCols; ++k) {
+		int centre = k*tileSize + half;
+		int x0 = std::max(centre, minX);
+		int x1 = std::min(centre + tileSize, maxX);
+		if (x0 >= x1)
+			continue;
+		float s0 = rowShifts[std::max(k, 0)];
+		float s1 = rowShifts[std::min(k + 1, tileCols - 1)];
+		if (s0 == 0 && s1 == 0)
+			continue;
+		float step = (s1 - s0) / tileSize;
+		float start = s0 + step*(x0 + 0.5f - centre);
+		int x = x0;
+#ifdef MAGIC_SAND_SSE2
+		__m128 zero = _mm_setzero_ps();
+		__m128 shift = _mm_setr_ps(start, start + step, start + 2 * step, start + 3 * step);
+		__m128 increment = _mm_set1_ps(4 * step);
+		for (; x + 4 <= x1; x += 4) {
+			__m128 value = _mm_loadu_ps(row + x);
+			__m128 valid = _mm_cmpgt_ps(value, zero);
+			_mm_storeu_ps(row + x, _mm_add_ps(value, _mm_and_ps(valid, shift)));
+			shift = _mm_add_ps(shift, increment);
+		}
+#endif
+		for (; x < x1; ++x) {
+			if (row[x] > 0)
+				row[x] += start + step*(x - x0);
+		}
+	}
+}
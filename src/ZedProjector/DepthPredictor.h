@@ -0,0 +1,74 @@
+/***********************************************************************
+DepthPredictor - Extrapolates the filtered depth frames forward in time
+to compensate the latency between the grab and the projection.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#pragma once
+
+#include "ofMain.h"
+
+// The velocity of the sand is estimated per tile from the mean depth of its valid pixels in
+// consecutive frames, smoothed over a few frames. Each tile is shifted by its velocity times the
+// prediction horizon, clamped to maxShift, and the shifts are bilinearly interpolated between the
+// tile centres so that no seam appears between tiles.
+// The prediction stops as soon as a tile slows down, changes direction or changes its number of
+// valid pixels (hands, border of the ROI), since a wrong prediction is worse than the latency.
+class DepthPredictor {
+public:
+	DepthPredictor();
+
+	void setup(int width, int height, int tileSize);
+	void reset(); // Forget the velocities, e.g. when the filter restarts
+
+	void setHorizon(float shorizon) { // ms
+		horizon = shorizon;
+	}
+	float getHorizon() const {
+		return horizon;
+	}
+	void setMaxShift(float smaxShift) { // mm
+		maxShift = smaxShift;
+	}
+
+	// depth is a width*height frame in mm, 0 marks an invalid pixel. time is the grab time
+	// of the frame in us. The depth is extrapolated in place inside the ROI and the tiles
+	// whose values differ from the measured depth, now or in the previous frame, are set
+	// in changedTiles.
+	void apply(float* depth, uint64_t time, int minX, int maxX, int minY, int maxY, std::vector<unsigned char>& changedTiles);
+
+	int getNumPredictedTiles() const { // Tiles shifted in the last frame
+		return numPredictedTiles;
+	}
+
+private:
+	void measureTiles(const float* depth, int minX, int maxX, int minY, int maxY);
+	void updateVelocities(uint64_t time);
+	void shiftRow(float* row, int minX, int maxX);
+
+	int width, height;
+	int tileSize, tileCols, tileRows;
+	float horizon; // ms
+	float maxShift; // Largest depth change (mm) applied to a tile
+	float minVelocity; // mm/s under which a tile is considered still
+	float smoothing; // Weight of the newest velocity measure
+
+	uint64_t lastTime; // us, 0 before the first frame
+	std::vector<float> sums, counts; // Valid depth sum and count per tile of the current frame
+	std::vector<float> means, lastCounts; // Previous frame
+	std::vector<float> velocities; // mm/s
+	std::vector<float> shifts, lastShifts; // mm, applied per tile
+	std::vector<float> rowShifts; // Shifts of the tile centres interpolated at the current row
+	int numPredictedTiles;
+};
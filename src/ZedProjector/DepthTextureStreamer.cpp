@@ -0,0 +1,365 @@
+/***********************************************************************
+DepthTextureStreamer - Uploads the changed tiles of the filtered depth
+frames to the depth texture through a ring of pixel buffer objects.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#include "DepthTextureStreamer.h"
+#include "Utils.h"
+
+// MSVC does not define __F16C__, every CPU its /arch:AVX2 code runs on has F16C
+#if defined(__F16C__) || (defined(_MSC_VER) && defined(__AVX2__))
+#include <immintrin.h>
+#define DEPTH_STREAMER_F16C
+#endif
+
+// Round to nearest float to half conversion of a value in [0, 1]
+static unsigned short floatToHalf(float f) {
+	uint32_t x;
+	memcpy(&x, &f, sizeof(x));
+	int exponent = static_cast<int>((x >> 23) & 0xff) - 127 + 15;
+	uint32_t mantissa = x & 0x7fffff;
+	if (exponent <= 0) { // Subnormal half
+		if (exponent < -10)
+			return 0;
+		mantissa |= 0x800000;
+		int shift = 14 - exponent;
+		uint32_t h = mantissa >> shift;
+		if ((mantissa >> (shift - 1)) & 1)
+			h++;
+		return static_cast<unsigned short>(h);
+	}
+	uint32_t h = (exponent << 10) | (mantissa >> 13);
+	if (mantissa & 0x1000)
+		h++;
+	return static_cast<unsigned short>(h);
+}
+
+DepthTextureStreamer::DepthTextureStreamer()
+	:width(0),
+	height(0),
+	format(DEPTH_FORMAT_FLOAT32),
+	bytesPerPixel(4),
+	internalFormat(GL_R32F),
+	pixelFormat(GL_RED),
+	pixelType(GL_FLOAT),
+	depthMin(0),
+	depthMax(1),
+	async(true),
+	supported(false),
+	timerSupported(false),
+	fullUploadNeeded(true),
+	currentSlot(0),
+	logInterval(300),
+	numUploads(0),
+	cpuTime(0),
+	gpuTime(0),
+	numGpuSamples(0),
+	fenceWaitTime(0),
+	uploadedPixels(0)
+{
+}
+
+DepthTextureStreamer::~DepthTextureStreamer() {
+	releaseSlots();
+}
+
+void DepthTextureStreamer::releaseSlots() {
+	for (auto & slot : slots) {
+		if (slot.fence != 0)
+			glDeleteSync(slot.fence);
+		if (slot.query != 0)
+			glDeleteQueries(1, &slot.query);
+	}
+	slots.clear();
+}
+
+void DepthTextureStreamer::setup(int swidth, int sheight, DepthFormat sformat, int numBuffers) {
+	width = swidth;
+	height = sheight;
+	format = sformat;
+	bool redSupported = GLEW_VERSION_3_0 || GLEW_ARB_texture_rg;
+	bool half16Supported = GLEW_VERSION_3_0 || (GLEW_ARB_texture_rg && GLEW_ARB_texture_float && GLEW_ARB_half_float_pixel);
+	if ((format == DEPTH_FORMAT_HALF_FLOAT && !half16Supported) || (format == DEPTH_FORMAT_UNORM16 && !redSupported)) {
+		ofLogWarning("DepthTextureStreamer") << "setup(): 16-bit depth textures not supported, using 32-bit float";
+		format = DEPTH_FORMAT_FLOAT32;
+	}
+	switch (format) {
+	case DEPTH_FORMAT_HALF_FLOAT:
+		bytesPerPixel = 2;
+		internalFormat = GL_R16F;
+		pixelType = GL_HALF_FLOAT;
+		break;
+	case DEPTH_FORMAT_UNORM16:
+		bytesPerPixel = 2;
+		internalFormat = GL_R16;
+		pixelType = GL_UNSIGNED_SHORT;
+		break;
+	default:
+		bytesPerPixel = 4;
+		internalFormat = GL_R32F;
+		pixelType = GL_FLOAT;
+		break;
+	}
+	pixelFormat = GL_RED;
+	if (format == DEPTH_FORMAT_FLOAT32 && !redSupported) {
+		// GL 2 without red textures, the luminance is sampled the same way through .r
+		internalFormat = GL_LUMINANCE32F_ARB;
+		pixelFormat = GL_LUMINANCE;
+	}
+	supported = (GLEW_VERSION_2_1 || GLEW_ARB_pixel_buffer_object) && (GLEW_VERSION_3_0 || GLEW_ARB_map_buffer_range)
+		&& (GLEW_VERSION_3_2 || GLEW_ARB_sync);
+	timerSupported = GLEW_VERSION_3_3 || GLEW_ARB_timer_query;
+	ofLogVerbose("DepthTextureStreamer") << "setup(): " << bytesPerPixel * 8 << "-bit depth texture, PBO streaming " << (supported ? "available" : "not available")
+		<< ", timer queries " << (timerSupported ? "available" : "not available");
+
+	releaseSlots();
+	slots.resize(numBuffers);
+	for (auto & slot : slots) {
+		slot.fence = 0;
+		slot.query = 0;
+		slot.queryPending = false;
+		if (supported)
+			slot.pbo.allocate(width*height*bytesPerPixel, GL_STREAM_DRAW);
+		if (timerSupported)
+			glGenQueries(1, &slot.query);
+	}
+	if (format != DEPTH_FORMAT_FLOAT32)
+		staging.resize(width*height*bytesPerPixel);
+	else
+		staging.clear();
+	currentSlot = 0;
+	fullUploadNeeded = true;
+}
+
+void DepthTextureStreamer::allocateTexture(ofTexture& texture) {
+	texture.allocate(width, height, internalFormat);
+	texture.setTextureMinMagFilter(GL_LINEAR, GL_LINEAR); // Decimated meshes sample between the depth pixels
+	fullUploadNeeded = true;
+}
+
+void DepthTextureStreamer::encodeRow(const float* src, unsigned char* dst, int count) const {
+	if (format == DEPTH_FORMAT_FLOAT32) {
+		memcpy(dst, src, count*sizeof(float));
+		return;
+	}
+	// Normalize over the quantization range, clamped to [0, 1]
+	const float scale = depthMax != depthMin ? 1.0f / (depthMax - depthMin) : 0.0f;
+	const float offset = -depthMin*scale;
+	unsigned short* out = reinterpret_cast<unsigned short*>(dst);
+	int i = 0;
+	if (format == DEPTH_FORMAT_HALF_FLOAT) {
+#ifdef DEPTH_STREAMER_F16C
+		const __m256 vscale = _mm256_set1_ps(scale);
+		const __m256 voffset = _mm256_set1_ps(offset);
+		const __m256 zero = _mm256_setzero_ps();
+		const __m256 one = _mm256_set1_ps(1.0f);
+		for (; i + 8 <= count; i += 8) {
+			__m256 v = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(src + i), vscale), voffset);
+			v = _mm256_min_ps(_mm256_max_ps(v, zero), one);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm256_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT));
+		}
+#endif
+		for (; i < count; i++)
+			out[i] = floatToHalf(ofClamp(src[i] * scale + offset, 0, 1));
+	}
+	else {
+#ifdef MAGIC_SAND_SSE2
+		// Pack to unsigned 16-bit through the signed pack by shifting the range by 32768
+		const __m128 vscale = _mm_set1_ps(scale*65535.0f);
+		const __m128 voffset = _mm_set1_ps(offset*65535.0f - 32768.0f);
+		const __m128 vmin = _mm_set1_ps(-32768.0f);
+		const __m128 vmax = _mm_set1_ps(32767.0f);
+		const __m128i bias = _mm_set1_epi16(static_cast<short>(0x8000));
+		for (; i + 8 <= count; i += 8) {
+			__m128 a = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(src + i), vscale), voffset);
+			__m128 b = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(src + i + 4), vscale), voffset);
+			a = _mm_min_ps(_mm_max_ps(a, vmin), vmax);
+			b = _mm_min_ps(_mm_max_ps(b, vmin), vmax);
+			__m128i packed = _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_xor_si128(packed, bias));
+		}
+#endif
+		for (; i < count; i++)
+			out[i] = static_cast<unsigned short>(ofClamp(src[i] * scale + offset, 0, 1)*65535.0f + 0.5f);
+	}
+}
+
+void DepthTextureStreamer::upload(ofTexture& texture, const DepthFrame& frame) {
+	uint64_t start = ofGetElapsedTimeMicros();
+	currentSlot = (currentSlot + 1) % slots.size();
+	Slot& slot = slots[currentSlot];
+	collectTimer(slot);
+
+	const float* data = frame.pixels.getData();
+	if (!isAsync()) {
+		// Reference path: synchronous full frame upload from client memory
+		rects.assign(1, ofRectangle(0, 0, width, height));
+		const unsigned char* src = reinterpret_cast<const unsigned char*>(data);
+		if (format != DEPTH_FORMAT_FLOAT32) {
+			encodeRow(data, staging.data(), width*height);
+			src = staging.data();
+		}
+		beginTimer(slot);
+		uploadRects(texture, src);
+		endTimer(slot);
+	}
+	else {
+		if (fullUploadNeeded || frame.dirtyTiles.empty()) {
+			rects.assign(1, ofRectangle(0, 0, width, height));
+			fullUploadNeeded = false;
+		}
+		else {
+			collectRects(frame);
+		}
+
+		if (!rects.empty()) {
+			// Wait until the GPU has read the previous content of this PBO
+			if (slot.fence != 0) {
+				uint64_t waitStart = ofGetElapsedTimeMicros();
+				glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+				glDeleteSync(slot.fence);
+				slot.fence = 0;
+				fenceWaitTime += ofGetElapsedTimeMicros() - waitStart;
+			}
+
+			// The PBO has the layout of the frame, only the dirty rectangles are encoded into it
+			unsigned char* mapped = slot.pbo.mapRange<unsigned char>(0, width*height*bytesPerPixel, GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+			if (mapped != nullptr) {
+				for (auto & rect : rects) {
+					int x = rect.x, w = rect.width;
+					for (int y = rect.y; y < rect.y + rect.height; y++)
+						encodeRow(data + y*width + x, mapped + (y*width + x)*bytesPerPixel, w);
+				}
+				slot.pbo.unmap();
+
+				beginTimer(slot);
+				slot.pbo.bind(GL_PIXEL_UNPACK_BUFFER);
+				uploadRects(texture, nullptr);
+				slot.pbo.unbind(GL_PIXEL_UNPACK_BUFFER);
+				endTimer(slot);
+				slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			}
+			else {
+				ofLogWarning("DepthTextureStreamer") << "upload(): Could not map the pixel buffer, uploading the whole frame from client memory";
+				rects.assign(1, ofRectangle(0, 0, width, height));
+				const unsigned char* src = reinterpret_cast<const unsigned char*>(data);
+				if (format != DEPTH_FORMAT_FLOAT32) {
+					encodeRow(data, staging.data(), width*height);
+					src = staging.data();
+				}
+				uploadRects(texture, src);
+			}
+		}
+	}
+
+	cpuTime += ofGetElapsedTimeMicros() - start;
+	if (++numUploads == logInterval)
+		logStats();
+}
+
+void DepthTextureStreamer::collectRects(const DepthFrame& frame) {
+	const int tileSize = DepthFrame::tileSize;
+	rects.clear();
+	size_t open = 0; // Rectangles before this index can not be extended anymore
+	for (int row = 0; row < frame.tileRows; row++) {
+		size_t rowEnd = rects.size();
+		int col = 0;
+		while (col < frame.tileCols) {
+			if (!frame.isTileDirty(col, row)) {
+				col++;
+				continue;
+			}
+			int runStart = col;
+			while (col < frame.tileCols && frame.isTileDirty(col, row))
+				col++;
+			ofRectangle run(runStart*tileSize, row*tileSize, (col - runStart)*tileSize, tileSize);
+			run.width = std::min(run.width, width - run.x);
+			run.height = std::min(run.height, height - run.y);
+
+			// Extend a rectangle reaching the previous tile row over the same columns
+			bool merged = false;
+			for (size_t i = open; i < rowEnd && !merged; i++) {
+				if (rects[i].x == run.x && rects[i].width == run.width && rects[i].getMaxY() == run.y) {
+					rects[i].height += run.height;
+					merged = true;
+				}
+			}
+			if (!merged)
+				rects.push_back(run);
+		}
+		// Skip the leading rectangles that were not extended on this row
+		while (open < rects.size() && rects[open].getMaxY() < std::min((row + 1)*tileSize, height))
+			open++;
+	}
+}
+
+void DepthTextureStreamer::uploadRects(ofTexture& texture, const unsigned char* data) {
+	// data is the frame in client memory, or nullptr to read from the bound PBO
+	const ofTextureData& texData = texture.getTextureData();
+	glBindTexture(texData.textureTarget, texData.textureID);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, bytesPerPixel);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, width);
+	for (auto & rect : rects) {
+		size_t offset = (static_cast<size_t>(rect.y)*width + static_cast<size_t>(rect.x))*bytesPerPixel;
+		const void* src = reinterpret_cast<const void*>(reinterpret_cast<uintptr_t>(data) + offset);
+		glTexSubImage2D(texData.textureTarget, 0, rect.x, rect.y, rect.width, rect.height, pixelFormat, pixelType, src);
+		uploadedPixels += static_cast<uint64_t>(rect.width*rect.height);
+	}
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glBindTexture(texData.textureTarget, 0);
+}
+
+void DepthTextureStreamer::beginTimer(Slot& slot) {
+	if (timerSupported && !slot.queryPending)
+		glBeginQuery(GL_TIME_ELAPSED, slot.query);
+}
+
+void DepthTextureStreamer::endTimer(Slot& slot) {
+	if (timerSupported && !slot.queryPending) {
+		glEndQuery(GL_TIME_ELAPSED);
+		slot.queryPending = true;
+	}
+}
+
+void DepthTextureStreamer::collectTimer(Slot& slot) {
+	// The query of this slot was issued numBuffers uploads ago, its result is usually
+	// available and reading it does not stall
+	if (!slot.queryPending)
+		return;
+	GLint available = 0;
+	glGetQueryObjectiv(slot.query, GL_QUERY_RESULT_AVAILABLE, &available);
+	if (available) {
+		GLuint64 elapsed = 0;
+		glGetQueryObjectui64v(slot.query, GL_QUERY_RESULT, &elapsed);
+		gpuTime += elapsed;
+		numGpuSamples++;
+		slot.queryPending = false;
+	}
+}
+
+void DepthTextureStreamer::logStats() {
+	ofLogVerbose("DepthTextureStreamer") << "upload(): " << (isAsync() ? "async dirty tiles" : "sync full frame") << ", " << bytesPerPixel * 8 << "-bit"
+		<< ": main thread " << cpuTime / numUploads << " us"
+		<< ", GPU upload " << (numGpuSamples > 0 ? gpuTime / numGpuSamples / 1000 : 0) << " us"
+		<< ", fence waits " << fenceWaitTime / numUploads << " us"
+		<< ", uploaded " << 100 * uploadedPixels / (static_cast<uint64_t>(numUploads)*width*height) << "% of the frame";
+	numUploads = 0;
+	cpuTime = 0;
+	gpuTime = 0;
+	numGpuSamples = 0;
+	fenceWaitTime = 0;
+	uploadedPixels = 0;
+}
@@ -0,0 +1,121 @@
+/***********************************************************************
+DepthTextureStreamer - Uploads the changed tiles of the filtered depth
+frames to the depth texture through a ring of pixel buffer objects.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#pragma once
+
+#include "ofMain.h"
+#include "ZedGrabber.h"
+
+// Each upload writes the dirty tiles of a DepthFrame into the next PBO of the ring and
+// transfers them with glTexSubImage2D from that PBO, so the driver copies the data
+// asynchronously. A fence per PBO prevents overwriting data the GPU has not read yet.
+// Dirty tiles of a tile row are merged into runs, and runs spanning the same columns on
+// consecutive tile rows into a single rectangle.
+// When async is off, or PBOs, buffer range mapping and fences are not available, the whole
+// frame is uploaded synchronously as before, which gives the reference for the timing statistics.
+// The dirty tiles are relative to the previous DepthFrame, so every received frame has to be
+// uploaded: a frame that is dropped must have its dirty tiles merged into the next one, or be
+// followed by invalidate().
+// The 16-bit formats store the depth normalized over the quantization range (the native
+// scale of the depth image); getDepthTransformation() gives the decoding for the shaders.
+class DepthTextureStreamer {
+public:
+	enum DepthFormat {
+		DEPTH_FORMAT_FLOAT32 = 0, // Depth in mm
+		DEPTH_FORMAT_HALF_FLOAT = 1, // Normalized depth as half float (R16F)
+		DEPTH_FORMAT_UNORM16 = 2 // Normalized depth as 16-bit unsigned normalized (R16)
+	};
+
+	DepthTextureStreamer();
+	~DepthTextureStreamer();
+
+	void setup(int width, int height, DepthFormat format = DEPTH_FORMAT_FLOAT32, int numBuffers = 3);
+	void allocateTexture(ofTexture& texture);
+	void upload(ofTexture& texture, const DepthFrame& frame); // Every frame received, in order
+
+	void setQuantizationRange(float sdepthMin, float sdepthMax) {
+		depthMin = sdepthMin;
+		depthMax = sdepthMax;
+		fullUploadNeeded = true;
+	}
+	DepthFormat getFormat() const {
+		return format;
+	}
+	glm::vec2 getDepthTransformation() const { // depth = sample * x + y
+		if (format == DEPTH_FORMAT_FLOAT32)
+			return glm::vec2(1, 0);
+		return glm::vec2(depthMax - depthMin, depthMin);
+	}
+
+	void setAsync(bool sasync) {
+		async = sasync;
+		fullUploadNeeded = true;
+	}
+	bool isAsync() const {
+		return async && supported;
+	}
+	void invalidate() { // Next upload sends the whole frame
+		fullUploadNeeded = true;
+	}
+
+	// Statistics since the last log, logged every logInterval uploads
+	void setLogInterval(int slogInterval) {
+		logInterval = slogInterval;
+	}
+
+private:
+	struct Slot {
+		ofBufferObject pbo;
+		GLsync fence;
+		GLuint query;
+		bool queryPending;
+	};
+
+	void releaseSlots();
+	void uploadRects(ofTexture& texture, const unsigned char* data);
+	void encodeRow(const float* src, unsigned char* dst, int count) const;
+	void collectRects(const DepthFrame& frame);
+	void beginTimer(Slot& slot);
+	void endTimer(Slot& slot);
+	void collectTimer(Slot& slot);
+	void logStats();
+
+	int width, height;
+	DepthFormat format;
+	int bytesPerPixel;
+	GLint internalFormat;
+	GLenum pixelFormat; // GL_RED, or GL_LUMINANCE on GL 2 without ARB_texture_rg
+	GLenum pixelType;
+	float depthMin, depthMax; // Quantization range of the 16-bit formats, in mm
+	std::vector<unsigned char> staging; // Encoded frame of the synchronous path
+	bool async;
+	bool supported; // PBOs, glMapBufferRange and fences are available
+	bool timerSupported;
+	bool fullUploadNeeded;
+	std::vector<Slot> slots;
+	int currentSlot;
+	std::vector<ofRectangle> rects; // Rectangles to upload, in Zed pixels
+
+	// Statistics
+	int logInterval;
+	int numUploads;
+	uint64_t cpuTime; // us spent in upload() on the main thread
+	uint64_t gpuTime; // ns measured by the GL timer queries
+	int numGpuSamples;
+	uint64_t fenceWaitTime; // us spent waiting for a PBO to be released by the GPU
+	uint64_t uploadedPixels;
+};
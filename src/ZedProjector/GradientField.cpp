@@ -0,0 +1,172 @@
+/***********************************************************************
+GradientField - GradientField computes the sandbox gradient from the
+filtered depth frame and reduces it into a pyramid of cell resolutions.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#include "GradientField.h"
+
+GradientField::GradientField()
+	:width(0),
+	height(0),
+	baseResolution(5),
+	numLevels(0),
+	pixelScale(1),
+	maxGradient(1000),
+	frameNumber(0)
+{
+}
+
+void GradientField::setup(int swidth, int sheight, int sbaseResolution, int snumLevels, int spixelScale) {
+	width = swidth;
+	height = sheight;
+	baseResolution = sbaseResolution;
+	numLevels = snumLevels;
+	pixelScale = spixelScale;
+
+	levels.resize(numLevels);
+	int cols = width / baseResolution;
+	int rows = height / baseResolution;
+	for (int i = 0; i < numLevels; i++) {
+		Level& level = levels[i];
+		level.cols = cols;
+		level.rows = rows;
+		level.sumX.assign(cols*rows, 0);
+		level.sumY.assign(cols*rows, 0);
+		level.count.assign(cols*rows, 0);
+		level.field.assign(cols*rows, glm::vec2(0));
+		cols /= 2;
+		rows /= 2;
+	}
+
+	rowGx.assign(width, 0);
+	rowGy.assign(width, 0);
+	rowValid.assign(width, 0);
+	ofLogVerbose("GradientField") << "setup(): " << numLevels << " levels from " << getResolution(0) << " px cells";
+}
+
+void GradientField::compute(const float* depth, int minX, int maxX, int minY, int maxY) {
+	Level& base = levels[0];
+	std::fill(base.sumX.begin(), base.sumX.end(), 0.0f);
+	std::fill(base.sumY.begin(), base.sumY.end(), 0.0f);
+	std::fill(base.count.begin(), base.count.end(), 0.0f);
+
+	// The 3x3 kernel needs one pixel of margin inside the frame
+	int x0 = std::max(minX, 1);
+	int x1 = std::min(maxX, width - 1);
+	int y0 = std::max(minY, 1);
+	int y1 = std::min(maxY, height - 1);
+
+	// Gradients are expressed per Zed pixel whatever the processing resolution
+	const float kernelScale = -0.125f / pixelScale;
+	float* gx = rowGx.data();
+	float* gy = rowGy.data();
+	float* valid = rowValid.data();
+	for (int y = y0; y < y1; y++) {
+		const float* r0 = depth + (y - 1)*width;
+		const float* r1 = depth + y*width;
+		const float* r2 = depth + (y + 1)*width;
+
+		// Branch free loop so that the compiler can vectorize it (SSE/AVX or NEON)
+		for (int x = x0; x < x1; x++) {
+			float v = ((r0[x - 1] > 0) & (r0[x] > 0) & (r0[x + 1] > 0) &
+				(r1[x - 1] > 0) & (r1[x] > 0) & (r1[x + 1] > 0) &
+				(r2[x - 1] > 0) & (r2[x] > 0) & (r2[x + 1] > 0)) ? 1.0f : 0.0f;
+			float sx = (r0[x + 1] + 2.0f*r1[x + 1] + r2[x + 1]) - (r0[x - 1] + 2.0f*r1[x - 1] + r2[x - 1]);
+			float sy = (r2[x - 1] + 2.0f*r2[x] + r2[x + 1]) - (r0[x - 1] + 2.0f*r0[x] + r0[x + 1]);
+			// The Sobel kernel weights sum to 8, the elevation slope is opposite to the depth slope
+			gx[x] = kernelScale*sx*v;
+			gy[x] = kernelScale*sy*v;
+			valid[x] = v;
+		}
+		accumulateRow(y / baseResolution, x0, x1);
+	}
+
+	for (int i = 1; i < numLevels; i++)
+		reduceLevel(i);
+	for (int i = 0; i < numLevels; i++)
+		updateField(i);
+}
+
+void GradientField::accumulateRow(int cellRow, int x0, int x1) {
+	Level& base = levels[0];
+	if (cellRow >= base.rows)
+		return;
+	float* sumX = base.sumX.data() + cellRow*base.cols;
+	float* sumY = base.sumY.data() + cellRow*base.cols;
+	float* count = base.count.data() + cellRow*base.cols;
+	for (int c = x0 / baseResolution; c < base.cols && c*baseResolution < x1; c++) {
+		int xs = std::max(c*baseResolution, x0);
+		int xe = std::min((c + 1)*baseResolution, x1);
+		float sx = 0, sy = 0, n = 0;
+		for (int x = xs; x < xe; x++) {
+			sx += rowGx[x];
+			sy += rowGy[x];
+			n += rowValid[x];
+		}
+		sumX[c] += sx;
+		sumY[c] += sy;
+		count[c] += n;
+	}
+}
+
+void GradientField::reduceLevel(int i) {
+	const Level& fine = levels[i - 1];
+	Level& coarse = levels[i];
+	for (int y = 0; y < coarse.rows; y++) {
+		const int f0 = 2 * y*fine.cols;
+		const int f1 = f0 + fine.cols;
+		for (int x = 0; x < coarse.cols; x++) {
+			int ind = y*coarse.cols + x;
+			coarse.sumX[ind] = fine.sumX[f0 + 2 * x] + fine.sumX[f0 + 2 * x + 1] + fine.sumX[f1 + 2 * x] + fine.sumX[f1 + 2 * x + 1];
+			coarse.sumY[ind] = fine.sumY[f0 + 2 * x] + fine.sumY[f0 + 2 * x + 1] + fine.sumY[f1 + 2 * x] + fine.sumY[f1 + 2 * x + 1];
+			coarse.count[ind] = fine.count[f0 + 2 * x] + fine.count[f0 + 2 * x + 1] + fine.count[f1 + 2 * x] + fine.count[f1 + 2 * x + 1];
+		}
+	}
+}
+
+void GradientField::updateField(int i) {
+	Level& level = levels[i];
+	for (int ind = 0; ind < level.cols*level.rows; ind++) {
+		if (level.count[ind] > 0) {
+			glm::vec2 g(level.sumX[ind] / level.count[ind], level.sumY[ind] / level.count[ind]);
+			float lgth = glm::length(g);
+			if (lgth > maxGradient)
+				g *= maxGradient / lgth;
+			level.field[ind] = g;
+		}
+		else {
+			level.field[ind] = glm::vec2(0);
+		}
+	}
+}
+
+int GradientField::getLevel(int resolution) const {
+	int best = 0;
+	for (int i = 1; i < numLevels; i++) {
+		if (std::abs(getResolution(i) - resolution) < std::abs(getResolution(best) - resolution))
+			best = i;
+	}
+	return best;
+}
+
+glm::vec2 GradientField::getGradient(float x, float y, int i) const {
+	const Level& level = levels[i];
+	int res = getResolution(i);
+	int col = static_cast<int>(floor(x / res));
+	int row = static_cast<int>(floor(y / res));
+	if (col < 0 || row < 0 || col >= level.cols || row >= level.rows)
+		return glm::vec2(0);
+	return level.field[row*level.cols + col];
+}
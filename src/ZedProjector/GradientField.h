@@ -0,0 +1,93 @@
+/***********************************************************************
+GradientField - GradientField computes the sandbox gradient from the
+filtered depth frame and reduces it into a pyramid of cell resolutions.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#pragma once
+
+#include "ofMain.h"
+
+// A single linear pass computes a full resolution Sobel gradient of the depth frame
+// and accumulates it into cells of baseResolution pixels. Each coarser level is then
+// reduced from the previous one by summing 2x2 cells, so every resolution
+// baseResolution * 2^level is available without reprocessing the frame.
+// Gradients are expressed as elevation change per pixel (opposite of the depth slope).
+// The grabber publishes GradientField objects as immutable snapshots of a given frame.
+class GradientField {
+public:
+	GradientField();
+
+	// width and height of the processed frame, whose pixels cover pixelScale x pixelScale Zed pixels
+	void setup(int width, int height, int baseResolution = 5, int numLevels = 5, int pixelScale = 1);
+	void setMaxGradient(float smaxGradient) {
+		maxGradient = smaxGradient;
+	}
+	void setFrameNumber(unsigned int sframeNumber) {
+		frameNumber = sframeNumber;
+	}
+	unsigned int getFrameNumber() const {
+		return frameNumber;
+	}
+
+	// depth is a width*height frame, 0 marks an invalid pixel
+	void compute(const float* depth, int minX, int maxX, int minY, int maxY);
+
+	// Level whose cell size is the closest to the requested resolution
+	int getLevel(int resolution) const;
+	int snapResolution(int resolution) const {
+		return getResolution(getLevel(resolution));
+	}
+
+	int getNumLevels() const {
+		return numLevels;
+	}
+	int getResolution(int level) const { // In Zed pixels
+		return (baseResolution*pixelScale) << level;
+	}
+	int getCols(int level) const {
+		return levels[level].cols;
+	}
+	int getRows(int level) const {
+		return levels[level].rows;
+	}
+	const glm::vec2* getField(int level) const {
+		return levels[level].field.data();
+	}
+
+	// Cell gradient at Zed pixel coordinate x, y
+	glm::vec2 getGradient(float x, float y, int level) const;
+
+private:
+	struct Level {
+		int cols, rows;
+		std::vector<float> sumX, sumY, count; // Accumulated gradients and number of valid pixels per cell
+		std::vector<glm::vec2> field; // Mean gradient per cell
+	};
+
+	void accumulateRow(int cellRow, int minX, int maxX);
+	void reduceLevel(int level);
+	void updateField(int level);
+
+	int width, height;
+	int baseResolution; // In processed pixels
+	int numLevels;
+	int pixelScale;
+	float maxGradient;
+	unsigned int frameNumber; // Depth frame the field was computed from
+	std::vector<Level> levels;
+
+	// Row buffers of the Sobel pass
+	std::vector<float> rowGx, rowGy, rowValid;
+};
@@ -0,0 +1,196 @@
+/***********************************************************************
+ShadeMap - Surface normals and hillshade of the filtered depth frames.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#include "ShadeMap.h"
+#include "Utils.h"
+
+// RGBA texel of a unit normal and a hillshade in [0, 1]
+static uint32_t packTexel(float nx, float ny, float nz, float shade) {
+	uint32_t r = static_cast<uint32_t>(ofClamp(nx*127.5f + 127.5f, 0, 255) + 0.5f);
+	uint32_t g = static_cast<uint32_t>(ofClamp(ny*127.5f + 127.5f, 0, 255) + 0.5f);
+	uint32_t b = static_cast<uint32_t>(ofClamp(nz*127.5f + 127.5f, 0, 255) + 0.5f);
+	uint32_t a = static_cast<uint32_t>(ofClamp(shade*255.0f, 0, 255) + 0.5f);
+	return r | (g << 8) | (b << 16) | (a << 24);
+}
+
+ShadeMap::ShadeMap()
+	:width(0),
+	height(0),
+	tileSize(32),
+	tileCols(0),
+	tileRows(0),
+	focalLength(700),
+	numPendingTiles(0),
+	fullUpdate(true)
+{
+	setSun(315, 45);
+}
+
+void ShadeMap::setup(int swidth, int sheight, int stileSize) {
+	width = swidth;
+	height = sheight;
+	tileSize = stileSize;
+	tileCols = (width + tileSize - 1) / tileSize;
+	tileRows = (height + tileSize - 1) / tileSize;
+	depth.assign(width*height, 0.0f);
+	pendingTiles.assign(tileCols*tileRows, 0);
+	numPendingTiles = 0;
+	fullUpdate = true;
+}
+
+void ShadeMap::setSun(float azimuth, float elevation) {
+	float a = ofDegToRad(azimuth);
+	float e = ofDegToRad(elevation);
+	sun = glm::vec3(std::sin(a)*std::cos(e), -std::cos(a)*std::cos(e), std::sin(e));
+}
+
+void ShadeMap::invalidate() {
+	fullUpdate = true;
+}
+
+uint32_t ShadeMap::getFlatTexel(float sunElevation) {
+	return packTexel(0, 0, 1, std::sin(ofDegToRad(sunElevation)));
+}
+
+void ShadeMap::store(const float* frame, const std::vector<unsigned char>& dirtyTiles) {
+	if (fullUpdate) {
+		std::copy(frame, frame + width*height, depth.begin());
+		std::fill(pendingTiles.begin(), pendingTiles.end(), 1);
+		numPendingTiles = tileCols*tileRows;
+		fullUpdate = false;
+		return;
+	}
+	for (int tile = 0; tile<tileCols*tileRows; ++tile) {
+		if (!dirtyTiles[tile])
+			continue;
+		int x0 = (tile % tileCols)*tileSize;
+		int x1 = std::min(x0 + tileSize, width);
+		int y0 = (tile / tileCols)*tileSize;
+		int y1 = std::min(y0 + tileSize, height);
+		for (int y = y0; y<y1; ++y)
+			std::copy(frame + y*width + x0, frame + y*width + x1, depth.begin() + y*width + x0);
+		if (!pendingTiles[tile]) {
+			pendingTiles[tile] = 1;
+			numPendingTiles++;
+		}
+	}
+}
+
+void ShadeMap::update(ShadeFrame& frame) {
+	// The frame vectors keep their capacity when recycled
+	frame.tiles.clear();
+	frame.texels.resize(static_cast<size_t>(numPendingTiles)*tileSize*tileSize);
+	uint32_t* texels = frame.texels.data();
+	for (int tile = 0; tile<tileCols*tileRows; ++tile) {
+		if (!pendingTiles[tile])
+			continue;
+		int x0 = (tile % tileCols)*tileSize;
+		int x1 = std::min(x0 + tileSize, width);
+		int y0 = (tile / tileCols)*tileSize;
+		int y1 = std::min(y0 + tileSize, height);
+		for (int y = y0; y<y1; ++y) {
+			const float* row = depth.data() + y*width;
+			const float* above = depth.data() + std::max(y - 1, 0)*width;
+			const float* below = depth.data() + std::min(y + 1, height - 1)*width;
+			shadeRow(above, row, below, x0, x1, texels + (y - y0)*tileSize);
+		}
+		texels += tileSize*tileSize;
+		frame.tiles.push_back(tile);
+		pendingTiles[tile] = 0;
+	}
+	numPendingTiles = 0;
+}
+
+uint32_t ShadeMap::shadePixel(const float* above, const float* row, const float* below, int x) const {
+	float c = row[x];
+	if (!(c > 0))
+		return packTexel(0, 0, 1, sun.z);
+	int xm = std::max(x - 1, 0);
+	int xp = std::min(x + 1, width - 1);
+	auto value = [c](float d) {
+		return d > 0 ? d : c;
+	};
+	float gx = (value(above[xp]) + 2 * value(row[xp]) + value(below[xp])) - (value(above[xm]) + 2 * value(row[xm]) + value(below[xm]));
+	float gy = (value(below[xm]) + 2 * value(below[x]) + value(below[xp])) - (value(above[xm]) + 2 * value(above[x]) + value(above[xp]));
+	// Elevation slopes, the elevation increases when the depth decreases
+	float scale = -focalLength / (8 * c);
+	float sx = gx*scale;
+	float sy = gy*scale;
+	float invLength = 1.0f / std::sqrt(sx*sx + sy*sy + 1);
+	float nx = -sx*invLength;
+	float ny = -sy*invLength;
+	float nz = invLength;
+	return packTexel(nx, ny, nz, std::max(nx*sun.x + ny*sun.y + nz*sun.z, 0.0f));
+}
+
+void ShadeMap::shadeRow(const float* above, const float* row, const float* below, int x0, int x1, uint32_t* dst) const {
+	int x = x0;
+	// The first and last pixels of the frame have a clamped neighbourhood
+	if (x == 0) {
+		dst[0] = shadePixel(above, row, below, 0);
+		x++;
+	}
+#ifdef MAGIC_SAND_SSE2
+	__m128 zero = _mm_setzero_ps();
+	__m128 one = _mm_set1_ps(1.0f);
+	__m128 half = _mm_set1_ps(127.5f);
+	__m128 maxValue = _mm_set1_ps(255.0f);
+	__m128 sunX = _mm_set1_ps(sun.x);
+	__m128 sunY = _mm_set1_ps(sun.y);
+	__m128 sunZ = _mm_set1_ps(sun.z);
+	__m128 kernelScale = _mm_set1_ps(-focalLength / 8);
+	__m128i flat = _mm_set1_epi32(static_cast<int>(packTexel(0, 0, 1, sun.z)));
+	int end = std::min(x1, width - 1); // The right neighbours of the last group are loaded
+	for (; x + 4 <= end; x += 4) {
+		__m128 c = _mm_loadu_ps(row + x);
+		__m128 valid = _mm_cmpgt_ps(c, zero);
+		auto value = [&](const float* p) { // Invalid neighbours take the center depth
+			__m128 d = _mm_loadu_ps(p);
+			__m128 m = _mm_cmpgt_ps(d, zero);
+			return _mm_or_ps(_mm_and_ps(m, d), _mm_andnot_ps(m, c));
+		};
+		__m128 a0 = value(above + x - 1), a1 = value(above + x), a2 = value(above + x + 1);
+		__m128 r0 = value(row + x - 1), r2 = value(row + x + 1);
+		__m128 b0 = value(below + x - 1), b1 = value(below + x), b2 = value(below + x + 1);
+		__m128 gx = _mm_sub_ps(_mm_add_ps(_mm_add_ps(a2, b2), _mm_add_ps(r2, r2)), _mm_add_ps(_mm_add_ps(a0, b0), _mm_add_ps(r0, r0)));
+		__m128 gy = _mm_sub_ps(_mm_add_ps(_mm_add_ps(b0, b2), _mm_add_ps(b1, b1)), _mm_add_ps(_mm_add_ps(a0, a2), _mm_add_ps(a1, a1)));
+
+		// Invalid centers divide by 0, their result is replaced by the flat texel
+		__m128 scale = _mm_div_ps(kernelScale, c);
+		__m128 sx = _mm_mul_ps(gx, scale);
+		__m128 sy = _mm_mul_ps(gy, scale);
+		__m128 invLength = _mm_rsqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, sx), _mm_mul_ps(sy, sy)), one));
+		__m128 nx = _mm_sub_ps(zero, _mm_mul_ps(sx, invLength));
+		__m128 ny = _mm_sub_ps(zero, _mm_mul_ps(sy, invLength));
+		__m128 nz = invLength;
+		__m128 shade = _mm_max_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, sunX), _mm_mul_ps(ny, sunY)), _mm_mul_ps(nz, sunZ)), zero);
+
+		auto channel = [&](__m128 v) {
+			return _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(v, zero), maxValue));
+		};
+		__m128i r = channel(_mm_add_ps(_mm_mul_ps(nx, half), half));
+		__m128i g = channel(_mm_add_ps(_mm_mul_ps(ny, half), half));
+		__m128i b = channel(_mm_add_ps(_mm_mul_ps(nz, half), half));
+		__m128i a = channel(_mm_mul_ps(shade, maxValue));
+		__m128i texels = _mm_or_si128(_mm_or_si128(r, _mm_slli_epi32(g, 8)), _mm_or_si128(_mm_slli_epi32(b, 16), _mm_slli_epi32(a, 24)));
+		__m128i validMask = _mm_castps_si128(valid);
+		texels = _mm_or_si128(_mm_and_si128(validMask, texels), _mm_andnot_si128(validMask, flat));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x - x0), texels);
+	}
+#endif
+	for (; x<x1; ++x)
+		dst[x - x0] = shadePixel(above, row, below, x);
+}
@@ -0,0 +1,68 @@
+/***********************************************************************
+ShadeMap - Surface normals and hillshade of the filtered depth frames.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#pragma once
+
+#include "ofMain.h"
+
+// Shaded tiles handed over to the main thread, recycled like the depth frames.
+// Each texel packs the surface normal in RGB (n * 127.5 + 127.5) and the hillshade in A.
+struct ShadeFrame {
+	unsigned int frameNumber; // Depth frame the tiles were shaded from
+	std::vector<int> tiles; // Tile indices, in the tile grid of the depth frames
+	std::vector<uint32_t> texels; // tileSize x tileSize texels per tile, rows cut at the frame border
+	ShadeFrame() : frameNumber(0) {}
+};
+
+// The dirty tiles of each depth frame are copied by store() right before the frame is sent,
+// then shaded by update() once it is gone, so the shading never delays the depth frames.
+// The slope comes from a 3x3 Sobel kernel on the depth, converted from depth change per pixel
+// to elevation change per mm with the pixel footprint depth / focalLength. Invalid neighbours
+// take the center depth, invalid centers are flat. The dirty tiles already extend one tile
+// around the changes of a frame, so the kernel never needs to reshade the tiles around them.
+class ShadeMap {
+public:
+	ShadeMap();
+
+	void setup(int width, int height, int tileSize);
+	void setFocalLength(float sfocalLength) { // Zed pixels
+		focalLength = sfocalLength;
+	}
+	void setSun(float azimuth, float elevation); // Degrees, azimuth clockwise from the top of the Zed image
+	void invalidate(); // The next store() copies and the next update() shades every tile
+
+	// depth is a width*height frame in mm, 0 marks an invalid pixel
+	void store(const float* depth, const std::vector<unsigned char>& dirtyTiles);
+	bool hasPendingTiles() const {
+		return numPendingTiles > 0;
+	}
+	void update(ShadeFrame& frame); // Shades the tiles stored since the last update into frame
+
+	static uint32_t getFlatTexel(float sunElevation); // Texel of a horizontal surface
+
+private:
+	void shadeRow(const float* above, const float* row, const float* below, int x0, int x1, uint32_t* dst) const;
+	uint32_t shadePixel(const float* above, const float* row, const float* below, int x) const;
+
+	int width, height;
+	int tileSize, tileCols, tileRows;
+	float focalLength;
+	glm::vec3 sun; // Towards the sun: x right and y down the Zed image, z up
+	std::vector<float> depth; // Copy of the stored tiles
+	std::vector<unsigned char> pendingTiles;
+	int numPendingTiles;
+	bool fullUpdate;
+};
@@ -0,0 +1,106 @@
+/***********************************************************************
+TerrainSampler - Read-only elevation and gradient sampling of one
+filtered depth frame.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#include "TerrainSampler.h"
+
+TerrainSampler::TerrainSampler()
+	:depth(nullptr),
+	width(0),
+	height(0),
+	ex(0), ey(0), ez(0), ew(0), planeOffset(0),
+	gradientLevel(0),
+	frameNumber(0)
+{
+}
+
+void TerrainSampler::bind(const float* sdepth, int swidth, int sheight, const glm::mat4x4& zedWorldMatrix, const glm::vec4& basePlaneEq,
+	std::shared_ptr<const GradientField> sgradientField, int sgradientLevel, unsigned int sframeNumber) {
+	depth = sdepth;
+	width = swidth;
+	height = sheight;
+	glm::vec3 normal(basePlaneEq);
+	ex = glm::dot(normal, glm::vec3(zedWorldMatrix[0]));
+	ey = glm::dot(normal, glm::vec3(zedWorldMatrix[1]));
+	ez = glm::dot(normal, glm::vec3(zedWorldMatrix[2]));
+	ew = glm::dot(normal, glm::vec3(zedWorldMatrix[3]));
+	planeOffset = basePlaneEq.w;
+	gradientField = sgradientField;
+	gradientLevel = sgradientLevel;
+	frameNumber = sframeNumber;
+}
+
+float TerrainSampler::elevationAt(float x, float y) const {
+	if (depth == nullptr)
+		return 0;
+	// Pixel centers are at (i + 0.5, j + 0.5)
+	float fx = ofClamp(x - 0.5f, 0, width - 1);
+	float fy = ofClamp(y - 0.5f, 0, height - 1);
+	int x0 = static_cast<int>(fx);
+	int y0 = static_cast<int>(fy);
+	int x1 = std::min(x0 + 1, width - 1);
+	int y1 = std::min(y0 + 1, height - 1);
+	float ax = fx - x0;
+	float ay = fy - y0;
+
+	// Interpolate the elevations of the valid neighbours only
+	const int xs[4] = { x0, x1, x0, x1 };
+	const int ys[4] = { y0, y0, y1, y1 };
+	const float ws[4] = { (1 - ax)*(1 - ay), ax*(1 - ay), (1 - ax)*ay, ax*ay };
+	float elevation = 0;
+	float weight = 0;
+	for (int i = 0; i < 4; i++) {
+		float d = depth[ys[i] * width + xs[i]];
+		if (d > 0) {
+			elevation += ws[i] * elevationAtPixel(xs[i] + 0.5f, ys[i] + 0.5f, d);
+			weight += ws[i];
+		}
+	}
+	if (weight == 0)
+		return elevationAtPixel(x, y, 0); // Same value as an invalid pixel in ZedProjector::elevationAtZedCoord
+	return elevation / weight;
+}
+
+glm::vec2 TerrainSampler::gradientAt(float x, float y) const {
+	if (!gradientField)
+		return glm::vec2(0);
+	// Cell centers are at ((col + 0.5)*resolution, (row + 0.5)*resolution)
+	int cols = gradientField->getCols(gradientLevel);
+	int rows = gradientField->getRows(gradientLevel);
+	float res = gradientField->getResolution(gradientLevel);
+	const glm::vec2* field = gradientField->getField(gradientLevel);
+	float fx = ofClamp(x / res - 0.5f, 0, cols - 1);
+	float fy = ofClamp(y / res - 0.5f, 0, rows - 1);
+	int c0 = static_cast<int>(fx);
+	int r0 = static_cast<int>(fy);
+	int c1 = std::min(c0 + 1, cols - 1);
+	int r1 = std::min(r0 + 1, rows - 1);
+	float ax = fx - c0;
+	float ay = fy - r0;
+	glm::vec2 top = glm::mix(field[r0*cols + c0], field[r0*cols + c1], ax);
+	glm::vec2 bottom = glm::mix(field[r1*cols + c0], field[r1*cols + c1], ax);
+	return glm::mix(top, bottom, ay);
+}
+
+void TerrainSampler::elevationsAt(const glm::vec2* points, float* elevations, size_t count) const {
+	for (size_t i = 0; i < count; i++)
+		elevations[i] = elevationAt(points[i].x, points[i].y);
+}
+
+void TerrainSampler::gradientsAt(const glm::vec2* points, glm::vec2* gradients, size_t count) const {
+	for (size_t i = 0; i < count; i++)
+		gradients[i] = gradientAt(points[i].x, points[i].y);
+}
@@ -0,0 +1,61 @@
+/***********************************************************************
+TerrainSampler - Read-only elevation and gradient sampling of one
+filtered depth frame.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#pragma once
+
+#include "ofMain.h"
+#include "GradientField.h"
+
+// A TerrainSampler is bound by ZedProjector::update() to the current depth frame,
+// gradient snapshot and base plane. Sampling is bilinear and has no side effect so
+// it can be called from several threads at once. The depth frame stays valid until
+// the next ZedProjector::update(), the gradient snapshot as long as the sampler lives.
+class TerrainSampler {
+public:
+	TerrainSampler();
+
+	void bind(const float* depth, int width, int height, const glm::mat4x4& zedWorldMatrix, const glm::vec4& basePlaneEq,
+		std::shared_ptr<const GradientField> gradientField, int gradientLevel, unsigned int frameNumber);
+
+	bool isBound() const {
+		return depth != nullptr;
+	}
+	unsigned int getFrameNumber() const {
+		return frameNumber;
+	}
+
+	// x, y in Zed pixel coordinate
+	float elevationAt(float x, float y) const;
+	glm::vec2 gradientAt(float x, float y) const;
+
+	// Batched versions for many points at once
+	void elevationsAt(const glm::vec2* points, float* elevations, size_t count) const;
+	void gradientsAt(const glm::vec2* points, glm::vec2* gradients, size_t count) const;
+
+private:
+	float elevationAtPixel(float x, float y, float depthValue) const {
+		// -dot(basePlaneEq, ZedWorldMatrix*(x, y, d, 1)*d) with the constant part precomputed
+		return -(depthValue*(ex*x + ey*y + ez*depthValue + ew) + planeOffset);
+	}
+
+	const float* depth;
+	int width, height;
+	float ex, ey, ez, ew, planeOffset; // Elevation coefficients of the base plane in Zed pixel space
+	std::shared_ptr<const GradientField> gradientField;
+	int gradientLevel;
+	unsigned int frameNumber;
+};
@@ -29,6 +29,13 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 
 #include "ofMain.h"
 
+// SSE2 kernels, always available on x86-64 and on 32-bit x86 when the compiler targets it.
+// The other architectures run the scalar loops the kernels fall back to.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MAGIC_SAND_SSE2
+#endif
+
 typedef glm::vec3 ofGlmPoint;
 
 
@@ -21,6 +21,7 @@ General Public License for more details.
 
 #include "ZedGrabber.h"
 #include "ofConstants.h"
+#include <atomic>
 
 // OpenGL includes
 
@@ -31,9 +32,16 @@ using namespace std;
 using namespace sl;
 
 ZedGrabber::ZedGrabber()
-	:newFrame(true),
+	:newFrame(false),
+	colorStreamRate(0),
+	lastColorFrameTime(0),
 	bufferInitiated(false),
-	zedOpened(false)
+	zedOpened(false),
+	latencyPrediction(false),
+	predictionLatency(50),
+	hillshade(false),
+	focalLength(700),
+	droppedGradientFields(0)
 {
 }
 
@@ -69,7 +77,7 @@ bool ZedGrabber::setup() {
 	InitParameters initParameters;
 	initParameters.camera_resolution = sl::RESOLUTION_HD720;
 	initParameters.depth_mode = sl::DEPTH_MODE_PERFORMANCE; //need quite a powerful graphic card in QUALITY
-	initParameters.coordinate_units = sl::UNIT_METER; // set meter as the OpenGL world will be in meters
+	initParameters.coordinate_units = sl::UNIT_MILLIMETER; // Depth frames, filter thresholds and base plane are in millimeters
 	initParameters.coordinate_system = sl::COORDINATE_SYSTEM_RIGHT_HANDED_Y_UP; // OpenGL's coordinate system is right_handed
 
 																				// Open the ZED
@@ -88,8 +96,7 @@ bool ZedGrabber::setup() {
 
 	zedDepthImage.allocate(width, height, 1);
 	filteredframe.allocate(width, height, 1);
-	zedColorImage.allocate(width, height);
-	zedColorImage.setUseTexture(false);
+	filteredframe.setImageType(OF_IMAGE_GRAYSCALE);
 
 
 	depthPixels_grayscale_.allocate(width, height, 1);
@@ -101,6 +108,21 @@ bool ZedGrabber::setup() {
 	leftTexture_.allocate(width, height, GL_RGB, false);
 	rightTexture_.allocate(width, height, GL_RGB, false);
 	depthTexture_.allocate(width, height, GL_LUMINANCE, false);
+
+	tileCols = (width + DepthFrame::tileSize - 1) / DepthFrame::tileSize;
+	tileRows = (height + DepthFrame::tileSize - 1) / DepthFrame::tileSize;
+	changedTiles.assign(tileCols*tileRows, 1);
+	depthPredictor.setup(width, height, DepthFrame::tileSize);
+	shadeMap.setup(width, height, DepthFrame::tileSize);
+	focalLength = zed.getCameraInformation().calibration_parameters.left_cam.fx;
+	shadeMap.setFocalLength(focalLength);
+
+	processingScale = 1;
+	maxgradfield = 1000;
+	updateProcessingResolution();
+	frameNumber = 0;
+	grabTime = 0;
+	grabInterval = 1000.0f / 60;
 	return true;
 }
 
@@ -108,70 +130,109 @@ bool ZedGrabber::openZed() {
 	zedOpened = zed.open();
 	return zedOpened;
 }
-void ZedGrabber::setupFramefilter(int sgradFieldresolution, float newMaxOffset, ofRectangle ROI, bool sspatialFilter, bool sfollowBigChange, int snumAveragingSlots) {
-	gradFieldresolution = sgradFieldresolution;
-	ofLogVerbose("zedGrabber") << "setupFramefilter(): Gradient Field resolution: " << gradFieldresolution;
-	gradFieldcols = width / gradFieldresolution;
-	ofLogVerbose("zedGrabber") << "setupFramefilter(): Width: " << width << " Gradient Field Cols: " << gradFieldcols;
-	gradFieldrows = height / gradFieldresolution;
-	ofLogVerbose("zedGrabber") << "setupFramefilter(): Height: " << height << " Gradient Field Rows: " << gradFieldrows;
+void ZedGrabber::setupFramefilter(float newMaxOffset, ofRectangle ROI, bool sspatialFilter, bool sfollowBigChange, int snumAveragingSlots, bool sadaptiveAveraging, int sminAveragingSlots, int sprocessingScale) {
 
 	spatialFilter = sspatialFilter;
 	followBigChange = sfollowBigChange;
 	numAveragingSlots = snumAveragingSlots;
 	minNumSamples = (numAveragingSlots + 1) / 2;
+	adaptiveAveraging = sadaptiveAveraging;
+	minAveragingSlots = std::max(1, std::min(sminAveragingSlots, numAveragingSlots));
 	maxOffset = newMaxOffset;
 
 	//Framefilter default parameters
 	maxVariance = 4;
 	hysteresis = 0.5f;
 	bigChange = 10.0f;
+	innovationThreshold = 3.0f;
+	minInnovationVariance = 0.25f;
 	instableValue = 0.0;
 	maxgradfield = 1000;
 	initialValue = 4000;
 	outsideROIValue = 3999;
 	minInitFrame = 60;
+	upsamplingRangeSigma = 10.0f;
 
-	//Setup ROI
+	//Setup processing resolution
+	processingScale = sprocessingScale;
+	updateProcessingResolution();
+
+	//Setup ROI and buffers
 	setzedROI(ROI);
+}
 
-	//setting buffers
-	initiateBuffers();
+void ZedGrabber::updateProcessingResolution(void) {
+	procWidth = (width + processingScale - 1) / processingScale;
+	procHeight = (height + processingScale - 1) / processingScale;
+	ofLogVerbose("zedGrabber") << "updateProcessingResolution(): Processing resolution: " << procWidth << "x" << procHeight;
+	if (processingScale > 1) {
+		processingDepthImage.allocate(procWidth, procHeight, 1);
+		processingframe.allocate(procWidth, procHeight, 1);
+	}
+	else {
+		processingDepthImage.clear();
+		processingframe.clear();
+	}
+
+	// Snapshots still read by the main thread keep their old resolution until released
+	// Three snapshots: one read by the main thread, one waiting in the channel and one being written
+	gradientPool.clear();
+	for (int i = 0; i < 3; i++)
+		addGradientSnapshot();
+}
+
+void ZedGrabber::addGradientSnapshot() {
+	gradientPool.push_back(std::make_shared<GradientField>());
+	gradientPool.back()->setup(procWidth, procHeight, 5, 5, processingScale);
+	gradientPool.back()->setMaxGradient(maxgradfield);
 }
 
 void ZedGrabber::initiateBuffers(void) {
 	filteredframe.set(0);
+	if (processingScale > 1)
+		processingframe.set(0);
 
-	averagingBuffer = new float[numAveragingSlots*height*width];
+	averagingBuffer = new float[numAveragingSlots*procHeight*procWidth];
 	float* averagingBufferPtr = averagingBuffer;
 	for (int i = 0; i<numAveragingSlots; ++i)
-		for (unsigned int y = 0; y<height; ++y)
-			for (unsigned int x = 0; x<width; ++x, ++averagingBufferPtr)
+		for (unsigned int y = 0; y<procHeight; ++y)
+			for (unsigned int x = 0; x<procWidth; ++x, ++averagingBufferPtr)
 				*averagingBufferPtr = initialValue;
 
 	averagingSlotIndex = 0;
 
 	/* Initialize the statistics buffer: */
-	statBuffer = new float[height*width * 3];
+	statBuffer = new float[procHeight*procWidth * 3];
 	float* sbPtr = statBuffer;
-	for (unsigned int y = 0; y<height; ++y)
-		for (unsigned int x = 0; x<width; ++x)
+	for (unsigned int y = 0; y<procHeight; ++y)
+		for (unsigned int x = 0; x<procWidth; ++x)
 			for (int i = 0; i<3; ++i, ++sbPtr)
 				*sbPtr = 0.0;
 
 	/* Initialize the valid buffer: */
-	validBuffer = new float[height*width];
+	validBuffer = new float[procHeight*procWidth];
 	float* vbPtr = validBuffer;
-	for (unsigned int y = 0; y<height; ++y)
-		for (unsigned int x = 0; x<width; ++x, ++vbPtr)
+	for (unsigned int y = 0; y<procHeight; ++y)
+		for (unsigned int x = 0; x<procWidth; ++x, ++vbPtr)
 			*vbPtr = initialValue;
 
-	/* Initialize the gradient field buffer: */
-	gradField = new glm::vec2[gradFieldcols*gradFieldrows];
-	glm::vec2* gfPtr = gradField;
-	for (unsigned int y = 0; y<gradFieldrows; ++y)
-		for (unsigned int x = 0; x<gradFieldcols; ++x, ++gfPtr)
-			*gfPtr = glm::vec2(0);
+	/* Initialize the adaptive averaging buffer (a zero window marks an uninitialized pixel), only allocated while adaptive averaging is on: */
+	adaptiveBuffer = nullptr;
+	if (adaptiveAveraging) {
+		adaptiveBuffer = new float[procHeight*procWidth * 4];
+		std::fill(adaptiveBuffer, adaptiveBuffer + procHeight*procWidth * 4, 0.0f);
+	}
+
+	/* Initialize the full resolution guide of the upsampling: */
+	guideBuffer = new float[height*width];
+	float* gbPtr = guideBuffer;
+	for (unsigned int y = 0; y<height; ++y)
+		for (unsigned int x = 0; x<width; ++x, ++gbPtr)
+			*gbPtr = 0.0;
+
+	/* The whole frame has to be sent again: */
+	std::fill(changedTiles.begin(), changedTiles.end(), 1);
+	depthPredictor.reset();
 
 	bufferInitiated = true;
 	currentInitFrame = 0;
@@ -179,14 +240,19 @@ void ZedGrabber::initiateBuffers(void) {
 }
 
 void ZedGrabber::resetBuffers(void) {
+	releaseBuffers();
+	initiateBuffers();
+}
+
+void ZedGrabber::releaseBuffers(void) {
 	if (bufferInitiated) {
 		bufferInitiated = false;
 		delete[] averagingBuffer;
 		delete[] statBuffer;
 		delete[] validBuffer;
-		delete[] gradField;
+		delete[] adaptiveBuffer;
+		delete[] guideBuffer;
 	}
-	initiateBuffers();
 }
 cv::Mat slMat2cvMat(sl::Mat& input) {
 	//convert MAT_TYPE to CV_TYPE
@@ -218,19 +284,36 @@ void ZedGrabber::threadedFunction() {
 		this->actionsLock.unlock();
 
 		if (zed.grab() == SUCCESS) {
-			
-			zedDepthImage = getDepthPixels_mm();
+			uint64_t previousGrabTime = grabTime;
+			grabTime = ofGetElapsedTimeMicros();
+			if (previousGrabTime != 0)
+				grabInterval += 0.1f*((grabTime - previousGrabTime) / 1000.0f - grabInterval);
+			markBuffersDirty(true);
+			ingestDepth();
+			frameNumber++;
 
 			filter();
-			filteredframe.setImageType(OF_IMAGE_GRAYSCALE);
-			updateGradientField();
-			zedColorImage.setFromPixels(getDepthPixels_grayscale().getPixels(), width, height);
+			newFrame = true;
+
+			// Color frames are only produced while subscribed, at the requested rate
+			if (colorStreamRate > 0) {
+				uint64_t now = ofGetElapsedTimeMillis();
+				if (now - lastColorFrameTime >= 1000 / colorStreamRate) {
+					lastColorFrameTime = now;
+					colored.send(getLeftPixels());
+				}
+			}
 		}
-		if (storedframes == 0)
+		if (storedframes == 0 && newFrame)
 		{
-			filtered.send(std::move(filteredframe));
-			gradient.send(std::move(gradField));
-			colored.send(std::move(zedColorImage.getPixels()));
+			if (processingScale > 1)
+				upsampleFilteredFrame();
+			updateGradientField();
+			if (latencyPrediction && firstImageReady)
+				predictDepth();
+			sendFilteredFrame();
+			if (hillshade)
+				updateShade();
 			lock();
 			storedframes += 1;
 			unlock();
@@ -238,10 +321,7 @@ void ZedGrabber::threadedFunction() {
 
 	}
 	zed.close();
-	delete[] averagingBuffer;
-	delete[] statBuffer;
-	delete[] validBuffer;
-	delete[] gradField;
+	releaseBuffers();
 }
 
 void ZedGrabber::performInThread(std::function<void(ZedGrabber&)> action) {
@@ -250,30 +330,130 @@ void ZedGrabber::performInThread(std::function<void(ZedGrabber&)> action) {
 	this->actionsLock.unlock();
 }
 
+void ZedGrabber::ingestDepth()
+{
+	zed.retrieveMeasure(depthMat, sl::MEASURE_DEPTH);
+	const float* depthData = depthMat.getPtr<sl::float1>(sl::MEM_CPU);
+	const size_t step = depthMat.getStepBytes() / sizeof(float);
+
+	/* Convert the depth measure to integer millimeters, unknown depths (NaN, inf) become 0: */
+	RawDepth* rawPtr = zedDepthImage.getData();
+	for (unsigned int y = 0; y<height; ++y)
+	{
+		const float* rowPtr = depthData + y*step;
+		for (unsigned int x = 0; x<width; ++x, ++rawPtr)
+		{
+			float d = rowPtr[x];
+			*rawPtr = (d > 0 && d < 65535.0f) ? static_cast<RawDepth>(d + 0.5f) : 0;
+		}
+	}
+
+	if (processingScale == 1)
+		return;
+
+	/* Downsample: each processing pixel is the mean of the valid depths of its block */
+	const RawDepth* raw = zedDepthImage.getData();
+	RawDepth* procPtr = processingDepthImage.getData();
+	for (unsigned int py = 0; py<procHeight; ++py)
+	{
+		unsigned int y0 = py*processingScale;
+		unsigned int y1 = std::min(y0 + processingScale, height);
+		for (unsigned int px = 0; px<procWidth; ++px, ++procPtr)
+		{
+			unsigned int x0 = px*processingScale;
+			unsigned int x1 = std::min(x0 + processingScale, width);
+			unsigned int sum = 0, count = 0;
+			for (unsigned int y = y0; y<y1; ++y)
+				for (unsigned int x = x0; x<x1; ++x) {
+					RawDepth d = raw[y*width + x];
+					sum += d;
+					count += d != 0;
+				}
+			*procPtr = count > 0 ? static_cast<RawDepth>((sum + count / 2) / count) : 0;
+		}
+	}
+}
+
+void ZedGrabber::refreshGuide(int px, int py)
+{
+	// The guide of a block follows the raw depth only when the block's stable value
+	// changes, so the upsampled frame stays as still as the filtered one
+	const RawDepth* raw = zedDepthImage.getData();
+	unsigned int y1 = std::min((py + 1)*processingScale, static_cast<int>(height));
+	unsigned int x1 = std::min((px + 1)*processingScale, static_cast<int>(width));
+	for (unsigned int y = py*processingScale; y<y1; ++y)
+		for (unsigned int x = px*processingScale; x<x1; ++x) {
+			float d = raw[y*width + x];
+			guideBuffer[y*width + x] = d > maxOffset ? d : 0;
+		}
+}
+
+void ZedGrabber::upsampleFilteredFrame()
+{
+	// Joint bilateral upsampling: bilinear weights of the four closest processing pixels,
+	// each damped by its distance in depth to the full resolution guide
+	const float* low = processingframe.getData();
+	const float invScale = 1.0f / processingScale;
+	const float invSigma2 = 1.0f / (upsamplingRangeSigma*upsamplingRangeSigma);
+	for (int y = minY; y<maxY; ++y)
+	{
+		float fy = ofClamp((y + 0.5f)*invScale - 0.5f, 0, procHeight - 1);
+		int y0 = static_cast<int>(fy);
+		int y1 = std::min(y0 + 1, static_cast<int>(procHeight) - 1);
+		float ay = fy - y0;
+		const float* guidePtr = guideBuffer + y*width;
+		float* outPtr = filteredframe.getData() + y*width;
+		for (int x = minX; x<maxX; ++x)
+		{
+			float fx = ofClamp((x + 0.5f)*invScale - 0.5f, 0, procWidth - 1);
+			int x0 = static_cast<int>(fx);
+			int x1 = std::min(x0 + 1, static_cast<int>(procWidth) - 1);
+			float ax = fx - x0;
+			const float d[4] = { low[y0*procWidth + x0], low[y0*procWidth + x1], low[y1*procWidth + x0], low[y1*procWidth + x1] };
+			const float w[4] = { (1 - ax)*(1 - ay), ax*(1 - ay), (1 - ax)*ay, ax*ay };
+			float guide = guidePtr[x];
+			float sum = 0, wsum = 0;
+			for (int i = 0; i<4; ++i) {
+				if (d[i] > 0) {
+					float diff = guide - d[i];
+					float weight = guide > 0 ? w[i] / (1.0f + diff*diff*invSigma2) : w[i];
+					sum += weight*d[i];
+					wsum += weight;
+				}
+			}
+			outPtr[x] = wsum > 0 ? sum / wsum : 0;
+		}
+	}
+}
+
 void ZedGrabber::filter()
 {
-	if (bufferInitiated)
+	if (bufferInitiated && adaptiveAveraging)
+	{
+		filterAdaptive();
+	}
+	else if (bufferInitiated)
 	{
-		const RawDepth* inputFramePtr = static_cast<const RawDepth*>(zedDepthImage.getData());
-		float* averagingBufferPtr = averagingBuffer + averagingSlotIndex*height*width;
+		const RawDepth* inputFramePtr = getProcessingDepth();
+		float* averagingBufferPtr = averagingBuffer + averagingSlotIndex*procHeight*procWidth;
 		float* statBufferPtr = statBuffer;
 		float* validBufferPtr = validBuffer;
-		float* filteredFramePtr = filteredframe.getData();
+		float* filteredFramePtr = getProcessingFrame().getData();
 
-		inputFramePtr += minY*width;  // We only scan zed ROI
-		averagingBufferPtr += minY*width;
-		statBufferPtr += minY*width * 3;
-		validBufferPtr += minY*width;
-		filteredFramePtr += minY*width;
+		inputFramePtr += procMinY*procWidth;  // We only scan zed ROI
+		averagingBufferPtr += procMinY*procWidth;
+		statBufferPtr += procMinY*procWidth * 3;
+		validBufferPtr += procMinY*procWidth;
+		filteredFramePtr += procMinY*procWidth;
 
-		for (unsigned int y = minY; y<maxY; ++y)
+		for (unsigned int y = procMinY; y<procMaxY; ++y)
 		{
-			inputFramePtr += minX;
-			averagingBufferPtr += minX;
-			statBufferPtr += minX * 3;
-			validBufferPtr += minX;
-			filteredFramePtr += minX;
-			for (unsigned int x = minX; x<maxX; ++x, ++inputFramePtr, ++averagingBufferPtr, statBufferPtr += 3, ++validBufferPtr, ++filteredFramePtr)
+			inputFramePtr += procMinX;
+			averagingBufferPtr += procMinX;
+			statBufferPtr += procMinX * 3;
+			validBufferPtr += procMinX;
+			filteredFramePtr += procMinX;
+			for (unsigned int x = procMinX; x<procMaxX; ++x, ++inputFramePtr, ++averagingBufferPtr, statBufferPtr += 3, ++validBufferPtr, ++filteredFramePtr)
 			{
 				float newVal = static_cast<float>(*inputFramePtr);
 				float oldVal = *averagingBufferPtr;
@@ -287,7 +467,7 @@ void ZedGrabber::filter()
 						{
 							float* aaveragingBufferPtr;
 							for (int i = 0; i < numAveragingSlots; i++) { // update all averaging slots
-								aaveragingBufferPtr = averagingBuffer + i*height*width + y*width + x;
+								aaveragingBufferPtr = averagingBuffer + i*procHeight*procWidth + y*procWidth + x;
 								*aaveragingBufferPtr = newVal;
 							}
 							statBufferPtr[0] = numAveragingSlots; //Update statistics
@@ -318,6 +498,9 @@ void ZedGrabber::filter()
 					{
 						/* Set the output pixel value to the depth-corrected running mean: */
 						*filteredFramePtr = *validBufferPtr = newFiltered;
+						markTileChanged(x, y);
+						if (processingScale > 1)
+							refreshGuide(x, y);
 					}
 					else {
 						/* Leave the pixel at its previous value: */
@@ -326,11 +509,11 @@ void ZedGrabber::filter()
 				}
 				*filteredFramePtr = *validBufferPtr;
 			}
-			inputFramePtr += width - maxX;
-			averagingBufferPtr += width - maxX;
-			statBufferPtr += (width - maxX) * 3;
-			validBufferPtr += width - maxX;
-			filteredFramePtr += width - maxX;
+			inputFramePtr += procWidth - procMaxX;
+			averagingBufferPtr += procWidth - procMaxX;
+			statBufferPtr += (procWidth - procMaxX) * 3;
+			validBufferPtr += procWidth - procMaxX;
+			filteredFramePtr += procWidth - procMaxX;
 		}
 
 		/* Go to the next averaging slot: */
@@ -351,43 +534,127 @@ void ZedGrabber::filter()
 	}
 }
 
+void ZedGrabber::filterAdaptive()
+{
+	// Each pixel keeps an exponential running mean whose window length lies between
+	// minAveragingSlots and numAveragingSlots. The innovation (new sample - mean) is
+	// normalized by the pixel's innovation variance: a pixel whose innovations stay in
+	// the noise envelope lengthens its window by one frame, a pixel receiving two
+	// consecutive large innovations of the same sign (the sand is moving) shrinks its
+	// window in proportion. A single large innovation is held back as a possible outlier.
+	const float k2 = innovationThreshold*innovationThreshold;
+	const float minWindow = static_cast<float>(minAveragingSlots);
+	const float maxWindow = static_cast<float>(numAveragingSlots);
+
+	for (unsigned int y = procMinY; y<procMaxY; ++y)
+	{
+		const RawDepth* inputFramePtr = getProcessingDepth() + y*procWidth + procMinX;
+		float* adaptiveBufferPtr = adaptiveBuffer + (y*procWidth + procMinX) * 4;
+		float* validBufferPtr = validBuffer + y*procWidth + procMinX;
+		float* filteredFramePtr = getProcessingFrame().getData() + y*procWidth + procMinX;
+		for (unsigned int x = procMinX; x<procMaxX; ++x, ++inputFramePtr, adaptiveBufferPtr += 4, ++validBufferPtr, ++filteredFramePtr)
+		{
+			float newVal = static_cast<float>(*inputFramePtr);
+			if (newVal > maxOffset)//we are under the ceiling plane
+			{
+				float& mean = adaptiveBufferPtr[0];
+				float& variance = adaptiveBufferPtr[1];
+				float& window = adaptiveBufferPtr[2];
+				float& lastOutlier = adaptiveBufferPtr[3];
+
+				if (window == 0) { // First valid sample of this pixel
+					mean = newVal;
+					variance = maxVariance;
+					window = 1;
+					lastOutlier = 0;
+				}
+				else {
+					float innovation = newVal - mean;
+					float innovation2 = innovation*innovation;
+					bool outlier = innovation2 > k2*variance;
+					if (outlier && innovation*lastOutlier <= 0) {
+						/* Possible spike: hold the sample back and let the variance grow a little */
+						lastOutlier = innovation;
+						variance += (k2*variance - variance) / window;
+					}
+					else {
+						if (outlier) {
+							/* Consistent change: shorten the window to follow the surface */
+							window = std::max(minWindow, window*k2*variance / innovation2);
+							lastOutlier = innovation;
+						}
+						else {
+							window = std::min(maxWindow, window + 1);
+							variance = std::max(minInnovationVariance, variance + (innovation2 - variance) / window);
+							lastOutlier = 0;
+						}
+						mean += innovation / window;
+					}
+				}
+			}
+			/* Check if the pixel has seen enough samples and left the previous value's envelope: */
+			if (adaptiveBufferPtr[2] >= minAveragingSlots && abs(adaptiveBufferPtr[0] - *validBufferPtr) >= hysteresis) {
+				*validBufferPtr = adaptiveBufferPtr[0];
+				markTileChanged(x, y);
+				if (processingScale > 1)
+					refreshGuide(x, y);
+			}
+			*filteredFramePtr = *validBufferPtr;
+		}
+	}
+
+	if (!firstImageReady) {
+		currentInitFrame++;
+		if (currentInitFrame > minInitFrame)
+			firstImageReady = true;
+	}
+
+	/* Apply a spatial filter if requested: */
+	if (spatialFilter)
+	{
+		applySpaceFilter();
+	}
+}
+
 void ZedGrabber::applySpaceFilter()
 {
 	for (int filterPass = 0; filterPass<2; ++filterPass)
 	{
 		/* Low-pass filter the entire output frame in-place: */
-		for (unsigned int x = minX; x<maxX; ++x)
+		for (unsigned int x = procMinX; x<procMaxX; ++x)
 		{
 			/* Get a pointer to the current column: */
-			float* colPtr = filteredframe.getData() + x;
+			float* colPtr = getProcessingFrame().getData() + procMinY*procWidth + x;
 
 			/* Filter the first pixel in the column: */
 			float lastVal = *colPtr;
-			*colPtr = (colPtr[0] * 2.0f + colPtr[width]) / 3.0f;
-			colPtr += width;
+			*colPtr = (colPtr[0] * 2.0f + colPtr[procWidth]) / 3.0f;
+			colPtr += procWidth;
 
 			/* Filter the interior pixels in the column: */
-			for (unsigned int y = minY + 1; y<maxY - 1; ++y, colPtr += width)
+			for (unsigned int y = procMinY + 1; y<procMaxY - 1; ++y, colPtr += procWidth)
 			{
 				/* Filter the pixel: */
 				float nextLastVal = *colPtr;
-				*colPtr = (lastVal + colPtr[0] * 2.0f + colPtr[width])*0.25f;
+				*colPtr = (lastVal + colPtr[0] * 2.0f + colPtr[procWidth])*0.25f;
 				lastVal = nextLastVal;
 			}
 
 			/* Filter the last pixel in the column: */
 			*colPtr = (lastVal + colPtr[0] * 2.0f) / 3.0f;
 		}
-		float* rowPtr = filteredframe.getData();
-		for (unsigned int y = minY; y<maxY; ++y)
+		for (unsigned int y = procMinY; y<procMaxY; ++y)
 		{
+			/* Get a pointer to the current row: */
+			float* rowPtr = getProcessingFrame().getData() + y*procWidth + procMinX;
+
 			/* Filter the first pixel in the row: */
 			float lastVal = *rowPtr;
 			*rowPtr = (rowPtr[0] * 2.0f + rowPtr[1]) / 3.0f;
 			++rowPtr;
 
 			/* Filter the interior pixels in the row: */
-			for (unsigned int x = minX + 1; x<maxX - 1; ++x, ++rowPtr)
+			for (unsigned int x = procMinX + 1; x<procMaxX - 1; ++x, ++rowPtr)
 			{
 				/* Filter the pixel: */
 				float nextLastVal = *rowPtr;
@@ -397,56 +664,114 @@ void ZedGrabber::applySpaceFilter()
 
 			/* Filter the last pixel in the row: */
 			*rowPtr = (lastVal + rowPtr[0] * 2.0f) / 3.0f;
-			++rowPtr;
 		}
 	}
 }
 
 void ZedGrabber::updateGradientField()
 {
-	int ind = 0;
-	float gx;
-	float gy;
-	int gvx, gvy;
-	float lgth = 0;
-	float* filteredFramePtr = filteredframe.getData();
-	for (unsigned int y = 0; y<gradFieldrows; ++y) {
-		for (unsigned int x = 0; x<gradFieldcols; ++x) {
-			if (isInsideROI(x*gradFieldresolution, y*gradFieldresolution) && isInsideROI((x + 1)*gradFieldresolution, (y + 1)*gradFieldresolution)) {
-				gx = 0;
-				gvx = 0;
-				gy = 0;
-				gvy = 0;
-				for (unsigned int i = 0; i<gradFieldresolution; i++) {
-					ind = y*gradFieldresolution*width + i*width + x*gradFieldresolution;
-					if (filteredFramePtr[ind] != 0 && filteredFramePtr[ind + gradFieldresolution - 1] != 0) {
-						gvx += 1;
-						gx += filteredFramePtr[ind] - filteredFramePtr[ind + gradFieldresolution - 1];
-					}
-					ind = y*gradFieldresolution*width + i + x*gradFieldresolution;
-					if (filteredFramePtr[ind] != 0 && filteredFramePtr[ind + (gradFieldresolution - 1)*width] != 0) {
-						gvy += 1;
-						gy += filteredFramePtr[ind] - filteredFramePtr[ind + (gradFieldresolution - 1)*width];
-					}
-				}
-				if (gvx != 0 && gvy != 0)
-					gradField[y*gradFieldcols + x] = glm::vec2(gx / gradFieldresolution / gvx, gy / gradFieldresolution / gvy);
-				if (gradField[y*gradFieldcols + x].length() > maxgradfield) {
-					gradField[y*gradFieldcols + x]= gradField[y*gradFieldcols + x]*maxgradfield;// /= gradField[y*gradFieldcols+x].length()*maxgradfield;
-					lgth += 1;
-				}
-			}
-			else {
-				gradField[y*gradFieldcols + x] = glm::vec2(0);
-			}
+	// Write into a snapshot that is only referenced by the pool, the main thread
+	// keeps reading the previous one meanwhile
+	std::shared_ptr<GradientField> target;
+	for (auto & snapshot : gradientPool) {
+		if (snapshot.use_count() == 1) {
+			// use_count() is a relaxed load. The fence pairs it with the release of the
+			// last main thread reference, so its reads are done before we write.
+			std::atomic_thread_fence(std::memory_order_acquire);
+			target = snapshot;
+			break;
 		}
 	}
+	if (!target) {
+		// The main thread holds on to the snapshots longer than a frame (stalled, or frames
+		// queued in the channel): grow the pool, up to a bound for a main thread that stopped
+		if (gradientPool.size() < maxGradientSnapshots) {
+			addGradientSnapshot();
+			target = gradientPool.back();
+			ofLogNotice("zedGrabber") << "updateGradientField(): All gradient snapshots in use, " << gradientPool.size() << " snapshots allocated";
+		}
+		else {
+			droppedGradientFields++;
+			ofLogWarning("zedGrabber") << "updateGradientField(): All " << gradientPool.size() << " gradient snapshots in use, frame " << frameNumber << " not published (" << droppedGradientFields << " dropped)";
+			return;
+		}
+	}
+	// Full resolution Sobel pass reduced into every cell resolution of the pyramid
+	target->compute(getProcessingFrame().getData(), procMinX, procMaxX, procMinY, procMaxY);
+	target->setFrameNumber(frameNumber);
+	gradient.send(std::shared_ptr<const GradientField>(target));
 }
 
-bool ZedGrabber::isInsideROI(int x, int y) {
-	if (x<minX || x>maxX || y<minY || y>maxY)
-		return false;
-	return true;
+void ZedGrabber::predictDepth()
+{
+	// The averaging delays the filtered depth by half its window on top of the
+	// measured latency. The gradient field keeps the measured depth.
+	int window = adaptiveAveraging ? minAveragingSlots : numAveragingSlots;
+	float averagingLag = (window - 1) / 2.0f*grabInterval;
+	depthPredictor.setHorizon(predictionLatency + averagingLag);
+	depthPredictor.apply(filteredframe.getData(), grabTime, minX, maxX, minY, maxY, changedTiles);
+}
+
+void ZedGrabber::sendFilteredFrame()
+{
+	// Hand the filtered buffer over without copying it and continue filtering
+	// into a buffer the main thread has released
+	DepthFrame frame;
+	frame.pixels = std::move(filteredframe);
+	frame.frameNumber = frameNumber;
+	frame.grabTime = grabTime;
+	frame.tileCols = tileCols;
+	frame.tileRows = tileRows;
+
+	// Dilate the changed tiles by one tile: the spatial filter and the upsampling
+	// spread a change over a few pixels around it
+	frame.dirtyTiles.assign(tileCols*tileRows, 0);
+	for (int row = 0; row<tileRows; ++row)
+		for (int col = 0; col<tileCols; ++col)
+			if (changedTiles[row*tileCols + col])
+				for (int r = std::max(row - 1, 0); r <= std::min(row + 1, tileRows - 1); ++r)
+					for (int c = std::max(col - 1, 0); c <= std::min(col + 1, tileCols - 1); ++c)
+						frame.dirtyTiles[r*tileCols + c] = 1;
+	std::fill(changedTiles.begin(), changedTiles.end(), 0);
+
+	// Only a copy of the dirty tiles, the shading itself waits until the frame is sent
+	if (hillshade)
+		shadeMap.store(frame.pixels.getData(), frame.dirtyTiles);
+
+	filtered.send(std::move(frame));
+	newFrame = false;
+
+	if (recycled.tryReceive(filteredframe) && filteredframe.getWidth() == width && filteredframe.getHeight() == height) {
+		// The filters rewrite every pixel of the ROI, only the border may hold stale values
+		clearOutsideROI(filteredframe);
+	}
+	else {
+		filteredframe.allocate(width, height, 1);
+		filteredframe.set(0);
+	}
+	filteredframe.setImageType(OF_IMAGE_GRAYSCALE);
+}
+
+void ZedGrabber::updateShade()
+{
+	if (!shadeMap.hasPendingTiles())
+		return;
+	ShadeFrame frame;
+	shadeRecycled.tryReceive(frame);
+	shadeMap.update(frame);
+	frame.frameNumber = frameNumber;
+	shade.send(std::move(frame));
+}
+
+void ZedGrabber::clearOutsideROI(ofFloatPixels& frame)
+{
+	float* data = frame.getData();
+	std::fill(data, data + minY*width, 0.0f);
+	for (int y = minY; y<maxY; ++y) {
+		std::fill(data + y*width, data + y*width + minX, 0.0f);
+		std::fill(data + y*width + maxX, data + (y + 1)*width, 0.0f);
+	}
+	std::fill(data + maxY*width, data + height*width, 0.0f);
 }
 
 void ZedGrabber::setzedROI(ofRectangle ROI) {
@@ -456,58 +781,85 @@ void ZedGrabber::setzedROI(ofRectangle ROI) {
 	maxY = static_cast<int>(ROI.getMaxY());
 	ROIwidth = maxX - minX;
 	ROIheight = maxY - minY;
+	procMinX = minX / processingScale;
+	procMaxX = std::min((maxX + processingScale - 1) / processingScale, static_cast<int>(procWidth));
+	procMinY = minY / processingScale;
+	procMaxY = std::min((maxY + processingScale - 1) / processingScale, static_cast<int>(procHeight));
 	resetBuffers();
 }
 
+void ZedGrabber::setColorStreamRate(float scolorStreamRate) {
+	colorStreamRate = scolorStreamRate;
+	lastColorFrameTime = 0; // Send the first frame right away
+	ofLogVerbose("zedGrabber") << "setColorStreamRate(): Color stream " << (colorStreamRate > 0 ? "started at " + ofToString(colorStreamRate) + " fps" : "stopped");
+}
+
+void ZedGrabber::setLatencyPrediction(bool slatencyPrediction) {
+	latencyPrediction = slatencyPrediction;
+	depthPredictor.reset();
+	// Replace the extrapolated tiles of the last frame by the measured depth
+	std::fill(changedTiles.begin(), changedTiles.end(), 1);
+}
+
+void ZedGrabber::setPredictionLatency(float spredictionLatency) {
+	predictionLatency = spredictionLatency;
+}
+
+void ZedGrabber::setHillshade(bool shillshade) {
+	hillshade = shillshade;
+	// The tiles were not stored while disabled
+	shadeMap.invalidate();
+}
+
+void ZedGrabber::setSunDirection(float azimuth, float elevation) {
+	shadeMap.setSun(azimuth, elevation);
+	shadeMap.invalidate();
+}
+
 void ZedGrabber::setAveragingSlotsNumber(int snumAveragingSlots) {
-	if (bufferInitiated) {
-		bufferInitiated = false;
-		delete[] averagingBuffer;
-		delete[] statBuffer;
-		delete[] validBuffer;
-		delete[] gradField;
-	}
+	releaseBuffers();
 	numAveragingSlots = snumAveragingSlots;
 	minNumSamples = (numAveragingSlots + 1) / 2;
+	minAveragingSlots = std::min(minAveragingSlots, numAveragingSlots);
 	initiateBuffers();
 }
 
-void ZedGrabber::setGradFieldResolution(int sgradFieldresolution) {
-	if (bufferInitiated) {
-		bufferInitiated = false;
-		delete[] averagingBuffer;
-		delete[] statBuffer;
-		delete[] validBuffer;
-		delete[] gradField;
-	}
-	gradFieldresolution = sgradFieldresolution;
+void ZedGrabber::setProcessingScale(int sprocessingScale) {
+	releaseBuffers();
+	processingScale = sprocessingScale;
+	updateProcessingResolution();
+	setzedROI(ofRectangle(minX, minY, ROIwidth, ROIheight));
+}
+
+void ZedGrabber::setAdaptiveAveraging(bool newadaptiveAveraging) {
+	releaseBuffers();
+	adaptiveAveraging = newadaptiveAveraging;
 	initiateBuffers();
 }
 
+void ZedGrabber::setMinAveragingSlotsNumber(int sminAveragingSlots) {
+	// Only bounds the window of the next updates, the running statistics are kept
+	minAveragingSlots = std::max(1, std::min(sminAveragingSlots, numAveragingSlots));
+}
+
 void ZedGrabber::setFollowBigChange(bool newfollowBigChange) {
-	if (bufferInitiated) {
-		bufferInitiated = false;
-		delete[] averagingBuffer;
-		delete[] statBuffer;
-		delete[] validBuffer;
-		delete[] gradField;
-	}
+	releaseBuffers();
 	followBigChange = newfollowBigChange;
 	initiateBuffers();
 }
 
 glm::vec3 ZedGrabber::getStatBuffer(int x, int y) {
-	float* statBufferPtr = statBuffer + 3 * (x + y*width);
+	float* statBufferPtr = statBuffer + 3 * processingIndex(x, y);
 	return glm::vec3(statBufferPtr[0], statBufferPtr[1], statBufferPtr[2]);
 }
 
 float ZedGrabber::getAveragingBuffer(int x, int y, int slotNum) {
-	float* averagingBufferPtr = averagingBuffer + slotNum*height*width + (x + y*width);
+	float* averagingBufferPtr = averagingBuffer + slotNum*procHeight*procWidth + processingIndex(x, y);
 	return *averagingBufferPtr;
 }
 
 float ZedGrabber::getValidBuffer(int x, int y) {
-	float* validBufferPtr = validBuffer + (x + y*width);
+	float* validBufferPtr = validBuffer + processingIndex(x, y);
 	return *validBufferPtr;
 }
 
@@ -526,6 +878,13 @@ glm::mat4x4 ZedGrabber::getWorldMatrix() {
 	return mat;
 }
 
+void ZedGrabber::markBuffersDirty(bool dirty)
+{
+	leftPixelsDirty_ = rightPixelsDirty_ = leftTextureDirty_ = rightTextureDirty_ = dirty;
+	depthPixels_mm_Dirty_ = depthPixels_grayscale_Dirty_ = depthTextureDirty_ = dirty;
+	pointCloudDirty_ = pointCloudFloatColorsDirty_ = dirty;
+}
+
 bool ZedGrabber::started()
 {
 	return true;
@@ -36,6 +36,27 @@ General Public License for more details.
 #include "ofxCv.h"
 
 #include "Utils.h"
+#include "GradientField.h"
+#include "DepthPredictor.h"
+#include "ShadeMap.h"
+
+// Filtered depth frame handed over to the main thread. The pixels are moved through
+// the channels, never copied: the main thread sends the frame it replaces back to the
+// grabber through ZedGrabber::recycled so the same few buffers keep circulating.
+struct DepthFrame {
+	static const int tileSize = 32; // Zed pixels per side of a dirty tile
+
+	ofFloatPixels pixels; // Full resolution filtered depth in mm, 0 outside the ROI, extrapolated with latency prediction
+	unsigned int frameNumber; // Grabbed frame the depth was filtered from
+	uint64_t grabTime; // ofGetElapsedTimeMicros() when that frame was grabbed
+	std::vector<unsigned char> dirtyTiles; // Tiles that changed since the previous DepthFrame
+	int tileCols, tileRows;
+	DepthFrame() : frameNumber(0), grabTime(0), tileCols(0), tileRows(0) {}
+
+	bool isTileDirty(int col, int row) const {
+		return dirtyTiles[row*tileCols + col] != 0;
+	}
+};
 
 class ZedGrabber: public ofThread {
 public:
@@ -49,9 +70,10 @@ public:
     void performInThread(std::function<void(ZedGrabber&)> action);
     bool setup();
 	bool openZed();
-	void setupFramefilter(int gradFieldresolution, float newMaxOffset, ofRectangle ROI, bool spatialFilter, bool followBigChange, int numAveragingSlots);
+	void setupFramefilter(float newMaxOffset, ofRectangle ROI, bool spatialFilter, bool followBigChange, int numAveragingSlots, bool adaptiveAveraging, int minAveragingSlots, int processingScale);
     void initiateBuffers(void); // Reinitialise buffers
     void resetBuffers(void);
+    void releaseBuffers(void);
     
     glm::vec3 getStatBuffer(int x, int y);
     float getAveragingBuffer(int x, int y, int slotNum);
@@ -60,7 +82,14 @@ public:
     void setFollowBigChange(bool newfollowBigChange);
     void setzedROI(ofRectangle szedROI);
     void setAveragingSlotsNumber(int snumAveragingSlots);
-    void setGradFieldResolution(int sgradFieldresolution);
+    void setAdaptiveAveraging(bool newadaptiveAveraging);
+    void setMinAveragingSlotsNumber(int sminAveragingSlots);
+    void setProcessingScale(int sprocessingScale);
+    void setColorStreamRate(float scolorStreamRate); // Color frames per second sent on colored, 0 stops the stream
+    void setLatencyPrediction(bool slatencyPrediction);
+    void setPredictionLatency(float spredictionLatency); // ms between the grab and the projection
+    void setHillshade(bool shillshade);
+    void setSunDirection(float azimuth, float elevation); // Degrees, see ShadeMap::setSun()
     
     void decStoredframes(){
         storedframes -= 1;
@@ -88,6 +117,18 @@ public:
         return numAveragingSlots;
     }
     
+    float getAdaptiveWindow(int x, int y){ // 0 while adaptive averaging is off
+        return adaptiveBuffer ? adaptiveBuffer[4*processingIndex(x, y)+2] : 0;
+    }
+    
+    int getProcessingScale(){
+        return processingScale;
+    }
+    
+    float getFocalLength(){ // Pixels, of the left camera
+        return focalLength;
+    }
+    
     void setMaxOffset(float newMaxOffset){
         maxOffset = newMaxOffset;
     }
@@ -96,9 +137,12 @@ public:
         spatialFilter = newspatialFilter;
     }
     
-	ofThreadChannel<ofFloatPixels> filtered;
-	ofThreadChannel<ofPixels> colored;
-	ofThreadChannel<glm::vec2*> gradient;
+	ofThreadChannel<DepthFrame> filtered;
+	ofThreadChannel<ofFloatPixels> recycled; // Buffers released by the main thread
+	ofThreadChannel<ofPixels> colored; // Left camera image, only while the color stream is requested
+	ofThreadChannel<std::shared_ptr<const GradientField> > gradient;
+	ofThreadChannel<ShadeFrame> shade; // Shaded tiles, only while the hillshade is enabled
+	ofThreadChannel<ShadeFrame> shadeRecycled; // Shade frames released by the main thread
 
 	//------------------------------------------ofxKuZed implementation
 
@@ -129,12 +173,37 @@ public:
     
 private:
 	void threadedFunction() override;
+    void ingestDepth();
     void filter();
-    bool isInsideROI(int x, int y); // test is x, y is inside ROI
+    void filterAdaptive();
+    void updateProcessingResolution();
+    void refreshGuide(int px, int py);
+    void upsampleFilteredFrame();
+    
+    // Filtering runs on the downsampled images when processingScale > 1
+    const RawDepth* getProcessingDepth(){
+        return processingScale > 1 ? processingDepthImage.getData() : zedDepthImage.getData();
+    }
+    ofFloatPixels& getProcessingFrame(){
+        return processingScale > 1 ? processingframe : filteredframe;
+    }
+    int processingIndex(int x, int y){ // x, y in Zed pixel coordinate
+        return (y / processingScale)*procWidth + x / processingScale;
+    }
     void applySpaceFilter();
     void updateGradientField();
+    void addGradientSnapshot();
+    void predictDepth();
+    void sendFilteredFrame();
+    void updateShade();
+    void clearOutsideROI(ofFloatPixels& frame);
+    void markTileChanged(int px, int py){ // px, py in processing pixel coordinate
+        changedTiles[(py*processingScale / DepthFrame::tileSize)*tileCols + px*processingScale / DepthFrame::tileSize] = 1;
+    }
     
-	bool newFrame;
+	bool newFrame; // A frame was filtered since the last DepthFrame was sent
+    float colorStreamRate;
+    uint64_t lastColorFrameTime; // ms
     bool bufferInitiated;
     bool firstImageReady;
     int storedframes;
@@ -151,19 +220,46 @@ private:
     int minY, maxY, ROIheight;
     
     // General buffers
-    ofxCvColorImage         zedColorImage;
     ofShortPixels     zedDepthImage;
-    ofFloatPixels filteredframe;
-    glm::vec2* gradField;
+    ofFloatPixels filteredframe; // Frame being filtered, moved into the next DepthFrame
+    sl::Mat depthMat;
+    
+    // Reduced resolution processing
+    int processingScale; // Filters and gradient run on processingScale x processingScale blocks of Zed pixels
+    unsigned int procWidth, procHeight; // Size of the processing images
+    int procMinX, procMaxX, procMinY, procMaxY; // ROI in processing pixels
+    ofShortPixels processingDepthImage; // Block averaged depth frame
+    ofFloatPixels processingframe; // Filtered frame before upsampling
+    float* guideBuffer; // Full resolution depth guiding the edge-aware upsampling
+    float upsamplingRangeSigma; // Depth difference (mm) at which a processing pixel weight is halved
     
     // Filtering buffers
 	float* averagingBuffer; // Buffer to calculate running averages of each pixel's depth value
 	float* statBuffer; // Buffer retaining the running means and variances of each pixel's depth value
 	float* validBuffer; // Buffer holding the most recent stable depth value for each pixel
+	float* adaptiveBuffer; // Buffer holding the running mean, innovation variance, window length and last outlier innovation of each pixel, null while adaptive averaging is off
+    
+    // Tiles whose filtered depth changed since the last DepthFrame was sent
+    std::vector<unsigned char> changedTiles;
+    int tileCols, tileRows;
     
     // Gradient computation variables
-    int gradFieldcols, gradFieldrows;
-    int gradFieldresolution;           //Resolution of grid relative to window width and height in pixels
+    std::vector<std::shared_ptr<GradientField> > gradientPool; // Snapshots reused once the main thread has released them
+    static const size_t maxGradientSnapshots = 8;
+    unsigned int droppedGradientFields; // Not published, every snapshot of a full pool was in use
+    unsigned int frameNumber;
+    uint64_t grabTime; // us, last successful grab
+    float grabInterval; // ms, running mean of the time between grabs
+    
+    // Extrapolation of the sent frames to the time they are projected
+    DepthPredictor depthPredictor;
+    bool latencyPrediction;
+    float predictionLatency; // ms, measured by the application
+    
+    // Normals and hillshade of the sent frames, computed after they are sent
+    ShadeMap shadeMap;
+    bool hillshade;
+    float focalLength;
     float maxgradfield, depthrange;
     
     // Frame filter parameters
@@ -175,6 +271,10 @@ private:
     float outsideROIValue;
 	float hysteresis; // Amount by which a new filtered value has to differ from the current value to update the display
     bool followBigChange;
+    bool adaptiveAveraging; // Flag whether each pixel adapts its averaging window to its recent innovations
+    int minAveragingSlots; // Shortest window an adaptive pixel can shrink to (numAveragingSlots is the longest)
+    float innovationThreshold; // Normalized innovation (in standard deviations) above which a pixel is considered moving
+    float minInnovationVariance; // Lower bound of the innovation variance to keep the normalization well defined
     float bigChange; // Amount of change over which the averaging slot is reset to new value
 	float instableValue; // Value to assign to instable pixels if retainValids is false
 	bool spatialFilter; // Flag whether to apply a spatial filter to time-averaged depth values
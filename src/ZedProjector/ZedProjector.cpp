@@ -34,6 +34,15 @@ ZedProjector::ZedProjector(std::shared_ptr<ofAppBaseWindow> const& p)
 	basePlaneUpdated(false),
 	projZedCalibrationUpdated(false),
 	ROIUpdated(false),
+	depthVersion(0),
+	depthFrameReceived(false),
+	colorFrameReceived(false),
+	projWindowVersion(0),
+	basePlaneVersion(0),
+	calibrationVersion(0),
+	shadeVersion(0),
+	hillshade(false),
+	sunElevation(45),
 	imageStabilized(false),
 	waitingForFlattenSand(false),
 	drawZedView(false)
@@ -73,6 +82,7 @@ void ZedProjector::setup(bool sdisplayGui) {
 
 	// 	Gradient Field
 	gradFieldResolution = 10;
+	gradFieldLevel = 0;
 	arrowLength = 25;
 
 	// Setup default base plane
@@ -94,6 +104,14 @@ void ZedProjector::setup(bool sdisplayGui) {
 	spatialFiltering = true;
 	followBigChanges = false;
 	numAveragingSlots = 15;
+	adaptiveAveraging = false;
+	minAveragingSlots = 2;
+	processingScale = 1;
+	asyncDepthUpload = true;
+	latencyPrediction = false;
+	depthTextureFormat = DepthTextureStreamer::DEPTH_FORMAT_FLOAT32;
+	colorStreamRate = 10;
+	colorStreamSubscribed = false;
 
 	// Get projector and Zed width & height
 	projRes = glm::vec2(projWindow->getWidth(), projWindow->getHeight());
@@ -102,6 +120,15 @@ void ZedProjector::setup(bool sdisplayGui) {
 
 	// Initialize the fbos and images
 	FilteredDepthImage.allocate(zedRes.x, zedRes.y);
+	depthFrame.pixels.allocate(zedRes.x, zedRes.y, 1);
+	depthFrame.pixels.set(0);
+	depthFrame.tileCols = (zedRes.x + DepthFrame::tileSize - 1) / DepthFrame::tileSize;
+	depthFrame.tileRows = (zedRes.y + DepthFrame::tileSize - 1) / DepthFrame::tileSize;
+	depthFrame.dirtyTiles.assign(depthFrame.tileCols*depthFrame.tileRows, 1);
+	tileVersions.assign(depthFrame.tileCols*depthFrame.tileRows, 0);
+	depthTileRanges.resize(depthFrame.tileCols*depthFrame.tileRows);
+	handoffTime = 0;
+	handoffFrames = 0;
 	ZedColorImage.allocate(zedRes.x, zedRes.y);
 	thresholdedImage.allocate(zedRes.x, zedRes.y);
 	Dptimg.allocate(20, 20); // Small detailed ROI
@@ -134,19 +161,31 @@ void ZedProjector::setup(bool sdisplayGui) {
 	else {
 		ofLogVerbose("ZedProjector") << "ZedProjector.setup(): Settings could not be loaded ";
 	}
+	for (int i = 0; i < depthFrame.tileCols*depthFrame.tileRows; i++)
+		updateDepthTileRange(i);
+
+	// Allocate the depth texture in the selected format
+	depthStreamer.setup(zedRes.x, zedRes.y, static_cast<DepthTextureStreamer::DepthFormat>(depthTextureFormat));
+	depthTextureFormat = depthStreamer.getFormat(); // 32-bit float if the driver lacks the 16-bit formats
+	depthStreamer.setAsync(asyncDepthUpload);
+	depthStreamer.allocateTexture(depthTexture);
+	shadePixels.allocate(zedRes.x, zedRes.y, 4);
+	shadeTexture.allocate(zedRes.x, zedRes.y, GL_RGBA);
+	shadeTexture.setTextureMinMagFilter(GL_LINEAR, GL_LINEAR);
+	shadeDirtyTiles.assign(depthFrame.tileCols*depthFrame.tileRows, 0);
+	shadeTileVersions.assign(depthFrame.tileCols*depthFrame.tileRows, 0);
 
 	// finish zedGrabber setup and start the grabber
-	zedGrabber.setupFramefilter(gradFieldResolution, maxOffset, zedROI, spatialFiltering, followBigChanges, numAveragingSlots);
+	zedGrabber.setupFramefilter(maxOffset, zedROI, spatialFiltering, followBigChanges, numAveragingSlots, adaptiveAveraging, minAveragingSlots, processingScale);
+	zedGrabber.setLatencyPrediction(latencyPrediction);
 	ZedWorldMatrix = zedGrabber.getWorldMatrix();
 	ofLogVerbose("ZedProjector") << "ZedProjector.setup(): ZedWorldMatrix: " << ZedWorldMatrix;
 
-	// Setup gradient field
-	setupGradientField();
-
 	fboProjWindow.allocate(projRes.x, projRes.y, GL_RGBA);
 	fboProjWindow.begin();
 	ofClear(255, 255, 255, 0);
 	fboProjWindow.end();
+	projWindowVersion++;
 
 	fboMainWindow.allocate(zedRes.x, zedRes.y, GL_RGBA);
 	fboMainWindow.begin();
@@ -169,23 +208,11 @@ void ZedProjector::exit(ofEventArgs& e) {
 	}
 }
 
-void ZedProjector::setupGradientField() {
-	gradFieldcols = zedRes.x / gradFieldResolution;
-	gradFieldrows = zedRes.y / gradFieldResolution;
-
-	gradField = new glm::vec2[gradFieldcols*gradFieldrows];
-	glm::vec2* gfPtr = gradField;
-	for (unsigned int y = 0; y<gradFieldrows; ++y)
-		for (unsigned int x = 0; x<gradFieldcols; ++x, ++gfPtr)
-			*gfPtr = glm::vec2(0);
-}
-
 void ZedProjector::setGradFieldResolution(int sgradFieldResolution) {
+	// The gradient snapshots hold a pyramid of resolutions, the closest one is used
 	gradFieldResolution = sgradFieldResolution;
-	setupGradientField();
-	zedGrabber.performInThread([sgradFieldResolution](ZedGrabber & kg) {
-		kg.setGradFieldResolution(sgradFieldResolution);
-	});
+	if (gradientField)
+		gradFieldLevel = gradientField->getLevel(gradFieldResolution);
 }
 
 void ZedProjector::update() {
@@ -197,25 +224,31 @@ void ZedProjector::update() {
 	if (displayGui)
 		gui->update();
 
-	// Get depth image from Zed grabber
-	ofFloatPixels filteredframe;
-	if (zedGrabber.filtered.tryReceive(filteredframe)) {
-		FilteredDepthImage.setFromPixels(filteredframe.getData(), zedRes.x, zedRes.y);
-		FilteredDepthImage.updateTexture();
-
-		// Get color image from Zed grabber
-		ofPixels coloredframe;
-		if (zedGrabber.colored.tryReceive(coloredframe)) {
-			ZedColorImage.setFromPixels(coloredframe);
-		}
+	// The color stream only runs while a calibration needs the camera image
+	if (calibrating != colorStreamSubscribed) {
+		colorStreamSubscribed = calibrating;
+		float rate = colorStreamSubscribed ? colorStreamRate : 0;
+		zedGrabber.performInThread([rate](ZedGrabber & kg) {
+			kg.setColorStreamRate(rate);
+		});
+		colorFrameReceived = false; // Wait for the first frame of the new stream
+	}
 
-		// Get gradient field from Zed grabber
-		zedGrabber.gradient.tryReceive(gradField);
+	// Get color image from Zed grabber, keep the most recent one
+	ofPixels coloredframe;
+	bool newColorFrame = false;
+	while (zedGrabber.colored.tryReceive(coloredframe))
+		newColorFrame = true;
+	if (newColorFrame && colorStreamSubscribed) {
+		ZedColorImage.setFromPixels(coloredframe);
+		colorFrameReceived = true;
+	}
 
-		// Update grabber stored frame number
-		zedGrabber.lock();
-		zedGrabber.decStoredframes();
-		zedGrabber.unlock();
+	// Get depth image from Zed grabber, frames received right before drawing the projector are processed here too
+	receiveDepthFrame();
+	receiveShadeFrames();
+	if (depthFrameReceived) {
+		depthFrameReceived = false;
 
 		// Is the depth image stabilized
 		imageStabilized = zedGrabber.isImageStabilized();
@@ -239,6 +272,161 @@ void ZedProjector::update() {
 			fboMainWindow.end();
 		}
 	}
+
+	// Bind the terrain sampler to the current frame, gradient snapshot and base plane
+	terrainSampler.bind(depthFrame.pixels.getData(), zedRes.x, zedRes.y, ZedWorldMatrix, basePlaneEq,
+		gradientField, gradFieldLevel, depthFrame.frameNumber);
+}
+
+bool ZedProjector::receiveDepthFrame() {
+	DepthFrame newDepthFrame;
+	if (!zedGrabber.filtered.tryReceive(newDepthFrame))
+		return false;
+
+	// Keep the newest frame only. The dirty tiles are relative to the previous frame, so
+	// those of the skipped frames are merged into the newest one before uploading it.
+	int numReceived = 1;
+	DepthFrame nextDepthFrame;
+	while (zedGrabber.filtered.tryReceive(nextDepthFrame)) {
+		for (size_t i = 0; i < nextDepthFrame.dirtyTiles.size() && i < newDepthFrame.dirtyTiles.size(); i++)
+			nextDepthFrame.dirtyTiles[i] |= newDepthFrame.dirtyTiles[i];
+		std::swap(newDepthFrame, nextDepthFrame);
+		zedGrabber.recycled.send(std::move(nextDepthFrame.pixels));
+		numReceived++;
+	}
+
+	// Adopt the received buffer and give the previous one back to the grabber
+	uint64_t handoffStart = ofGetElapsedTimeMicros();
+	std::swap(depthFrame, newDepthFrame);
+	zedGrabber.recycled.send(std::move(newDepthFrame.pixels));
+	depthStreamer.upload(depthTexture, depthFrame);
+	depthVersion++;
+	for (size_t i = 0; i < tileVersions.size() && i < depthFrame.dirtyTiles.size(); i++)
+		if (depthFrame.dirtyTiles[i])
+			tileVersions[i] = depthVersion;
+	if (drawZedView)
+		FilteredDepthImage.setFromPixels(depthFrame.pixels.getData(), zedRes.x, zedRes.y);
+	handoffTime += ofGetElapsedTimeMicros() - handoffStart;
+	if (++handoffFrames == 300) {
+		ofLogVerbose("ZedProjector") << "receiveDepthFrame(): Depth frame handoff: " << handoffTime / handoffFrames << " us per frame";
+		handoffTime = 0;
+		handoffFrames = 0;
+	}
+	for (size_t i = 0; i < depthTileRanges.size() && i < depthFrame.dirtyTiles.size(); i++)
+		if (depthFrame.dirtyTiles[i])
+			updateDepthTileRange(i);
+
+	// Get the newest gradient field from Zed grabber, the previous snapshots go back to the grabber pool
+	bool newGradientField = false;
+	while (zedGrabber.gradient.tryReceive(gradientField))
+		newGradientField = true;
+	if (newGradientField)
+		gradFieldLevel = gradientField->getLevel(gradFieldResolution);
+
+	// Update grabber stored frame number
+	zedGrabber.lock();
+	for (int i = 0; i < numReceived; i++)
+		zedGrabber.decStoredframes();
+	zedGrabber.unlock();
+
+	depthFrameReceived = true; // Processed by the next update()
+	return true;
+}
+
+void ZedProjector::invalidateDepthTiles() {
+	std::fill(tileVersions.begin(), tileVersions.end(), depthVersion);
+}
+
+bool ZedProjector::isDepthTileChangedSince(int col, int row, unsigned int version) const {
+	return tileVersions[row*depthFrame.tileCols + col] > version;
+}
+
+void ZedProjector::updateDepthTileRange(int tile) {
+	// The sandbox mesh only covers the ROI, the pixels outside it are left out
+	int col = tile % depthFrame.tileCols;
+	int row = tile / depthFrame.tileCols;
+	int width = depthFrame.pixels.getWidth();
+	int minX = std::max(col*DepthFrame::tileSize, static_cast<int>(zedROI.getLeft()));
+	int maxX = std::min((col + 1)*DepthFrame::tileSize, static_cast<int>(zedROI.getRight()));
+	int minY = std::max(row*DepthFrame::tileSize, static_cast<int>(zedROI.getTop()));
+	int maxY = std::min((row + 1)*DepthFrame::tileSize, static_cast<int>(zedROI.getBottom()));
+	DepthTileRange& range = depthTileRanges[tile];
+	range.depthMin = std::numeric_limits<float>::max();
+	range.depthMax = -std::numeric_limits<float>::max();
+	range.holes = false;
+	for (int y = minY; y < maxY; y++) {
+		const float* depthPtr = depthFrame.pixels.getData() + y*width;
+		for (int x = minX; x < maxX; x++) {
+			float depth = depthPtr[x];
+			if (depth > 0) {
+				range.depthMin = std::min(range.depthMin, depth);
+				range.depthMax = std::max(range.depthMax, depth);
+			}
+			else {
+				range.holes = true;
+			}
+		}
+	}
+}
+
+void ZedProjector::receiveShadeFrames() {
+	// The shade frames only hold the tiles changed since the previous one, they are all applied in order
+	const int tileSize = DepthFrame::tileSize;
+	const int width = zedRes.x, height = zedRes.y;
+	bool received = false;
+	ShadeFrame frame;
+	while (zedGrabber.shade.tryReceive(frame)) {
+		uint32_t* dst = reinterpret_cast<uint32_t*>(shadePixels.getData());
+		const uint32_t* texels = frame.texels.data();
+		for (int tile : frame.tiles) {
+			int x0 = (tile % depthFrame.tileCols)*tileSize;
+			int y0 = (tile / depthFrame.tileCols)*tileSize;
+			int w = std::min(tileSize, width - x0);
+			int h = std::min(tileSize, height - y0);
+			for (int y = 0; y < h; y++)
+				std::copy(texels + y*tileSize, texels + y*tileSize + w, dst + (y0 + y)*width + x0);
+			texels += tileSize*tileSize;
+			shadeDirtyTiles[tile] = 1;
+		}
+		zedGrabber.shadeRecycled.send(std::move(frame));
+		received = true;
+	}
+	if (received)
+		uploadShadeTiles();
+}
+
+void ZedProjector::uploadShadeTiles() {
+	// Runs of dirty tiles of each tile row, read from shadePixels with its row length
+	const int tileSize = DepthFrame::tileSize;
+	const int width = zedRes.x, height = zedRes.y;
+	shadeVersion++;
+	const ofTextureData& texData = shadeTexture.getTextureData();
+	glBindTexture(texData.textureTarget, texData.textureID);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, width);
+	for (int row = 0; row < depthFrame.tileRows; row++) {
+		int col = 0;
+		while (col < depthFrame.tileCols) {
+			if (!shadeDirtyTiles[row*depthFrame.tileCols + col]) {
+				col++;
+				continue;
+			}
+			int runStart = col;
+			for (; col < depthFrame.tileCols && shadeDirtyTiles[row*depthFrame.tileCols + col]; col++) {
+				shadeTileVersions[row*depthFrame.tileCols + col] = shadeVersion;
+				shadeDirtyTiles[row*depthFrame.tileCols + col] = 0;
+			}
+			int x = runStart*tileSize, y = row*tileSize;
+			int w = std::min(col*tileSize, width) - x;
+			int h = std::min(tileSize, height - y);
+			glTexSubImage2D(texData.textureTarget, 0, x, y, w, h, GL_RGBA, GL_UNSIGNED_BYTE, shadePixels.getData() + (y*width + x) * 4);
+		}
+	}
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glBindTexture(texData.textureTarget, 0);
+}
+
+bool ZedProjector::isShadeTileChangedSince(int col, int row, unsigned int version) const {
+	return shadeTileVersions[row*depthFrame.tileCols + col] > version;
 }
 
 void ZedProjector::updateCalibration() {
@@ -302,13 +490,15 @@ void ZedProjector::updateROIFromColorImage() {
 	fboProjWindow.begin();
 	ofBackground(255);
 	fboProjWindow.end();
+	projWindowVersion++;
 	if (ROICalibState == ROI_CALIBRATION_STATE_INIT) { // set Zed to max depth range
 		ROICalibState = ROI_CALIBRATION_STATE_MOVE_UP;
 		large = ofPolyline();
 		threshold = 90;
 
 	}
-	else if (ROICalibState == ROI_CALIBRATION_STATE_MOVE_UP) {
+	else if (ROICalibState == ROI_CALIBRATION_STATE_MOVE_UP && colorFrameReceived) {
+		colorFrameReceived = false;
 		while (threshold < 255) {
 			ZedColorImage.setROI(0, 0, zedRes.x, zedRes.y);
 			thresholdedImage = ZedColorImage;
@@ -359,7 +549,7 @@ void ZedProjector::updateROIFromDepthImage() {
 		ROICalibState = ROI_CALIBRATION_STATE_MOVE_UP;
 		large = ofPolyline();
 		ofxCvFloatImage temp;
-		temp.setFromPixels(FilteredDepthImage.getFloatPixelsRef().getData(), zedRes.x, zedRes.y);
+		temp.setFromPixels(depthFrame.pixels.getData(), zedRes.x, zedRes.y);
 		temp.setNativeScale(FilteredDepthImage.getNativeScaleMin(), FilteredDepthImage.getNativeScaleMax());
 		temp.convertToRange(0, 1);
 		thresholdedImage.setFromPixels(temp.getFloatPixelsRef());
@@ -448,6 +638,9 @@ void ZedProjector::setNewZedROI() {
 	// Update states variables
 	ROIcalibrated = true;
 	ROIUpdated = true;
+	calibrationVersion++;
+	for (size_t i = 0; i < depthTileRanges.size(); i++)
+		updateDepthTileRange(i);
 	saveCalibrationAndSettings();
 	updateZedGrabberROI(zedROI);
 }
@@ -502,7 +695,8 @@ void ZedProjector::updateProjZedAutoCalibration() {
 		autoCalibState = AUTOCALIB_STATE_NEXT_POINT;
 	}
 	else if (autoCalibState == AUTOCALIB_STATE_NEXT_POINT && imageStabilized) {
-		if (currentCalibPts < 5 || (upframe && currentCalibPts < 10)) {
+		if ((currentCalibPts < 5 || (upframe && currentCalibPts < 10)) && colorFrameReceived) {
+			colorFrameReceived = false; // Each color frame is searched once
 			if (!upframe) {
 				string mess = "Acquiring low level calibration point " + std::to_string(currentCalibPts + 1) + "/5.";
 				calibModal->setMessage(mess);
@@ -536,6 +730,7 @@ void ZedProjector::updateProjZedAutoCalibration() {
 						fboProjWindow.begin(); // Clear projector
 						ofBackground(255);
 						fboProjWindow.end();
+						projWindowVersion++;
 						cleared = false;
 						trials = 0;
 						currentCalibPts++;
@@ -551,6 +746,7 @@ void ZedProjector::updateProjZedAutoCalibration() {
 							fboProjWindow.begin(); // Clear projector
 							ofBackground(255);
 							fboProjWindow.end();
+							projWindowVersion++;
 							cleared = false;
 							trials = 0;
 						}
@@ -575,13 +771,14 @@ void ZedProjector::updateProjZedAutoCalibration() {
 						fboProjWindow.begin(); // Clear projector
 						ofBackground(255);
 						fboProjWindow.end();
+						projWindowVersion++;
 						cleared = false;
 						trials = 0;
 					}
 				}
 			}
 		}
-		else {
+		else if (currentCalibPts >= 5 && (!upframe || currentCalibPts >= 10)) {
 			if (upframe) { // We are done
 				calibModal->setMessage("Updating acquision ceiling.");
 				updateMaxOffset(); // Find max offset
@@ -616,6 +813,7 @@ void ZedProjector::updateProjZedAutoCalibration() {
 
 			projZedCalibrated = true; // Update states variables
 			projZedCalibrationUpdated = true;
+			calibrationVersion++;
 			calibrating = false;
 			calibModal->setMessage("Calibration successfull.");
 			calibModal->hide();
@@ -630,6 +828,9 @@ void ZedProjector::updateProjZedAutoCalibration() {
 void ZedProjector::updateProjZedManualCalibration() {
 	// Draw a Chessboard
 	drawChessboard(ofGetMouseX(), ofGetMouseY(), chessboardSize);
+	if (!colorFrameReceived)
+		return;
+	colorFrameReceived = false;
 	// Try to find the chess board on the Zed color image
 	cvRgbImage = ofxCv::toCv(ZedColorImage.getPixels());
 	cv::Size patternSize = cv::Size(chessboardX - 1, chessboardY - 1);
@@ -673,6 +874,7 @@ void ZedProjector::updateBasePlane() {
 	basePlaneNormalBack = basePlaneNormal;
 	basePlaneOffsetBack = basePlaneOffset;
 	basePlaneUpdated = true;
+	basePlaneVersion++;
 }
 
 void ZedProjector::updateMaxOffset() {
@@ -738,6 +940,7 @@ void ZedProjector::askToFlattenSand() {
 	fboProjWindow.begin();
 	ofBackground(255);
 	fboProjWindow.end();
+	projWindowVersion++;
 	confirmModal->setMessage("Please flatten the sand surface.");
 	confirmModal->show();
 	waitingForFlattenSand = true;
@@ -780,17 +983,24 @@ void ZedProjector::drawChessboard(int x, int y, int chessboardSize) {
 	}
 	ofSetColor(255);
 	fboProjWindow.end();
+	projWindowVersion++;
 }
 
 void ZedProjector::drawGradField()
 {
 	ofClear(255, 0);
+	if (!gradientField)
+		return;
+	int resolution = gradientField->getResolution(gradFieldLevel);
+	int gradFieldcols = gradientField->getCols(gradFieldLevel);
+	int gradFieldrows = gradientField->getRows(gradFieldLevel);
+	const glm::vec2* gradField = gradientField->getField(gradFieldLevel);
 	for (int rowPos = 0; rowPos< gradFieldrows; rowPos++)
 	{
 		for (int colPos = 0; colPos< gradFieldcols; colPos++)
 		{
-			float x = colPos*gradFieldResolution + gradFieldResolution / 2;
-			float y = rowPos*gradFieldResolution + gradFieldResolution / 2;
+			float x = colPos*resolution + resolution / 2;
+			float y = rowPos*resolution + resolution / 2;
 			glm::vec2 projectedPoint = zedCoordToProjCoord(x, y);
 			int ind = colPos + rowPos * gradFieldcols;
 			glm::vec2 v2 = gradField[ind];
@@ -822,6 +1032,33 @@ void ZedProjector::drawArrow(glm::vec2 projectedPoint, glm::vec2 v1)
 
 void ZedProjector::updateNativeScale(float scaleMin, float scaleMax) {
 	FilteredDepthImage.setNativeScale(scaleMin, scaleMax);
+
+	// The 16-bit depth textures are quantized over the same range, re-encode the current frame
+	depthStreamer.setQuantizationRange(scaleMin, scaleMax);
+	if (depthStreamer.getFormat() != DepthTextureStreamer::DEPTH_FORMAT_FLOAT32)
+		depthStreamer.upload(depthTexture, depthFrame);
+	depthVersion++;
+	invalidateDepthTiles();
+}
+
+float ZedProjector::getProjectorPixelsPerZedPixel()
+{
+	if (!projZedCalibrated)
+		return 1;
+	// Footprint of the projector image on the base plane, in Zed pixels
+	glm::vec2 corners[4] = {
+		worldCoordToZedCoord(projCoordAndWorldZToWorldCoord(0, 0, basePlaneOffset.z)),
+		worldCoordToZedCoord(projCoordAndWorldZToWorldCoord(projRes.x, 0, basePlaneOffset.z)),
+		worldCoordToZedCoord(projCoordAndWorldZToWorldCoord(projRes.x, projRes.y, basePlaneOffset.z)),
+		worldCoordToZedCoord(projCoordAndWorldZToWorldCoord(0, projRes.y, basePlaneOffset.z))
+	};
+	float area = 0;
+	for (int i = 0; i < 4; i++)
+		area += corners[i].x*corners[(i + 1) % 4].y - corners[(i + 1) % 4].x*corners[i].y;
+	area = std::abs(area) / 2;
+	if (area < 1)
+		return 1;
+	return sqrt(projRes.x*projRes.y / area);
 }
 
 glm::vec2 ZedProjector::zedCoordToProjCoord(float x, float y) // x, y in Zed pixel coord
@@ -829,6 +1066,25 @@ glm::vec2 ZedProjector::zedCoordToProjCoord(float x, float y) // x, y in Zed pix
 	return worldCoordToProjCoord(ZedCoordToWorldCoord(x, y));
 }
 
+ofRectangle ZedProjector::zedRectToProjRect(const ofRectangle& zedRect, float depthMin, float depthMax) // Projected bounds for depths in the range
+{
+	ofRectangle projRect;
+	bool first = true;
+	for (float depth : { depthMin, depthMax }) {
+		for (int i = 0; i < 4; i++) {
+			glm::vec4 kc = glm::vec4(i & 1 ? zedRect.getRight() : zedRect.getLeft(), i & 2 ? zedRect.getBottom() : zedRect.getTop(), depth, 1);
+			glm::vec4 wc = ZedWorldMatrix*kc*depth;
+			glm::vec2 pc = worldCoordToProjCoord(glm::vec3(wc));
+			if (first)
+				projRect.set(pc.x, pc.y, 0, 0);
+			else
+				projRect.growToInclude(pc.x, pc.y);
+			first = false;
+		}
+	}
+	return projRect;
+}
+
 glm::vec2 ZedProjector::worldCoordToProjCoord(glm::vec3 vin)
 {
 	glm::vec4 wc = glm::vec4(vin, 0);
@@ -859,7 +1115,7 @@ glm::vec3 ZedProjector::ZedCoordToWorldCoord(float x, float y) // x, y in Zed pi
 {
 	glm::vec4 kc = glm::vec4(x, y, 0, 0);
 	int ind = static_cast<int>(y) * zedRes.x + static_cast<int>(x);
-	kc.z = FilteredDepthImage.getFloatPixelsRef().getData()[ind];
+	kc.z = depthFrame.pixels.getData()[ind];
 	kc.w = 1;
 	glm::vec4 wc = ZedWorldMatrix*kc*kc.z;
 	return glm::vec3(wc);
@@ -897,10 +1153,32 @@ float ZedProjector::elevationToZedDepth(float elevation, float x, float y) // x,
 	return ZedDepth;
 }
 
+glm::vec2 ZedProjector::zedCoordAndElevationToProjCoord(float x, float y, float elevation) // x, y in Zed pixel coordinate
+{
+	// Depth d of the Zed ray through x, y at that elevation:
+	// -dot(basePlaneEq, ZedWorldMatrix*(x, y, d, 1)*d) = elevation, a quadratic in d
+	glm::vec3 normal(basePlaneEq);
+	float a = glm::dot(normal, glm::vec3(ZedWorldMatrix[2]));
+	float b = glm::dot(normal, glm::vec3(ZedWorldMatrix[0]))*x + glm::dot(normal, glm::vec3(ZedWorldMatrix[1]))*y + glm::dot(normal, glm::vec3(ZedWorldMatrix[3]));
+	float c = basePlaneEq.w + elevation;
+	float depth = -c / b;
+	float discriminant = b*b - 4 * a*c;
+	if (std::abs(a*depth) > 1e-6*std::abs(b) && discriminant >= 0) {
+		// Root closest to the linear solution
+		float root1 = (-b + std::sqrt(discriminant)) / (2 * a);
+		float root2 = (-b - std::sqrt(discriminant)) / (2 * a);
+		depth = std::abs(root1 - depth) < std::abs(root2 - depth) ? root1 : root2;
+	}
+	glm::vec4 wc = ZedWorldMatrix*glm::vec4(x, y, depth, 1)*depth;
+	return worldCoordToProjCoord(glm::vec3(wc));
+}
+
 glm::vec2 ZedProjector::gradientAtZedCoord(float x, float y) {
-	int ind = static_cast<int>(floor(x / gradFieldResolution)) + gradFieldcols*static_cast<int>(floor(y / gradFieldResolution));
-	fishInd = ind;
-	return gradField[ind];
+	if (!gradientField)
+		return glm::vec2(0);
+	int resolution = gradientField->getResolution(gradFieldLevel);
+	fishInd = static_cast<int>(floor(x / resolution)) + gradientField->getCols(gradFieldLevel)*static_cast<int>(floor(y / resolution));
+	return gradientField->getGradient(x, y, gradFieldLevel);
 }
 
 void ZedProjector::setupGui() {
@@ -914,12 +1192,24 @@ void ZedProjector::setupGui() {
 	gui->addButton("Reset sea level");
 	gui->addBreak();
 
+	vector<string> processingResolutions = { "Full resolution", "Half resolution", "Quarter resolution" };
+	gui->addDropdown("Processing resolution", processingResolutions)->setName("Processing resolution");
+	gui->getDropdown("Processing resolution")->select(processingScale == 4 ? 2 : processingScale - 1);
+	vector<string> depthTextureFormats = { "32-bit float depth", "16-bit half float depth", "16-bit normalized depth" };
+	gui->addDropdown("Depth texture format", depthTextureFormats)->setName("Depth texture format");
+	gui->getDropdown("Depth texture format")->select(depthTextureFormat);
+	gui->addBreak();
+
 	auto advancedFolder = gui->addFolder("Advanced", ofColor::purple);
 	advancedFolder->addToggle("Display Zed depth view", drawZedView)->setName("Draw Zed depth view");
 	advancedFolder->addSlider("Ceiling", -300, 300, 0);
 	advancedFolder->addToggle("Spatial filtering", spatialFiltering);
-	advancedFolder->addToggle("Quick reaction", followBigChanges);
+	advancedFolder->addToggle("Quick reaction", followBigChanges)->setEnabled(!adaptiveAveraging); // The adaptive window reacts by itself
 	advancedFolder->addSlider("Averaging", 1, 40, numAveragingSlots)->setPrecision(0);
+	advancedFolder->addToggle("Adaptive averaging", adaptiveAveraging);
+	advancedFolder->addSlider("Min averaging", 1, 40, minAveragingSlots)->setPrecision(0);
+	advancedFolder->addToggle("Async depth upload", asyncDepthUpload);
+	advancedFolder->addToggle("Latency prediction", latencyPrediction);
 	advancedFolder->addBreak();
 	advancedFolder->addButton("Calibrate")->setName("Full Calibration");
 	//	advancedFolder->addButton("Update ROI from calibration");
@@ -935,6 +1225,7 @@ void ZedProjector::setupGui() {
 	gui->onButtonEvent(this, &ZedProjector::onButtonEvent);
 	gui->onToggleEvent(this, &ZedProjector::onToggleEvent);
 	gui->onSliderEvent(this, &ZedProjector::onSliderEvent);
+	gui->onDropdownEvent(this, &ZedProjector::onDropdownEvent);
 
 	// disactivate autodraw
 	gui->setAutoDraw(false);
@@ -986,6 +1277,71 @@ void ZedProjector::setFollowBigChanges(bool sfollowBigChanges) {
 	});
 }
 
+void ZedProjector::setAdaptiveAveraging(bool sadaptiveAveraging) {
+	adaptiveAveraging = sadaptiveAveraging;
+	zedGrabber.performInThread([sadaptiveAveraging](ZedGrabber & kg) {
+		kg.setAdaptiveAveraging(sadaptiveAveraging);
+	});
+}
+
+void ZedProjector::setAsyncDepthUpload(bool sasyncDepthUpload) {
+	asyncDepthUpload = sasyncDepthUpload;
+	depthStreamer.setAsync(asyncDepthUpload);
+}
+
+void ZedProjector::setLatencyPrediction(bool slatencyPrediction) {
+	latencyPrediction = slatencyPrediction;
+	zedGrabber.performInThread([slatencyPrediction](ZedGrabber & kg) {
+		kg.setLatencyPrediction(slatencyPrediction);
+	});
+}
+
+void ZedProjector::setPredictionLatency(float spredictionLatency) {
+	zedGrabber.performInThread([spredictionLatency](ZedGrabber & kg) {
+		kg.setPredictionLatency(spredictionLatency);
+	});
+}
+
+void ZedProjector::setHillshade(bool shillshade) {
+	if (shillshade && !hillshade) {
+		// Flat until the grabber shades every tile again
+		uint32_t flat = ShadeMap::getFlatTexel(sunElevation);
+		uint32_t* data = reinterpret_cast<uint32_t*>(shadePixels.getData());
+		std::fill(data, data + shadePixels.getWidth()*shadePixels.getHeight(), flat);
+		std::fill(shadeDirtyTiles.begin(), shadeDirtyTiles.end(), 1);
+		uploadShadeTiles();
+	}
+	hillshade = shillshade;
+	zedGrabber.performInThread([shillshade](ZedGrabber & kg) {
+		kg.setHillshade(shillshade);
+	});
+}
+
+void ZedProjector::setSunDirection(float azimuth, float elevation) {
+	sunElevation = elevation;
+	zedGrabber.performInThread([azimuth, elevation](ZedGrabber & kg) {
+		kg.setSunDirection(azimuth, elevation);
+	});
+}
+
+void ZedProjector::setDepthTextureFormat(int sdepthTextureFormat) {
+	depthStreamer.setup(zedRes.x, zedRes.y, static_cast<DepthTextureStreamer::DepthFormat>(sdepthTextureFormat));
+	depthTextureFormat = depthStreamer.getFormat();
+	if (depthTextureFormat != sdepthTextureFormat && displayGui)
+		gui->getDropdown("Depth texture format")->select(depthTextureFormat);
+	depthStreamer.allocateTexture(depthTexture);
+	depthStreamer.upload(depthTexture, depthFrame);
+	depthVersion++;
+	invalidateDepthTiles();
+}
+
+void ZedProjector::setProcessingScale(int sprocessingScale) {
+	processingScale = sprocessingScale;
+	zedGrabber.performInThread([sprocessingScale](ZedGrabber & kg) {
+		kg.setProcessingScale(sprocessingScale);
+	});
+}
+
 void ZedProjector::onButtonEvent(ofxDatGuiButtonEvent e) {
 	if (e.target->is("Full Calibration")) {
 		startFullCalibration();
@@ -1013,6 +1369,7 @@ void ZedProjector::onButtonEvent(ofxDatGuiButtonEvent e) {
 		basePlaneOffset = basePlaneOffsetBack;
 		basePlaneEq = getPlaneEquation(basePlaneOffset, basePlaneNormal);
 		basePlaneUpdated = true;
+		basePlaneVersion++;
 	}
 }
 
@@ -1023,6 +1380,16 @@ void ZedProjector::onToggleEvent(ofxDatGuiToggleEvent e) {
 	else if (e.target->is("Quick reaction")) {
 		setFollowBigChanges(e.checked);
 	}
+	else if (e.target->is("Adaptive averaging")) {
+		setAdaptiveAveraging(e.checked);
+		gui->getToggle("Quick reaction")->setEnabled(!adaptiveAveraging);
+	}
+	else if (e.target->is("Async depth upload")) {
+		setAsyncDepthUpload(e.checked);
+	}
+	else if (e.target->is("Latency prediction")) {
+		setLatencyPrediction(e.checked);
+	}
 	else if (e.target->is("Draw Zed depth view")) {
 		drawZedView = e.checked;
 	}
@@ -1034,11 +1401,13 @@ void ZedProjector::onSliderEvent(ofxDatGuiSliderEvent e) {
 		glm::rotate(basePlaneNormal, (glm::mediump_float)gui->getSlider("Tilt Y")->getValue(), glm::vec3(0, 1, 0));
 		basePlaneEq = getPlaneEquation(basePlaneOffset, basePlaneNormal);
 		basePlaneUpdated = true;
+		basePlaneVersion++;
 	}
 	else if (e.target->is("Vertical offset")) {
 		basePlaneOffset.z = basePlaneOffsetBack.z + e.value;
 		basePlaneEq = getPlaneEquation(basePlaneOffset, basePlaneNormal);
 		basePlaneUpdated = true;
+		basePlaneVersion++;
 	}
 	else if (e.target->is("Ceiling")) {
 		maxOffset = maxOffsetBack - e.value;
@@ -1052,6 +1421,29 @@ void ZedProjector::onSliderEvent(ofxDatGuiSliderEvent e) {
 		zedGrabber.performInThread([e](ZedGrabber & kg) {
 			kg.setAveragingSlotsNumber(e.value);
 		});
+		// The grabber lowers its minimum window with the maximum one, so does the slider
+		if (minAveragingSlots > numAveragingSlots) {
+			minAveragingSlots = numAveragingSlots;
+			gui->getSlider("Min averaging")->setValue(minAveragingSlots);
+		}
+	}
+	else if (e.target->is("Min averaging")) {
+		minAveragingSlots = std::max(1, std::min(static_cast<int>(e.value), numAveragingSlots));
+		if (minAveragingSlots != static_cast<int>(e.value))
+			e.target->setValue(minAveragingSlots);
+		int slots = minAveragingSlots;
+		zedGrabber.performInThread([slots](ZedGrabber & kg) {
+			kg.setMinAveragingSlotsNumber(slots);
+		});
+	}
+}
+
+void ZedProjector::onDropdownEvent(ofxDatGuiDropdownEvent e) {
+	if (e.target->is("Processing resolution")) {
+		setProcessingScale(1 << e.child); // Full, half or quarter resolution
+	}
+	else if (e.target->is("Depth texture format")) {
+		setDepthTextureFormat(e.child);
 	}
 }
 
@@ -1131,17 +1523,42 @@ bool ZedProjector::loadSettings() {
 		return false;
 	xml.setTo("ZedSETTINGS");
 	zedROI = xml.getValue<ofRectangle>("ZedROI");
-	basePlaneNormalBack = xml.getValue<glm::vec3>("basePlaneNormalBack");
-	basePlaneNormal = basePlaneNormalBack;
-	basePlaneOffsetBack = xml.getValue<glm::vec3>("basePlaneOffsetBack");
-	basePlaneOffset = basePlaneOffsetBack;
-	basePlaneEq = xml.getValue<glm::vec4>("basePlaneEq");
-	maxOffsetBack = xml.getValue<float>("maxOffsetBack");
-	maxOffset = maxOffsetBack;
+	// Files saved before the depth frames were in millimeters hold a base plane in other units,
+	// the defaults are kept and the sandbox has to be calibrated again
+	bool millimeters = xml.getValue<string>("depthUnits") == "mm";
+	if (millimeters) {
+		basePlaneNormalBack = xml.getValue<glm::vec3>("basePlaneNormalBack");
+		basePlaneNormal = basePlaneNormalBack;
+		basePlaneOffsetBack = xml.getValue<glm::vec3>("basePlaneOffsetBack");
+		basePlaneOffset = basePlaneOffsetBack;
+		basePlaneEq = xml.getValue<glm::vec4>("basePlaneEq");
+		maxOffsetBack = xml.getValue<float>("maxOffsetBack");
+		maxOffset = maxOffsetBack;
+	}
+	else {
+		ofLogWarning("ZedProjector") << "loadSettings(): " << settingsFile << " has no millimeter base plane, the sandbox has to be calibrated again";
+	}
 	spatialFiltering = xml.getValue<bool>("spatialFiltering");
 	followBigChanges = xml.getValue<bool>("followBigChanges");
 	numAveragingSlots = xml.getValue<int>("numAveragingSlots");
-	return true;
+	if (xml.exists("adaptiveAveraging")) {
+		adaptiveAveraging = xml.getValue<bool>("adaptiveAveraging");
+		minAveragingSlots = xml.getValue<int>("minAveragingSlots");
+	}
+	numAveragingSlots = std::max(numAveragingSlots, 1);
+	minAveragingSlots = std::max(1, std::min(minAveragingSlots, numAveragingSlots));
+	if (xml.exists("processingScale")) {
+		// The grabber block-averages by 1, 2 or 4, snap anything else down to one of them
+		int scale = xml.getValue<int>("processingScale");
+		processingScale = scale >= 4 ? 4 : (scale >= 2 ? 2 : 1);
+	}
+	if (xml.exists("asyncDepthUpload"))
+		asyncDepthUpload = xml.getValue<bool>("asyncDepthUpload");
+	if (xml.exists("latencyPrediction"))
+		latencyPrediction = xml.getValue<bool>("latencyPrediction");
+	if (xml.exists("depthTextureFormat"))
+		depthTextureFormat = std::max(0, std::min(xml.getValue<int>("depthTextureFormat"), static_cast<int>(DepthTextureStreamer::DEPTH_FORMAT_UNORM16)));
+	return millimeters;
 }
 
 bool ZedProjector::saveSettings() {
@@ -1151,6 +1568,7 @@ bool ZedProjector::saveSettings() {
 	xml.addChild("zedSETTINGS");
 	xml.setTo("zedSETTINGS");
 	xml.addValue("zedROI", zedROI);
+	xml.addValue("depthUnits", string("mm"));
 	xml.addValue("basePlaneNormalBack", basePlaneNormalBack);
 	xml.addValue("basePlaneOffsetBack", basePlaneOffsetBack);
 	xml.addValue("basePlaneEq", basePlaneEq);
@@ -1158,6 +1576,12 @@ bool ZedProjector::saveSettings() {
 	xml.addValue("spatialFiltering", spatialFiltering);
 	xml.addValue("followBigChanges", followBigChanges);
 	xml.addValue("numAveragingSlots", numAveragingSlots);
+	xml.addValue("adaptiveAveraging", adaptiveAveraging);
+	xml.addValue("minAveragingSlots", minAveragingSlots);
+	xml.addValue("processingScale", processingScale);
+	xml.addValue("asyncDepthUpload", asyncDepthUpload);
+	xml.addValue("latencyPrediction", latencyPrediction);
+	xml.addValue("depthTextureFormat", depthTextureFormat);
 	xml.setToParent();
 	return xml.save(settingsFile);
 }
@@ -33,6 +33,8 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 
 #include "ZedProjectorCalibration.h"
 #include "Utils.h"
+#include "TerrainSampler.h"
+#include "DepthTextureStreamer.h"
 class ofxModalThemeProjZed : public ofxModalTheme {
 public:
 	ofxModalThemeProjZed()
@@ -50,21 +52,34 @@ public:
 	// Running loop functions
 	void setup(bool sdisplayGui);
 	void update();
+	bool receiveDepthFrame(); // Adopts a new depth frame if there is one, also called right before drawing the projector
 	void updateNativeScale(float scaleMin, float scaleMax);
 	void drawProjectorWindow();
 	void drawMainWindow(float x, float y, float width, float height);
+	const ofFbo& getProjectorWindowFbo() const { // Calibration patterns, layer of the projector compositor
+		return fboProjWindow;
+	}
+	unsigned int getProjectorWindowVersion() const {
+		return projWindowVersion;
+	}
 	void drawGradField();
 
 	// Coordinate conversion functions
 	glm::vec2 worldCoordToProjCoord(glm::vec3 vin);
 	glm::vec3 projCoordAndWorldZToWorldCoord(float projX, float projY, float worldZ);
 	glm::vec2 zedCoordToProjCoord(float x, float y);
+	ofRectangle zedRectToProjRect(const ofRectangle& zedRect, float depthMin, float depthMax);
 	glm::vec3 ZedCoordToWorldCoord(float x, float y);
 	glm::vec2 worldCoordToZedCoord(glm::vec3 wc);
 	glm::vec3 RawZedCoordToWorldCoord(float x, float y);
 	float elevationAtZedCoord(float x, float y);
 	float elevationToZedDepth(float elevation, float x, float y);
+	glm::vec2 zedCoordAndElevationToProjCoord(float x, float y, float elevation); // Independent of the current depth frame
 	glm::vec2 gradientAtZedCoord(float x, float y);
+	float getProjectorPixelsPerZedPixel();
+	const TerrainSampler& getTerrainSampler() const { // Bound to the current frame, valid until the next depth frame is received
+		return terrainSampler;
+	}
 
 	// Setup & calibration functions
 	void startFullCalibration();
@@ -73,32 +88,56 @@ public:
 	void setGradFieldResolution(int gradFieldResolution);
 	void setSpatialFiltering(bool sspatialFiltering);
 	void setFollowBigChanges(bool sfollowBigChanges);
+	void setAdaptiveAveraging(bool sadaptiveAveraging);
+	void setProcessingScale(int sprocessingScale);
+	void setAsyncDepthUpload(bool sasyncDepthUpload);
+	void setLatencyPrediction(bool slatencyPrediction);
+	void setPredictionLatency(float spredictionLatency); // ms between the grab of a frame and its projection
+	void setDepthTextureFormat(int sdepthTextureFormat);
+	void setHillshade(bool shillshade);
+	void setSunDirection(float azimuth, float elevation); // Degrees, azimuth clockwise from the top of the Zed image
 
 	// Gui and event functions
 	void setupGui();
 	void onButtonEvent(ofxDatGuiButtonEvent e);
 	void onToggleEvent(ofxDatGuiToggleEvent e);
 	void onSliderEvent(ofxDatGuiSliderEvent e);
+	void onDropdownEvent(ofxDatGuiDropdownEvent e);
 	void onConfirmModalEvent(ofxModalEvent e);
 	void onCalibModalEvent(ofxModalEvent e);
 
 	// Functions for shaders
 	void bind() {
-		FilteredDepthImage.getTexture().bind();
+		depthTexture.bind();
 	}
 	void unbind() {
-		FilteredDepthImage.getTexture().unbind();
+		depthTexture.unbind();
 	}
+	glm::vec2 getDepthTransformation() {
+		return depthStreamer.getDepthTransformation();
+	} // Decoding of the depth texture samples into mm: depth = sample * x + y
 	glm::mat4x4  getTransposedZedWorldMatrix() {
 		return glm::transpose(ZedWorldMatrix);
 	} // For shaders: OpenGL is row-major order and OF is column-major order
 	glm::mat4x4  getTransposedZedProjMatrix() {
 		return glm::transpose(ZedProjMatrix);
 	}
+	glm::mat4x4  getZedWorldMatrix() {
+		return ZedWorldMatrix;
+	} // For CPU code
+	glm::mat4x4  getZedProjMatrix() {
+		return ZedProjMatrix;
+	}
 
 	// Getter and setter
 	ofTexture & getTexture() {
-		return FilteredDepthImage.getTexture();
+		return depthTexture;
+	}
+	const ofTexture& getShadeTexture() const { // Normal in RGB and hillshade in A, see ShadeFrame
+		return shadeTexture;
+	}
+	const DepthFrame& getDepthFrame() { // Current frame, valid until the next update()
+		return depthFrame;
 	}
 	ofRectangle getZedROI() {
 		return zedROI;
@@ -106,6 +145,9 @@ public:
 	glm::vec2 getZedRes() {
 		return zedRes;
 	}
+	float getZedFocalLength() { // Pixels
+		return zedGrabber.getFocalLength();
+	}
 	glm::vec4 getBasePlaneEq() {
 		return basePlaneEq;
 	}
@@ -134,6 +176,30 @@ public:
 		return projZedCalibrationUpdated;
 	}
 
+	// Versions of the renderer inputs, incremented on every change so the renderers
+	// can skip the passes whose inputs did not change since they were drawn
+	unsigned int getDepthVersion() const { // New depth frame or new depth texture encoding
+		return depthVersion;
+	}
+	bool isDepthTileChangedSince(int col, int row, unsigned int version) const; // Tile of DepthFrame::tileSize pixels changed after that depth version
+	struct DepthTileRange { // Depths of the ROI pixels of a depth tile in the current frame
+		float depthMin, depthMax; // mm, of the valid pixels, depthMin > depthMax when there are none
+		bool holes; // Some pixels have no depth
+	};
+	const DepthTileRange& getDepthTileRange(int col, int row) const {
+		return depthTileRanges[row*depthFrame.tileCols + col];
+	}
+	unsigned int getShadeVersion() const { // New shaded tiles, see getShadeTexture()
+		return shadeVersion;
+	}
+	bool isShadeTileChangedSince(int col, int row, unsigned int version) const;
+	unsigned int getBasePlaneVersion() const {
+		return basePlaneVersion;
+	}
+	unsigned int getCalibrationVersion() const { // Projector calibration or ROI
+		return calibrationVersion;
+	}
+
 private:
 	enum Calibration_state
 	{
@@ -167,8 +233,11 @@ private:
 
 	// Private methods
 	void exit(ofEventArgs& e);
-	void setupGradientField();
 
+	void invalidateDepthTiles();
+	void updateDepthTileRange(int tile);
+	void receiveShadeFrames();
+	void uploadShadeTiles(); // Uploads and clears shadeDirtyTiles
 	void updateCalibration();
 	void updateFullAutoCalibration();
 	void updateROIAutoCalibration();
@@ -203,6 +272,14 @@ private:
 	bool ROIUpdated;
 	bool projZedCalibrationUpdated;
 	bool basePlaneUpdated;
+	unsigned int depthVersion;
+	unsigned int basePlaneVersion;
+	unsigned int calibrationVersion;
+	bool depthFrameReceived; // A depth frame was received since the last update()
+	bool colorFrameReceived; // A color frame was received since a calibration step last used one
+	std::vector<unsigned int> tileVersions; // Depth version of the last change of each depth tile
+	std::vector<DepthTileRange> depthTileRanges;
+	unsigned int projWindowVersion;
 	bool imageStabilized;
 	bool waitingForFlattenSand;
 	bool drawZedView;
@@ -219,11 +296,30 @@ private:
 	bool                        spatialFiltering;
 	bool                        followBigChanges;
 	int                         numAveragingSlots;
+	bool                        adaptiveAveraging;
+	int                         minAveragingSlots;
+	int                         processingScale; // 1, 2 or 4: filtering resolution divider
 
 	//Zed buffer
-	ofxCvFloatImage             FilteredDepthImage;
+	DepthFrame                  depthFrame; // Adopted from the grabber, returned to it when replaced
+	ofTexture                   depthTexture;
+	DepthTextureStreamer        depthStreamer;
+	bool                        asyncDepthUpload; // Stream the dirty tiles through PBOs instead of full frame uploads
+	bool                        latencyPrediction; // Extrapolate the depth frames to the time they are projected
+	int                         depthTextureFormat; // DepthTextureStreamer::DepthFormat of the depth texture
+	float                       colorStreamRate; // Color frames per second requested while calibrating
+	bool                        colorStreamSubscribed;
+	ofxCvFloatImage             FilteredDepthImage; // Scaled copy for the Zed view only
 	ofxCvColorImage             ZedColorImage;
-	glm::vec2*                    gradField;
+	std::shared_ptr<const GradientField> gradientField;
+	TerrainSampler              terrainSampler;
+	ofPixels                    shadePixels; // Applied shade frames, in the layout of the depth frame
+	ofTexture                   shadeTexture;
+	std::vector<unsigned char>  shadeDirtyTiles; // Tiles received since the last upload
+	std::vector<unsigned int>   shadeTileVersions; // Shade version of the last change of each tile
+	unsigned int                shadeVersion;
+	bool                        hillshade;
+	float                       sunElevation;
 
 	// Projector and Zed variables
 	glm::vec2 projRes;
@@ -237,9 +333,13 @@ private:
 	cv::Mat                     cvRgbImage;
 	ofxCvFloatImage             Dptimg;
 
+	// Main thread time spent adopting depth frames
+	uint64_t handoffTime;
+	int handoffFrames;
+
 	//Gradient field variables
-	int gradFieldcols, gradFieldrows;
 	int gradFieldResolution;
+	int gradFieldLevel; // Level of the gradient snapshot pyramid closest to gradFieldResolution
 	float arrowLength;
 	int fishInd;
 
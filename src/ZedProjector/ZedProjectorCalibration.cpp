@@ -108,6 +108,12 @@ bool ofxZedProjectorToolkit::loadCalibration(string path){
 	glm::vec2 szedRes = xml.getValue<glm::vec2>("Zed");
 	if (sprojRes!=projRes || szedRes!=zedRes)
 		return false;
+	// The coefficients map Zed world coordinates, older files were computed from other depth units
+	xml.setTo("//CALIBRATION");
+	if (xml.getValue<string>("UNITS") != "mm") {
+		ofLogWarning("ofxZedProjectorToolkit") << "loadCalibration(): " << path << " was not computed in millimeters";
+		return false;
+	}
     xml.setTo("//CALIBRATION/COEFFICIENTS");
     for (int i=0; i<11; i++) {
         x(i, 0) = xml.getValue<float>("COEFF"+ofToString(i));
@@ -129,6 +135,7 @@ bool ofxZedProjectorToolkit::saveCalibration(string path){
 	xml.addValue("PROJECTOR", projRes);
 	xml.addValue("Zed", zedRes);
 	xml.setTo("//CALIBRATION");
+	xml.addValue("UNITS", string("mm"));
 	xml.addChild("COEFFICIENTS");
 	xml.setTo("COEFFICIENTS");
 	for (int i=0; i<11; i++) {
@@ -21,6 +21,7 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 
 #include "ofMain.h"
 #include "ofApp.h"
+#include "Benchmark.h"
 
 bool setSecondWindowDimensions(ofGLFWWindowSettings& settings) {
 	// Check screens size and location
@@ -45,7 +46,10 @@ bool setSecondWindowDimensions(ofGLFWWindowSettings& settings) {
 }
 
 //========================================================================
-int main() {
+int main(int argc, char* argv[]) {
+	if (argc > 1 && string(argv[1]) == "--benchmark")
+		return Benchmark::run();
+
 	ofGLFWWindowSettings settings;
 	settings.width = 1200;
 	settings.height = 600;
@@ -20,6 +20,7 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 ***********************************************************************/
 
 #include "ofApp.h"
+#include "ofMainLoop.h"
 
 void ofApp::setup() {
 	// OF basics
@@ -37,6 +38,12 @@ void ofApp::setup() {
 	sandSurfaceRenderer = new SandSurfaceRenderer(zedProjector, projWindow);
 	sandSurfaceRenderer->setup(true);
 
+	// Setup terrainAnalyzer
+	terrainAnalyzer = new TerrainAnalyzer(zedProjector, projWindow);
+	terrainAnalyzer->setup(true);
+	sandSurfaceRenderer->setWaterSimulation(&terrainAnalyzer->getWaterSimulation());
+	sandSurfaceRenderer->setErosionSimulation(&terrainAnalyzer->getErosionSimulation());
+
 	// Retrieve variables
 	kinectRes = zedProjector->getZedRes();
 	projRes = glm::vec2(projWindow->getWidth(), projWindow->getHeight());
@@ -46,6 +53,31 @@ void ofApp::setup() {
 	fboVehicles.begin();
 	ofClear(0, 0, 0, 255);
 	fboVehicles.end();
+	fboVehiclesEmpty = false;
+	skippedVehiclesPasses = 0;
+	fboVehiclesVersion = 0;
+
+	// Projector layers, from bottom to top
+	compositor.setup(projRes.x, projRes.y);
+	zedLayer = compositor.addLayer(zedProjector->getProjectorWindowFbo());
+	sandboxLayer = compositor.addLayer(sandSurfaceRenderer->getProjectorWindowFbo());
+	analysisLayer = compositor.addLayer(terrainAnalyzer->getOverlayFbo());
+	vehiclesLayer = compositor.addLayer(fboVehicles);
+
+	// Swap intervals, the projector window is created without vertical sync. Both windows are
+	// drawn one after the other by the same main loop, with projector pacing the projector swap
+	// sets the pace of that loop and the main window is only redrawn at mainWindowRate.
+	mainWindow = ofGetMainLoop()->getCurrentWindow();
+	lateLatching = false;
+	projectorPacing = false;
+	projectorVSync = false;
+	projectorVSyncApplied = false;
+	mainWindowRate = 15;
+	lastMainWindowDraw = 0;
+	lastProjectedFrame = 0;
+	latencySum = 0;
+	latencySamples = 0;
+	projectorLatency = 0;
 
 	setupGui();
 
@@ -135,44 +167,158 @@ void ofApp::update() {
 	// Call zedProjector->update() first during the update function()
 	zedProjector->update();
 
+	terrainAnalyzer->update(); // Before the sandbox pass blending its water
 	sandSurfaceRenderer->update();
 
 	if (zedProjector->isROIUpdated())
 		kinectROI = zedProjector->getZedROI();
 
 	if (zedProjector->isImageStabilized()) {
+		// Terrain sampling bound once for this frame
+		const TerrainSampler& terrain = zedProjector->getTerrainSampler();
+		const DrainageNetwork& rivers = terrainAnalyzer->getDrainageNetwork();
 		for (auto & f : fish) {
-			f.applyBehaviours(showMotherFish);
+			f.applyBehaviours(showMotherFish, terrain, rivers);
 			f.update();
 		}
 		for (auto & r : rabbits) {
-			r.applyBehaviours(showMotherRabbit);
+			r.applyBehaviours(showMotherRabbit, terrain, rivers);
 			r.update();
 		}
 		drawVehicles();
 	}
+
+	updateCompositor();
 	gui->update();
 }
 
+void ofApp::updateCompositor() {
+	// Recomposite the projector image where the layers changed
+	// The calibration patterns are only projected while calibrating, so the composite is the
+	// sandbox image the main window previews the rest of the time
+	bool calibrating = zedProjector->isCalibrating();
+	compositor.setLayerVisible(zedLayer, calibrating);
+	compositor.setLayerVisible(sandboxLayer, !calibrating);
+	compositor.setLayerVisible(analysisLayer, !calibrating);
+	compositor.setLayerVisible(vehiclesLayer, !calibrating);
+	compositor.updateLayer(zedLayer, zedProjector->getProjectorWindowVersion());
+	compositor.updateLayer(sandboxLayer, sandSurfaceRenderer->getProjectorWindowVersion(), sandSurfaceRenderer->getProjectorWindowDirtyRects());
+	compositor.updateLayer(analysisLayer, terrainAnalyzer->getOverlayVersion(), terrainAnalyzer->getOverlayDirtyRects());
+	compositor.updateLayer(vehiclesLayer, fboVehiclesVersion, vehiclesDirtyRects);
+	compositor.update();
+}
+
 
 void ofApp::draw() {
-	sandSurfaceRenderer->drawMainWindow(300, 30, 600, 450);//400, 20, 400, 300);
-	fboVehicles.draw(300, 30, 600, 450);
+	if (!projectorPacing) {
+		drawMainWindow();
+		return;
+	}
+
+	// The GUI and the previews are drawn into fboMainWindow at mainWindowRate, the other loop
+	// iterations only show it again, so their cost does not delay the projector frames
+	uint64_t now = ofGetElapsedTimeMicros();
+	bool resized = !fboMainWindow.isAllocated() || fboMainWindow.getWidth() != ofGetWidth() || fboMainWindow.getHeight() != ofGetHeight();
+	if (resized || now - lastMainWindowDraw >= 1000000 / mainWindowRate) {
+		if (resized)
+			fboMainWindow.allocate(ofGetWidth(), ofGetHeight(), GL_RGBA);
+		fboMainWindow.begin();
+		ofClear(ofGetBackgroundColor());
+		drawMainWindow();
+		fboMainWindow.end();
+		lastMainWindowDraw = now;
+	}
+	fboMainWindow.draw(0, 0);
+}
+
+void ofApp::drawMainWindow() {
+	// Preview of the projector image, without the calibration patterns
+	if (zedProjector->isCalibrating()) {
+		sandSurfaceRenderer->getProjectorWindowFbo().draw(300, 30, 600, 450);
+		terrainAnalyzer->getOverlayFbo().draw(300, 30, 600, 450);
+		fboVehicles.draw(300, 30, 600, 450);
+	}
+	else {
+		compositor.draw(300, 30, 600, 450);//400, 20, 400, 300);
+	}
+	sandSurfaceRenderer->drawGui();
+	terrainAnalyzer->drawGui();
 	zedProjector->drawMainWindow(300, 30, 600, 450);
 	gui->draw();
 }
 
 void ofApp::drawProjWindow(ofEventArgs &args) {
-	zedProjector->drawProjectorWindow();
+	// The swap interval belongs to the current context, it is only changed here for the projector
+	if (projectorVSync != projectorVSyncApplied) {
+		projWindow->setVerticalSync(projectorVSync);
+		projectorVSyncApplied = projectorVSync;
+	}
+
+	// Late latching: the newest depth frame is received and rendered after the main window
+	// was drawn, right before drawing the projector
+	if (lateLatching && !zedProjector->isCalibrating()) {
+		// The fbos and vertex arrays are not shared between the contexts, render in the main one.
+		// The main window frame is finished and swapped at this point, its renderer matrix stacks
+		// and bound objects are back to their base state, and setCurrentWindow() also switches the
+		// current renderer, so the fbo passes below do not see the projector frame state.
+		ofGetMainLoop()->setCurrentWindow(mainWindow);
+		mainWindow->makeCurrent();
+		if (zedProjector->receiveDepthFrame()) {
+			sandSurfaceRenderer->render();
+			updateCompositor();
+		}
+		ofGetMainLoop()->setCurrentWindow(projWindow);
+		projWindow->makeCurrent();
+	}
+
+	compositor.draw(0, 0);
+	measureLatency();
+}
 
-	if (!zedProjector->isCalibrating()) {
-		sandSurfaceRenderer->drawProjectorWindow();
-		fboVehicles.draw(0, 0);
+void ofApp::measureLatency() {
+	// Measured when the projector frame is submitted, the swap and the projector add their own delay
+	const DepthFrame& frame = zedProjector->getDepthFrame();
+	if (frame.grabTime == 0 || frame.frameNumber == lastProjectedFrame)
+		return;
+	lastProjectedFrame = frame.frameNumber;
+	latencySum += ofGetElapsedTimeMicros() - frame.grabTime;
+	if (++latencySamples == 300) {
+		projectorLatency = latencySum / latencySamples / 1000.0;
+		ofLogVerbose("ofApp") << "measureLatency(): Grab to projector latency: " << projectorLatency << " ms" << (lateLatching ? " (late latching)" : "");
+		zedProjector->setPredictionLatency(projectorLatency);
+		latencySum = 0;
+		latencySamples = 0;
 	}
 }
 
 void ofApp::drawVehicles()
 {
+	// Without vehicles the fbo only needs to be cleared once
+	bool empty = !showMotherFish && !showMotherRabbit && fish.empty() && rabbits.empty();
+	if (empty && fboVehiclesEmpty) {
+		skippedVehiclesPasses++;
+		return;
+	}
+	fboVehiclesEmpty = empty;
+
+	// Changed area: the drawings of the vehicles at their previous and new locations
+	vehiclesDirtyRects = vehiclesRects;
+	vehiclesRects.clear();
+	if (showMotherFish)
+		vehiclesRects.push_back(getMotherFishBounds());
+	if (showMotherRabbit)
+		vehiclesRects.push_back(getMotherRabbitBounds());
+	for (auto & f : fish)
+		vehiclesRects.push_back(f.getProjectorBounds());
+	for (auto & r : rabbits)
+		vehiclesRects.push_back(r.getProjectorBounds());
+	vehiclesDirtyRects.insert(vehiclesDirtyRects.end(), vehiclesRects.begin(), vehiclesRects.end());
+	if (fboVehiclesVersion == 0)
+		vehiclesDirtyRects.clear(); // The first redraw replaces the opaque clear of setup()
+	else if (vehiclesDirtyRects.empty())
+		vehiclesDirtyRects.push_back(ofRectangle()); // Empty fbo cleared again, nothing visible changed
+	fboVehiclesVersion++;
+
 	fboVehicles.begin();
 	ofClear(255, 255, 255, 0);
 	if (showMotherFish)
@@ -188,6 +334,20 @@ void ofApp::drawVehicles()
 	fboVehicles.end();
 }
 
+ofRectangle ofApp::getMotherFishBounds()
+{
+	// Same layout as drawMotherFish(): the platform circle and the fish, 3 * sc long, around the translation
+	float sc = 10;
+	glm::vec2 p = zedProjector->zedCoordToProjCoord(motherFish.x + sc, motherFish.y);
+	ofRectangle bounds(p.x - 0.5*sc - motherPlatformSize, p.y - motherPlatformSize, 2 * motherPlatformSize, 2 * motherPlatformSize);
+	bounds.growToInclude(ofRectangle(p.x - 3 * sc, p.y - sc, 4 * sc, 2 * sc));
+	bounds.x -= 3;
+	bounds.y -= 3;
+	bounds.width += 6;
+	bounds.height += 6;
+	return bounds;
+}
+
 void ofApp::drawMotherFish()
 {
 	// Mother fish scale
@@ -224,6 +384,20 @@ void ofApp::drawMotherFish()
 	ofPopMatrix();
 }
 
+ofRectangle ofApp::getMotherRabbitBounds()
+{
+	// Same layout as drawMotherRabbit(): the platform circle and the rabbit, from -21 * sc to 9.5 * sc
+	float sc = 2;
+	glm::vec2 p = zedProjector->zedCoordToProjCoord(motherRabbit.x + 5 * sc, motherRabbit.y);
+	ofRectangle bounds(p.x - 5 * sc - motherPlatformSize, p.y - motherPlatformSize, 2 * motherPlatformSize, 2 * motherPlatformSize);
+	bounds.growToInclude(ofRectangle(p.x - 21 * sc, p.y - 7.5*sc, 30.5*sc, 15 * sc));
+	bounds.x -= 3;
+	bounds.y -= 3;
+	bounds.width += 6;
+	bounds.height += 6;
+	return bounds;
+}
+
 void ofApp::drawMotherRabbit()
 {
 	float sc = 2; // MotherRabbit scale
@@ -328,6 +502,10 @@ void ofApp::setupGui() {
 	gui->addToggle("Mother rabbit", showMotherRabbit);
 	gui->addButton("Remove all animals");
 	gui->addBreak();
+	gui->addToggle("Late latching", lateLatching);
+	gui->addToggle("Projector pacing", projectorPacing);
+	gui->addSlider("Main window fps", 5, 60, mainWindowRate)->setPrecision(0);
+	gui->addBreak();
 	gui->addHeader(":: Game ::", false);
 
 	gui->onButtonEvent(this, &ofApp::onButtonEvent);
@@ -371,6 +549,17 @@ void ofApp::onToggleEvent(ofxDatGuiToggleEvent e) {
 			showMotherRabbit = e.checked;
 		}
 	}
+	else if (e.target->is("Late latching")) {
+		lateLatching = e.checked;
+	}
+	else if (e.target->is("Projector pacing")) {
+		// Only the projector waits for its vertical sync, and the frame rate is not capped so
+		// the loop runs at the projector refresh rate
+		projectorPacing = e.checked;
+		mainWindow->setVerticalSync(!projectorPacing); // The main window context is current during update()
+		projectorVSync = projectorPacing; // Applied by drawProjWindow()
+		ofSetFrameRate(projectorPacing ? 0 : 60);
+	}
 }
 
 void ofApp::onSliderEvent(ofxDatGuiSliderEvent e) {
@@ -395,4 +584,7 @@ void ofApp::onSliderEvent(ofxDatGuiSliderEvent e) {
 				rabbits.pop_back();
 			}
 	}
+	else if (e.target->is("Main window fps")) {
+		mainWindowRate = e.value;
+	}
 }
@@ -24,7 +24,9 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 #include "ofMain.h"
 #include "ofxDatGui.h"
 #include "SandSurfaceRenderer/SandSurfaceRenderer.h"
+#include "TerrainAnalysis/TerrainAnalyzer.h"
 #include "vehicle.h"
+#include "ProjectorCompositor.h"
 
 class ofApp : public ofBaseApp {
 
@@ -40,10 +42,15 @@ public:
 	void update();
 
 	void draw();
+	void drawMainWindow();
 	void drawProjWindow(ofEventArgs& args);
 	void drawVehicles();
 	void drawMotherFish();
 	void drawMotherRabbit();
+	ofRectangle getMotherFishBounds();
+	ofRectangle getMotherRabbitBounds();
+	void updateCompositor();
+	void measureLatency();
 
 	void keyPressed(int key);
 	void keyReleased(int key);
@@ -62,11 +69,19 @@ public:
 	void onToggleEvent(ofxDatGuiToggleEvent e);
 	void onSliderEvent(ofxDatGuiSliderEvent e);
 
+	uint64_t getSkippedVehiclesPasses() const { // Vehicles fbo redraws skipped because it was already empty
+		return skippedVehiclesPasses;
+	}
+	float getProjectorLatency() const { // Average ms between the grab of a depth frame and the draw of the projector showing it
+		return projectorLatency;
+	}
+
 	std::shared_ptr<ofAppBaseWindow> projWindow;
 
 private:
 	std::shared_ptr<ZedProjector> zedProjector;
 	SandSurfaceRenderer* sandSurfaceRenderer;
+	TerrainAnalyzer* terrainAnalyzer;
 	
 	// Projector and kinect variables
 	glm::vec2 projRes;
@@ -75,6 +90,28 @@ private:
 	
 	// FBos
 	ofFbo fboVehicles;
+	bool fboVehiclesEmpty; // Nothing drawn in fboVehicles since it was cleared
+	uint64_t skippedVehiclesPasses;
+	unsigned int fboVehiclesVersion;
+	std::vector<ofRectangle> vehiclesRects; // Projector area covered by the vehicles in fboVehicles
+	std::vector<ofRectangle> vehiclesDirtyRects; // Changed by the last fboVehicles redraw
+
+	// Projector image
+	ProjectorCompositor compositor;
+	int zedLayer, sandboxLayer, analysisLayer, vehiclesLayer;
+
+	// Projector pacing and latency, both windows are drawn by the same loop
+	std::shared_ptr<ofAppBaseWindow> mainWindow;
+	bool lateLatching; // Receive and render the newest depth frame right before drawing the projector
+	bool projectorPacing; // The projector vertical sync paces the loop, the main window is redrawn at mainWindowRate
+	bool projectorVSync, projectorVSyncApplied;
+	float mainWindowRate; // Hz
+	uint64_t lastMainWindowDraw;
+	ofFbo fboMainWindow; // Last main window image, shown again between its redraws
+	unsigned int lastProjectedFrame;
+	uint64_t latencySum;
+	int latencySamples;
+	float projectorLatency;
 
 	// Fish and Rabbits
 	vector<Fish> fish;
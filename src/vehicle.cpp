@@ -34,26 +34,27 @@ Vehicle::Vehicle(std::shared_ptr<ZedProjector> const& k, ofGlmPoint slocation, o
     motherLocation = smotherLocation;
 }
 
-void Vehicle::updateBeachDetection(){
+void Vehicle::updateBeachDetection(const TerrainSampler& terrain, const DrainageNetwork& rivers){
     // Find sandbox gradients and elevations in the next 10 steps of vehicle v, update vehicle variables
-    ofGlmPoint futureLocation;
-    futureLocation = location;
+    glm::vec2 futureLocations[9];
+    float elevations[9];
+    for (int i = 0; i < 9; i++)
+        futureLocations[i] = glm::vec2(location + velocity*i);
+    terrain.elevationsAt(futureLocations, elevations, 9);
+    
     beachSlope = glm::vec2(0);
     beach = false;
-    int i = 1;
-    while (i < 10 && !beach)
+    for (int i = 0; i < 9 && !beach; i++)
     {
-        bool overwater = zedProjector->elevationAtZedCoord(futureLocation.x, futureLocation.y) > 0;
+        bool overwater = elevations[i] > 0 && !rivers.isRiverAt(futureLocations[i]); // Rivers are water
         if ((overwater && liveInWater) || (!overwater && !liveInWater))
         {
             beach = true;
-            beachDist = i;
-            beachSlope = zedProjector->gradientAtZedCoord(futureLocation.x,futureLocation.y);
+            beachDist = i + 1;
+            beachSlope = terrain.gradientAt(futureLocations[i].x, futureLocations[i].y);
             if (liveInWater)
                 beachSlope *= -1;
         }
-        futureLocation += velocity; // Go to next future location step
-        i++;
     }
 }
 
@@ -201,6 +202,22 @@ void Vehicle::applyVelocityChange(const ofGlmPoint & velocityChange){
     globalVelocityChange += velocityChange;
 }
 
+ofRectangle Vehicle::drawingBounds(const ofRectangle& local) const {
+    // Corners rotated by the drawing angle, the curves may overshoot their control points and
+    // the lines are antialiased, hence the margin
+    const float margin = 3;
+    float c = cos(ofDegToRad(angle));
+    float s = sin(ofDegToRad(angle));
+    ofRectangle bounds(projectorCoord, 0, 0);
+    for (auto & corner : { local.getTopLeft(), local.getTopRight(), local.getBottomLeft(), local.getBottomRight() })
+        bounds.growToInclude(projectorCoord.x + corner.x*c - corner.y*s, projectorCoord.y + corner.x*s + corner.y*c);
+    bounds.x -= margin;
+    bounds.y -= margin;
+    bounds.width += 2 * margin;
+    bounds.height += 2 * margin;
+    return bounds;
+}
+
 void Vehicle::update(){
     projectorCoord = zedProjector->zedCoordToProjCoord(location.x, location.y);
     if (!mother || glm::length2(velocity) != 0)
@@ -267,8 +284,8 @@ ofGlmPoint Fish::wanderEffect(){
     return velocityChange;
 }
 
-void Fish::applyBehaviours(bool seekMother){
-    updateBeachDetection();
+void Fish::applyBehaviours(bool seekMother, const TerrainSampler& terrain, const DrainageNetwork& rivers){
+    updateBeachDetection(terrain, rivers);
     
     //    separateF = separateEffect(vehicles);
     seekF = glm::vec2(0);
@@ -354,6 +371,12 @@ void Fish::draw()
     ofPopMatrix();
 }
 
+ofRectangle Fish::getProjectorBounds() const {
+    // Same scale as draw(): the tail reaches 3 * sc behind the center, the head sc ahead
+    float sc = 7;
+    return drawingBounds(ofRectangle(-3 * sc, -sc, 4 * sc, 2 * sc));
+}
+
 //==============================================================
 // Derived class Rabbit
 //==============================================================
@@ -410,8 +433,8 @@ ofGlmPoint Rabbit::wanderEffect(){
     return velocityChange;
 }
 
-void Rabbit::applyBehaviours(bool seekMother){
-    updateBeachDetection();
+void Rabbit::applyBehaviours(bool seekMother, const TerrainSampler& terrain, const DrainageNetwork& rivers){
+    updateBeachDetection(terrain, rivers);
     
     //    separateF = separateEffect(vehicles);
     seekF = glm::vec2(0);
@@ -552,3 +575,9 @@ void Rabbit::draw()//, std::vector<glm::vec2> forces)
 }
 
 
+
+ofRectangle Rabbit::getProjectorBounds() const {
+    // Same scale as draw(): from the tail circle at -19 * sc to the nose circle at 8.5 * sc
+    float sc = 1;
+    return drawingBounds(ofRectangle(-21 * sc, -7.5 * sc, 30.5 * sc, 15 * sc));
+}
@@ -25,6 +25,7 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 #include "ofxCv.h"
 
 #include "ZedProjector/ZedProjector.h"
+#include "TerrainAnalysis/DrainageNetwork.h"
 
 class Vehicle{
 
@@ -33,8 +34,9 @@ public:
     
     // Virtual functions
     virtual void setup() = 0;
-    virtual void applyBehaviours(bool seekMother) = 0;
+    virtual void applyBehaviours(bool seekMother, const TerrainSampler& terrain, const DrainageNetwork& rivers) = 0;
     virtual void draw() = 0;
+    virtual ofRectangle getProjectorBounds() const = 0; // Projector area covered by draw()
     
     void update();
     
@@ -47,6 +49,10 @@ public:
         return velocity;
     }
     
+    const glm::vec2& getProjectorCoord() const {
+        return projectorCoord;
+    }
+    
     const float getAngle() const {
         return angle;
     }
@@ -60,12 +66,13 @@ public:
     }
     
 protected:
-    void updateBeachDetection();
+    void updateBeachDetection(const TerrainSampler& terrain, const DrainageNetwork& rivers);
     ofGlmPoint seekEffect();
     ofGlmPoint bordersEffect();
     ofGlmPoint slopesEffect();
     virtual ofGlmPoint wanderEffect();
     void applyVelocityChange(const ofGlmPoint & force);
+    ofRectangle drawingBounds(const ofRectangle& local) const; // local: drawing extent before the rotation and translation of draw()
     
     std::shared_ptr<ZedProjector> zedProjector;
 
@@ -111,8 +118,9 @@ public:
     Fish(std::shared_ptr<ZedProjector> const& k, ofGlmPoint slocation, ofRectangle sborders, glm::vec2 motherLocation) : Vehicle(k, slocation, sborders, true, motherLocation){}
 
     void setup();
-    void applyBehaviours(bool seekMother);
+    void applyBehaviours(bool seekMother, const TerrainSampler& terrain, const DrainageNetwork& rivers);
     void draw();
+    ofRectangle getProjectorBounds() const;
     
 private:
     ofGlmPoint wanderEffect();
@@ -123,8 +131,9 @@ public:
     Rabbit(std::shared_ptr<ZedProjector> const& k, ofGlmPoint slocation, ofRectangle sborders, glm::vec2 motherLocation) : Vehicle(k, slocation, sborders, false, motherLocation){}
     
     void setup();
-    void applyBehaviours(bool seekMother);
+    void applyBehaviours(bool seekMother, const TerrainSampler& terrain, const DrainageNetwork& rivers);
     void draw();
+    ofRectangle getProjectorBounds() const;
 
 private:
     ofGlmPoint wanderEffect();